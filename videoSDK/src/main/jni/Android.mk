@@ -11,7 +11,7 @@ ifeq ($(TARGET_ARCH),x86)
     LOCAL_LDLIBS += -Lffmpeg/lib/x86
 else
     LOCAL_LDLIBS += -Lffmpeg/lib/armeabi-v7a
-    LOCAL_CFLAGS += -march=armv7-a -mfloat-abi=hardfp -mfpu=neon
+    LOCAL_CFLAGS += -march=armv7-a -mfloat-abi=softfp -mfpu=neon
 endif
 
 LOCAL_LDLIBS += \
@@ -19,8 +19,35 @@ LOCAL_LDLIBS += \
 
 LOCAL_SRC_FILES := \
     FFmpegRtmp.c \
+    PacketRing.c \
+    BandwidthEstimator.c \
+    DropPolicy.c \
+    NalUtils.c \
+    BufferPool.c \
+    Reconnect.c \
+    Stats.c \
+    Trace.c \
+    KeyFrameRequest.c \
+    GopCache.c \
+    FFmpegInit.c \
+    Watchdog.c \
+    DecodeTime.c \
+    SocketIo.c \
+    RtmpPublisher.c \
+    JniOnLoad.c \
+    ClipIndex.c \
+    ProbePool.c \
+    RenderPlan.c \
+    Prefetcher.c \
+    Transcoder.c \
     FFmpegMuxer.c
 
-LOCAL_CFLAGS := -O0 -g -Wall --std=c99
+#  Appended, so the per-ABI flags above (NEON on ARM) survive.
+LOCAL_CFLAGS += -O2 -g -Wall --std=c99
+
+#  ndk-build FFMPEG_WRAPPER_TRACE=1 compiles in the trace points; see Trace.h.
+ifeq ($(FFMPEG_WRAPPER_TRACE),1)
+    LOCAL_CFLAGS += -DTRACE_ENABLED=1
+endif
 
 include $(BUILD_SHARED_LIBRARY)
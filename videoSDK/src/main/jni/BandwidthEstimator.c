@@ -0,0 +1,133 @@
+#include "BandwidthEstimator.h"
+
+/**
+ * Steps the encoder walks down as the recommended bitrate falls. Step 0 is the configured quality.
+ */
+const QualityStep QUALITY_LADDER[] = {
+    {100, 30, 1},
+    {50, 20, 1},
+    {25, 15, 2},
+};
+const int QUALITY_LADDER_SIZE = sizeof(QUALITY_LADDER) / sizeof(QUALITY_LADDER[0]);
+
+/**
+ * Reset the estimator to recommend the configured bitrate. overheadBitrate is what the rest of
+ * the stream (audio, container) needs on top of the video. ringStats is where the ring's
+ * counters are now; they outlive the estimator, so the first interval starts from them.
+ */
+void bandwidth_estimator_init(BandwidthEstimator *estimator, int maxBitrate, int overheadBitrate,
+                              int64_t nowNs, const PacketRingStats *ringStats) {
+    estimator->maxBitrate = maxBitrate;
+    estimator->minBitrate = (int) ((int64_t) maxBitrate * BWE_MIN_BITRATE_PERCENT / 100);
+    estimator->overheadBitrate = overheadBitrate;
+    estimator->recommendedBitrate = maxBitrate;
+    estimator->estimatedBps = 0;
+    estimator->intervalStartNs = nowNs;
+    estimator->intervalBytes = 0;
+    estimator->intervalBusyNs = 0;
+    estimator->lastPopped = ringStats->popped;
+    estimator->lastQueueNsTotal = ringStats->queueNsTotal;
+    estimator->lastDepth = ringStats->depth;
+    estimator->growingIntervals = 0;
+    estimator->stableIntervals = 0;
+}
+
+/**
+ * Account for one finished write of the given size that took writeNs.
+ */
+void bandwidth_estimator_on_write(BandwidthEstimator *estimator, int bytes, int64_t writeNs) {
+    estimator->intervalBytes += (uint64_t) bytes;
+    estimator->intervalBusyNs += writeNs;
+}
+
+/**
+ * Re-evaluate once an interval has passed. Returns 1 if the recommended bitrate changed.
+ */
+int bandwidth_estimator_update(BandwidthEstimator *estimator, int64_t nowNs,
+                               const PacketRingStats *ringStats) {
+    int64_t elapsedNs = nowNs - estimator->intervalStartNs;
+    if (elapsedNs < BWE_INTERVAL_NS) {
+        return 0;
+    }
+
+    uint64_t popped = ringStats->popped - estimator->lastPopped;
+    int64_t avgQueueNs = popped
+                         ? (int64_t) ((ringStats->queueNsTotal - estimator->lastQueueNsTotal)
+                                      / popped)
+                         : 0;
+    bool isGrowing = ringStats->depth > estimator->lastDepth;
+    bool isDraining = ringStats->depth < estimator->lastDepth;
+    //  Nothing left the queue while packets were waiting: the sender is stuck in a write.
+    bool isStuck = !popped && ringStats->depth > 0;
+
+    //  Only a busy sender tells us what the link can do; an idle one just means we're sending
+    //  less than the link could carry.
+    if (estimator->intervalBusyNs > 0
+        && estimator->intervalBusyNs * 100 >= elapsedNs * BWE_SATURATED_PERCENT) {
+        int64_t sampleBps = (int64_t) ((double) estimator->intervalBytes * 8 * 1e9
+                                       / estimator->intervalBusyNs);
+        estimator->estimatedBps = estimator->estimatedBps
+                                  ? (estimator->estimatedBps * 3 + sampleBps) / 4 : sampleBps;
+    }
+
+    estimator->growingIntervals = isGrowing ? estimator->growingIntervals + 1 : 0;
+    bool isCongested = isStuck || avgQueueNs > BWE_HIGH_DELAY_NS
+                       || estimator->growingIntervals >= BWE_GROWING_INTERVALS;
+    bool isClear = !isGrowing && avgQueueNs < BWE_LOW_DELAY_NS;
+
+    //  Multiplicative decrease, additive increase, and hold anywhere in between.
+    int64_t target = estimator->recommendedBitrate;
+    int64_t linkTarget = estimator->estimatedBps
+                         ? estimator->estimatedBps * 85 / 100 - estimator->overheadBitrate : 0;
+    if (isCongested && isDraining && linkTarget && target <= linkTarget) {
+        //  We're already below what the link carries and the backlog is going down; cutting
+        //  further would only overshoot.
+        estimator->stableIntervals = 0;
+    } else if (isCongested) {
+        estimator->stableIntervals = 0;
+        target = target * 7 / 10;
+        if (linkTarget && linkTarget < target) {
+            target = linkTarget;
+        }
+    } else if (isClear) {
+        if (++estimator->stableIntervals >= BWE_STABLE_INTERVALS) {
+            target += estimator->maxBitrate / 20;
+        }
+    } else {
+        estimator->stableIntervals = 0;
+    }
+    if (target > estimator->maxBitrate) {
+        target = estimator->maxBitrate;
+    }
+    if (target < estimator->minBitrate) {
+        target = estimator->minBitrate;
+    }
+
+    int changed = target != estimator->recommendedBitrate;
+    __atomic_store_n(&estimator->recommendedBitrate, (int) target, __ATOMIC_RELAXED);
+
+    estimator->intervalStartNs = nowNs;
+    estimator->intervalBytes = 0;
+    estimator->intervalBusyNs = 0;
+    estimator->lastPopped = ringStats->popped;
+    estimator->lastQueueNsTotal = ringStats->queueNsTotal;
+    estimator->lastDepth = ringStats->depth;
+    return changed;
+}
+
+/**
+ * Pick the quality ladder step for a bitrate, moving away from currentStep only once the bitrate
+ * is clearly past the boundary so we don't flap between steps.
+ */
+int bandwidth_estimator_quality_step(int maxBitrate, int bitrate, int currentStep) {
+    int64_t percent = maxBitrate > 0 ? (int64_t) bitrate * 100 / maxBitrate : 100;
+    int step = currentStep;
+    while (step + 1 < QUALITY_LADDER_SIZE && percent < QUALITY_LADDER[step + 1].belowPercent) {
+        step++;
+    }
+    //  Going back up needs 30% of headroom over the boundary we came down through.
+    while (step > 0 && percent * 10 >= QUALITY_LADDER[step].belowPercent * 13) {
+        step--;
+    }
+    return step;
+}
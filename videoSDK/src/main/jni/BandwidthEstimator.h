@@ -0,0 +1,86 @@
+#ifndef BANDWIDTH_ESTIMATOR_H
+#define BANDWIDTH_ESTIMATOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "PacketRing.h"
+
+//  How often the estimate is re-evaluated.
+#define BWE_INTERVAL_NS (500 * 1000000LL)
+//  Queueing delay above which we call the uplink congested, and below which we call it clear.
+#define BWE_HIGH_DELAY_NS (400 * 1000000LL)
+#define BWE_LOW_DELAY_NS (100 * 1000000LL)
+//  Consecutive clear intervals needed before the bitrate is allowed back up.
+#define BWE_STABLE_INTERVALS 4
+//  Consecutive intervals of queue growth that count as congestion even at low delay.
+#define BWE_GROWING_INTERVALS 3
+//  Never recommend less than this fraction (in percent) of the configured bitrate.
+#define BWE_MIN_BITRATE_PERCENT 10
+//  Writes busier than this fraction (in percent) of the interval mean the socket is the
+//  bottleneck, so their throughput is a measurement of the link.
+#define BWE_SATURATED_PERCENT 70
+
+/**
+ * Estimates how much a destination's uplink can carry from what its sender thread observes:
+ * bytes written, time spent inside av_write_frame, and how its queue grows. It turns that into a
+ * recommended encoder bitrate that drops quickly on congestion and climbs back slowly, so the
+ * queue (and with it glass-to-glass latency) stays bounded.
+ * Owned by one sender thread; only recommendedBitrate is read from elsewhere.
+ */
+typedef struct bandwidth_estimator_t {
+    int maxBitrate;
+    int minBitrate;
+    int overheadBitrate;
+    int recommendedBitrate;
+    //  Exponentially smoothed link throughput in bits per second, 0 until measured.
+    int64_t estimatedBps;
+
+    int64_t intervalStartNs;
+    uint64_t intervalBytes;
+    int64_t intervalBusyNs;
+    uint64_t lastPopped;
+    uint64_t lastQueueNsTotal;
+    uint32_t lastDepth;
+    int growingIntervals;
+    int stableIntervals;
+} BandwidthEstimator;
+
+/**
+ * One rung of the quality ladder: below belowPercent of the configured bitrate the encoder
+ * should run at frameRate and divide its resolution by resolutionDivisor.
+ */
+typedef struct quality_step_t {
+    int belowPercent;
+    int frameRate;
+    int resolutionDivisor;
+} QualityStep;
+
+extern const QualityStep QUALITY_LADDER[];
+extern const int QUALITY_LADDER_SIZE;
+
+/**
+ * Reset the estimator to recommend the configured bitrate. overheadBitrate is what the rest of
+ * the stream (audio, container) needs on top of the video. ringStats is where the ring's
+ * counters are now; they outlive the estimator, so the first interval starts from them.
+ */
+void bandwidth_estimator_init(BandwidthEstimator *estimator, int maxBitrate, int overheadBitrate,
+                              int64_t nowNs, const PacketRingStats *ringStats);
+
+/**
+ * Account for one finished write of the given size that took writeNs.
+ */
+void bandwidth_estimator_on_write(BandwidthEstimator *estimator, int bytes, int64_t writeNs);
+
+/**
+ * Re-evaluate once an interval has passed. Returns 1 if the recommended bitrate changed.
+ */
+int bandwidth_estimator_update(BandwidthEstimator *estimator, int64_t nowNs,
+                               const PacketRingStats *ringStats);
+
+/**
+ * Pick the quality ladder step for a bitrate, moving away from currentStep only once the bitrate
+ * is clearly past the boundary so we don't flap between steps.
+ */
+int bandwidth_estimator_quality_step(int maxBitrate, int bitrate, int currentStep);
+
+#endif /* BANDWIDTH_ESTIMATOR_H */
@@ -0,0 +1,160 @@
+#include <pthread.h>
+#include "libavutil/error.h"
+#include "libavutil/mem.h"
+#include "BufferPool.h"
+
+#define COUNT(counter) __atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED)
+
+static AllocationStats allocationStats;
+
+//  Idle frames and packets shared by the live and stitching paths.
+static pthread_mutex_t recyclerLock = PTHREAD_MUTEX_INITIALIZER;
+static AVFrame *idleFrames[RECYCLER_MAX_FRAMES];
+static int numIdleFrames = 0;
+static AVPacket *idlePackets[RECYCLER_MAX_PACKETS];
+static int numIdlePackets = 0;
+
+/**
+ * Allocator the pools fall back to when they're empty; counts every real allocation.
+ */
+static AVBufferRef *counted_buffer_alloc(int size) {
+    COUNT(allocationStats.pooledAllocations);
+    return av_buffer_alloc(size);
+}
+
+/**
+ * Create the pools for every size class. Returns 0 or a negative AVERROR.
+ */
+int buffer_pool_init(BufferPool *pool) {
+    int classSize = BUFFER_POOL_SMALLEST_CLASS;
+    for (int i = 0; i < BUFFER_POOL_NUM_CLASSES; i++, classSize *= 4) {
+        pool->pools[i] = av_buffer_pool_init(classSize, counted_buffer_alloc);
+        if (!pool->pools[i]) {
+            buffer_pool_uninit(pool);
+            return AVERROR(ENOMEM);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Release the pools. Buffers still referenced elsewhere are freed when they are released.
+ */
+void buffer_pool_uninit(BufferPool *pool) {
+    for (int i = 0; i < BUFFER_POOL_NUM_CLASSES; i++) {
+        if (pool->pools[i]) {
+            av_buffer_pool_uninit(&pool->pools[i]);
+        }
+    }
+}
+
+/**
+ * Get a buffer with room for size bytes plus AV_INPUT_BUFFER_PADDING_SIZE. The buffer's size
+ * field is the size of its class, not the requested size.
+ */
+AVBufferRef *buffer_pool_get(BufferPool *pool, int size) {
+    int needed = size + AV_INPUT_BUFFER_PADDING_SIZE;
+    int classSize = BUFFER_POOL_SMALLEST_CLASS;
+    COUNT(allocationStats.bufferRequests);
+    for (int i = 0; i < BUFFER_POOL_NUM_CLASSES; i++, classSize *= 4) {
+        if (needed <= classSize && pool->pools[i]) {
+            return av_buffer_pool_get(pool->pools[i]);
+        }
+    }
+    COUNT(allocationStats.unpooledAllocations);
+    return av_buffer_alloc(needed);
+}
+
+/**
+ * Get an unused AVFrame from the shared recycler, allocating one only if none are idle.
+ */
+AVFrame *recycler_get_frame(void) {
+    AVFrame *frame = NULL;
+    COUNT(allocationStats.frameRequests);
+    pthread_mutex_lock(&recyclerLock);
+    if (numIdleFrames > 0) {
+        frame = idleFrames[--numIdleFrames];
+    }
+    pthread_mutex_unlock(&recyclerLock);
+    if (!frame) {
+        COUNT(allocationStats.frameAllocations);
+        frame = av_frame_alloc();
+    }
+    return frame;
+}
+
+/**
+ * Unreference the frame's data and give it back to the recycler.
+ */
+void recycler_put_frame(AVFrame *frame) {
+    if (!frame) {
+        return;
+    }
+    av_frame_unref(frame);
+    pthread_mutex_lock(&recyclerLock);
+    if (numIdleFrames < RECYCLER_MAX_FRAMES) {
+        idleFrames[numIdleFrames++] = frame;
+        frame = NULL;
+    }
+    pthread_mutex_unlock(&recyclerLock);
+    //  The recycler is full; this one really goes.
+    av_frame_free(&frame);
+}
+
+/**
+ * Get an initialized, empty AVPacket from the shared recycler.
+ */
+AVPacket *recycler_get_packet(void) {
+    AVPacket *packet = NULL;
+    COUNT(allocationStats.packetRequests);
+    pthread_mutex_lock(&recyclerLock);
+    if (numIdlePackets > 0) {
+        packet = idlePackets[--numIdlePackets];
+    }
+    pthread_mutex_unlock(&recyclerLock);
+    if (!packet) {
+        COUNT(allocationStats.packetAllocations);
+        packet = av_malloc(sizeof(AVPacket));
+        if (!packet) {
+            return NULL;
+        }
+    }
+    av_init_packet(packet);
+    packet->data = NULL;
+    packet->size = 0;
+    return packet;
+}
+
+/**
+ * Unreference the packet's data and give it back to the recycler.
+ */
+void recycler_put_packet(AVPacket *packet) {
+    if (!packet) {
+        return;
+    }
+    av_packet_unref(packet);
+    pthread_mutex_lock(&recyclerLock);
+    if (numIdlePackets < RECYCLER_MAX_PACKETS) {
+        idlePackets[numIdlePackets++] = packet;
+        packet = NULL;
+    }
+    pthread_mutex_unlock(&recyclerLock);
+    av_free(packet);
+}
+
+/**
+ * Read the process-wide allocation counters.
+ */
+void get_allocation_stats(AllocationStats *stats) {
+    stats->pooledAllocations = __atomic_load_n(&allocationStats.pooledAllocations,
+                                               __ATOMIC_RELAXED);
+    stats->unpooledAllocations = __atomic_load_n(&allocationStats.unpooledAllocations,
+                                                 __ATOMIC_RELAXED);
+    stats->bufferRequests = __atomic_load_n(&allocationStats.bufferRequests, __ATOMIC_RELAXED);
+    stats->frameAllocations = __atomic_load_n(&allocationStats.frameAllocations,
+                                              __ATOMIC_RELAXED);
+    stats->packetAllocations = __atomic_load_n(&allocationStats.packetAllocations,
+                                               __ATOMIC_RELAXED);
+    stats->frameRequests = __atomic_load_n(&allocationStats.frameRequests, __ATOMIC_RELAXED);
+    stats->packetRequests = __atomic_load_n(&allocationStats.packetRequests, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,86 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdint.h>
+#include "libavutil/buffer.h"
+#include "libavutil/frame.h"
+#include "libavcodec/avcodec.h"
+
+//  Payload size classes; the smallest is 2 KB and each class is four times the previous, so
+//  the largest holds 2 MB (a big 1080p I-frame).
+#define BUFFER_POOL_NUM_CLASSES 6
+#define BUFFER_POOL_SMALLEST_CLASS 2048
+//  How many idle frames and packets the recycler keeps around.
+#define RECYCLER_MAX_FRAMES 16
+#define RECYCLER_MAX_PACKETS 32
+
+/**
+ * Size-classed pool of refcounted payload buffers on top of av_buffer_pool. A request is served
+ * from the smallest class it fits in, and the buffer goes back to that class when its last
+ * reference is dropped, so steady-state streaming stops hitting the allocator for payloads.
+ * Getting buffers is lock-free and safe from any thread.
+ */
+typedef struct buffer_pool_t {
+    AVBufferPool *pools[BUFFER_POOL_NUM_CLASSES];
+} BufferPool;
+
+/**
+ * Process-wide allocation counters, so we can verify the hot paths stop allocating.
+ */
+typedef struct allocation_stats_t {
+    //  Payload buffers created by the pools (grows only while the pools warm up).
+    uint64_t pooledAllocations;
+    //  Requests too big for any class, served by av_buffer_alloc().
+    uint64_t unpooledAllocations;
+    //  Buffers handed out by the pools, new or reused.
+    uint64_t bufferRequests;
+    //  AVFrames/AVPackets created because the recycler was empty.
+    uint64_t frameAllocations;
+    uint64_t packetAllocations;
+    //  AVFrames/AVPackets handed out by the recycler, new or reused.
+    uint64_t frameRequests;
+    uint64_t packetRequests;
+} AllocationStats;
+
+/**
+ * Create the pools for every size class. Returns 0 or a negative AVERROR.
+ */
+int buffer_pool_init(BufferPool *pool);
+
+/**
+ * Release the pools. Buffers still referenced elsewhere are freed when they are released.
+ */
+void buffer_pool_uninit(BufferPool *pool);
+
+/**
+ * Get a buffer with room for size bytes plus AV_INPUT_BUFFER_PADDING_SIZE. The buffer's size
+ * field is the size of its class, not the requested size.
+ */
+AVBufferRef *buffer_pool_get(BufferPool *pool, int size);
+
+/**
+ * Get an unused AVFrame from the shared recycler, allocating one only if none are idle.
+ */
+AVFrame *recycler_get_frame(void);
+
+/**
+ * Unreference the frame's data and give it back to the recycler.
+ */
+void recycler_put_frame(AVFrame *frame);
+
+/**
+ * Get an initialized, empty AVPacket from the shared recycler.
+ */
+AVPacket *recycler_get_packet(void);
+
+/**
+ * Unreference the packet's data and give it back to the recycler.
+ */
+void recycler_put_packet(AVPacket *packet);
+
+/**
+ * Read the process-wide allocation counters.
+ */
+void get_allocation_stats(AllocationStats *stats);
+
+#endif /* BUFFER_POOL_H */
@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ClipIndex.h"
+
+/**
+ * What starts a sidecar file. The stream entries follow, then each stream's keyframes.
+ */
+typedef struct clip_index_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t pathHash;
+    int64_t fileSize;
+    int64_t mtimeNs;
+    int64_t duration;
+    int32_t numStreams;
+    int32_t streamSize;
+} ClipIndexHeader;
+
+/**
+ * 64-bit FNV-1a, enough to tell paths and extradata apart. Clips without an index hash their
+ * extradata with it too, so they compare with ones that have one.
+ */
+uint64_t clip_index_hash(const uint8_t *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Build the sidecar's path into buf. Returns 0, or AVERROR(ENAMETOOLONG).
+ */
+static int get_sidecar_path(char *buf, size_t size, const char *path) {
+    int length = snprintf(buf, size, "%s%s", path, CLIP_INDEX_SUFFIX);
+    return length < 0 || (size_t) length >= size ? AVERROR(ENAMETOOLONG) : 0;
+}
+
+/**
+ * Fill in the key the sidecar is matched on from the clip as it is now.
+ */
+static int get_clip_key(ClipIndex *index, const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        return AVERROR(errno);
+    }
+    index->pathHash = clip_index_hash((const uint8_t *) path, strlen(path));
+    index->fileSize = (int64_t) st.st_size;
+    index->mtimeNs = (int64_t) st.st_mtime * 1000000000;
+    //  The old bionic headers we build against keep the nanoseconds in a field of their own and
+    //  glibc keeps them in st_mtim; anywhere else the key makes do with whole seconds.
+#if defined(__GLIBC__)
+    index->mtimeNs += (int64_t) st.st_mtim.tv_nsec;
+#elif defined(ANDROID)
+    index->mtimeNs += (int64_t) st.st_mtime_nsec;
+#endif
+    return 0;
+}
+
+/**
+ * Load the sidecar for the clip at path, if there's one matching the clip as it is now.
+ * Returns 0, or a negative AVERROR if there's none or it's stale.
+ */
+int clip_index_load(ClipIndex *index, const char *path) {
+    char sidecarPath[1024];
+    memset(index, 0, sizeof(*index));
+    int ret = get_sidecar_path(sidecarPath, sizeof(sidecarPath), path);
+    if (ret < 0 || (ret = get_clip_key(index, path)) < 0) {
+        return ret;
+    }
+    FILE *file = fopen(sidecarPath, "rb");
+    if (!file) {
+        return AVERROR(errno);
+    }
+    ClipIndexHeader header;
+    ret = AVERROR_INVALIDDATA;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != CLIP_INDEX_MAGIC
+        || header.version != CLIP_INDEX_VERSION || header.streamSize != sizeof(ClipStreamIndex)
+        || header.numStreams <= 0 || header.numStreams > CLIP_INDEX_MAX_STREAMS) {
+        goto end;
+    }
+    if (header.pathHash != index->pathHash || header.fileSize != index->fileSize
+        || header.mtimeNs != index->mtimeNs) {
+        //  The clip was edited, replaced or moved since.
+        ret = AVERROR(ESTALE);
+        goto end;
+    }
+    index->duration = header.duration;
+    index->numStreams = header.numStreams;
+    if (fread(index->streams, sizeof(ClipStreamIndex), (size_t) index->numStreams, file)
+        != (size_t) index->numStreams) {
+        goto end;
+    }
+    for (int i = 0; i < index->numStreams; i++) {
+        int numKeyFrames = index->streams[i].numKeyFrames;
+        if (numKeyFrames < 0 || numKeyFrames > CLIP_INDEX_MAX_KEY_FRAMES) {
+            goto end;
+        }
+        if (!numKeyFrames) {
+            continue;
+        }
+        if (!(index->keyFrames[i] = av_malloc_array((size_t) numKeyFrames,
+                                                    sizeof(ClipKeyFrame)))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        if (fread(index->keyFrames[i], sizeof(ClipKeyFrame), (size_t) numKeyFrames, file)
+            != (size_t) numKeyFrames) {
+            goto end;
+        }
+    }
+    ret = 0;
+end:
+    fclose(file);
+    if (ret < 0) {
+        clip_index_release(index);
+    }
+    return ret;
+}
+
+/**
+ * Fill index from a clip that has just been opened and probed, taking the keyframes from the
+ * demuxer's own index rather than reading packets. Returns 0 or a negative AVERROR.
+ */
+int clip_index_build(ClipIndex *index, const char *path, AVFormatContext *format) {
+    memset(index, 0, sizeof(*index));
+    int ret = get_clip_key(index, path);
+    if (ret < 0) {
+        return ret;
+    }
+    index->duration = format->duration;
+    index->numStreams = (int32_t) FFMIN(format->nb_streams, CLIP_INDEX_MAX_STREAMS);
+    for (int i = 0; i < index->numStreams; i++) {
+        AVStream *st = format->streams[i];
+        AVCodecContext *codec = st->codec;
+        ClipStreamIndex *stream = &index->streams[i];
+        stream->codecType = codec->codec_type;
+        stream->codecId = codec->codec_id;
+        stream->width = codec->width;
+        stream->height = codec->height;
+        stream->pixFmt = codec->pix_fmt;
+        stream->sampleRate = codec->sample_rate;
+        stream->channels = codec->channels;
+        stream->sampleFmt = codec->sample_fmt;
+        stream->bitRate = codec->bit_rate;
+        stream->timeBaseNum = st->time_base.num;
+        stream->timeBaseDen = st->time_base.den;
+        stream->duration = st->duration;
+        stream->numPackets = st->nb_index_entries ? st->nb_index_entries : st->nb_frames;
+        stream->extradataHash = clip_index_hash(codec->extradata, (size_t) codec->extradata_size);
+        stream->extradataSize = codec->extradata_size;
+
+        int numKeyFrames = 0;
+        for (int j = 0; j < st->nb_index_entries; j++) {
+            numKeyFrames += (st->index_entries[j].flags & AVINDEX_KEYFRAME) != 0;
+        }
+        //  A table with every packet in it says nothing a seek couldn't work out itself.
+        stream->isAllKeyFrames = st->nb_index_entries && numKeyFrames == st->nb_index_entries;
+        if (stream->isAllKeyFrames || !numKeyFrames) {
+            continue;
+        }
+        if (!(index->keyFrames[i] = av_malloc_array((size_t) numKeyFrames,
+                                                    sizeof(ClipKeyFrame)))) {
+            clip_index_release(index);
+            return AVERROR(ENOMEM);
+        }
+        for (int j = 0; j < st->nb_index_entries; j++) {
+            AVIndexEntry *entry = &st->index_entries[j];
+            if (entry->flags & AVINDEX_KEYFRAME) {
+                ClipKeyFrame *keyFrame = &index->keyFrames[i][stream->numKeyFrames++];
+                keyFrame->timestamp = entry->timestamp;
+                keyFrame->pos = entry->pos;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write index as the clip's sidecar, replacing any old one in a single rename.
+ * Returns 0 or a negative AVERROR.
+ */
+int clip_index_save(const ClipIndex *index, const char *path) {
+    char sidecarPath[1024], tempPath[1040];
+    int ret = get_sidecar_path(sidecarPath, sizeof(sidecarPath), path);
+    if (ret < 0) {
+        return ret;
+    }
+    //  Probe threads for other clips may be saving at the same time, but never for this one.
+    snprintf(tempPath, sizeof(tempPath), "%s.%d", sidecarPath, (int) getpid());
+    FILE *file = fopen(tempPath, "wb");
+    if (!file) {
+        return AVERROR(errno);
+    }
+    ClipIndexHeader header = {
+        .magic = CLIP_INDEX_MAGIC,
+        .version = CLIP_INDEX_VERSION,
+        .pathHash = index->pathHash,
+        .fileSize = index->fileSize,
+        .mtimeNs = index->mtimeNs,
+        .duration = index->duration,
+        .numStreams = index->numStreams,
+        .streamSize = sizeof(ClipStreamIndex),
+    };
+    bool isWritten = fwrite(&header, sizeof(header), 1, file) == 1
+                     && fwrite(index->streams, sizeof(ClipStreamIndex),
+                               (size_t) index->numStreams, file) == (size_t) index->numStreams;
+    for (int i = 0; i < index->numStreams && isWritten; i++) {
+        size_t numKeyFrames = (size_t) index->streams[i].numKeyFrames;
+        isWritten = !numKeyFrames
+                    || fwrite(index->keyFrames[i], sizeof(ClipKeyFrame), numKeyFrames, file)
+                       == numKeyFrames;
+    }
+    isWritten &= fclose(file) == 0;
+    if (!isWritten) {
+        ret = AVERROR(EIO);
+    } else if (rename(tempPath, sidecarPath) < 0) {
+        ret = AVERROR(errno);
+    }
+    if (ret < 0) {
+        unlink(tempPath);
+    }
+    return ret;
+}
+
+/**
+ * Check that an opened clip still matches index, then fill in what the demuxer's header left
+ * out, the way probing would have. Returns 0, or a negative AVERROR if it doesn't match.
+ */
+int clip_index_apply(const ClipIndex *index, AVFormatContext *format) {
+    if ((int) format->nb_streams != index->numStreams) {
+        return AVERROR(ESTALE);
+    }
+    for (int i = 0; i < index->numStreams; i++) {
+        AVStream *st = format->streams[i];
+        AVCodecContext *codec = st->codec;
+        const ClipStreamIndex *stream = &index->streams[i];
+        if (codec->codec_id != (enum AVCodecID) stream->codecId
+            || codec->extradata_size != stream->extradataSize
+            || clip_index_hash(codec->extradata, (size_t) codec->extradata_size)
+               != stream->extradataHash) {
+            return AVERROR(ESTALE);
+        }
+        //  Only pixel and sample formats need decoding to find; the rest is belt and braces.
+        if (codec->pix_fmt == AV_PIX_FMT_NONE) {
+            codec->pix_fmt = (enum AVPixelFormat) stream->pixFmt;
+        }
+        if (codec->sample_fmt == AV_SAMPLE_FMT_NONE) {
+            codec->sample_fmt = (enum AVSampleFormat) stream->sampleFmt;
+        }
+        if (!codec->width || !codec->height) {
+            codec->width = stream->width;
+            codec->height = stream->height;
+        }
+        if (!codec->sample_rate) {
+            codec->sample_rate = stream->sampleRate;
+        }
+        if (!codec->channels) {
+            codec->channels = stream->channels;
+        }
+        if (!codec->bit_rate) {
+            codec->bit_rate = stream->bitRate;
+        }
+        if (st->duration == AV_NOPTS_VALUE) {
+            st->duration = stream->duration;
+        }
+    }
+    if (format->duration == AV_NOPTS_VALUE) {
+        format->duration = index->duration;
+    }
+    return 0;
+}
+
+/**
+ * Return the last keyframe of stream at or before timeMs, or NULL if there's none to go by.
+ */
+const ClipKeyFrame *clip_index_find_key_frame(const ClipIndex *index, int stream, int64_t timeMs) {
+    if (stream < 0 || stream >= index->numStreams || !index->keyFrames[stream]) {
+        return NULL;
+    }
+    const ClipStreamIndex *streamIndex = &index->streams[stream];
+    int64_t timestamp = av_rescale_q(timeMs, (AVRational) {1, 1000},
+                               (AVRational) {streamIndex->timeBaseNum, streamIndex->timeBaseDen});
+    const ClipKeyFrame *keyFrames = index->keyFrames[stream];
+    //  The table is in file order, which for keyframes is time order too.
+    int low = 0, high = streamIndex->numKeyFrames;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (keyFrames[mid].timestamp <= timestamp) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low ? &keyFrames[low - 1] : NULL;
+}
+
+/**
+ * Free the keyframe tables.
+ */
+void clip_index_release(ClipIndex *index) {
+    for (int i = 0; i < CLIP_INDEX_MAX_STREAMS; i++) {
+        av_freep(&index->keyFrames[i]);
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef CLIP_INDEX_H
+#define CLIP_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "libavformat/avformat.h"
+
+//  Sidecars sit next to their clip, named after it with this appended.
+#define CLIP_INDEX_SUFFIX ".idx"
+#define CLIP_INDEX_MAGIC 0x58495356
+//  Bump whenever the layout changes; older sidecars are then rebuilt.
+#define CLIP_INDEX_VERSION 1
+//  Recorded clips are single-stream, but a few more cost nothing.
+#define CLIP_INDEX_MAX_STREAMS 4
+//  Sanity limit on a loaded table; a 30-minute clip has a couple of thousand.
+#define CLIP_INDEX_MAX_KEY_FRAMES (1 << 20)
+
+/**
+ * Where a keyframe is: its timestamp as the demuxer indexes it (in the stream's time_base) and
+ * its offset in the file.
+ */
+typedef struct clip_key_frame_t {
+    int64_t timestamp;
+    int64_t pos;
+} ClipKeyFrame;
+
+/**
+ * What stitching needs to know about one stream without probing it: its codec parameters and
+ * timing, a hash of its extradata, and its keyframes. Streams where every packet is a keyframe
+ * (audio) keep no table, since any packet is a place to start.
+ */
+typedef struct clip_stream_index_t {
+    int32_t codecType;
+    int32_t codecId;
+    int32_t width;
+    int32_t height;
+    int32_t pixFmt;
+    int32_t sampleRate;
+    int32_t channels;
+    int32_t sampleFmt;
+    int64_t bitRate;
+    int32_t timeBaseNum;
+    int32_t timeBaseDen;
+    int64_t duration;
+    int64_t numPackets;
+    uint64_t extradataHash;
+    int32_t extradataSize;
+    int32_t isAllKeyFrames;
+    int32_t numKeyFrames;
+    //  Keeps the layout, which is also the file's, the same on 32 and 64-bit ABIs.
+    int32_t reserved;
+} ClipStreamIndex;
+
+/**
+ * Everything cached about one clip, keyed by its path, size and modification time so an edited
+ * or replaced clip is never matched with an old sidecar.
+ */
+typedef struct clip_index_t {
+    uint64_t pathHash;
+    int64_t fileSize;
+    int64_t mtimeNs;
+    //  Of the whole file, in AV_TIME_BASE.
+    int64_t duration;
+    int32_t numStreams;
+    ClipStreamIndex streams[CLIP_INDEX_MAX_STREAMS];
+    ClipKeyFrame *keyFrames[CLIP_INDEX_MAX_STREAMS];
+} ClipIndex;
+
+/**
+ * Load the sidecar for the clip at path, if there's one matching the clip as it is now.
+ * Returns 0, or a negative AVERROR if there's none or it's stale.
+ */
+int clip_index_load(ClipIndex *index, const char *path);
+
+/**
+ * Fill index from a clip that has just been opened and probed, taking the keyframes from the
+ * demuxer's own index rather than reading packets. Returns 0 or a negative AVERROR.
+ */
+int clip_index_build(ClipIndex *index, const char *path, AVFormatContext *format);
+
+/**
+ * Write index as the clip's sidecar, replacing any old one in a single rename.
+ * Returns 0 or a negative AVERROR.
+ */
+int clip_index_save(const ClipIndex *index, const char *path);
+
+/**
+ * Check that an opened clip still matches index, then fill in what the demuxer's header left
+ * out, the way probing would have. Returns 0, or a negative AVERROR if it doesn't match.
+ */
+int clip_index_apply(const ClipIndex *index, AVFormatContext *format);
+
+/**
+ * Return the last keyframe of stream at or before timeMs, or NULL if there's none to go by.
+ */
+const ClipKeyFrame *clip_index_find_key_frame(const ClipIndex *index, int stream, int64_t timeMs);
+
+/**
+ * Free the keyframe tables.
+ */
+void clip_index_release(ClipIndex *index);
+
+/**
+ * 64-bit FNV-1a, enough to tell paths and extradata apart. Clips without an index hash their
+ * extradata with it too, so they compare with ones that have one.
+ */
+uint64_t clip_index_hash(const uint8_t *data, size_t size);
+
+#endif /* CLIP_INDEX_H */
@@ -0,0 +1,73 @@
+#include <string.h>
+#include "DecodeTime.h"
+
+/**
+ * Start with reorderDepth frames of reordering, clamped to DECODE_TIME_MAX_REORDER_DEPTH.
+ */
+void decode_time_init(DecodeTime *decodeTime, int reorderDepth) {
+    memset(decodeTime, 0, sizeof(*decodeTime));
+    decodeTime->reorderDepth = reorderDepth < 0 ? 0
+                               : reorderDepth > DECODE_TIME_MAX_REORDER_DEPTH
+                                 ? DECODE_TIME_MAX_REORDER_DEPTH : reorderDepth;
+}
+
+/**
+ * Start a new encoder's frames, after a config change say. Decode times still carry on from the
+ * last one given out.
+ */
+void decode_time_restart(DecodeTime *decodeTime) {
+    decodeTime->numPending = 0;
+    decodeTime->numFrames = 0;
+}
+
+/**
+ * Derive a decode time from the presentation times seen so far, taking pts into the window.
+ */
+static int64_t derive(DecodeTime *decodeTime, int64_t pts) {
+    int depth = decodeTime->reorderDepth;
+    if (!depth) {
+        return pts;
+    }
+    if (!decodeTime->numFrames) {
+        decodeTime->firstPts = pts;
+    }
+    //  Insertion keeps the window sorted; it's only ever depth + 1 long.
+    int i = decodeTime->numPending++;
+    for (; i > 0 && decodeTime->pending[i - 1] > pts; i--) {
+        decodeTime->pending[i] = decodeTime->pending[i - 1];
+    }
+    decodeTime->pending[i] = pts;
+    int frame = decodeTime->numFrames++;
+    if (frame < depth) {
+        //  Nothing to look back on yet: count back from the first frame at a nominal rate.
+        return decodeTime->firstPts - (int64_t) (depth - frame) * DECODE_TIME_FRAME_DURATION_US;
+    }
+    int64_t dts = decodeTime->pending[0];
+    decodeTime->numPending--;
+    memmove(decodeTime->pending, decodeTime->pending + 1,
+            sizeof(int64_t) * (size_t) decodeTime->numPending);
+    return dts;
+}
+
+/**
+ * Return the decode time of the next packet. dts is the caller's, or DECODE_TIME_UNKNOWN to
+ * derive it. *pts is moved forward in the rare case it would come before the decode time.
+ */
+int64_t decode_time_next(DecodeTime *decodeTime, int64_t *pts, int64_t dts) {
+    if (dts == DECODE_TIME_UNKNOWN) {
+        dts = derive(decodeTime, *pts);
+    }
+    if (decodeTime->hasLastDts && dts <= decodeTime->lastDts) {
+        dts = decodeTime->lastDts + 1;
+        __atomic_store_n(&decodeTime->adjusted, decodeTime->adjusted + 1, __ATOMIC_RELAXED);
+    }
+    if (*pts < dts) {
+        *pts = dts;
+    }
+    if (*pts - dts > decodeTime->maxCompositionUs) {
+        __atomic_store_n(&decodeTime->maxCompositionUs, *pts - dts, __ATOMIC_RELAXED);
+    }
+    decodeTime->lastDts = dts;
+    decodeTime->hasLastDts = true;
+    return dts;
+}
@@ -0,0 +1,55 @@
+#ifndef DECODE_TIME_H
+#define DECODE_TIME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//  Most frames the encoder may hold back for reordering (B-frames) that we can derive decode
+//  times for. 0 means decode order is presentation order.
+#define DECODE_TIME_MAX_REORDER_DEPTH 16
+//  Spacing assumed for the frames decoded before the first one we can look back on.
+#define DECODE_TIME_FRAME_DURATION_US 33333
+//  Passed instead of a decode time when the caller doesn't have one.
+#define DECODE_TIME_UNKNOWN INT64_MIN
+
+/**
+ * Gives one stream's packets, handed over in decode order, decode times the muxers accept: taken
+ * from the caller when it has them, otherwise derived from the presentation times with a reorder
+ * window. With reorderDepth frames of reordering, the i-th frame decodes at the (i - depth)-th
+ * smallest presentation time seen so far, which is already known by then. Either way decode
+ * times come out strictly increasing and no later than their presentation times.
+ * Owned by the producer thread; the counters are read from anywhere.
+ */
+typedef struct decode_time_t {
+    int reorderDepth;
+    //  Presentation times not yet used as a decode time, smallest first.
+    int64_t pending[DECODE_TIME_MAX_REORDER_DEPTH + 1];
+    int numPending;
+    int numFrames;
+    int64_t firstPts;
+    int64_t lastDts;
+    bool hasLastDts;
+
+    //  Decode times moved forward to keep them increasing, and the largest composition offset.
+    uint64_t adjusted;
+    int64_t maxCompositionUs;
+} DecodeTime;
+
+/**
+ * Start with reorderDepth frames of reordering, clamped to DECODE_TIME_MAX_REORDER_DEPTH.
+ */
+void decode_time_init(DecodeTime *decodeTime, int reorderDepth);
+
+/**
+ * Start a new encoder's frames, after a config change say. Decode times still carry on from the
+ * last one given out.
+ */
+void decode_time_restart(DecodeTime *decodeTime);
+
+/**
+ * Return the decode time of the next packet. dts is the caller's, or DECODE_TIME_UNKNOWN to
+ * derive it. *pts is moved forward in the rare case it would come before the decode time.
+ */
+int64_t decode_time_next(DecodeTime *decodeTime, int64_t *pts, int64_t dts);
+
+#endif /* DECODE_TIME_H */
@@ -0,0 +1,45 @@
+#include "DropPolicy.h"
+
+/**
+ * Set the thresholds (in ms of queued media) and the payload framing, and clear the counters.
+ */
+void drop_policy_init(DropPolicy *policy, int nonReferenceThresholdMs, int gopThresholdMs,
+                      bool isLengthPrefixed) {
+    policy->nonReferenceThresholdUs = (int64_t) nonReferenceThresholdMs * 1000;
+    policy->gopThresholdUs = (int64_t) gopThresholdMs * 1000;
+    policy->isLengthPrefixed = isLengthPrefixed;
+    policy->isSkippingGop = false;
+    policy->droppedNonReference = 0;
+    policy->droppedGop = 0;
+}
+
+/**
+ * Return whether the packet at the head of the queue should be discarded, given how much media
+ * (in Android microseconds) is queued behind it. Counts the drop if so.
+ */
+bool drop_policy_should_drop(DropPolicy *policy, const RingPacket *packet, int64_t queuedUs) {
+    //  Audio is cheap and gaps in it are far more noticeable than in video.
+    if (!packet->isVideo) {
+        return false;
+    }
+    //  A keyframe ends any GOP we were skipping, and is never dropped itself.
+    if (packet->isKeyFrame) {
+        policy->isSkippingGop = false;
+        return false;
+    }
+    //  Once part of a GOP is gone, everything up to the next keyframe would decode wrong anyway.
+    if (policy->isSkippingGop
+        || (policy->gopThresholdUs > 0 && queuedUs > policy->gopThresholdUs)) {
+        policy->isSkippingGop = true;
+        __atomic_store_n(&policy->droppedGop, policy->droppedGop + 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    if (policy->nonReferenceThresholdUs > 0 && queuedUs > policy->nonReferenceThresholdUs
+        && nal_is_non_reference(packet->data, packet->size, policy->isLengthPrefixed)) {
+        __atomic_store_n(&policy->droppedNonReference, policy->droppedNonReference + 1,
+                         __ATOMIC_RELAXED);
+        return true;
+    }
+    return false;
+}
+
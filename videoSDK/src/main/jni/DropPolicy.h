@@ -0,0 +1,42 @@
+#ifndef DROP_POLICY_H
+#define DROP_POLICY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "PacketRing.h"
+#include "NalUtils.h"
+
+//  Default queued durations at which we start shedding video.
+#define DEFAULT_DROP_NON_REFERENCE_MS 500
+#define DEFAULT_DROP_GOP_MS 1500
+
+/**
+ * Decides which queued packets a sender thread throws away instead of writing when it falls
+ * behind. Once the queue holds more than nonReferenceThresholdUs of media, video frames nothing
+ * else refers to are dropped. Past gopThresholdUs the rest of the current GOP goes, up to the
+ * next keyframe. Audio and keyframes are always kept.
+ * Owned by one sender thread; the counters are read from elsewhere.
+ */
+typedef struct drop_policy_t {
+    int64_t nonReferenceThresholdUs;
+    int64_t gopThresholdUs;
+    //  Whether video payloads are length-prefixed (AVCC) rather than Annex-B.
+    bool isLengthPrefixed;
+    bool isSkippingGop;
+    uint64_t droppedNonReference;
+    uint64_t droppedGop;
+} DropPolicy;
+
+/**
+ * Set the thresholds (in ms of queued media) and the payload framing, and clear the counters.
+ */
+void drop_policy_init(DropPolicy *policy, int nonReferenceThresholdMs, int gopThresholdMs,
+                      bool isLengthPrefixed);
+
+/**
+ * Return whether the packet at the head of the queue should be discarded, given how much media
+ * (in Android microseconds) is queued behind it. Counts the drop if so.
+ */
+bool drop_policy_should_drop(DropPolicy *policy, const RingPacket *packet, int64_t queuedUs);
+
+#endif /* DROP_POLICY_H */
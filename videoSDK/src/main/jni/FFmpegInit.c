@@ -0,0 +1,47 @@
+#include <pthread.h>
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+#include "FFmpegInit.h"
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Lock manager for FFmpeg's global codec lock, which it needs before codecs are opened from
+ * more than one thread at once (probing does this).
+ */
+static int manage_lock(void **mutex, enum AVLockOp op) {
+    switch (op) {
+        case AV_LOCK_CREATE:
+            *mutex = av_malloc(sizeof(pthread_mutex_t));
+            if (!*mutex || pthread_mutex_init(*mutex, NULL)) {
+                av_freep(mutex);
+                return 1;
+            }
+            return 0;
+        case AV_LOCK_OBTAIN:
+            return pthread_mutex_lock(*mutex) != 0;
+        case AV_LOCK_RELEASE:
+            return pthread_mutex_unlock(*mutex) != 0;
+        case AV_LOCK_DESTROY:
+            pthread_mutex_destroy(*mutex);
+            av_freep(mutex);
+            return 0;
+    }
+    return 1;
+}
+
+static void init_once(void) {
+    av_lockmgr_register(manage_lock);
+    av_register_all();
+    avcodec_register_all();
+    avformat_network_init();
+}
+
+/**
+ * Register FFmpeg's formats, codecs and lock manager and set up networking, once per process.
+ * Safe to call from any thread, as often as convenient; only the first call does anything.
+ * Networking is never torn down, so sessions after the first skip its setup too.
+ */
+void ffmpeg_global_init(void) {
+    pthread_once(&initOnce, init_once);
+}
@@ -0,0 +1,11 @@
+#ifndef FFMPEG_INIT_H
+#define FFMPEG_INIT_H
+
+/**
+ * Register FFmpeg's formats, codecs and lock manager and set up networking, once per process.
+ * Safe to call from any thread, as often as convenient; only the first call does anything.
+ * Networking is never torn down, so sessions after the first skip its setup too.
+ */
+void ffmpeg_global_init(void);
+
+#endif /* FFMPEG_INIT_H */
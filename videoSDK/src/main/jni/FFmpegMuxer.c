@@ -1,21 +1,181 @@
 #include "FFmpegMuxer.h"
 
 /**
- * Take the two given input stream and mux them packet-by-packet into the given output context.
+ * Jump ahead to the last place the stream can start from before offsetMs, going by the clip's
+ * index, so the packets the right-alignment would only drop aren't read at all.
  */
-void writeInterleaved(AVFormatContext *fmtA, AVFormatContext *fmtB,
-                      AVFormatContext *outFmtCtx, bool performEncoding){
-    //  Codec used to encode the video, if necessary.
-    AVCodecContext *encoder = NULL;
+static void seekToOffset(AVFormatContext *format, const ClipIndex *index, int64_t offsetMs){
+    if(!index || offsetMs <= 0){
+        return;
+    }
+    const ClipStreamIndex *stream = &index->streams[0];
+    int64_t timestamp;
+    if(stream->isAllKeyFrames){
+        timestamp = av_rescale_q(offsetMs, (AVRational) {1, 1000}, format->streams[0]->time_base);
+    }
+    else{
+        const ClipKeyFrame *keyFrame = clip_index_find_key_frame(index, 0, offsetMs);
+        if(!keyFrame){
+            return;
+        }
+        timestamp = keyFrame->timestamp;
+    }
+    if(av_seek_frame(format, 0, timestamp, AVSEEK_FLAG_BACKWARD) < 0){
+        LOGE("Couldn't seek %s to %" PRId64 " ms, reading from the start.\n",
+             format->filename, offsetMs);
+    }
+}
+
+/**
+ * How much of the front of format to skip so that it ends along with other: of the two files
+ * in a pair, the longer is right-aligned with the shorter. Durations come from the clips'
+ * indexes when they have them (NULL otherwise).
+ */
+int64_t getSkipMs(AVFormatContext *format, const ClipIndex *index,
+                  AVFormatContext *other, const ClipIndex *otherIndex){
+    int64_t duration = getMsFromPts(index ? index->duration : format->duration, AV_TIME_BASE_Q);
+    int64_t otherDuration = getMsFromPts(otherIndex ? otherIndex->duration : other->duration,
+                                         AV_TIME_BASE_Q);
+    if(VERBOSE) LOGE("Input %s duration is %" PRId64 "\n", format->filename, duration);
+    return duration > otherDuration ? duration - otherDuration : 0;
+}
+
+/**
+ * Return whether the stream's H.264 is length-prefixed, going by an avcC in its extradata.
+ */
+static bool isLengthPrefixed(AVStream *stream){
+    return stream->codec->codec_id == AV_CODEC_ID_H264 && stream->codec->extradata_size > 0
+           && stream->codec->extradata[0] == 1;
+}
+
+/**
+ * Replace the packet's data with size bytes of a new buffer, keeping its timing and flags.
+ * Returns 0 or a negative AVERROR, leaving the packet as it was.
+ */
+static int replacePacketData(AVPacket *packet, int size, AVPacket *replacement){
+    int ret = av_new_packet(replacement, size);
+    if(ret >= 0 && (ret = av_packet_copy_props(replacement, packet)) < 0){
+        av_packet_unref(replacement);
+    }
+    return ret;
+}
+
+/**
+ * Rewrite an encoder's Annex-B packet as the four-byte length-prefixed NAL units a track with an
+ * avcC holds. Returns 0 or a negative AVERROR.
+ */
+static int convertToAvcc(AVPacket *packet){
+    AVPacket converted;
+    int ret = replacePacketData(packet, nal_avcc_size(packet->data, packet->size), &converted);
+    if(ret < 0){
+        return ret;
+    }
+    converted.size = nal_annexb_to_avcc(packet->data, packet->size, converted.data);
+    av_packet_unref(packet);
+    av_packet_move_ref(packet, &converted);
+    return 0;
+}
+
+/**
+ * Put headers in front of the packet's data. Returns 0 or a negative AVERROR.
+ */
+static int prependHeaders(AVPacket *packet, const uint8_t *headers, int headersSize){
+    AVPacket merged;
+    int ret = replacePacketData(packet, headersSize + packet->size, &merged);
+    if(ret < 0){
+        return ret;
+    }
+    memcpy(merged.data, headers, (size_t) headersSize);
+    memcpy(merged.data + headersSize, packet->data, (size_t) packet->size);
+    av_packet_unref(packet);
+    av_packet_move_ref(packet, &merged);
+    return 0;
+}
+
+/**
+ * Make the headers a copied clip has to carry in-band, because the track's extradata is another
+ * clip's: its avcC's SPSs and PPSs as length-prefixed NAL units, or otherwise its extradata as
+ * it is. Returns their size, 0 when the clip's extradata is the track's, or a negative AVERROR.
+ */
+static int getInBandHeaders(AVStream *inStream, AVStream *outStream, uint8_t **headers){
+    AVCodecContext *in = inStream->codec, *out = outStream->codec;
+    *headers = NULL;
+    if(in->extradata_size == out->extradata_size
+            && (!in->extradata_size
+                || !memcmp(in->extradata, out->extradata, (size_t) in->extradata_size))){
+        return 0;
+    }
+    if(!(*headers = av_malloc((size_t) in->extradata_size * 2))){
+        return AVERROR(ENOMEM);
+    }
+    int ret = in->extradata_size;
+    if(isLengthPrefixed(inStream)){
+        ret = nal_avcc_parameter_sets(in->extradata, in->extradata_size, *headers);
+    }
+    else{
+        memcpy(*headers, in->extradata, (size_t) in->extradata_size);
+    }
+    if(ret <= 0){
+        av_freep(headers);
+    }
+    return ret;
+}
+
+/**
+ * Write whatever the transcoder has encoded so far, or with wait set, everything up to the end
+ * of the current clip. Returns TRANSCODER_CLIP_DONE, AVERROR(EAGAIN) or AVERROR_EOF.
+ */
+static int writeTranscoded(Transcoder *transcoder, bool wait, int64_t *currentTime,
+                           AVStream *outStream, AVFormatContext *outFmt){
+    AVPacket packet;
+    av_init_packet(&packet);
+    //  The encoder's H.264 is Annex-B, while a track with a copied clip's avcC is length-prefixed.
+    bool isConverted = isLengthPrefixed(outStream);
+    int ret;
+    while((ret = transcoder_receive_packet(transcoder, &packet, wait)) == 0){
+        //  The frames before the clip's offset were already left out by the decoder.
+        packet.stream_index = outStream->index;
+        if(isConverted && convertToAvcc(&packet) < 0){
+            LOGE("Couldn't convert an encoded packet, leaving it out.\n");
+        }
+        else{
+            writePacketInTime(&packet, currentTime, 0, transcoder->timeBase, outStream, outFmt);
+        }
+        av_packet_unref(&packet);
+    }
+    return ret;
+}
+
+/**
+ * Take the two given inputs of the prefetcher and mux them packet-by-packet into the given
+ * output context. skipMsA and skipMsB are how much of the front of each to leave out. If
+ * isEncoded the video goes through the transcoder; otherwise it's copied, except that with a
+ * transcoder the GOP the offset falls in is re-encoded, so the copy starts on a keyframe.
+ */
+void writeInterleaved(Prefetcher *prefetcher, int inputA, int inputB, int64_t skipMsA,
+                      int64_t skipMsB, AVFormatContext *outFmtCtx, Transcoder *transcoder,
+                      bool isEncoded){
     //  Find which of the two formats is video
+    AVFormatContext *fmtA = prefetcher->inputs[inputA].format;
+    AVFormatContext *fmtB = prefetcher->inputs[inputB].format;
     AVFormatContext *videoFormat, *audioFormat;
+    int videoInput, audioInput;
+    int64_t skipVideoMs, skipAudioMs;
     if(isVideoStream(fmtA->streams[0])){
         videoFormat = fmtA;
         audioFormat = fmtB;
+        videoInput = inputA;
+        audioInput = inputB;
+        skipVideoMs = skipMsA;
+        skipAudioMs = skipMsB;
     }
     else{
         videoFormat = fmtB;
         audioFormat = fmtA;
+        videoInput = inputB;
+        audioInput = inputA;
+        skipVideoMs = skipMsB;
+        skipAudioMs = skipMsA;
     }
     if(VERBOSE) LOGI("\tWriting video file: %s\n"
                      "\tWriting audio file: %s\n",
@@ -25,9 +185,14 @@ void writeInterleaved(AVFormatContext *fmtA, AVFormatContext *fmtB,
     AVStream *inVideoStream, *inAudioStream;
     inVideoStream = videoFormat->streams[0];
     inAudioStream = audioFormat->streams[0];
-    //  If encoding is needed, we need to allocate the encoder codec (MPEG-4).
-    if(performEncoding){
-        getEncoderCodec(encoder, inVideoStream);
+    //  Whether the video packets go through the transcoder: all of an encoded clip's, and of a
+    //  copied one's the GOP its offset falls in. The clip's index has already put the reader on
+    //  the keyframe before the offset, so that's the first one.
+    bool isSplicing = transcoder && (isEncoded || skipVideoMs > 0);
+    //  If encoding is needed, this clip gets a decoder of its own in the transcoder.
+    if(isSplicing && transcoder_begin_clip(transcoder, inVideoStream, skipVideoMs) < 0){
+        LOGE("Couldn't start transcoding %s.\n", videoFormat->filename);
+        return;
     }
     //  Find the video stream in the output format
     AVStream *outputVideoStream, *outputAudioStream;
@@ -39,29 +204,24 @@ void writeInterleaved(AVFormatContext *fmtA, AVFormatContext *fmtB,
         outputVideoStream = outFmtCtx->streams[1];
         outputAudioStream = outFmtCtx->streams[0];
     }
-    //  If the two files are of different length, let's right-align the files.
-    int64_t videoDuration = getMsFromPts(videoFormat->duration, AV_TIME_BASE_Q);
-    int64_t audioDuration = getMsFromPts(audioFormat->duration, AV_TIME_BASE_Q);
-    int64_t skipVideoMs = 0;
-    int64_t skipAudioMs = 0;
-    if(VERBOSE) LOGE("Input video duration is %" PRId64 "\n", videoDuration);
-    if(VERBOSE) LOGE("Input audio duration is %" PRId64 "\n", audioDuration);
-    if(videoDuration > audioDuration){
-        skipVideoMs = videoDuration - audioDuration;
-    }
-    else{
-        skipAudioMs = audioDuration - videoDuration;
+    //  A copied clip whose headers aren't the track's carries them ahead of each keyframe, so
+    //  seeking into it finds them too.
+    uint8_t *headers = NULL;
+    int headersSize = isEncoded ? 0 : getInBandHeaders(inVideoStream, outputVideoStream,
+                                                       &headers);
+    if(headersSize < 0){
+        LOGE("Couldn't get the headers of %s.\n", videoFormat->filename);
     }
     //  We have two packets and we compare the timestamps and write to the output file in order.
     AVPacket videoPacket, audioPacket;
     av_init_packet(&videoPacket);
     av_init_packet(&audioPacket);
-    //  Position of new file will start at 0.
+    //  Position of new file will start where the last one ended, in the output's time bases.
     int64_t currentTimeAudio, currentTimeVideo;
     currentTimeAudio = av_rescale_q(outFmtCtx->duration,
-                                    AV_TIME_BASE_Q, audioFormat->streams[0]->time_base);
+                                    AV_TIME_BASE_Q, outputAudioStream->time_base);
     currentTimeVideo = av_rescale_q(outFmtCtx->duration,
-                                    AV_TIME_BASE_Q, videoFormat->streams[0]->time_base);
+                                    AV_TIME_BASE_Q, outputVideoStream->time_base);
     //  Keep looping until either of the two streams are done.
     bool hasAudio = false, hasVideo = false, audioEOF = false, videoEOF = false;
     do{
@@ -69,33 +229,46 @@ void writeInterleaved(AVFormatContext *fmtA, AVFormatContext *fmtB,
         if((hasVideo && hasAudio &&
                 comparePts(&videoPacket, &audioPacket, inVideoStream, inAudioStream) < 0) ||
                 (!hasAudio && hasVideo)){
-            int gotFrame = 0;
-            if(performEncoding){
-                gotFrame = reEncodePacket(encoder, videoFormat->streams[0], &videoPacket);
+            if(isSplicing && !isEncoded && (videoPacket.flags & AV_PKT_FLAG_KEY) &&
+                    getMsFromPts(videoPacket.pts, inVideoStream->time_base) >= skipVideoMs){
+                //  The rest can be copied from this keyframe on, after the re-encoded start.
+                if(transcoder_end_clip(transcoder) == 0){
+                    writeTranscoded(transcoder, true, &currentTimeVideo, outputVideoStream,
+                                    outFmtCtx);
+                }
+                isSplicing = false;
+            }
+            if(isSplicing){
+                //  The transcoder takes the packet; write whatever it has finished meanwhile.
+                transcoder_send_packet(transcoder, &videoPacket);
+                writeTranscoded(transcoder, false, &currentTimeVideo, outputVideoStream,
+                                outFmtCtx);
             }
-            if(gotFrame >= 0){
-                if(VERBOSE) LOGE("Writing video at time %" PRId64 ", duration %" PRId32 ".\n",
-                                 getMsFromPts(currentTimeVideo, outputVideoStream->time_base),
-                                 videoPacket.duration);
+            else{
+                if(headersSize > 0 && (videoPacket.flags & AV_PKT_FLAG_KEY)
+                        && prependHeaders(&videoPacket, headers, headersSize) < 0){
+                    LOGE("Couldn't put the headers ahead of a keyframe.\n");
+                }
                 writePacketInTime(&videoPacket, &currentTimeVideo, skipVideoMs,
-                                  videoFormat, outputVideoStream, outFmtCtx);
+                                  inVideoStream->time_base, outputVideoStream, outFmtCtx);
             }
+            //  The muxer doesn't take ownership, so give the demuxer's buffer back.
+            av_packet_unref(&videoPacket);
             hasVideo = false;
         }
         // If audio pts < video pts or there is only audio frames remaining.
         else if((hasVideo &&
                 comparePts(&videoPacket, &audioPacket, inVideoStream, inAudioStream) > 0) ||
                 (!hasVideo && hasAudio)){
-            if(VERBOSE) LOGE("Writing audio at time %" PRId64 ", duration %" PRId32 ".\n",
-                             getMsFromPts(currentTimeAudio, outputAudioStream->time_base),
-                             audioPacket.duration);
             writePacketInTime(&audioPacket, &currentTimeAudio, skipAudioMs,
-                              audioFormat, outputAudioStream, outFmtCtx);
+                              inAudioStream->time_base, outputAudioStream, outFmtCtx);
+            av_packet_unref(&audioPacket);
             hasAudio = false;
         }
         //  Queue up the next audio and video frame if necessary.
+        //  The prefetcher has normally read them already.
         if(!hasVideo){
-            hasVideo = (av_read_frame(videoFormat, &videoPacket) == 0);
+            hasVideo = (prefetcher_read(prefetcher, videoInput, &videoPacket) == 0);
             if(hasVideo){
                 videoPacket.stream_index = outputVideoStream->index;
             }
@@ -104,7 +277,7 @@ void writeInterleaved(AVFormatContext *fmtA, AVFormatContext *fmtB,
             }
         }
         if(!hasAudio){
-            hasAudio = (av_read_frame(audioFormat, &audioPacket) == 0);
+            hasAudio = (prefetcher_read(prefetcher, audioInput, &audioPacket) == 0);
             if(hasAudio){
                 audioPacket.stream_index = outputAudioStream->index;
             }
@@ -113,13 +286,25 @@ void writeInterleaved(AVFormatContext *fmtA, AVFormatContext *fmtB,
             }
         }
     } while(!audioEOF && !videoEOF);
+    //  Whichever stream didn't hit EOF still holds a packet we read but never wrote.
+    if(hasVideo){
+        av_packet_unref(&videoPacket);
+    }
+    if(hasAudio){
+        av_packet_unref(&audioPacket);
+    }
+    //  Flush the clip's decoder and write the rest of its frames before the next clip starts.
+    if(isSplicing && transcoder_end_clip(transcoder) == 0){
+        writeTranscoded(transcoder, true, &currentTimeVideo, outputVideoStream, outFmtCtx);
+    }
+    av_free(headers);
     if(audioEOF){
         outFmtCtx->duration = av_rescale_q(currentTimeAudio,
-                                            audioFormat->streams[0]->time_base, AV_TIME_BASE_Q);
+                                            outputAudioStream->time_base, AV_TIME_BASE_Q);
     }
     if(videoEOF){
         outFmtCtx->duration = av_rescale_q(currentTimeVideo,
-                                            videoFormat->streams[0]->time_base, AV_TIME_BASE_Q);
+                                            outputVideoStream->time_base, AV_TIME_BASE_Q);
     }
 
     if(VERBOSE) LOGE("Final audio time: %" PRId64 ", video time: %" PRId64 ".\n",
@@ -145,81 +330,206 @@ int64_t getMsFromPts(int64_t pts, AVRational time_base){
 
 /**
  * Takes the given packet and writes it to the given output format A pointer to the current
- * timestamp is passed and updated accordingly. Also, a time offset in ms is passed.
+ * timestamp is passed and updated accordingly. Also, a time offset in ms is passed, and the
+ * time base the packet's timestamps are in.
  */
 void writePacketInTime(AVPacket* packet, int64_t *currentTime, int64_t offsetTimeMs,
-                       AVFormatContext* inFmt,
+                       AVRational inTimeBase,
                        AVStream* outStream, AVFormatContext* outFmt){
-    if(getMsFromPts(packet->pts, inFmt->streams[0]->time_base) >= offsetTimeMs){
+    int traceStream = outStream->codec->codec_type == AVMEDIA_TYPE_VIDEO ? TRACE_STREAM_VIDEO
+                                                                         : TRACE_STREAM_AUDIO;
+    if(getMsFromPts(packet->pts, inTimeBase) >= offsetTimeMs){
         packet->pts = *currentTime;
         packet->dts = *currentTime;
-        packet->duration = av_rescale_q(packet->duration,
-                                        inFmt->streams[0]->time_base,
-                                        outStream->time_base);
+        packet->duration = av_rescale_q(packet->duration, inTimeBase, outStream->time_base);
         (*currentTime) += packet->duration;
+        TRACE_BEGIN(TRACE_MUX_WRITE, traceStream, packet->pts, packet->size);
         av_write_frame(outFmt, packet);
+        TRACE_END(TRACE_MUX_WRITE, traceStream, packet->pts, packet->size);
     }
     else{
-        if(VERBOSE) LOGE("Dropping packet at time %" PRId64 " because of offset.\n",
-                         getMsFromPts(packet->pts, outStream->time_base));
+        //  Skipped because of the offset.
+        TRACE_INSTANT(TRACE_MUX_SKIP, traceStream, packet->pts, packet->size);
     }
 }
 
 /**
- * Take the given video packet, decode it to a frame, re-encode it using the given encoder.
+ * Add the output's streams, taking them from the first pair, and write its header. With a plan
+ * the video stream is the plan's reference clip's, or the encoder's if every clip is re-encoded,
+ * and the transcoder is started for the clips that need it. Returns 0 or a negative AVERROR.
  */
-int reEncodePacket(AVCodecContext *encoder, AVStream *inVideoStream, AVPacket *videoPacket){
-    //  Allocate the frame needed to decode the video packet
-    AVFrame *frame = av_frame_alloc();
-    //  Decode the video packet into the frame.
-    int gotFrame;
-    int ret = avcodec_decode_video2(inVideoStream->codec, frame, &gotFrame, videoPacket);
-    if(ret >= 0 && gotFrame >= 0){
-        //  Re-encode it in the new format
-        avcodec_encode_video2(inVideoStream->codec, videoPacket, frame, &gotFrame);
-    }
-    return gotFrame;
+static int startOutput(AVFormatContext *outputFormat, AVFormatContext **formats, int firstPair,
+                       RenderPlan *plan, Transcoder *transcoder, bool *isTranscoding){
+    int ret = 0;
+    for (int i = firstPair; i < firstPair + 2 && ret >= 0; i++) {
+        AVStream *stream = formats[i]->streams[0];
+        if(!plan || !isVideoStream(stream)){
+            copyStreamToOutput(outputFormat, stream);
+            continue;
+        }
+        AVCodecContext *encoder = NULL;
+        if(plan->reference >= 0){
+            //  Encoded clips carry their headers in-band; the track's belong to the copied ones.
+            AVStream *reference = formats[plan->reference]->streams[0];
+            if(getEncoderCodec(&encoder, reference->codec->codec_id, reference, false) < 0){
+                LOGE("Re-encoding all the video instead.\n");
+                render_plan_encode_all(plan);
+            }
+            else{
+                copyStreamToOutput(outputFormat, reference);
+            }
+        }
+        if(plan->reference < 0){
+            bool isGlobalHeader = outputFormat->oformat->flags & AVFMT_GLOBALHEADER;
+            if((ret = getEncoderCodec(&encoder, AV_CODEC_ID_MPEG4, stream, isGlobalHeader)) < 0){
+                break;
+            }
+            copyEncoderToOutput(outputFormat, encoder);
+        }
+        if((ret = transcoder_start(transcoder, encoder)) < 0){
+            LOGE("Couldn't start the transcoder.\n");
+            break;
+        }
+        *isTranscoding = true;
+    }
+    if(ret >= 0 && (ret = avformat_write_header(outputFormat, NULL)) < 0){
+        LOGE("Couldn't write the file header.\n");
+    }
+    return ret;
 }
 
 /**
- * Take all the input files and stitch them together into the output file.
- * Pass it the number of files, the list of files, the output file, and whether to perform encoding.
+ * Take all the input files, already opened and probed by the pool, and stitch them together
+ * into the output file. The files are read ahead on a prefetcher thread while earlier pairs are
+ * written, and each is released as soon as it's written.
+ * Pass it the probed files, the output file, and whether to perform encoding.
  */
-int stitchFile(int numFiles, char* filesList[], char* outputFilePath, bool performEncoding) {
-    //  The format and the stream for the pair of files (audio and video)
-    AVFormatContext *formatA = NULL, *formatB = NULL, *outputFormat = NULL;
+int stitchFile(ProbePool *inputs, char* outputFilePath, bool performEncoding) {
+    //  The format for every file, in pairs (audio and video), and for the output.
+    int numFormats = inputs->numInputs & ~1;
+    AVFormatContext **formats = NULL, *outputFormat = NULL;
+    //  How much of the front of each file the right-alignment leaves out.
+    int64_t *skipMs = NULL;
+    if(numFormats){
+        formats = av_mallocz_array((size_t) numFormats, sizeof(AVFormatContext*));
+        skipMs = av_mallocz_array((size_t) numFormats, sizeof(int64_t));
+        if(!formats || !skipMs){
+            av_free(formats);
+            av_free(skipMs);
+            return AVERROR(ENOMEM);
+        }
+    }
     //  Make the format for the output file.
     int ret = getOutputFormat(&outputFormat, outputFilePath);
     if(ret < 0){
+        av_free(formats);
+        av_free(skipMs);
         return ret;
     }
 
-    for (int i = 0; i < numFiles; i+=2) {
-        //  Get the formats of the audio and video file pair.
-        getInputFormat(&formatA, filesList[i]);
-        getInputFormat(&formatB, filesList[i+1]);
-        //  The first video dictates the format for subsequent streams.
-        if(i == 0){
-            copyStreamToOutput(outputFormat,formatA->streams[0]);
-            copyStreamToOutput(outputFormat,formatB->streams[0]);
-            ret = avformat_write_header(outputFormat, NULL);
-            if (ret < 0) {
-                LOGE("Couldn't write the file header.\n");
-                break;
-            }
+    for (int i = 0; i < numFormats; i+=2) {
+        //  Take the formats of the audio and video file pair from the probe.
+        formats[i] = probe_pool_take(inputs, i);
+        formats[i+1] = probe_pool_take(inputs, i+1);
+        if(!formats[i] || !formats[i+1]){
+            LOGE("Skipping %s and %s, they couldn't be opened.\n",
+                 inputs->inputs[i].path, inputs->inputs[i+1].path);
+            releaseFormat(&formats[i]);
+            releaseFormat(&formats[i+1]);
+            continue;
         }
-        if(VERBOSE) av_dump_format(outputFormat, 0, filesList[i], 1);
+        //  Position every pair before reading starts; with an index that's a lookup, not a read.
+        const ClipIndex *indexA = inputs->inputs[i].hasIndex ? &inputs->inputs[i].index : NULL;
+        const ClipIndex *indexB = inputs->inputs[i+1].hasIndex ? &inputs->inputs[i+1].index
+                                                               : NULL;
+        skipMs[i] = getSkipMs(formats[i], indexA, formats[i+1], indexB);
+        skipMs[i+1] = getSkipMs(formats[i+1], indexB, formats[i], indexA);
+        seekToOffset(formats[i], indexA, skipMs[i]);
+        seekToOffset(formats[i+1], indexB, skipMs[i+1]);
+    }
+
+    //  The first pair that opened sets up the output.
+    int firstPair = -1;
+    for (int i = numFormats - 2; i >= 0; i-=2) {
+        if(formats[i]){
+            firstPair = i;
+        }
+    }
+    //  Work out which clips can be copied as they are, and which have to be re-encoded.
+    RenderPlan plan;
+    bool hasPlan = false;
+    if(performEncoding && firstPair >= 0){
+        if((ret = render_plan_build(&plan, formats, inputs->inputs, numFormats)) < 0){
+            LOGE("Couldn't plan the stitch.\n");
+        }
+        hasPlan = ret >= 0;
+    }
+    //  Re-encodes the video on threads of its own, for the clips that can't just be copied.
+    Transcoder transcoder;
+    bool isTranscoding = false;
+    bool wroteHeader = false;
+    if(firstPair >= 0 && ret >= 0){
+        ret = startOutput(outputFormat, formats, firstPair, hasPlan ? &plan : NULL, &transcoder,
+                          &isTranscoding);
+        wroteHeader = ret >= 0;
+    }
+    if(hasPlan){
+        LOGI("Copying %" PRId64 " ms of video and re-encoding %" PRId64 " ms.\n",
+             plan.copyMs, plan.encodeMs);
+    }
+
+    //  From here the files are read on the prefetcher's thread, ahead of the writing below.
+    Prefetcher prefetcher;
+    bool isPrefetching = false;
+    if(ret >= 0){
+        ret = prefetcher_start(&prefetcher, formats, numFormats, PREFETCH_BUDGET_BYTES);
+        isPrefetching = true;
+    }
+    for (int i = 0; i < numFormats && ret >= 0; i+=2) {
+        if(!formats[i]){
+            continue;
+        }
+        if(VERBOSE) av_dump_format(outputFormat, 0, inputs->inputs[i].path, 1);
         //  Sequentially write the audio and video to the output file.
-        writeInterleaved(formatA, formatB, outputFormat, performEncoding);
-        //  Release the allocated formats.
-        releaseFormat(&formatA);
-        releaseFormat(&formatB);
+        bool isEncoded = hasPlan && (plan.clips[i].isEncoded || plan.clips[i+1].isEncoded);
+        writeInterleaved(&prefetcher, i, i+1, skipMs[i], skipMs[i+1], outputFormat,
+                         isTranscoding ? &transcoder : NULL, isEncoded);
+        //  Release the allocated formats once the prefetcher lets go of them.
+        prefetcher_finish(&prefetcher, i);
+        prefetcher_finish(&prefetcher, i+1);
+        releaseFormat(&formats[i]);
+        releaseFormat(&formats[i+1]);
+    }
+    if(isPrefetching){
+        prefetcher_stop(&prefetcher);
+        LOGI("Read %" PRId64 " KB ahead (at most %" PRId64 " KB queued); the writer waited %"
+             PRId64 " ms for reads and the reader %" PRId64 " ms for room.\n",
+             prefetcher.bytesRead / 1024, prefetcher.maxBytes / 1024,
+             prefetcher.writerWaitNs / 1000000, prefetcher.readerWaitNs / 1000000);
+    }
+    if(isTranscoding){
+        transcoder_stop(&transcoder);
+        LOGI("Transcoded %" PRIu64 " frames (%" PRIu64 " left out, %" PRIu64 " scaled, %" PRIu64
+             " decode and %" PRIu64 " encode errors) into %" PRIu64 " packets. Waits for room: "
+             "writer %" PRId64 " ms, decoder %" PRId64 " ms, scaler %" PRId64 " ms.\n",
+             transcoder.framesDecoded, transcoder.framesSkipped, transcoder.framesScaled,
+             transcoder.decodeErrors, transcoder.encodeErrors, transcoder.packetsEncoded,
+             transcoder.packets.waitNs / 1000000, transcoder.frames.waitNs / 1000000,
+             transcoder.scaledFrames.waitNs / 1000000);
+    }
+    if(hasPlan){
+        render_plan_release(&plan);
     }
     //  Release the allocated formats (in case they weren't).
-    releaseFormat(&formatA);
-    releaseFormat(&formatB);
+    for (int i = 0; i < numFormats; i++) {
+        releaseFormat(&formats[i]);
+    }
+    av_free(formats);
+    av_free(skipMs);
     //  Write the output file trailer
-    av_write_trailer(outputFormat);
+    if(wroteHeader){
+        av_write_trailer(outputFormat);
+    }
     //  Release the allocated output format.
     releaseFormat(&outputFormat);
     return 0;
@@ -233,35 +543,55 @@ bool isVideoStream(AVStream *avStream){
 }
 
 /**
- * Configure an MPEG-4 video encoder with same bitrate, etc. as the original video stream. Pass
- * the reference to the video codec to be initialized.
+ * Configure and open a video encoder for the given codec with same bitrate, size, etc. as the
+ * original video stream. Pass the reference to the video codec to be initialized, and whether
+ * the output format wants global headers. Returns 0 or a negative AVERROR.
  * This is only called when encoding is really necessary.
  */
-void getEncoderCodec(AVCodecContext *videoCodec, AVStream *videoStream) {
+int getEncoderCodec(AVCodecContext **videoCodec, enum AVCodecID codecId, AVStream *videoStream,
+                    bool isGlobalHeader) {
     AVCodec *encoder;
-    encoder = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    encoder = avcodec_find_encoder(codecId);
     if (!encoder) {
-        LOGE("MPEG-4 video encoder not found.\n");
-        return;
+        LOGE("No %s video encoder.\n", avcodec_get_name(codecId));
+        return AVERROR_ENCODER_NOT_FOUND;
     }
-    videoCodec = avcodec_alloc_context3(encoder);
-    if (!videoCodec) {
+    *videoCodec = avcodec_alloc_context3(encoder);
+    if (!*videoCodec) {
         LOGE("Could not allocate video codec.\n");
-        return;
+        return AVERROR(ENOMEM);
     }
     //  Set the required parameters for the encoder based on input stream.
-    videoCodec->bit_rate = videoStream->codec->bit_rate;
-    videoCodec->width = videoStream->codec->width;
-    videoCodec->height = videoStream->codec->height;
-    videoCodec->time_base = (AVRational) {1, 30};
-    videoCodec->gop_size = videoStream->codec->gop_size;
-    videoCodec->max_b_frames = videoStream->codec->max_b_frames;
-    videoCodec->pix_fmt = videoStream->codec->pix_fmt;
+    AVCodecContext *codec = *videoCodec;
+    codec->bit_rate = videoStream->codec->bit_rate > 0 ? videoStream->codec->bit_rate
+                                                       : ENCODER_DEFAULT_BIT_RATE;
+    codec->width = videoStream->codec->width;
+    codec->height = videoStream->codec->height;
+    //  Frames are timed in ms, whatever rate each clip was recorded at.
+    codec->time_base = (AVRational) {1, 1000};
+    codec->gop_size = videoStream->codec->gop_size;
+    //  No B-frames: packets come out in the order frames go in, so dts can equal pts.
+    codec->max_b_frames = 0;
+    //  The stream's own if the encoder takes it; every other goes through the transcoder's scaler.
+    codec->pix_fmt = encoder->pix_fmts ? encoder->pix_fmts[0] : videoStream->codec->pix_fmt;
+    for (const enum AVPixelFormat *pixFmt = encoder->pix_fmts;
+         pixFmt && *pixFmt != AV_PIX_FMT_NONE; pixFmt++) {
+        if (*pixFmt == videoStream->codec->pix_fmt) {
+            codec->pix_fmt = *pixFmt;
+        }
+    }
+    codec->thread_count = 0;
+    codec->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (isGlobalHeader) {
+        codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    }
     //  Open the encoder for later use.
-    if (avcodec_open2(videoCodec, encoder, NULL) < 0) {
+    int ret = avcodec_open2(codec, encoder, NULL);
+    if (ret < 0) {
         LOGE("Could not start video codec.\n");
-        return;
+        avcodec_free_context(videoCodec);
     }
+    return ret;
 }
 
 /**
@@ -282,6 +612,21 @@ void copyStreamToOutput(AVFormatContext *fmtCtx, AVStream *inStream){
     if(VERBOSE) LOGE("Added stream %d to output format.\n", newStream->index);
 }
 
+/**
+ * Adds a stream for what the given opened encoder produces to the given output format.
+ */
+void copyEncoderToOutput(AVFormatContext *fmtCtx, AVCodecContext *encoder){
+    AVStream *newStream = avformat_new_stream(fmtCtx, encoder->codec);
+    //  Copy the encoder's parameters, extradata included, to the output stream.
+    int ret = avcodec_copy_context(newStream->codec, encoder);
+    if (ret < 0) {
+        LOGE("Failed to copy the encoder to the output stream.\n");
+    }
+    newStream->time_base = encoder->time_base;
+    newStream->codec->codec_tag = 0;
+    if(VERBOSE) LOGE("Added encoded stream %d to output format.\n", newStream->index);
+}
+
 /**
  * Get the format for the given file. Pass the AVFormatContext by reference to get filled.
  */
@@ -328,29 +673,62 @@ void releaseFormat(AVFormatContext** fmtCtx){
 }
 
 /*
- * Iterate through each video file to make sure the codec are same. If not, we need to do encoding.
+ * Iterate through each probed video file to make sure the codec, picture size and format, and
+ * framing are same, and so are the headers unless they can go in-band. If not, we need to do
+ * encoding.
  */
-bool needsEncoding(int numFiles, char* filesList[]){
-    AVFormatContext *format = NULL; //  Holds the format of the file (eg. mp4).
+bool needsEncoding(ProbePool *inputs){
+    AVFormatContext *format; //  Holds the format of the file (eg. mp4).
     AVStream *stream;        //  Holds the stream/codec for the format (eg. H.264).
-    enum AVCodecID videoCodecID = AV_CODEC_ID_NONE;
-    bool needsEncoding = false;
-    for (int i = 0; i < numFiles; i++) {
-        if(VERBOSE) LOGE("Inspecting file %s.\n", filesList[i]);
-        getInputFormat(&format, filesList[i]);
-        avformat_find_stream_info(format, NULL);
+    ClipParams videoParams;  //  What the first video has, that every other has to match.
+    bool hasVideo = false;
+    for (int i = 0; i < inputs->numInputs; i++) {
+        ProbedInput *input = &inputs->inputs[i];
+        if(VERBOSE) LOGE("Inspecting file %s.\n", input->path);
+        if(!(format = input->format)){
+            continue;
+        }
+        //  The clip's index has the same answer without touching the stream.
         stream = format->streams[0];
-        if (stream->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
-            //  If codec id doesn't match, we need to do encoding.
-            if (videoCodecID != AV_CODEC_ID_NONE && videoCodecID != stream->codec->codec_id) {
-                needsEncoding = true;
-                releaseFormat(&format);
-                break;
+        enum AVMediaType codecType = input->hasIndex
+                                     ? (enum AVMediaType) input->index.streams[0].codecType
+                                     : stream->codec->codec_type;
+        if (codecType == AVMEDIA_TYPE_VIDEO) {
+            ClipParams params;
+            render_clip_params(&params, format, input->hasIndex ? &input->index : NULL);
+            //  If anything doesn't match, the packets can't share a track; we need to do encoding.
+            if (hasVideo && !render_params_match(&videoParams, &params)) {
+                return true;
             }
+            videoParams = params;
+            hasVideo = true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Log how long each file took to open and probe, and the pass as a whole.
+ */
+static void reportProbeTimes(ProbePool *inputs){
+    int64_t totalNs = 0;
+    int numIndexHits = 0;
+    for (int i = 0; i < inputs->numInputs; i++) {
+        ProbedInput *input = &inputs->inputs[i];
+        totalNs += input->probeNs;
+        numIndexHits += input->isIndexHit;
+        if(input->result < 0){
+            LOGE("Probing %s failed after %" PRId64 " us: %s\n", input->path,
+                 input->probeNs / 1000, av_err2str(input->result));
+        }
+        else{
+            LOGI("Probed %s in %" PRId64 " us%s.\n", input->path, input->probeNs / 1000,
+                 input->isIndexHit ? " from its index" : "");
         }
-        releaseFormat(&format);
     }
-    return needsEncoding;
+    LOGI("Probed %d files (%d from their index) in %" PRId64 " ms on %d threads "
+         "(%" PRId64 " ms one at a time).\n", inputs->numInputs, numIndexHits,
+         inputs->wallNs / 1000000, inputs->numThreads + 1, totalNs / 1000000);
 }
 
 /*
@@ -360,20 +738,35 @@ bool needsEncoding(int numFiles, char* filesList[]){
  * into the desired format.
  */
 int muxFiles(int numFiles, char* filesList[], char* outputFileName){
-    av_register_all();
-    avcodec_register_all();
+    ffmpeg_global_init();
 
     //if(VERBOSE) av_log_set_level(AV_LOG_DEBUG);
     if(VERBOSE) LOGE("Muxing %d files into %s", numFiles, outputFileName);
 
+    //  Open and probe every file up front, side by side; stitching uses the same contexts.
+    ProbePool inputs;
+    if(probe_pool_run(&inputs, numFiles, filesList, 0) < 0){
+        LOGE("Couldn't start probing the input files.\n");
+        return -1;
+    }
+    reportProbeTimes(&inputs);
+
     //  Loop through each file and check if the codecs are the same. If not, we need to encode.
-    bool willEncode = needsEncoding(numFiles, filesList);
+    bool willEncode = needsEncoding(&inputs);
 
     if(VERBOSE) LOGI("Output file name: %s\n", outputFileName);
     if(VERBOSE) LOGI("Encoding is %s necessary.\n", willEncode ? "" : "not");
 
     //  Stitch the files together into an output file.
-    stitchFile(numFiles, filesList, outputFileName, willEncode);
+    stitchFile(&inputs, outputFileName, willEncode);
+    probe_pool_release(&inputs);
+
+    if(VERBOSE){
+        AllocationStats stats;
+        get_allocation_stats(&stats);
+        LOGI("Frames: %" PRIu64 " allocated for %" PRIu64 " requests.\n",
+             stats.frameAllocations, stats.frameRequests);
+    }
     return 0;
 }
 
@@ -390,6 +783,13 @@ int main(int argc, char *argv[]) {
     //  Do the actual work. Pass it the number of files, list of files to mux, and the output file.
     int success = muxFiles((argc - 2), &argv[1], argv[argc - 1]);
 
+#if TRACE_ENABLED
+    //  Leave the trace next to the output, ready for Perfetto.
+    char tracePath[1024];
+    snprintf(tracePath, sizeof(tracePath), "%s.trace.json", argv[argc - 1]);
+    trace_export_chrome_json(tracePath);
+#endif
+
     //  Return whether it worked.
     return success;
 }
@@ -417,4 +817,15 @@ Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_muxFiles(JNIEnv *env,
     }
     free(paths);
 }
-#endif
\ No newline at end of file
+
+/**
+ * Register the stitching natives.
+ */
+int register_muxer_natives(JNIEnv *env, jclass wrapperClass) {
+    static const JNINativeMethod methods[] = {
+        {"muxFiles", "([Ljava/lang/String;)V",
+         Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_muxFiles},
+    };
+    return register_methods(env, wrapperClass, methods, sizeof(methods) / sizeof(methods[0]));
+}
+#endif
@@ -4,6 +4,7 @@
 #ifdef ANDROID
 #include <jni.h>
 #include <android/log.h>
+#include "JniOnLoad.h"
 #endif
 
 #include <stdbool.h>
@@ -15,32 +16,54 @@
 #include "libavutil/imgutils.h"
 #include "libavutil/mathematics.h"
 #include "libavutil/samplefmt.h"
+#include "BufferPool.h"
+#include "Trace.h"
+#include "FFmpegInit.h"
+#include "ProbePool.h"
+#include "Prefetcher.h"
+#include "Transcoder.h"
+#include "RenderPlan.h"
+#include "NalUtils.h"
 
 static bool VERBOSE = false;
 
+//  Bit rate for re-encoded video when the first clip doesn't say what it was recorded at.
+#define ENCODER_DEFAULT_BIT_RATE 4000000
+
 /**
- * Take the two given input stream and mux them packet-by-packet into the given output context.
+ * How much of the front of format to skip so that it ends along with other: of the two files
+ * in a pair, the longer is right-aligned with the shorter. Durations come from the clips'
+ * indexes when they have them (NULL otherwise).
  */
-void writeInterleaved(AVFormatContext *fmtA, AVFormatContext *fmtB, AVFormatContext *outFmtCtx, bool performEncoding);
+int64_t getSkipMs(AVFormatContext *format, const ClipIndex *index,
+                  AVFormatContext *other, const ClipIndex *otherIndex);
 
 /**
- * Takes the given packet and writes it to the given output format A pointer to the current
- * timestamp is passed and updated accordingly. Also, a time offset in ms is passed.
+ * Take the two given inputs of the prefetcher and mux them packet-by-packet into the given
+ * output context. skipMsA and skipMsB are how much of the front of each to leave out. If
+ * isEncoded the video goes through the transcoder; otherwise it's copied, except that with a
+ * transcoder the GOP the offset falls in is re-encoded, so the copy starts on a keyframe.
  */
-void writePacketInTime(AVPacket* packet, int64_t *currentTime, int64_t offsetTimeMs,
-                       AVFormatContext* inFmt,
-                       AVStream* outStream, AVFormatContext* outFmt);
+void writeInterleaved(Prefetcher *prefetcher, int inputA, int inputB, int64_t skipMsA,
+                      int64_t skipMsB, AVFormatContext *outFmtCtx, Transcoder *transcoder,
+                      bool isEncoded);
 
 /**
- * Take the given video packet, decode it to a frame, re-encode it using the given encoder.
+ * Takes the given packet and writes it to the given output format A pointer to the current
+ * timestamp is passed and updated accordingly. Also, a time offset in ms is passed, and the
+ * time base the packet's timestamps are in.
  */
-int reEncodePacket(AVCodecContext *encoder, AVStream *inVideoStream, AVPacket *videoPacket);
+void writePacketInTime(AVPacket* packet, int64_t *currentTime, int64_t offsetTimeMs,
+                       AVRational inTimeBase,
+                       AVStream* outStream, AVFormatContext* outFmt);
 
 /**
- * Take all the input files and stitch them together into the output file.
- * Pass it the number of files, the list of files, the output file, and whether to perform encoding.
+ * Take all the input files, already opened and probed by the pool, and stitch them together
+ * into the output file. The files are read ahead on a prefetcher thread while earlier pairs are
+ * written, and each is released as soon as it's written.
+ * Pass it the probed files, the output file, and whether to perform encoding.
  */
-int stitchFile(int numFiles, char* filesList[], char* outputFilePath, bool performEncoding);
+int stitchFile(ProbePool *inputs, char* outputFilePath, bool performEncoding);
 
 /**
  * Helper function returns whether the given stream is a video stream.
@@ -59,17 +82,24 @@ int comparePts(AVPacket *packetA, AVPacket *packetB, AVStream *streamA, AVStream
 int64_t getMsFromPts(int64_t pts, AVRational time_base);
 
 /**
- * Configure an MPEG-4 video encoder with same bitrate, etc. as the original video stream. Pass
- * the reference to the video codec to be initialized.
+ * Configure and open a video encoder for the given codec with same bitrate, size, etc. as the
+ * original video stream. Pass the reference to the video codec to be initialized, and whether
+ * the output format wants global headers. Returns 0 or a negative AVERROR.
  * This is only called when encoding is really necessary.
  */
-void getEncoderCodec(AVCodecContext *videoCodec, AVStream *videoStream);
+int getEncoderCodec(AVCodecContext **videoCodec, enum AVCodecID codecId, AVStream *videoStream,
+                    bool isGlobalHeader);
 
 /**
  * Takes an input stream and copies its codec and its parameters to the given output format.
  */
 void copyStreamToOutput(AVFormatContext *fmtCtx, AVStream *inStream);
 
+/**
+ * Adds a stream for what the given opened encoder produces to the given output format.
+ */
+void copyEncoderToOutput(AVFormatContext *fmtCtx, AVCodecContext *encoder);
+
 /**
  * Get the format for the given file. Pass the AVFormatContext by reference to get filled.
  */
@@ -91,9 +121,10 @@ void getStream(AVStream* stream, AVFormatContext *fmtCtx);
 void releaseFormat(AVFormatContext** fmtCtx);
 
 /*
- * Iterate through each video file to make sure the codec are same. If not, we need to do encoding.
+ * Iterate through each probed video file to make sure the codec, picture size and format, and
+ * headers are same. If not, we need to do encoding.
  */
-bool needsEncoding(int numFiles, char* filesList[]);
+bool needsEncoding(ProbePool *inputs);
 
 /*
  * Stitch together a list of files. Arguments are the number of files to stitch and the array of
@@ -1,189 +1,1632 @@
 #include "FFmpegRtmp.h"
 
 #ifdef ANDROID
-JNIEXPORT void JNICALL
+/**
+ * Turn the long handle held by Java back into the session it points to.
+ */
+static inline RtmpSession *get_session(jlong handle) {
+    return (RtmpSession *) (intptr_t) handle;
+}
+
+JNIEXPORT jlong JNICALL
 Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_init(JNIEnv *env, jobject  __unused instance,
                                                           jobject jOpts){
-    av_register_all();
-    avformat_network_init();
-    avcodec_register_all();
+    //  JNI_OnLoad has normally done this already.
+    ffmpeg_global_init();
+
+    RtmpSession *session = av_mallocz(sizeof(RtmpSession));
+    if (!session) {
+        jclass exc = (*env)->FindClass(env, "java/lang/OutOfMemoryError");
+        (*env)->ThrowNew(env, exc, "Couldn't allocate the session.");
+        return 0;
+    }
+    pthread_mutex_init(&session->recommendationLock, NULL);
+    pthread_mutex_init(&session->configLock, NULL);
 
     // Get the values passed in from java side and populate the struct.
-    populate_metadata_from_java(env, jOpts);
+    populate_metadata_from_java(env, jOpts, &session->metadata);
+    key_frame_requester_init(&session->keyFrameRequester,
+                             session->metadata.keyFrameRequestIntervalMs);
+    decode_time_init(&session->videoDecodeTime, session->metadata.videoReorderDepth);
+    decode_time_init(&session->audioDecodeTime, 0);
+
+    //  One destination per output URL, all fed from the same encoder.
+    session->numDestinations = session->metadata.numOutputFiles;
+    for (int i = 0; i < session->numDestinations; i++) {
+        Destination *destination = &session->destinations[i];
+        destination->session = session;
+        destination->index = i;
+        destination->url = session->metadata.outputFiles[i];
+        destination->formatName = session->metadata.outputFormatName;
+        destination->lastDts[1] = 1;
+        watchdog_init(&destination->watchdog, session->metadata.connectTimeoutMs,
+                      session->metadata.headerTimeoutMs, session->metadata.packetTimeoutMs);
+        destination->interruptCallback.callback = destination_interrupted;
+        destination->interruptCallback.opaque = destination;
+    }
+    //  The recording is just one more consumer of the same packets, on its own writer thread.
+    if (session->metadata.recordingFile) {
+        Destination *destination = &session->destinations[session->numDestinations];
+        destination->session = session;
+        destination->index = session->numDestinations++;
+        destination->url = session->metadata.recordingFile;
+        destination->formatName = RECORDING_FORMAT_NAME;
+        destination->isRecording = true;
+        destination->isFragmented = session->metadata.fragmentRecording;
+        destination->lastDts[1] = 1;
+    }
+    return (jlong) (intptr_t) session;
 }
 
 JNIEXPORT void JNICALL
-Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_start(JNIEnv  __unused *env,
-                                                           jobject  __unused instance) {
-    //  Malloc the packet early for later use.
-    if (!packet) {
-        packet = av_malloc(sizeof(AVPacket));
-        av_init_packet(packet);
+Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_start(JNIEnv *env,
+                                                           jobject  __unused instance,
+                                                           jlong jHandle) {
+    RtmpSession *session = get_session(jHandle);
+    if (!session) {
+        return;
+    }
+    //  Get the packet early for later use.
+    if (!session->packet) {
+        session->packet = recycler_get_packet();
+    }
+    //  Ready before the buffer pool, which is what lets packets in.
+    if (!session->isGopCacheReady) {
+        if (gop_cache_init(&session->gopCache, session->metadata.gopCacheKb) < 0) {
+            gop_cache_uninit(&session->gopCache);
+            jclass exc = (*env)->FindClass(env, "java/lang/OutOfMemoryError");
+            (*env)->ThrowNew(env, exc, "Couldn't allocate the GOP cache.");
+            return;
+        }
+        session->isGopCacheReady = true;
+    }
+    if (!session->isBufferPoolReady) {
+        if (buffer_pool_init(&session->bufferPool) < 0) {
+            jclass exc = (*env)->FindClass(env, "java/lang/OutOfMemoryError");
+            (*env)->ThrowNew(env, exc, "Couldn't allocate the buffer pool.");
+            return;
+        }
+        session->isBufferPoolReady = true;
+    }
+    //  The rings are allocated once per session, so the encoder thread never has to.
+    for (int i = 0; i < session->numDestinations; i++) {
+        Destination *destination = &session->destinations[i];
+        if (!destination->isRingAllocated) {
+            if (packet_ring_init(&destination->packetRing, destination->isRecording
+                                                           ? RECORDING_RING_NUM_SLOTS
+                                                           : RING_NUM_SLOTS) < 0) {
+                jclass exc = (*env)->FindClass(env, "java/lang/OutOfMemoryError");
+                (*env)->ThrowNew(env, exc, "Couldn't allocate the packet ring.");
+                return;
+            }
+            destination->isRingAllocated = true;
+        }
+        //  Room to copy the GOP cache into when joining; recordings never rejoin. Without it
+        //  every join would wait for the next keyframe, so it's no less required than the ring.
+        if (!destination->isRecording && session->gopCache.entries
+            && !destination->primePackets
+            && !(destination->primePackets = av_malloc_array(GOP_CACHE_MAX_PACKETS,
+                                                             sizeof(RingPacket)))) {
+            jclass exc = (*env)->FindClass(env, "java/lang/OutOfMemoryError");
+            (*env)->ThrowNew(env, exc, "Couldn't allocate room to copy the GOP cache.");
+            return;
+        }
+    }
+    //  Dial while the camera warms up, so the first packets don't wait for the handshake.
+    if (!session->foundConfigFrame) {
+        session->startTimeNs = clock_now_ns();
+        start_predials(session);
     }
 }
 
 JNIEXPORT void JNICALL
 Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_writePacketInterleaved(JNIEnv *env,
-                                                                            jobject  __unused instance,
+                                                                            jobject instance,
+                                                                            jlong jHandle,
                                                                             jobject jData,
                                                                             jint jIsVideo,
                                                                             jint jSize,
                                                                             jlong jPts,
                                                                             jint jIsKeyFrame,
                                                                             jint jIsConfigFrame) {
+    RtmpSession *session = get_session(jHandle);
+    if (!session || !session->packet || !session->isBufferPoolReady) {
+        return;
+    }
     // Get the Byte array backing the Java ByteBuffer.
     uint8_t *data = (*env)->GetDirectBufferAddress(env, jData);
+    jlong capacity = (*env)->GetDirectBufferCapacity(env, jData);
+    if (!data || jSize <= 0 || jSize > capacity) {
+        LOGE("Skipping a packet that's outside its buffer.");
+        return;
+    }
+    submit_packet(env, session, instance, data, jSize, (int64_t) jPts, DECODE_TIME_UNKNOWN,
+                  jIsVideo == JNI_TRUE, jIsKeyFrame == 1, jIsConfigFrame != 0);
+}
+
+/**
+ * Submit several packets that the encoder wrote back to back into one direct ByteBuffer, so a
+ * whole drain of the encoder costs one JNI transition. jDescriptors holds
+ * BATCH_DESCRIPTOR_LONGS longs per packet: offset into jData, size, pts, and BATCH_FLAG_* bits,
+ * with the composition offset above them when BATCH_FLAG_HAS_DTS is set.
+ */
+JNIEXPORT void JNICALL
+Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_writePackets(JNIEnv *env,
+                                                                  jobject instance,
+                                                                  jlong jHandle,
+                                                                  jobject jData,
+                                                                  jint jCount,
+                                                                  jlongArray jDescriptors) {
+    RtmpSession *session = get_session(jHandle);
+    if (!session || !session->packet || !session->isBufferPoolReady || !jDescriptors) {
+        return;
+    }
+    uint8_t *data = (*env)->GetDirectBufferAddress(env, jData);
+    jlong capacity = (*env)->GetDirectBufferCapacity(env, jData);
+    int count = (int) (*env)->GetArrayLength(env, jDescriptors) / BATCH_DESCRIPTOR_LONGS;
+    if (!data || jCount < count) {
+        count = data ? jCount : 0;
+    }
 
-    // Put the necessary data from ByteBuffer into the AVPacket.
-    packet->size = jSize;
-    packet->data = data;
+    //  Copy the descriptors out a chunk at a time rather than pinning the array across the
+    //  submits, which can block on a config frame.
+    jlong descriptors[BATCH_MAX_PACKETS * BATCH_DESCRIPTOR_LONGS];
+    for (int first = 0; first < count; first += BATCH_MAX_PACKETS) {
+        int chunk = count - first < BATCH_MAX_PACKETS ? count - first : BATCH_MAX_PACKETS;
+        (*env)->GetLongArrayRegion(env, jDescriptors, first * BATCH_DESCRIPTOR_LONGS,
+                                   chunk * BATCH_DESCRIPTOR_LONGS, descriptors);
+        if ((*env)->ExceptionCheck(env)) {
+            return;
+        }
+        for (int i = 0; i < chunk; i++) {
+            jlong *descriptor = &descriptors[i * BATCH_DESCRIPTOR_LONGS];
+            jlong offset = descriptor[0];
+            jlong size = descriptor[1];
+            int flags = (int) descriptor[3];
+            int64_t pts = (int64_t) descriptor[2];
+            int64_t dts = flags & BATCH_FLAG_HAS_DTS
+                          ? pts - (int32_t) (descriptor[3] >> BATCH_CTS_SHIFT)
+                          : DECODE_TIME_UNKNOWN;
+            if (offset < 0 || size <= 0 || offset + size > capacity) {
+                LOGE("Skipping packet %d of the batch, it's outside the buffer.", first + i);
+                continue;
+            }
+            submit_packet(env, session, instance, data + offset, (int) size, pts, dts,
+                          (flags & BATCH_FLAG_VIDEO) != 0, (flags & BATCH_FLAG_KEY_FRAME) != 0,
+                          (flags & BATCH_FLAG_CONFIG_FRAME) != 0);
+        }
+    }
+}
 
-    //  Wait for config frame to come, since we need this to open the connection.
-    if(jIsConfigFrame){
-        foundConfigFrame = true;
-        initConnection(env);
+JNIEXPORT jlongArray JNICALL
+Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_getDestinationStats(JNIEnv *env,
+                                                                         jobject  __unused instance,
+                                                                         jlong jHandle,
+                                                                         jint jIndex) {
+    RtmpSession *session = get_session(jHandle);
+    //  Order: queue depth, max depth, pushed, popped, dropped, avg/max enqueue ns,
+    //  avg/max queue ns, packets written, bytes written, write errors, throughput in bits/s,
+    //  non-reference frames dropped, GOP frames dropped, reconnects.
+    jlong values[16] = {0};
+    if (session && jIndex >= 0 && jIndex < session->numDestinations
+        && session->destinations[jIndex].isRingAllocated) {
+        Destination *destination = &session->destinations[jIndex];
+        PacketRingStats stats;
+        packet_ring_get_stats(&destination->packetRing, &stats);
+        values[0] = stats.depth;
+        values[1] = stats.maxDepth;
+        values[2] = (jlong) stats.pushed;
+        values[3] = (jlong) stats.popped;
+        values[4] = (jlong) stats.dropped;
+        values[5] = stats.pushed ? (jlong) (stats.enqueueNsTotal / stats.pushed) : 0;
+        values[6] = (jlong) stats.enqueueNsMax;
+        values[7] = stats.popped ? (jlong) (stats.queueNsTotal / stats.popped) : 0;
+        values[8] = (jlong) stats.queueNsMax;
+        for (int stream = 0; stream < STATS_NUM_STREAMS; stream++) {
+            values[9] += (jlong) __atomic_load_n(&destination->stats.packets[stream],
+                                                 __ATOMIC_RELAXED);
+            values[10] += (jlong) __atomic_load_n(&destination->stats.bytes[stream],
+                                                  __ATOMIC_RELAXED);
+        }
+        values[11] = (jlong) __atomic_load_n(&destination->writeErrors, __ATOMIC_RELAXED);
+        int64_t elapsedNs = __atomic_load_n(&destination->lastWriteTimeNs, __ATOMIC_RELAXED)
+                            - __atomic_load_n(&destination->firstWriteTimeNs, __ATOMIC_RELAXED);
+        if (elapsedNs > 0) {
+            values[12] = (jlong) ((double) values[10] * 8 * 1e9 / elapsedNs);
+        }
+        values[13] = (jlong) __atomic_load_n(&destination->dropPolicy.droppedNonReference,
+                                             __ATOMIC_RELAXED);
+        values[14] = (jlong) __atomic_load_n(&destination->dropPolicy.droppedGop,
+                                             __ATOMIC_RELAXED);
+        values[15] = (jlong) __atomic_load_n(&destination->reconnectPolicy.reconnects,
+                                             __ATOMIC_RELAXED);
+    }
+    jlongArray result = (*env)->NewLongArray(env, 16);
+    if (result) {
+        (*env)->SetLongArrayRegion(env, result, 0, 16, values);
+    }
+    return result;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_getAllocationStats(JNIEnv *env,
+                                                                        jclass  __unused clazz) {
+    //  Order: pooled allocations, unpooled allocations, buffer requests, frame allocations,
+    //  packet allocations, frame requests, packet requests. Shared by streaming and stitching.
+    AllocationStats stats;
+    get_allocation_stats(&stats);
+    jlong values[7] = {
+        (jlong) stats.pooledAllocations, (jlong) stats.unpooledAllocations,
+        (jlong) stats.bufferRequests, (jlong) stats.frameAllocations,
+        (jlong) stats.packetAllocations, (jlong) stats.frameRequests,
+        (jlong) stats.packetRequests
+    };
+    jlongArray result = (*env)->NewLongArray(env, 7);
+    if (result) {
+        (*env)->SetLongArrayRegion(env, result, 0, 7, values);
+    }
+    return result;
+}
+
+/**
+ * Return a JSON snapshot of the session's counters and latency histograms; see format_stats().
+ */
+JNIEXPORT jstring JNICALL
+Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_getStats(JNIEnv *env,
+                                                              jobject  __unused instance,
+                                                              jlong jHandle) {
+    RtmpSession *session = get_session(jHandle);
+    if (!session) {
+        return NULL;
+    }
+    char *json = alloc_stats(session);
+    if (!json) {
+        return NULL;
+    }
+    jstring result = (*env)->NewStringUTF(env, json);
+    av_free(json);
+    return result;
+}
+
+/**
+ * Write the native trace to path as Chrome trace JSON. Returns false if the library was built
+ * without tracing or the file couldn't be written.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_exportTrace(JNIEnv *env,
+                                                                 jobject  __unused instance,
+                                                                 jstring jPath) {
+    if (!TRACE_ENABLED || !jPath) {
+        return JNI_FALSE;
+    }
+    const char *path = (*env)->GetStringUTFChars(env, jPath, NULL);
+    if (!path) {
+        return JNI_FALSE;
+    }
+    int ret = trace_export_chrome_json(path);
+    if (ret < 0) {
+        LOGE("Couldn't write the trace to %s: %s", path, av_err2str(ret));
+    }
+    (*env)->ReleaseStringUTFChars(env, jPath, path);
+    return ret < 0 ? JNI_FALSE : JNI_TRUE;
+}
+
+/**
+ * Stop streaming and free the session. The handle is invalid once this returns.
+ */
+JNIEXPORT void JNICALL
+Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_stop(JNIEnv *env,
+                                                          jobject  __unused instance,
+                                                          jlong jHandle) {
+    RtmpSession *session = get_session(jHandle);
+    if (!session) {
+        return;
+    }
+    stop_senders(env, session);
+    cancel_predials(session);
+    log_stats(session);
+    release_resources(session);
+    free_session(session);
+}
+
+/**
+ * Look up a method that the Java class may not implement, returning NULL if it doesn't.
+ */
+static jmethodID get_optional_method(JNIEnv *env, jclass clazz, const char *name,
+                                     const char *signature) {
+    jmethodID methodId = (*env)->GetMethodID(env, clazz, name, signature);
+    if ((*env)->ExceptionCheck(env)) {
+        (*env)->ExceptionClear(env);
+        return NULL;
+    }
+    return methodId;
+}
+
+/**
+ * Cache the IDs of the wrapper callbacks the sender threads call.
+ */
+void resolve_wrapper_ids(JNIEnv *env, jclass wrapperClass) {
+    jniCache.connectionDroppedMethod = get_optional_method(env, wrapperClass,
+                                                           "onConnectionDropped", "(I)V");
+    jniCache.isConnectionDroppedIndexed = jniCache.connectionDroppedMethod != NULL;
+    //  Wrappers written before there were several destinations don't say which one dropped.
+    if (!jniCache.connectionDroppedMethod) {
+        jniCache.connectionDroppedMethod = get_optional_method(env, wrapperClass,
+                                                               "onConnectionDropped", "()V");
+    }
+    //  The bitrate callback is optional; without it we just don't adapt.
+    jniCache.bitrateRecommendationMethod = get_optional_method(env, wrapperClass,
+                                                               "onBitrateRecommendation",
+                                                               "(III)V");
+    //  So are the reconnect progress callbacks; a connection only counts as dropped once we
+    //  give up on it.
+    jniCache.reconnectingMethod = get_optional_method(env, wrapperClass, "onReconnecting",
+                                                      "(II)V");
+    jniCache.reconnectedMethod = get_optional_method(env, wrapperClass, "onReconnected", "(II)V");
+    //  Without the keyframe request callback we wait for the encoder's own keyframes.
+    jniCache.keyFrameRequestMethod = get_optional_method(env, wrapperClass, "onKeyFrameRequest",
+                                                         "(I)V");
+    jniCache.isWrapperResolved = true;
+}
+
+/**
+ * Register the live streaming natives and cache the method IDs they call back into. init() is
+ * left to the default lookup, since its signature names the Metadata class.
+ */
+int register_rtmp_natives(JavaVM *vm, JNIEnv *env, jclass wrapperClass) {
+    static const JNINativeMethod methods[] = {
+        {"start", "(J)V", Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_start},
+        {"writePacketInterleaved", "(JLjava/nio/ByteBuffer;IIJII)V",
+         Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_writePacketInterleaved},
+        {"writePackets", "(JLjava/nio/ByteBuffer;I[J)V",
+         Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_writePackets},
+        {"getDestinationStats", "(JI)[J",
+         Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_getDestinationStats},
+        {"getAllocationStats", "()[J",
+         Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_getAllocationStats},
+        {"getStats", "(J)Ljava/lang/String;",
+         Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_getStats},
+        {"exportTrace", "(Ljava/lang/String;)Z",
+         Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_exportTrace},
+        {"stop", "(J)V", Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_stop},
+    };
+    javaVM = vm;
+    resolve_wrapper_ids(env, wrapperClass);
+    return register_methods(env, wrapperClass, methods, sizeof(methods) / sizeof(methods[0]));
+}
+
+/**
+ * Copy a packet's payload into a pooled buffer, returned in *out. Video is rewritten to
+ * length-prefixed NAL units on the way when the session uses an avcC, so it's ready for the
+ * muxers. Updates *size to the size of the copied payload. Returns 0 or a negative AVERROR.
+ */
+static int copy_payload(RtmpSession *session, const uint8_t *data, int *size, bool isVideo,
+                        AVBufferRef **out) {
+    if (!data || *size <= 0) {
+        return AVERROR(EINVAL);
+    }
+    AVBufferRef *buf = buffer_pool_get(&session->bufferPool, *size);
+    if (!buf) {
+        return AVERROR(ENOMEM);
     }
+    memcpy(buf->data, data, (size_t) *size);
+    if (isVideo && session->isLengthPrefixed
+        && nal_annexb_to_avcc_in_place(buf->data, *size) < 0) {
+        //  Three-byte start codes leave no room for the lengths; convert from the original.
+        av_buffer_unref(&buf);
+        int avccSize = nal_avcc_size(data, *size);
+        if (!avccSize) {
+            return AVERROR_INVALIDDATA;
+        }
+        if (!(buf = buffer_pool_get(&session->bufferPool, avccSize))) {
+            return AVERROR(ENOMEM);
+        }
+        *size = nal_annexb_to_avcc(data, *size, buf->data);
+    }
+    memset(buf->data + *size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    *out = buf;
+    return 0;
+}
+
+/**
+ * Ask the encoder for a sync frame through onKeyFrameRequest(reason) if something is waiting
+ * for one and the last request wasn't too recent.
+ */
+static void request_key_frame_if_due(JNIEnv *env, RtmpSession *session, jobject instance,
+                                     int64_t nowNs) {
+    if (!jniCache.keyFrameRequestMethod) {
+        return;
+    }
+    int reason = key_frame_requester_poll(&session->keyFrameRequester, nowNs);
+    if (reason >= 0) {
+        TRACE_INSTANT(TRACE_KEY_FRAME_REQUEST, TRACE_STREAM_VIDEO, 0, reason);
+        (*env)->CallVoidMethod(env, instance, jniCache.keyFrameRequestMethod, (jint) reason);
+    }
+}
 
-    if(!isConnectionOpen){
-        if(!foundConfigFrame){
+/**
+ * Hand one encoded packet to the session. A config frame (re)builds the connections; anything
+ * else is copied once into a pooled buffer and queued for every running destination. dts is
+ * DECODE_TIME_UNKNOWN when the caller doesn't have one, and it's derived from pts.
+ */
+void submit_packet(JNIEnv *env, RtmpSession *session, jobject instance, uint8_t *data, int size,
+                   int64_t pts, int64_t dts, bool isVideo, bool isKeyFrame, bool isConfigFrame) {
+    int64_t submitTimeNs = clock_now_ns();
+    //  The audio's AudioSpecificConfig is built from the metadata with the output streams, so
+    //  the AAC encoder's config frame has nothing in it for us. Only video's (the SPS/PPS) do.
+    if (isConfigFrame && !isVideo) {
+        return;
+    }
+    //  Wait for config frame to come, since we need this to open the connection.
+    if(isConfigFrame){
+        //  Mid-stream, new parameter sets (a resolution change, say) go out on the connections
+        //  we have.
+        if (session->foundConfigFrame
+            && hot_swap_config(session, data, size, submitTimeNs)) {
             return;
         }
-        //  Open the connection and write the header.
-        LOGE("Reopening connection.");
-        openConnection(env);
-        //  If it fails, openConnection() will call releaseResources().
-        if(!isConnectionOpen){
+        //  Any previous connections go away with their sender threads before we build new ones.
+        stop_senders(env, session);
+        //  The old GOP belongs to the old encoder configuration.
+        gop_cache_clear(&session->gopCache);
+        session->foundConfigFrame = true;
+        session->foundKeyFrame = false;
+        //  So does the timeline.
+        decode_time_init(&session->videoDecodeTime, session->metadata.videoReorderDepth);
+        decode_time_init(&session->audioDecodeTime, 0);
+        __atomic_store_n(&session->configTimeNs, submitTimeNs, __ATOMIC_RELAXED);
+        //  Keep our own copy of the SPS/PPS; every output context built from now on, including
+        //  the ones rebuilt after a reconnect, takes its extradata from it.
+        av_freep(&session->configData);
+        session->configSize = 0;
+        session->configData = av_malloc((size_t) size + NAL_AVCC_RECORD_OVERHEAD
+                                        + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!session->configData) {
+            jclass exc = (*env)->FindClass(env, "java/lang/OutOfMemoryError");
+            (*env)->ThrowNew(env, exc, "Couldn't copy the config frame.");
+            release_resources(session);
             return;
         }
+        //  With an avcC as extradata the muxers take length-prefixed packets as they are, instead
+        //  of converting (and allocating) every packet themselves.
+        int avccSize = nal_build_avcc(data, size, session->configData);
+        session->isLengthPrefixed = avccSize > 0;
+        if (session->isLengthPrefixed) {
+            session->configSize = avccSize;
+        } else {
+            LOGE("Couldn't find an SPS and PPS in the config frame, sending it as is.");
+            memcpy(session->configData, data, (size_t) size);
+            session->configSize = size;
+        }
+        memset(session->configData + session->configSize, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+        initConnection(env, session);
+        if (session->foundConfigFrame) {
+            start_senders(env, session, instance);
+        }
+        return;
+    }
+
+    //  The sender threads open the connections; if they all failed there's nowhere to send to.
+    int numRunning = 0;
+    for (int i = 0; i < session->numDestinations; i++) {
+        numRunning += __atomic_load_n(&session->destinations[i].isSenderRunning,
+                                      __ATOMIC_ACQUIRE);
+    }
+    if (!numRunning) {
+        return;
+    }
+
+    //  Let's make the first frame sent to be a KeyFrame, so things are smooth.
+    if (isKeyFrame){
+        session->foundKeyFrame = true;
+        key_frame_requester_on_key_frame(&session->keyFrameRequester, submitTimeNs);
+    } else if (!session->foundKeyFrame && isVideo) {
+        //  Rather than drop the rest of the encoder's GOP, ask for a new one to start now.
+        key_frame_requester_need(&session->keyFrameRequester, KEY_FRAME_REASON_START,
+                                 submitTimeNs);
+    }
+    request_key_frame_if_due(env, session, instance, submitTimeNs);
+    if(!session->foundKeyFrame) {
+        return;
+    }
+    //  Decode times only count frames that go out, starting from the keyframe.
+    if (isVideo) {
+        dts = decode_time_next(&session->videoDecodeTime, &pts, dts);
+        session->lastVideoDts = dts;
+    } else {
+        dts = decode_time_next(&session->audioDecodeTime, &pts, dts);
+    }
+
+    //  Copy the payload once into a pooled, refcounted buffer and give every destination its own
+    //  reference. A full ring drops (and counts) the packet for that destination only.
+    int traceStream = isVideo ? TRACE_STREAM_VIDEO : TRACE_STREAM_AUDIO;
+    TRACE_BEGIN(TRACE_SUBMIT, traceStream, pts, size);
+    AVBufferRef *buf = NULL;
+    if (copy_payload(session, data, &size, isVideo, &buf) < 0) {
+        TRACE_END(TRACE_SUBMIT, traceStream, pts, size);
+        return;
+    }
+    gop_cache_add(&session->gopCache, buf, size, pts, dts, isVideo, isKeyFrame, submitTimeNs);
+    for (int i = 0; i < session->numDestinations; i++) {
+        Destination *destination = &session->destinations[i];
+        if (!__atomic_load_n(&destination->isSenderRunning, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        if (isVideo && !isKeyFrame && destination->isSkippingToKeyFrame) {
+            continue;
+        }
+        AVBufferRef *ref = av_buffer_ref(buf);
+        if (packet_ring_push(&destination->packetRing, ref, size, pts, dts, isVideo, isKeyFrame,
+                             0, submitTimeNs) < 0) {
+            TRACE_INSTANT(TRACE_QUEUE_FULL, traceStream, pts, size);
+            av_buffer_unref(&ref);
+            //  The rest of this GOP won't decode cleanly there; skip it and cut it short.
+            if (isVideo) {
+                destination->isSkippingToKeyFrame = true;
+                key_frame_requester_need(&session->keyFrameRequester,
+                                         KEY_FRAME_REASON_QUEUE_FULL, submitTimeNs);
+            }
+        } else if (isVideo) {
+            destination->isSkippingToKeyFrame = false;
+        }
+    }
+    av_buffer_unref(&buf);
+    histogram_record(&session->submitLatency, clock_now_ns() - submitTimeNs);
+    TRACE_END(TRACE_SUBMIT, traceStream, pts, size);
+}
+
+/**
+ * Switch a streaming session to the parameter sets in a new config frame without touching its
+ * connections: the avcC is queued in every running destination's ring, in order with the
+ * packets around it, and each sender switches over when it gets there. Returns false, leaving
+ * the caller to rebuild everything, when nothing is running or the config can't be turned into
+ * an avcC like the one the session started with.
+ */
+bool hot_swap_config(RtmpSession *session, const uint8_t *data, int size,
+                     int64_t submitTimeNs) {
+    bool isStarted = false;
+    for (int i = 0; i < session->numDestinations; i++) {
+        isStarted |= session->destinations[i].isSenderStarted;
+    }
+    if (!isStarted || !session->isLengthPrefixed) {
+        return false;
+    }
+    AVBufferRef *avcC = av_buffer_alloc(size + NAL_AVCC_RECORD_OVERHEAD
+                                        + AV_INPUT_BUFFER_PADDING_SIZE);
+    int avccSize = avcC ? nal_build_avcc(data, size, avcC->data) : AVERROR(ENOMEM);
+    uint8_t *configData = avccSize > 0 ? av_malloc((size_t) avccSize
+                                                   + AV_INPUT_BUFFER_PADDING_SIZE) : NULL;
+    if (!configData) {
+        av_buffer_unref(&avcC);
+        return false;
+    }
+    //  Encoders repeat their config, after a sync frame request for one; that changes nothing.
+    if (avccSize == session->configSize
+        && !memcmp(avcC->data, session->configData, (size_t) avccSize)) {
+        av_free(configData);
+        av_buffer_unref(&avcC);
+        return true;
+    }
+    memset(avcC->data + avccSize, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    memcpy(configData, avcC->data, (size_t) avccSize + AV_INPUT_BUFFER_PADDING_SIZE);
+    //  Output contexts rebuilt from here on, after a reconnect, start with the new ones.
+    pthread_mutex_lock(&session->configLock);
+    av_free(session->configData);
+    session->configData = configData;
+    session->configSize = avccSize;
+    pthread_mutex_unlock(&session->configLock);
+
+    //  Config frames often carry no real timestamp; stamp it with the video it follows, which
+    //  the new encoder's keyframe can't decode before.
+    int64_t pts = session->lastVideoDts;
+    //  The cached GOP doesn't decode with the new parameter sets.
+    gop_cache_clear(&session->gopCache);
+    for (int i = 0; i < session->numDestinations; i++) {
+        Destination *destination = &session->destinations[i];
+        if (!__atomic_load_n(&destination->isSenderRunning, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        AVBufferRef *ref = av_buffer_ref(avcC);
+        if (!ref || packet_ring_push(&destination->packetRing, ref, avccSize, pts, pts, 1, 0, 1,
+                                     submitTimeNs) < 0) {
+            av_buffer_unref(&ref);
+            destination->configMissedNs = submitTimeNs;
+            __atomic_store_n(&destination->isConfigMissed, 1, __ATOMIC_RELEASE);
+        }
+    }
+    av_buffer_unref(&avcC);
+    //  Nothing before the encoder's next keyframe decodes with the new parameter sets either.
+    session->foundKeyFrame = false;
+    decode_time_restart(&session->videoDecodeTime);
+    LOGI("Switched to new parameter sets without reconnecting.");
+    return true;
+}
+
+/**
+ * Start one thread per destination that opens its connection and drains its ring. From here on
+ * each sender thread owns its destination's outputFormatContext until stop_senders() joins it.
+ */
+int start_senders(JNIEnv *env, RtmpSession *session, jobject instance) {
+    if (!javaVM && (*env)->GetJavaVM(env, &javaVM) != JNI_OK) {
+        return -1;
+    }
+    session->wrapperInstance = (*env)->NewGlobalRef(env, instance);
+    //  JNI_OnLoad normally got these already; this covers a class loaded some other way.
+    if (!jniCache.isWrapperResolved) {
+        jclass thisClass = (*env)->GetObjectClass(env, instance);
+        resolve_wrapper_ids(env, thisClass);
+        (*env)->DeleteLocalRef(env, thisClass);
+    }
+    session->recommendedBitrate = session->metadata.videoBitrate;
+    session->qualityStep = 0;
+
+    for (int i = 0; i < session->numDestinations; i++) {
+        Destination *destination = &session->destinations[i];
+        if (!destination->isRingAllocated || !destination->outputFormatContext) {
+            continue;
+        }
+        destination->firstWriteTimeNs = 0;
+        destination->lastWriteTimeNs = 0;
+        drop_policy_init(&destination->dropPolicy, session->metadata.dropNonReferenceMs,
+                         session->metadata.dropGopMs, session->isLengthPrefixed);
+        PacketRingStats ringStats;
+        packet_ring_get_stats(&destination->packetRing, &ringStats);
+        bandwidth_estimator_init(&destination->bandwidthEstimator,
+                                 session->metadata.videoBitrate, session->metadata.audioBitRate,
+                                 clock_now_ns(), &ringStats);
+        reconnect_policy_init(&destination->reconnectPolicy,
+                              session->metadata.reconnectInitialDelayMs,
+                              session->metadata.reconnectMaxDelayMs,
+                              session->metadata.reconnectMaxAttempts,
+                              (uint32_t) clock_now_ns() + (uint32_t) i);
+        //  A new config frame starts a new timeline.
+        destination->ptsOffsetUs = 0;
+        destination->lastWrittenDtsUs = 0;
+        destination->hasWritten = false;
+        destination->hasMuxerBase = false;
+        destination->isRebasePending = false;
+        destination->isAwaitingKeyFrame = false;
+        destination->isSkippingToKeyFrame = false;
+        __atomic_store_n(&destination->stopSenderRequested, 0, __ATOMIC_RELEASE);
+        //  stop_senders() set this too, and it would interrupt every write from here on.
+        __atomic_store_n(&destination->stopPredialRequested, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&destination->isSenderRunning, 1, __ATOMIC_RELEASE);
+        if (pthread_create(&destination->senderThread, NULL, sender_loop, destination) != 0) {
+            LOGE("Couldn't start the sender thread for %s.", destination->url);
+            __atomic_store_n(&destination->isSenderRunning, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+        destination->isSenderStarted = true;
+    }
+    return 0;
+}
+
+/**
+ * Ask every sender thread to finish, wait for them, and throw away whatever they didn't send.
+ */
+void stop_senders(JNIEnv *env, RtmpSession *session) {
+    for (int i = 0; i < session->numDestinations; i++) {
+        Destination *destination = &session->destinations[i];
+        if (destination->isSenderStarted) {
+            __atomic_store_n(&destination->stopSenderRequested, 1, __ATOMIC_RELEASE);
+            //  In case it's still waiting on its pre-dial.
+            __atomic_store_n(&destination->stopPredialRequested, 1, __ATOMIC_RELEASE);
+        }
+    }
+    for (int i = 0; i < session->numDestinations; i++) {
+        Destination *destination = &session->destinations[i];
+        if (!destination->isSenderStarted) {
+            continue;
+        }
+        pthread_join(destination->senderThread, NULL);
+        destination->isSenderStarted = false;
+        __atomic_store_n(&destination->isSenderRunning, 0, __ATOMIC_RELEASE);
+        packet_ring_clear(&destination->packetRing);
+    }
+    if (session->wrapperInstance) {
+        (*env)->DeleteGlobalRef(env, session->wrapperInstance);
+        session->wrapperInstance = NULL;
+    }
+}
+
+/**
+ * Body of a sender thread: attach to the VM for callbacks, run the destination, detach.
+ */
+void *sender_loop(void *arg) {
+    Destination *destination = arg;
+    destination->senderEnv = NULL;
+    if (javaVM && (*javaVM)->AttachCurrentThread(javaVM, &destination->senderEnv, NULL) != JNI_OK) {
+        destination->senderEnv = NULL;
+    }
+    if (destination->isRecording) {
+        run_recording(destination);
+    } else {
+        run_destination(destination);
+    }
+    if (destination->senderEnv) {
+        (*javaVM)->DetachCurrentThread(javaVM);
+        destination->senderEnv = NULL;
+    }
+    return NULL;
+}
+
+/**
+ * The destination's AVIOInterruptCB. Gives up when its sender or pre-dial is asked to stop, or
+ * when the operation in progress misses its deadline, which counts as a stall and marks the
+ * session degraded until a packet goes out again. Closing only minds its deadline, so a stop
+ * still unpublishes cleanly from a healthy server.
+ */
+int destination_interrupted(void *opaque) {
+    Destination *destination = opaque;
+    Watchdog *watchdog = &destination->watchdog;
+    if (watchdog->operation != WATCHDOG_CLOSE
+        && (__atomic_load_n(&destination->stopSenderRequested, __ATOMIC_ACQUIRE)
+            || __atomic_load_n(&destination->stopPredialRequested, __ATOMIC_ACQUIRE))) {
+        return 1;
+    }
+    bool hadExpired = watchdog->hasExpired;
+    bool wasStalled = watchdog->isStalled;
+    int64_t nowNs = clock_now_ns();
+    if (!watchdog_check(watchdog, nowNs)) {
+        return 0;
+    }
+    if (!hadExpired) {
+        if (!wasStalled) {
+            __atomic_fetch_add(&destination->session->numStalledDestinations, 1,
+                               __ATOMIC_RELAXED);
+        }
+        TRACE_INSTANT(TRACE_STALL, TRACE_STREAM_NONE, 0, watchdog->operation);
+        LOGE("%s stalled for %lld ms, giving up on the connection.", destination->url,
+             (long long) ((nowNs - watchdog->operationStartNs) / 1000000));
+    }
+    return 1;
+}
+
+/**
+ * Forget a stall that won't be recovered from, because the destination has stopped sending.
+ */
+void clear_stall(Destination *destination) {
+    if (destination->watchdog.isStalled) {
+        __atomic_store_n(&destination->watchdog.isStalled, 0, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&destination->session->numStalledDestinations, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Open the destination's connection, then write packets out of its ring until asked to stop.
+ * A dropped or stalled connection is rebuilt with backoff; only once we give up is Java told
+ * it's gone.
+ */
+void run_destination(Destination *destination) {
+    //  A slow first connect may have overflowed the ring, so start from the cache like a
+    //  reconnect would.
+    int ret = openConnection(destination) == 0 ? prime_from_gop_cache(destination, false)
+                                                : AVERROR(ECONNREFUSED);
+    if (ret < 0) {
+        ret = reconnect_destination(destination);
+    }
+    while (ret >= 0 && !__atomic_load_n(&destination->stopSenderRequested, __ATOMIC_ACQUIRE)) {
+        update_bitrate_recommendation(destination);
+        //  New parameter sets that didn't fit in the ring; a rebuilt context picks them up.
+        if (__atomic_exchange_n(&destination->isConfigMissed, 0, __ATOMIC_ACQ_REL)) {
+            ret = reconnect_destination(destination);
+            continue;
+        }
+        RingPacket *ringPacket = packet_ring_peek(&destination->packetRing);
+        if (!ringPacket) {
+            //  A quiet stream mustn't leave packets sitting in a coalescing socket.
+            watchdog_arm(&destination->watchdog, WATCHDOG_PACKET, clock_now_ns());
+            ret = 0;
+            if (destination->socketIo) {
+                ret = socket_io_poll(destination->socketIo);
+            } else if (destination->rtmpPublisher) {
+                ret = rtmp_publisher_poll(destination->rtmpPublisher);
+            }
+            if (watchdog_disarm(&destination->watchdog, ret) < 0) {
+                __atomic_store_n(&destination->writeErrors, destination->writeErrors + 1,
+                                 __ATOMIC_RELAXED);
+                ret = reconnect_destination(destination);
+                continue;
+            }
+            usleep(SENDER_IDLE_SLEEP_US);
+            continue;
+        }
+        //  Written from the GOP cache already, or older than what was.
+        if (ringPacket->submitTimeNs <= destination->primedThroughNs) {
+            packet_ring_pop(&destination->packetRing);
+            continue;
+        }
+        //  When we've fallen behind, shed video according to how much media is queued.
+        int64_t queuedUs = packet_ring_peek_newest(&destination->packetRing)->pts
+                           - ringPacket->pts;
+        if (!ringPacket->isConfig
+            && drop_policy_should_drop(&destination->dropPolicy, ringPacket, queuedUs)) {
+            TRACE_INSTANT(TRACE_POLICY_DROP,
+                          ringPacket->isVideo ? TRACE_STREAM_VIDEO : TRACE_STREAM_AUDIO,
+                          ringPacket->pts, ringPacket->size);
+            //  A skipped GOP lasts until the next keyframe, so have that come sooner.
+            if (destination->dropPolicy.isSkippingGop) {
+                key_frame_requester_need(&destination->session->keyFrameRequester,
+                                         KEY_FRAME_REASON_GOP_DROPPED, clock_now_ns());
+            }
+            packet_ring_pop(&destination->packetRing);
+            continue;
+        }
+        if (destination->isAwaitingKeyFrame && ringPacket->isVideo && !ringPacket->isConfig) {
+            if (!ringPacket->isKeyFrame) {
+                packet_ring_pop(&destination->packetRing);
+                continue;
+            }
+            destination->isAwaitingKeyFrame = false;
+        }
+        ret = write_ring_packet(destination, ringPacket);
+        packet_ring_pop(&destination->packetRing);
+        if (ret < 0) {
+            __atomic_store_n(&destination->writeErrors, destination->writeErrors + 1,
+                             __ATOMIC_RELAXED);
+            ret = reconnect_destination(destination);
+        }
+    }
+    //  A destination that's no longer sending doesn't keep the session degraded.
+    clear_stall(destination);
+    if (ret < 0 && ret != AVERROR_EXIT) {
+        //  Stop accepting packets for this destination only; the others carry on.
+        __atomic_store_n(&destination->isSenderRunning, 0, __ATOMIC_RELEASE);
+        notify_connection_dropped(destination);
+    }
+}
+
+/**
+ * Point the recording at its next part: the file name with "-<n>" in front of the extension, so
+ * the parts written before stay as they were.
+ */
+static int next_recording_part(Destination *destination) {
+    const char *path = destination->session->metadata.recordingFile;
+    size_t size = strlen(path) + RECORDING_PART_SUFFIX_SIZE;
+    if (!destination->partUrl && !(destination->partUrl = av_mallocz(size))) {
+        return AVERROR(ENOMEM);
+    }
+    const char *extension = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    if (!extension || (slash && extension < slash)) {
+        extension = path + strlen(path);
+    }
+    snprintf(destination->partUrl, size, "%.*s-%d%s", (int) (extension - path), path,
+             destination->numParts, extension);
+    destination->url = destination->partUrl;
+    av_strlcpy(destination->outputFormatContext->filename, destination->url,
+               sizeof(destination->outputFormatContext->filename));
+    return 0;
+}
+
+/**
+ * Open the recording file, then write every packet out of its ring until asked to stop. Packets
+ * still queued at that point are written too, and the file is finalized whether we stop or hit
+ * a write error, so a dropped stream or a full disk still leaves a playable file.
+ */
+void run_recording(Destination *destination) {
+    RtmpSession *session = destination->session;
+    //  Only the first run writes to recordingFile itself; after a rebuild that file is finished.
+    int ret = destination->numParts > 0 ? next_recording_part(destination) : 0;
+    destination->numParts++;
+    if (ret == 0 && openConnection(destination) != 0) {
+        ret = AVERROR(EIO);
+    }
+    bool isStopping = false;
+    bool isConfigPending = false;
+    int64_t configMissedNs = 0;
+    while (ret >= 0) {
+        //  New parameter sets that didn't fit in the ring. The file isn't rebuilt for them:
+        //  what was queued before still goes out as it is, and video after them starts at a
+        //  keyframe carrying the session's copy.
+        if (__atomic_exchange_n(&destination->isConfigMissed, 0, __ATOMIC_ACQ_REL)) {
+            isConfigPending = true;
+            configMissedNs = destination->configMissedNs;
+        }
+        RingPacket *ringPacket = packet_ring_peek(&destination->packetRing);
+        if (!ringPacket) {
+            if (isStopping) {
+                break;
+            }
+            //  Only stop once the ring has been looked at empty after the request, so nothing
+            //  the producer pushed before stop_senders() is lost.
+            isStopping = __atomic_load_n(&destination->stopSenderRequested, __ATOMIC_ACQUIRE);
+            if (!isStopping) {
+                usleep(SENDER_IDLE_SLEEP_US);
+            }
+            continue;
+        }
+        if (isConfigPending && ringPacket->isVideo && !ringPacket->isConfig
+            && ringPacket->submitTimeNs > configMissedNs) {
+            if (!ringPacket->isKeyFrame) {
+                packet_ring_pop(&destination->packetRing);
+                continue;
+            }
+            pthread_mutex_lock(&session->configLock);
+            ret = hold_parameter_sets(destination, session->configData, session->configSize);
+            pthread_mutex_unlock(&session->configLock);
+            isConfigPending = false;
+            if (ret <= 0) {
+                ret = ret < 0 ? ret : AVERROR_INVALIDDATA;
+                break;
+            }
+        }
+        ret = write_ring_packet(destination, ringPacket);
+        packet_ring_pop(&destination->packetRing);
+    }
+    if (destination->isConnectionOpen) {
+        int trailerRet = av_write_trailer(destination->outputFormatContext);
+        if (trailerRet < 0 && ret >= 0) {
+            ret = trailerRet;
+        }
+        if (!(destination->outputFormatContext->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&destination->outputFormatContext->pb);
+        }
+        destination->isConnectionOpen = 0;
+        LOGI("Finalized recording %s.", destination->url);
+    }
+    if (ret < 0) {
+        LOGE("Recording to %s failed.", destination->url);
+        __atomic_store_n(&destination->writeErrors, destination->writeErrors + 1,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&destination->isSenderRunning, 0, __ATOMIC_RELEASE);
+        notify_connection_dropped(destination);
     }
+}
+
+/**
+ * Tear down the destination's connection and dial it again, backing off between attempts. While
+ * we wait, queued packets are thrown away; the GOP cache has what we'll restart from.
+ * Returns 0 once reconnected, AVERROR_EXIT if asked to stop, or a negative AVERROR once the
+ * attempts are used up.
+ */
+int reconnect_destination(Destination *destination) {
+    RtmpSession *session = destination->session;
+    ReconnectPolicy *policy = &destination->reconnectPolicy;
+    int ret = AVERROR(ECONNRESET);
+    int64_t delayNs;
+
+    release_destination(destination);
+    while ((delayNs = reconnect_policy_next_delay_ns(policy)) >= 0) {
+        LOGI("Reconnecting to %s in %lld ms (attempt %d).", destination->url,
+             (long long) (delayNs / 1000000), policy->attempt);
+        notify_reconnect(destination, jniCache.reconnectingMethod, policy->attempt);
+        TRACE_INSTANT(TRACE_RECONNECT, TRACE_STREAM_NONE, 0, policy->attempt);
+        int64_t deadlineNs = clock_now_ns() + delayNs;
+        do {
+            if (__atomic_load_n(&destination->stopSenderRequested, __ATOMIC_ACQUIRE)) {
+                return AVERROR_EXIT;
+            }
+            discard_ring(destination);
+            usleep(SENDER_IDLE_SLEEP_US);
+        } while (clock_now_ns() < deadlineNs);
+
+        ret = build_destination(session, destination);
+        if (ret == 0 && openConnection(destination) != 0) {
+            ret = AVERROR(ECONNREFUSED);
+        }
+        if (ret == 0) {
+            ret = prime_from_gop_cache(destination, true);
+        }
+        if (ret >= 0) {
+            LOGI("Reconnected to %s after %d attempts.", destination->url, policy->attempt);
+            notify_reconnect(destination, jniCache.reconnectedMethod, policy->attempt);
+            reconnect_policy_on_connected(policy);
+            return 0;
+        }
+        release_destination(destination);
+    }
+    LOGE("Giving up on %s.", destination->url);
+    return ret;
+}
+
+/**
+ * Start a (re)joining destination from the session's newest keyframe: the cached GOP is written
+ * ahead of whatever is queued, and everything in the ring up to its last packet is skipped.
+ * Timestamps are shifted to continue from the last one the server saw. With nothing cached,
+ * video waits in the ring for the next keyframe instead; on a first connect (not isRejoining)
+ * the ring still holds everything since the session's first keyframe, so it's left as it is.
+ * Returns 0 or a negative AVERROR.
+ */
+int prime_from_gop_cache(Destination *destination, bool isRejoining) {
+    RtmpSession *session = destination->session;
+    int numPackets = 0;
+    int64_t lastSubmitTimeNs = 0;
+    if (destination->primePackets) {
+        numPackets = gop_cache_snapshot(&session->gopCache, destination->primePackets,
+                                        clock_now_ns(), &lastSubmitTimeNs);
+    }
+    //  The producer doesn't wait for us, so packets in the snapshot may still be on their way
+    //  into the ring; run_destination() skips them, and everything older, as they come out.
+    if (numPackets) {
+        destination->primedThroughNs = lastSubmitTimeNs;
+    }
+
+    destination->isRebasePending = destination->hasWritten;
+    if (!numPackets && isRejoining) {
+        destination->isAwaitingKeyFrame = true;
+        key_frame_requester_need(&session->keyFrameRequester, KEY_FRAME_REASON_RECONNECT,
+                                 clock_now_ns());
+    }
+    int ret = 0;
+    for (int i = 0; i < numPackets; i++) {
+        if (ret >= 0) {
+            ret = write_ring_packet(destination, &destination->primePackets[i]);
+        }
+        av_buffer_unref(&destination->primePackets[i].buf);
+    }
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Empty the ring without writing anything.
+ */
+void discard_ring(Destination *destination) {
+    while (packet_ring_peek(&destination->packetRing)) {
+        packet_ring_pop(&destination->packetRing);
+    }
+}
+
+/**
+ * Return the decode time the destination's FLV timestamps count from, whether the muxer or our
+ * own publisher writes them. The first packet of a timeline sets it.
+ */
+static int64_t get_timeline_base(Destination *destination, int64_t dtsUs) {
+    if (!destination->hasMuxerBase) {
+        destination->muxerBaseDtsUs = dtsUs;
+        destination->hasMuxerBase = true;
+        if (destination->rtmpPublisher) {
+            rtmp_publisher_set_base_timestamp(destination->rtmpPublisher, dtsUs / 1000);
+        }
+    }
+    return destination->muxerBaseDtsUs;
+}
+
+/**
+ * Turn a packet from the ring into an AVPacket on the right stream and write it out.
+ */
+int write_ring_packet(Destination *destination, RingPacket *ringPacket) {
+    if (ringPacket->isConfig) {
+        return write_config_packet(destination, ringPacket);
+    }
+    AVPacket avPacket;
+    av_init_packet(&avPacket);
+    avPacket.data = ringPacket->data;
+    avPacket.size = ringPacket->size;
 
     //  Get the proper stream from the stream index.
-    AVStream *stream = (jIsVideo == JNI_TRUE) ? videoStream : audioStream;
+    AVStream *stream = ringPacket->isVideo ? destination->videoStream : destination->audioStream;
     if(!stream){
-        return;
+        return 0;
+    }
+    avPacket.stream_index = stream->index;
+
+    //  New parameter sets go in-band at the start of the keyframe they first apply to.
+    AVBufferRef *payloadBuf = ringPacket->buf;
+    AVBufferRef *merged = NULL;
+    if (destination->parameterSets && ringPacket->isVideo && ringPacket->isKeyFrame) {
+        int size = destination->parameterSetsSize + ringPacket->size;
+        if (!(merged = av_buffer_alloc(size + AV_INPUT_BUFFER_PADDING_SIZE))) {
+            return AVERROR(ENOMEM);
+        }
+        memcpy(merged->data, destination->parameterSets, (size_t) destination->parameterSetsSize);
+        memcpy(merged->data + destination->parameterSetsSize, ringPacket->data,
+               (size_t) ringPacket->size);
+        memset(merged->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+        av_freep(&destination->parameterSets);
+        avPacket.data = merged->data;
+        avPacket.size = size;
+        payloadBuf = merged;
     }
-    packet->stream_index = stream->index;
 
-    //  Rescale the Android PTS to the stream's timebase.
-    packet->pts = av_rescale_q((int64_t) jPts, androidSourceTimebase, stream->time_base);
-    packet->dts = packet->pts;
-    packet->duration = packet->pts - lastPts[packet->stream_index];
-    lastPts[packet->stream_index] = packet->pts;
+    //  After a reconnect, shift the timeline so it carries on from the last packet we sent.
+    //  Decode times are what has to keep increasing, so they're what lines up.
+    if (destination->isRebasePending) {
+        destination->ptsOffsetUs = destination->lastWrittenDtsUs + RESUME_GAP_US
+                                   - ringPacket->dts;
+        destination->isRebasePending = false;
+    }
+    int64_t ptsUs = ringPacket->pts + destination->ptsOffsetUs;
+    int64_t dtsUs = ringPacket->dts + destination->ptsOffsetUs;
+    int64_t muxerPtsUs = ptsUs;
+    int64_t muxerDtsUs = dtsUs;
+    if (destination->rtmpPublisher) {
+        get_timeline_base(destination, dtsUs);
+    } else if (is_flv(destination->outputFormatContext)) {
+        int64_t baseUs = get_timeline_base(destination, dtsUs);
+        muxerDtsUs = FFMAX(dtsUs - baseUs, 0);
+        muxerPtsUs = FFMAX(ptsUs - baseUs, muxerDtsUs);
+    }
+
+    //  Rescale the Android timestamps to the stream's timebase. With B-frames the encoder
+    //  emits frames in decode order, and pts - dts becomes FLV's composition time.
+    avPacket.pts = av_rescale_q(muxerPtsUs, androidSourceTimebase, stream->time_base);
+    avPacket.dts = av_rescale_q(muxerDtsUs, androidSourceTimebase, stream->time_base);
+    avPacket.duration = avPacket.dts - destination->lastDts[avPacket.stream_index];
+    destination->lastDts[avPacket.stream_index] = avPacket.dts;
 
     //  If keyframe, set the flag.
-    if (jIsKeyFrame == 1){
-        packet->flags |= AV_PKT_FLAG_KEY;
-        foundKeyFrame = true;
+    if (ringPacket->isKeyFrame){
+        avPacket.flags |= AV_PKT_FLAG_KEY;
     }
 
-    //  Let's make the first frame sent to be a KeyFrame, so things are smooth.
-    if(!foundKeyFrame) {
-        return;
+    int traceStream = ringPacket->isVideo ? TRACE_STREAM_VIDEO : TRACE_STREAM_AUDIO;
+    TRACE_BEGIN(TRACE_PACKET_WRITE, traceStream, ringPacket->pts, ringPacket->size);
+    int64_t startNs = clock_now_ns();
+    histogram_record(&destination->stats.queue, startNs - ringPacket->enqueueTimeNs);
+    watchdog_arm(&destination->watchdog, WATCHDOG_PACKET, startNs);
+    int ret;
+    if (destination->rtmpPublisher) {
+        ret = rtmp_publisher_write_packet(destination->rtmpPublisher, ringPacket->isVideo,
+                                          ringPacket->isKeyFrame, dtsUs / 1000,
+                                          (int32_t) (ptsUs / 1000 - dtsUs / 1000),
+                                          ringPacket->data, ringPacket->size, ringPacket->buf);
+    } else {
+        if (destination->socketIo) {
+            socket_io_begin_packet(destination->socketIo, payloadBuf);
+        }
+        ret = av_write_frame(destination->outputFormatContext, &avPacket);
+        if (destination->socketIo && ret >= 0) {
+            ret = socket_io_end_packet(destination->socketIo);
+        }
     }
-    if (av_write_frame(outputFormatContext, packet) < 0) {
-        //  Fire the callback that connection has been lost to java.
-        jclass thisClass = (*env)->GetObjectClass(env, instance);
-        jmethodID connectionCallback = (*env)
-                                        ->GetMethodID(env, thisClass, "onConnectionDropped", "()V");
-        if (connectionCallback) {
-            (*env)->CallVoidMethod(env, instance, connectionCallback);
+    ret = watchdog_disarm(&destination->watchdog, ret);
+    av_buffer_unref(&merged);
+    TRACE_END(TRACE_PACKET_WRITE, traceStream, ringPacket->pts, ret < 0 ? ret : ringPacket->size);
+    if (ret >= 0) {
+        if (!destination->hasWritten || dtsUs > destination->lastWrittenDtsUs) {
+            destination->lastWrittenDtsUs = dtsUs;
         }
+        destination->hasWritten = true;
+        int64_t nowNs = clock_now_ns();
+        if (watchdog_on_progress(&destination->watchdog, nowNs)) {
+            __atomic_fetch_sub(&destination->session->numStalledDestinations, 1,
+                               __ATOMIC_RELAXED);
+            LOGI("%s is writing again after a %lld ms stall.", destination->url,
+                 (long long) ((nowNs - destination->watchdog.stallStartNs) / 1000000));
+        }
+        histogram_record(&destination->stats.packetWrite, nowNs - startNs);
+        histogram_record(&destination->stats.endToEnd, nowNs - ringPacket->submitTimeNs);
+        stats_count_packet(&destination->stats, ringPacket->isVideo ? STATS_STREAM_VIDEO
+                                                                    : STATS_STREAM_AUDIO,
+                           ringPacket->size);
+        bandwidth_estimator_on_write(&destination->bandwidthEstimator, ringPacket->size,
+                                     nowNs - startNs);
+        if (!destination->firstWriteTimeNs) {
+            __atomic_store_n(&destination->firstWriteTimeNs, nowNs, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&destination->lastWriteTimeNs, nowNs, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
+
+/**
+ * Write an FLV AVC sequence header tag straight into the muxer's output, between the tags it
+ * writes itself. FFmpeg's FLV muxer only ever sends the one from the header. Returns 0 or a
+ * negative AVERROR.
+ */
+static int write_flv_sequence_header(Destination *destination, int64_t dtsUs,
+                                     const uint8_t *avcC, int size) {
+    AVIOContext *pb = destination->outputFormatContext->pb;
+    int64_t ms = av_rescale_q(destination->hasMuxerBase
+                              ? FFMAX(dtsUs - destination->muxerBaseDtsUs, 0) : 0,
+                              androidSourceTimebase, (AVRational) {1, 1000});
+    //  Tag header, then a keyframe/AVC byte, the sequence header type and a 0 composition time.
+    avio_w8(pb, 9);
+    avio_wb24(pb, size + 5);
+    avio_wb24(pb, (unsigned int) (ms & 0xffffff));
+    avio_w8(pb, (int) ((ms >> 24) & 0x7f));
+    avio_wb24(pb, 0);
+    avio_w8(pb, 0x17);
+    avio_w8(pb, 0);
+    avio_wb24(pb, 0);
+    avio_write(pb, avcC, size);
+    avio_wb32(pb, size + 5 + 11);
+    if (destination->socketIo) {
+        socket_io_begin_packet(destination->socketIo, NULL);
+        return socket_io_end_packet(destination->socketIo);
     }
+    avio_flush(pb);
+    return pb->error < 0 ? pb->error : 0;
+}
 
-    frameCount++;
+/**
+ * Keep the parameter sets in an avcC, length-prefixed, for write_ring_packet() to put in front of
+ * the next keyframe. Returns the size kept or a negative AVERROR.
+ */
+int hold_parameter_sets(Destination *destination, const uint8_t *avcC, int size) {
+    av_freep(&destination->parameterSets);
+    destination->parameterSets = av_malloc((size_t) size * 2);
+    int ret = destination->parameterSets
+              ? nal_avcc_parameter_sets(avcC, size, destination->parameterSets)
+              : AVERROR(ENOMEM);
+    destination->parameterSetsSize = ret > 0 ? ret : 0;
+    if (ret <= 0) {
+        av_freep(&destination->parameterSets);
+    }
+    return ret;
 }
 
-JNIEXPORT void JNICALL
-Java_com_infinitetakes_stream_videoSDK_FFmpegWrapper_stop(JNIEnv  __unused *env,
-                                                          jobject  __unused instance) {
-    release_resources();
+/**
+ * Switch the destination to the parameter sets (an avcC) in a config packet from the ring,
+ * without reconnecting: FLV, ours or FFmpeg's, gets a new sequence header right away, and
+ * anything else gets them in-band with the next keyframe. Returns 0 or a negative AVERROR.
+ */
+int write_config_packet(Destination *destination, RingPacket *ringPacket) {
+    if (!destination->videoStream) {
+        return 0;
+    }
+    //  Stamped like the packet after it will be, including after a reconnect.
+    int64_t dtsUs = destination->isRebasePending
+                    ? destination->lastWrittenDtsUs + RESUME_GAP_US
+                    : ringPacket->dts + destination->ptsOffsetUs;
+    int ret = 0;
+    watchdog_arm(&destination->watchdog, WATCHDOG_PACKET, clock_now_ns());
+    if (destination->rtmpPublisher) {
+        get_timeline_base(destination, dtsUs);
+        ret = rtmp_publisher_write_video_config(destination->rtmpPublisher, dtsUs / 1000,
+                                                ringPacket->data, ringPacket->size);
+    } else if (is_flv(destination->outputFormatContext)) {
+        ret = write_flv_sequence_header(destination, dtsUs, ringPacket->data, ringPacket->size);
+    } else {
+        ret = hold_parameter_sets(destination, ringPacket->data, ringPacket->size);
+    }
+    ret = watchdog_disarm(&destination->watchdog, ret);
+    if (ret < 0) {
+        LOGE("Couldn't switch %s to the new parameter sets.", destination->url);
+        return ret;
+    }
+    return 0;
+}
+
+/**
+ * Fire the callback that a destination's connection has been lost to java. Called from the
+ * sender thread, which is attached to the VM.
+ */
+void notify_connection_dropped(Destination *destination) {
+    RtmpSession *session = destination->session;
+    JNIEnv *env = destination->senderEnv;
+    if (!env || !jniCache.connectionDroppedMethod) {
+        return;
+    }
+    if (jniCache.isConnectionDroppedIndexed) {
+        (*env)->CallVoidMethod(env, session->wrapperInstance, jniCache.connectionDroppedMethod,
+                               (jint) destination->index);
+    } else {
+        (*env)->CallVoidMethod(env, session->wrapperInstance, jniCache.connectionDroppedMethod);
+    }
+}
+
+/**
+ * Tell Java about reconnect progress on the given destination, if it's listening.
+ */
+void notify_reconnect(Destination *destination, jmethodID method, int attempt) {
+    JNIEnv *env = destination->senderEnv;
+    if (!env || !method) {
+        return;
+    }
+    (*env)->CallVoidMethod(env, destination->session->wrapperInstance, method,
+                           (jint) destination->index, (jint) attempt);
+}
+
+/**
+ * Let the destination's estimator look at the last interval. If the slowest running destination
+ * now needs a different encoder bitrate (or quality step), tell Java through
+ * onBitrateRecommendation(bitrate, frameRate, resolutionDivisor).
+ */
+void update_bitrate_recommendation(Destination *destination) {
+    RtmpSession *session = destination->session;
+    BandwidthEstimator *estimator = &destination->bandwidthEstimator;
+    int64_t nowNs = clock_now_ns();
+    if (nowNs - estimator->intervalStartNs < BWE_INTERVAL_NS) {
+        return;
+    }
+    PacketRingStats stats;
+    packet_ring_get_stats(&destination->packetRing, &stats);
+    if (!bandwidth_estimator_update(estimator, nowNs, &stats)) {
+        return;
+    }
+
+    pthread_mutex_lock(&session->recommendationLock);
+    int bitrate = session->metadata.videoBitrate;
+    for (int i = 0; i < session->numDestinations; i++) {
+        Destination *other = &session->destinations[i];
+        if (other->isRecording || !__atomic_load_n(&other->isSenderRunning, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        int otherBitrate = __atomic_load_n(&other->bandwidthEstimator.recommendedBitrate,
+                                           __ATOMIC_RELAXED);
+        if (otherBitrate < bitrate) {
+            bitrate = otherBitrate;
+        }
+    }
+    int step = bandwidth_estimator_quality_step(session->metadata.videoBitrate, bitrate,
+                                                session->qualityStep);
+    if (bitrate != session->recommendedBitrate || step != session->qualityStep) {
+        session->recommendedBitrate = bitrate;
+        session->qualityStep = step;
+        LOGI("Recommending %d bps at %d fps, resolution / %d.", bitrate,
+             QUALITY_LADDER[step].frameRate, QUALITY_LADDER[step].resolutionDivisor);
+        JNIEnv *env = destination->senderEnv;
+        if (env && jniCache.bitrateRecommendationMethod) {
+            (*env)->CallVoidMethod(env, session->wrapperInstance,
+                                   jniCache.bitrateRecommendationMethod, (jint) bitrate,
+                                   (jint) QUALITY_LADDER[step].frameRate,
+                                   (jint) QUALITY_LADDER[step].resolutionDivisor);
+        }
+    }
+    pthread_mutex_unlock(&session->recommendationLock);
 }
 #endif
 
-void initConnection(JNIEnv *env) {
-    int error = 0;
-    AVCodec *audio_codec, *video_codec;
+/**
+ * Build an output context for every destination from the config frame in session->packet.
+ * On failure an exception is thrown to Java and everything is released.
+ */
+void initConnection(JNIEnv *env, RtmpSession *session) {
+    Metadata *metadata = &session->metadata;
 
-    isConnectionOpen = 0;
+    // Verify that all the parameters have been set, or throw an IllegalArgumentException to Java.
+    if (!metadata->videoHeight || !metadata->videoWidth || !metadata->audioSampleRate ||
+        !metadata->videoBitrate || !metadata->audioBitRate ||
+        !metadata->numAudioChannels || !metadata->outputFormatName || !session->numDestinations) {
+        jclass exc = (*env)->FindClass(env, "java/lang/IllegalArgumentException");
+        (*env)->ThrowNew(env, exc, "Make sure all the Metadata parameters have been passed.");
+        release_resources(session);
+        return;
+    }
 
-    if ((error = avformat_alloc_output_context2(&outputFormatContext, NULL,
-                                                metadata.outputFormatName,
-                                                metadata.outputFile)) < 0 || !outputFormatContext) {
-        LOGE("Couldn't allocate the output context.");
+    for (int i = 0; i < session->numDestinations; i++) {
+        if (init_destination(env, session, &session->destinations[i]) < 0) {
+            release_resources(session);
+            return;
+        }
+    }
+}
+
+/**
+ * Allocate the output context and streams for one destination. Throws to Java and returns a
+ * negative value on failure.
+ */
+int init_destination(JNIEnv *env, RtmpSession *session, Destination *destination) {
+    int error = build_destination(session, destination);
+    if (error == AVERROR(EINVAL)) {
+        jclass exc = (*env)->FindClass(env, "java/lang/IllegalArgumentException");
+        (*env)->ThrowNew(env, exc, "Couldn't create the stream.");
+    } else if (error < 0) {
         char errorStr[1024];
         get_error_string(error, errorStr);
         jclass exc = (*env)->FindClass(env, "java/lang/Exception");
         (*env)->ThrowNew(env, exc, errorStr);
-        release_resources();
-        return;
+    }
+    return error;
+}
+
+/**
+ * Allocate the output context and streams for one destination from the session's config frame.
+ * Doesn't touch Java, so sender threads can use it to rebuild after a dropped connection.
+ * Returns 0 or a negative AVERROR.
+ */
+int build_destination(RtmpSession *session, Destination *destination) {
+    int error = 0;
+    AVCodec *audio_codec, *video_codec;
+
+    //  A new config frame means a fresh output context.
+    release_destination(destination);
+
+    if ((error = avformat_alloc_output_context2(&destination->outputFormatContext, NULL,
+                                                destination->formatName,
+                                                destination->url)) < 0
+        || !destination->outputFormatContext) {
+        LOGE("Couldn't allocate the output context for %s.", destination->url);
+        return error < 0 ? error : AVERROR(ENOMEM);
+    }
+    //  For anything the muxer opens or waits on itself. Recordings have no deadlines to keep
+    //  and must finish their file after a stop, so they're left uninterruptible.
+    if (!destination->isRecording) {
+        destination->outputFormatContext->interrupt_callback = destination->interruptCallback;
     }
 
-    AVOutputFormat *fmt = outputFormatContext->oformat;
+    AVOutputFormat *fmt = destination->outputFormatContext->oformat;
     if (fmt->audio_codec != AV_CODEC_ID_NONE && AUDIO_CODEC_ID != AV_CODEC_ID_NONE) {
-        audioStream = add_stream(outputFormatContext, &audio_codec, AUDIO_CODEC_ID);
+        destination->audioStream = add_stream(session, destination, &audio_codec,
+                                              AUDIO_CODEC_ID);
     }
 
     if (fmt->video_codec != AV_CODEC_ID_NONE && VIDEO_CODEC_ID != AV_CODEC_ID_NONE) {
-        videoStream = add_stream(outputFormatContext, &video_codec, VIDEO_CODEC_ID);
+        destination->videoStream = add_stream(session, destination, &video_codec,
+                                              VIDEO_CODEC_ID);
     }
 
 
-    if((fmt->video_codec != AV_CODEC_ID_NONE && VIDEO_CODEC_ID != AV_CODEC_ID_NONE && !videoStream)
+    if((fmt->video_codec != AV_CODEC_ID_NONE && VIDEO_CODEC_ID != AV_CODEC_ID_NONE
+            && !destination->videoStream)
         || (fmt->audio_codec != AV_CODEC_ID_NONE
-                && AUDIO_CODEC_ID != AV_CODEC_ID_NONE && !audioStream)){
-        jclass exc = (*env)->FindClass(env, "java/lang/IllegalArgumentException");
-        (*env)->ThrowNew(env, exc, "Couldn't create the stream.");
-        release_resources();
-        return;
+                && AUDIO_CODEC_ID != AV_CODEC_ID_NONE && !destination->audioStream)){
+        return AVERROR(EINVAL);
     }
 
     // Debug the output format
-    av_dump_format(outputFormatContext, 0, NULL, 1);
+    av_dump_format(destination->outputFormatContext, 0, destination->url, 1);
+    return 0;
+}
 
-    // Verify that all the parameters have been set, or throw an IllegalArgumentException to Java.
-    if (!metadata.videoHeight || !metadata.videoWidth || !metadata.audioSampleRate ||
-        !metadata.videoBitrate || !metadata.audioBitRate ||
-        !metadata.numAudioChannels || !metadata.outputFormatName || !metadata.outputFile) {
-        jclass exc = (*env)->FindClass(env, "java/lang/IllegalArgumentException");
-        (*env)->ThrowNew(env, exc, "Make sure all the Metadata parameters have been passed.");
-        release_resources();
-        return;
+
+/**
+ * Copy a Java string into memory owned by the session.
+ */
+static char *dup_java_string(JNIEnv *env, jstring jStr) {
+    if (!jStr) {
+        return NULL;
     }
+    const char *utf = (*env)->GetStringUTFChars(env, jStr, 0);
+    char *copy = av_strdup(utf);
+    (*env)->ReleaseStringUTFChars(env, jStr, utf);
+    return copy;
 }
 
+/**
+ * Look up a field that older Metadata classes may not have, returning NULL if it's missing.
+ */
+static jfieldID get_optional_field(JNIEnv *env, jclass clazz, const char *name,
+                                   const char *signature) {
+    jfieldID fieldId = (*env)->GetFieldID(env, clazz, name, signature);
+    if ((*env)->ExceptionCheck(env)) {
+        (*env)->ExceptionClear(env);
+        return NULL;
+    }
+    return fieldId;
+}
 
 /**
- * Take the Java Metadata object and populate the C struct declared above with these parameters.
+ * Cache the Metadata field IDs. Every session is configured from the same class, so this only
+ * runs for the first one.
  */
-void populate_metadata_from_java(JNIEnv *env, jobject jOpts) {
-    jclass jMetadataClass = (*env)->GetObjectClass(env, jOpts);
-    jfieldID jVideoHeightId = (*env)->GetFieldID(env, jMetadataClass, "videoHeight", "I");
-    jfieldID jVideoWidthId = (*env)->GetFieldID(env, jMetadataClass, "videoWidth", "I");
-    jfieldID jVideoBitrate = (*env)->GetFieldID(env, jMetadataClass, "videoBitrate", "I");
-    jfieldID jAudioBitRateId = (*env)->GetFieldID(env, jMetadataClass, "audioBitRate", "I");
-    jfieldID jAudioSampleRateId = (*env)->GetFieldID(env, jMetadataClass, "audioSampleRate", "I");
-    jfieldID jNumAudioChannelsId = (*env)->GetFieldID(env, jMetadataClass, "numAudioChannels", "I");
-    jfieldID jOutputFormatName = (*env)->GetFieldID(env, jMetadataClass, "outputFormatName",
-                                                    "Ljava/lang/String;");
-    jfieldID jOutputFile = (*env)->GetFieldID(env, jMetadataClass, "outputFile",
-                                              "Ljava/lang/String;");
-    jstring jStrOutputFormatName = (*env)->GetObjectField(env, jOpts, jOutputFormatName);
-    jstring jStrOutputFile = (*env)->GetObjectField(env, jOpts, jOutputFile);
+void resolve_metadata_ids(JNIEnv *env, jclass metadataClass) {
+    jniCache.videoHeight = (*env)->GetFieldID(env, metadataClass, "videoHeight", "I");
+    jniCache.videoWidth = (*env)->GetFieldID(env, metadataClass, "videoWidth", "I");
+    jniCache.videoBitrate = (*env)->GetFieldID(env, metadataClass, "videoBitrate", "I");
+    jniCache.audioBitRate = (*env)->GetFieldID(env, metadataClass, "audioBitRate", "I");
+    jniCache.audioSampleRate = (*env)->GetFieldID(env, metadataClass, "audioSampleRate", "I");
+    jniCache.numAudioChannels = (*env)->GetFieldID(env, metadataClass, "numAudioChannels", "I");
+    jniCache.outputFormatName = (*env)->GetFieldID(env, metadataClass, "outputFormatName",
+                                                   "Ljava/lang/String;");
+    jniCache.outputFile = (*env)->GetFieldID(env, metadataClass, "outputFile",
+                                             "Ljava/lang/String;");
+    //  outputFiles is optional; older callers only set outputFile.
+    jniCache.outputFiles = get_optional_field(env, metadataClass, "outputFiles",
+                                              "[Ljava/lang/String;");
+    jniCache.dropNonReferenceMs = get_optional_field(env, metadataClass, "dropNonReferenceMs",
+                                                     "I");
+    jniCache.dropGopMs = get_optional_field(env, metadataClass, "dropGopMs", "I");
+    jniCache.reconnectInitialDelayMs = get_optional_field(env, metadataClass,
+                                                          "reconnectInitialDelayMs", "I");
+    jniCache.reconnectMaxDelayMs = get_optional_field(env, metadataClass, "reconnectMaxDelayMs",
+                                                      "I");
+    jniCache.reconnectMaxAttempts = get_optional_field(env, metadataClass, "reconnectMaxAttempts",
+                                                       "I");
+    jniCache.recordingFile = get_optional_field(env, metadataClass, "recordingFile",
+                                                "Ljava/lang/String;");
+    jniCache.fragmentRecording = get_optional_field(env, metadataClass, "fragmentRecording", "Z");
+    jniCache.socketIoMode = get_optional_field(env, metadataClass, "socketIoMode", "I");
+    jniCache.socketCoalesceMs = get_optional_field(env, metadataClass, "socketCoalesceMs", "I");
+    jniCache.socketCoalesceKb = get_optional_field(env, metadataClass, "socketCoalesceKb", "I");
+    jniCache.socketSendBufferKb = get_optional_field(env, metadataClass, "socketSendBufferKb",
+                                                     "I");
+    jniCache.nativeRtmp = get_optional_field(env, metadataClass, "nativeRtmp", "Z");
+    jniCache.keyFrameRequestIntervalMs = get_optional_field(env, metadataClass,
+                                                            "keyFrameRequestIntervalMs", "I");
+    jniCache.gopCacheKb = get_optional_field(env, metadataClass, "gopCacheKb", "I");
+    jniCache.connectTimeoutMs = get_optional_field(env, metadataClass, "connectTimeoutMs", "I");
+    jniCache.headerTimeoutMs = get_optional_field(env, metadataClass, "headerTimeoutMs", "I");
+    jniCache.packetTimeoutMs = get_optional_field(env, metadataClass, "packetTimeoutMs", "I");
+    jniCache.videoReorderDepth = get_optional_field(env, metadataClass, "videoReorderDepth", "I");
+    jniCache.isMetadataResolved = true;
+}
 
-    metadata.videoHeight = (*env)->GetIntField(env, jOpts, jVideoHeightId);
-    metadata.videoWidth = (*env)->GetIntField(env, jOpts, jVideoWidthId);
-    metadata.videoBitrate = (*env)->GetIntField(env, jOpts, jVideoBitrate);
-    metadata.audioBitRate = (*env)->GetIntField(env, jOpts, jAudioBitRateId);
-    metadata.audioSampleRate = (*env)->GetIntField(env, jOpts, jAudioSampleRateId);
-    metadata.numAudioChannels = (*env)->GetIntField(env, jOpts, jNumAudioChannelsId);
-    metadata.outputFormatName = (*env)->GetStringUTFChars(env, jStrOutputFormatName, 0);
-    metadata.outputFile = (*env)->GetStringUTFChars(env, jStrOutputFile, 0);
+/**
+ * Read an optional int field, falling back to defaultValue when the class doesn't have it.
+ */
+static int get_optional_int_field(JNIEnv *env, jobject jObj, jfieldID fieldId, int defaultValue) {
+    return fieldId ? (*env)->GetIntField(env, jObj, fieldId) : defaultValue;
 }
 
 /**
- * Add an output stream to the given AVFormatContext.
+ * Take the Java Metadata object and populate the given C struct with these parameters.
  */
-static AVStream *add_stream(AVFormatContext *oc, AVCodec **codec, enum AVCodecID codec_id) {
+void populate_metadata_from_java(JNIEnv *env, jobject jOpts, Metadata *metadata) {
+    if (!jniCache.isMetadataResolved) {
+        jclass jMetadataClass = (*env)->GetObjectClass(env, jOpts);
+        resolve_metadata_ids(env, jMetadataClass);
+        (*env)->DeleteLocalRef(env, jMetadataClass);
+    }
+    jstring jStrOutputFormatName = (*env)->GetObjectField(env, jOpts, jniCache.outputFormatName);
+    jstring jStrOutputFile = (*env)->GetObjectField(env, jOpts, jniCache.outputFile);
+    jobjectArray jOutputFilesArray = jniCache.outputFiles
+                                     ? (*env)->GetObjectField(env, jOpts, jniCache.outputFiles)
+                                     : NULL;
+
+    metadata->videoHeight = (*env)->GetIntField(env, jOpts, jniCache.videoHeight);
+    metadata->videoWidth = (*env)->GetIntField(env, jOpts, jniCache.videoWidth);
+    metadata->videoBitrate = (*env)->GetIntField(env, jOpts, jniCache.videoBitrate);
+    metadata->audioBitRate = (*env)->GetIntField(env, jOpts, jniCache.audioBitRate);
+    metadata->audioSampleRate = (*env)->GetIntField(env, jOpts, jniCache.audioSampleRate);
+    metadata->numAudioChannels = (*env)->GetIntField(env, jOpts, jniCache.numAudioChannels);
+    metadata->dropNonReferenceMs = get_optional_int_field(env, jOpts, jniCache.dropNonReferenceMs,
+                                                          DEFAULT_DROP_NON_REFERENCE_MS);
+    metadata->dropGopMs = get_optional_int_field(env, jOpts, jniCache.dropGopMs,
+                                                 DEFAULT_DROP_GOP_MS);
+    metadata->reconnectInitialDelayMs = get_optional_int_field(env, jOpts,
+                                                               jniCache.reconnectInitialDelayMs,
+                                                               DEFAULT_RECONNECT_INITIAL_DELAY_MS);
+    metadata->reconnectMaxDelayMs = get_optional_int_field(env, jOpts,
+                                                           jniCache.reconnectMaxDelayMs,
+                                                           DEFAULT_RECONNECT_MAX_DELAY_MS);
+    metadata->reconnectMaxAttempts = get_optional_int_field(env, jOpts,
+                                                            jniCache.reconnectMaxAttempts,
+                                                            DEFAULT_RECONNECT_MAX_ATTEMPTS);
+    metadata->socketIoMode = get_optional_int_field(env, jOpts, jniCache.socketIoMode,
+                                                    SOCKET_IO_OFF);
+    metadata->socketCoalesceMs = get_optional_int_field(env, jOpts, jniCache.socketCoalesceMs,
+                                                        DEFAULT_SOCKET_IO_COALESCE_MS);
+    metadata->socketCoalesceKb = get_optional_int_field(env, jOpts, jniCache.socketCoalesceKb,
+                                                        DEFAULT_SOCKET_IO_COALESCE_KB);
+    metadata->socketSendBufferKb = get_optional_int_field(env, jOpts,
+                                                          jniCache.socketSendBufferKb,
+                                                          DEFAULT_SOCKET_IO_SEND_BUFFER_KB);
+    metadata->keyFrameRequestIntervalMs = get_optional_int_field(env, jOpts,
+                                                   jniCache.keyFrameRequestIntervalMs,
+                                                   DEFAULT_KEY_FRAME_REQUEST_INTERVAL_MS);
+    metadata->gopCacheKb = get_optional_int_field(env, jOpts, jniCache.gopCacheKb,
+                                                  DEFAULT_GOP_CACHE_KB);
+    metadata->connectTimeoutMs = get_optional_int_field(env, jOpts, jniCache.connectTimeoutMs,
+                                                        DEFAULT_CONNECT_TIMEOUT_MS);
+    metadata->headerTimeoutMs = get_optional_int_field(env, jOpts, jniCache.headerTimeoutMs,
+                                                       DEFAULT_HEADER_TIMEOUT_MS);
+    metadata->packetTimeoutMs = get_optional_int_field(env, jOpts, jniCache.packetTimeoutMs,
+                                                       DEFAULT_PACKET_TIMEOUT_MS);
+    metadata->videoReorderDepth = get_optional_int_field(env, jOpts, jniCache.videoReorderDepth,
+                                                         0);
+    metadata->nativeRtmp = jniCache.nativeRtmp
+                           && (*env)->GetBooleanField(env, jOpts, jniCache.nativeRtmp);
+    metadata->fragmentRecording = jniCache.fragmentRecording
+                                  && (*env)->GetBooleanField(env, jOpts,
+                                                             jniCache.fragmentRecording);
+    //  Sessions outlive the Java call, so take our own copies of the strings.
+    metadata->outputFormatName = dup_java_string(env, jStrOutputFormatName);
+    if (jniCache.recordingFile) {
+        jstring jStrRecordingFile = (*env)->GetObjectField(env, jOpts, jniCache.recordingFile);
+        metadata->recordingFile = dup_java_string(env, jStrRecordingFile);
+    }
+    metadata->numOutputFiles = 0;
+    if (jOutputFilesArray) {
+        int count = (int) (*env)->GetArrayLength(env, jOutputFilesArray);
+        for (int i = 0; i < count && metadata->numOutputFiles < MAX_DESTINATIONS; i++) {
+            jstring jStr = (*env)->GetObjectArrayElement(env, jOutputFilesArray, i);
+            if (jStr) {
+                metadata->outputFiles[metadata->numOutputFiles++] = dup_java_string(env, jStr);
+                (*env)->DeleteLocalRef(env, jStr);
+            }
+        }
+    }
+    if (!metadata->numOutputFiles && jStrOutputFile) {
+        metadata->outputFiles[metadata->numOutputFiles++] = dup_java_string(env, jStrOutputFile);
+    }
+}
+
+/**
+ * Return whether the output context writes FLV, which wants FLV codec tags on its streams.
+ */
+static bool is_flv(AVFormatContext *oc) {
+    return !strcmp(oc->oformat->name, "flv");
+}
+
+/**
+ * Add an output stream to the destination's AVFormatContext.
+ */
+static AVStream *add_stream(RtmpSession *session, Destination *destination, AVCodec **codec,
+                            enum AVCodecID codec_id) {
+    AVFormatContext *oc = destination->outputFormatContext;
     AVCodecContext *codecContext = NULL;
     AVStream *st = NULL;
 
@@ -203,27 +1646,35 @@ static AVStream *add_stream(AVFormatContext *oc, AVCodec **codec, enum AVCodecID
     if (codec_id == VIDEO_CODEC_ID) {
         codecContext->codec_id = VIDEO_CODEC_ID;
         codecContext->codec_type = AVMEDIA_TYPE_VIDEO;
-        codecContext->bit_rate = metadata.videoBitrate;
-        codecContext->width = metadata.videoWidth;
-        codecContext->height = metadata.videoHeight;
+        codecContext->bit_rate = session->metadata.videoBitrate;
+        codecContext->width = session->metadata.videoWidth;
+        codecContext->height = session->metadata.videoHeight;
         codecContext->pix_fmt = VIDEO_PIX_FMT;
         codecContext->framerate = (AVRational){30,1};
-        av_opt_set(codecContext->priv_data, "profile", "baseline", 0);
-        st->codec->codec_tag = 7;
-        //  H.264 Annex-B requires you send SPS+PPS in extra data.
-        codecContext->extradata = (uint8_t*)av_mallocz(packet->size);
-        codecContext->extradata_size = packet->size;
-        int i;
-        for(i = 0; i < packet->size; i++){
-            codecContext->extradata[i] = packet->data[i];
+        //  The profile is whatever the encoder's SPS says; with B-frames the muxer has to know
+        //  how far decode runs ahead of display.
+        codecContext->has_b_frames = session->videoDecodeTime.reorderDepth;
+        //  FLV's own codec IDs; other containers pick their tag themselves.
+        st->codec->codec_tag = is_flv(oc) ? 7 : 0;
+        //  The SPS/PPS go in the extradata, as an avcC when we could build one.
+        pthread_mutex_lock(&session->configLock);
+        codecContext->extradata = (uint8_t*)av_mallocz(session->configSize
+                                                       + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (codecContext->extradata) {
+            codecContext->extradata_size = session->configSize;
+            memcpy(codecContext->extradata, session->configData, (size_t) session->configSize);
+        }
+        pthread_mutex_unlock(&session->configLock);
+        if (!codecContext->extradata) {
+            return NULL;
         }
     } else if (codec_id == AUDIO_CODEC_ID) {
         codecContext->codec_id = AUDIO_CODEC_ID;
         codecContext->codec_type = AVMEDIA_TYPE_AUDIO;
         codecContext->sample_fmt = AUDIO_SAMPLE_FMT;
-        codecContext->sample_rate = metadata.audioSampleRate;
-        codecContext->bit_rate = metadata.audioBitRate;
-        codecContext->channels = metadata.numAudioChannels;
+        codecContext->sample_rate = session->metadata.audioSampleRate;
+        codecContext->bit_rate = session->metadata.audioBitRate;
+        codecContext->channels = session->metadata.numAudioChannels;
         /*codecContext->extradata = (uint8_t*)av_mallocz(2);
         codecContext->extradata_size = 2;
         //  Extra data for AAC LC should be 0x11 0x90.
@@ -238,11 +1689,11 @@ static AVStream *add_stream(AVFormatContext *oc, AVCodec **codec, enum AVCodecID
         put_bits(&pb, 4, 2);
 
         flush_put_bits(&pb);
-        st->codec->codec_tag = 10;
+        st->codec->codec_tag = is_flv(oc) ? 10 : 0;
     }
 
     //  Some of the things we do aren't totally kosher.
-    outputFormatContext->strict_std_compliance = FF_COMPLIANCE_STRICT;
+    oc->strict_std_compliance = FF_COMPLIANCE_STRICT;
 
     // Some formats want stream headers to be separate.
     if (oc->oformat->flags & AVFMT_GLOBALHEADER)
@@ -261,69 +1712,578 @@ char *get_error_string(int errorNum, char *errBuf) {
     return errBuf;
 }
 
+/**
+ * Append a destination's socket counters, including what the kernel still had queued to send
+ * when we last looked.
+ */
+static int format_socket_stats(SocketIoStats *stats, char *buf, int size, int length) {
+    return stats_append(buf, size, length,
+                        ",\"socket\":{\"bytesSent\":%llu,\"writevCalls\":%llu,"
+                        "\"referencedBytes\":%llu,\"copiedBytes\":%llu,\"sendQueueBytes\":%u,"
+                        "\"maxSendQueueBytes\":%u,\"sendBufferBytes\":%u}",
+                        (unsigned long long) __atomic_load_n(&stats->bytesSent, __ATOMIC_RELAXED),
+                        (unsigned long long) __atomic_load_n(&stats->writevCalls,
+                                                             __ATOMIC_RELAXED),
+                        (unsigned long long) __atomic_load_n(&stats->referencedBytes,
+                                                             __ATOMIC_RELAXED),
+                        (unsigned long long) __atomic_load_n(&stats->copiedBytes,
+                                                             __ATOMIC_RELAXED),
+                        __atomic_load_n(&stats->sendQueueBytes, __ATOMIC_RELAXED),
+                        __atomic_load_n(&stats->maxSendQueueBytes, __ATOMIC_RELAXED),
+                        __atomic_load_n(&stats->sendBufferBytes, __ATOMIC_RELAXED));
+}
+
+/**
+ * Append a destination's RTMP chunk stream counters and what the server has acknowledged.
+ */
+static int format_rtmp_stats(RtmpPublisherStats *stats, char *buf, int size, int length) {
+    return stats_append(buf, size, length,
+                        ",\"rtmp\":{\"messages\":%llu,\"chunks\":%llu,"
+                        "\"continuationChunks\":%llu,\"compressedHeaders\":%llu,"
+                        "\"ackedBytes\":%llu,\"unacknowledgedBytes\":%llu,"
+                        "\"windowAckSize\":%u,\"pings\":%u}",
+                        (unsigned long long) __atomic_load_n(&stats->messages, __ATOMIC_RELAXED),
+                        (unsigned long long) __atomic_load_n(&stats->chunks, __ATOMIC_RELAXED),
+                        (unsigned long long) __atomic_load_n(&stats->continuationChunks,
+                                                             __ATOMIC_RELAXED),
+                        (unsigned long long) __atomic_load_n(&stats->compressedHeaders,
+                                                             __ATOMIC_RELAXED),
+                        (unsigned long long) __atomic_load_n(&stats->ackedBytes,
+                                                             __ATOMIC_RELAXED),
+                        (unsigned long long) __atomic_load_n(&stats->unacknowledgedBytes,
+                                                             __ATOMIC_RELAXED),
+                        __atomic_load_n(&stats->windowAckSize, __ATOMIC_RELAXED),
+                        __atomic_load_n(&stats->pings, __ATOMIC_RELAXED));
+}
+
+/**
+ * Append the keyframe requests: what needed one, how often the encoder was asked, and how long
+ * a need waited for its keyframe.
+ */
+static int format_key_frame_stats(KeyFrameRequester *requester, char *buf, int size,
+                                  int length) {
+    length = stats_append(buf, size, length,
+                          ",\"keyFrameRequests\":{\"needs\":{\"start\":%llu,\"reconnect\":%llu,"
+                          "\"queueFull\":%llu,\"gopDropped\":%llu},\"requests\":%llu,"
+                          "\"coalesced\":%llu,\"answered\":%llu,\"latency\":",
+                          (unsigned long long) __atomic_load_n(
+                              &requester->needs[KEY_FRAME_REASON_START], __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(
+                              &requester->needs[KEY_FRAME_REASON_RECONNECT], __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(
+                              &requester->needs[KEY_FRAME_REASON_QUEUE_FULL], __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(
+                              &requester->needs[KEY_FRAME_REASON_GOP_DROPPED], __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(&requester->requests,
+                                                               __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(&requester->coalesced,
+                                                               __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(&requester->answered,
+                                                               __ATOMIC_RELAXED));
+    length = stats_append_histogram(buf, size, length, &requester->latency);
+    return stats_append(buf, size, length, "}");
+}
+
+/**
+ * Append a destination's stalls: how many operations of each kind missed their deadline, whether
+ * it's stalled now, and how long the stalls it recovered from lasted.
+ */
+static int format_stall_stats(Watchdog *watchdog, char *buf, int size, int length) {
+    length = stats_append(buf, size, length,
+                          ",\"stalls\":{\"connect\":%llu,\"header\":%llu,\"packet\":%llu,"
+                          "\"close\":%llu,\"stalled\":%s,\"duration\":",
+                          (unsigned long long) __atomic_load_n(
+                              &watchdog->stalls[WATCHDOG_CONNECT], __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(
+                              &watchdog->stalls[WATCHDOG_HEADER], __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(
+                              &watchdog->stalls[WATCHDOG_PACKET], __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(
+                              &watchdog->stalls[WATCHDOG_CLOSE], __ATOMIC_RELAXED),
+                          __atomic_load_n(&watchdog->isStalled, __ATOMIC_RELAXED)
+                          ? "true" : "false");
+    length = stats_append_histogram(buf, size, length, &watchdog->stallDuration);
+    return stats_append(buf, size, length, "}");
+}
+
+/**
+ * Write a JSON snapshot of the session into buf: JNI submit latency, the current recommendation,
+ * whether any destination is stalled, keyframe requests, the GOP cache, decode times, and for every
+ * destination its queue and drop counters, per-stream packets and bytes, time to first byte,
+ * stalls, and queue/header/write/end-to-end latency histograms. URLs are left out since they
+ * carry stream keys. Safe to call while streaming. Returns the length written.
+ */
+int format_stats(RtmpSession *session, char *buf, int size) {
+    int length = stats_append(buf, size, 0, "{\"submit\":");
+    length = stats_append_histogram(buf, size, length, &session->submitLatency);
+    int numStalled = __atomic_load_n(&session->numStalledDestinations, __ATOMIC_RELAXED);
+    length = stats_append(buf, size, length,
+                          ",\"recommendedBitrate\":%d,\"qualityStep\":%d,\"degraded\":%s,"
+                          "\"stalledDestinations\":%d",
+                          __atomic_load_n(&session->recommendedBitrate, __ATOMIC_RELAXED),
+                          __atomic_load_n(&session->qualityStep, __ATOMIC_RELAXED),
+                          numStalled ? "true" : "false", numStalled);
+    length = format_key_frame_stats(&session->keyFrameRequester, buf, size, length);
+    length = stats_append(buf, size, length,
+                          ",\"gopCache\":{\"gops\":%llu,\"overflows\":%llu,\"snapshots\":%llu,"
+                          "\"maxBytes\":%llu}",
+                          (unsigned long long) __atomic_load_n(&session->gopCache.gops,
+                                                               __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(&session->gopCache.overflows,
+                                                               __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(&session->gopCache.snapshots,
+                                                               __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(&session->gopCache.maxBytes,
+                                                               __ATOMIC_RELAXED));
+    length = stats_append(buf, size, length,
+                          ",\"decodeTime\":{\"reorderDepth\":%d,\"videoAdjusted\":%llu,"
+                          "\"audioAdjusted\":%llu,\"maxCompositionUs\":%lld}",
+                          session->videoDecodeTime.reorderDepth,
+                          (unsigned long long) __atomic_load_n(&session->videoDecodeTime.adjusted,
+                                                               __ATOMIC_RELAXED),
+                          (unsigned long long) __atomic_load_n(&session->audioDecodeTime.adjusted,
+                                                               __ATOMIC_RELAXED),
+                          (long long) __atomic_load_n(&session->videoDecodeTime.maxCompositionUs,
+                                                      __ATOMIC_RELAXED));
+    length = stats_append(buf, size, length, ",\"destinations\":[");
+    for (int i = 0; i < session->numDestinations; i++) {
+        Destination *destination = &session->destinations[i];
+        DestinationStats *stats = &destination->stats;
+        PacketRingStats ringStats = {0};
+        if (destination->isRingAllocated) {
+            packet_ring_get_stats(&destination->packetRing, &ringStats);
+        }
+        uint64_t bytes = __atomic_load_n(&stats->bytes[STATS_STREAM_AUDIO], __ATOMIC_RELAXED)
+                         + __atomic_load_n(&stats->bytes[STATS_STREAM_VIDEO], __ATOMIC_RELAXED);
+        int64_t elapsedNs = __atomic_load_n(&destination->lastWriteTimeNs, __ATOMIC_RELAXED)
+                            - __atomic_load_n(&destination->firstWriteTimeNs, __ATOMIC_RELAXED);
+        length = stats_append(buf, size, length,
+                              "%s{\"index\":%d,\"recording\":%s,\"running\":%s,\"depth\":%u,"
+                              "\"maxDepth\":%u,\"pushed\":%llu,\"dropped\":{\"queueFull\":%llu,"
+                              "\"nonReference\":%llu,\"gop\":%llu},\"reconnects\":%llu,"
+                              "\"writeErrors\":%llu,\"throughputBps\":%lld,"
+                              "\"recommendedBitrate\":%d,",
+                              i ? "," : "", destination->index,
+                              destination->isRecording ? "true" : "false",
+                              __atomic_load_n(&destination->isSenderRunning, __ATOMIC_ACQUIRE)
+                              ? "true" : "false",
+                              ringStats.depth, ringStats.maxDepth,
+                              (unsigned long long) ringStats.pushed,
+                              (unsigned long long) ringStats.dropped,
+                              (unsigned long long) __atomic_load_n(
+                                  &destination->dropPolicy.droppedNonReference, __ATOMIC_RELAXED),
+                              (unsigned long long) __atomic_load_n(
+                                  &destination->dropPolicy.droppedGop, __ATOMIC_RELAXED),
+                              (unsigned long long) __atomic_load_n(
+                                  &destination->reconnectPolicy.reconnects, __ATOMIC_RELAXED),
+                              (unsigned long long) __atomic_load_n(&destination->writeErrors,
+                                                                   __ATOMIC_RELAXED),
+                              (long long) (elapsedNs > 0 ? (double) bytes * 8 * 1e9 / elapsedNs
+                                                         : 0),
+                              __atomic_load_n(&destination->bandwidthEstimator.recommendedBitrate,
+                                              __ATOMIC_RELAXED));
+        //  Time to first byte, from start() and from the latest config frame; -1 until then.
+        int64_t firstWriteNs = __atomic_load_n(&destination->firstWriteTimeNs, __ATOMIC_RELAXED);
+        int64_t configNs = __atomic_load_n(&session->configTimeNs, __ATOMIC_RELAXED);
+        length = stats_append(buf, size, length,
+                              "\"firstByte\":{\"predialUs\":%lld,\"predialed\":%s,"
+                              "\"fromStartUs\":%lld,\"fromConfigUs\":%lld},",
+                              (long long) (__atomic_load_n(&destination->predialNs,
+                                                           __ATOMIC_RELAXED) / 1000),
+                              __atomic_load_n(&destination->usedPredial, __ATOMIC_RELAXED)
+                              ? "true" : "false",
+                              (long long) (firstWriteNs && session->startTimeNs
+                                           ? (firstWriteNs - session->startTimeNs) / 1000 : -1),
+                              (long long) (firstWriteNs && configNs
+                                           ? (firstWriteNs - configNs) / 1000 : -1));
+        length = stats_append_destination(buf, size, length, stats);
+        if (!destination->isRecording) {
+            length = format_stall_stats(&destination->watchdog, buf, size, length);
+        }
+        if (session->metadata.nativeRtmp && rtmp_publisher_supports_url(destination->url)) {
+            length = format_rtmp_stats(&destination->rtmpStats, buf, size, length);
+            length = format_socket_stats(&destination->socketStats, buf, size, length);
+        } else if (session->metadata.socketIoMode != SOCKET_IO_OFF
+                   && socket_io_supports_url(destination->url)) {
+            length = format_socket_stats(&destination->socketStats, buf, size, length);
+        }
+        length = stats_append(buf, size, length, "}");
+    }
+    return stats_append(buf, size, length, "]}");
+}
+
+/**
+ * Format the stats snapshot into a buffer of its own, which the caller frees with av_free().
+ * stats_append() stops at the end of the buffer, so a snapshot that filled it is cut short and
+ * isn't valid JSON; it's formatted again into a bigger one. Returns NULL if out of memory or the
+ * snapshot outgrows STATS_JSON_MAX_SIZE.
+ */
+char *alloc_stats(RtmpSession *session) {
+    for (int size = STATS_JSON_SIZE; size <= STATS_JSON_MAX_SIZE; size *= 2) {
+        char *json = av_malloc((size_t) size);
+        if (!json) {
+            return NULL;
+        }
+        if (format_stats(session, json, size) < size - 1) {
+            return json;
+        }
+        av_free(json);
+    }
+    return NULL;
+}
+
+/**
+ * Log the final stats snapshot, so runs without a Java side still show where time went.
+ */
+void log_stats(RtmpSession *session) {
+    char *json = alloc_stats(session);
+    if (json) {
+        LOGI("Stats: %s", json);
+        av_free(json);
+    }
+}
+
 /**
  * This function is called when an exception is thrown and we want to quit everything, or
  * when stop is called. It will try to release all the allocated resources, even if we're in a
- * bad state.
+ * bad state. The session itself stays valid.
  */
-void release_resources() {
+void release_resources(RtmpSession *session) {
     LOGI("Releasing resources.");
-    isConnectionOpen = 0;
-    frameCount = 0;
-    foundKeyFrame = false;
-    foundConfigFrame = false;
-    lastPts[0] = 0;
-    lastPts[1] = 1;
+    session->foundKeyFrame = false;
+    session->foundConfigFrame = false;
+
+    for (int i = 0; i < session->numDestinations; i++) {
+        release_destination(&session->destinations[i]);
+    }
+    if (session->packet) {
+        LOGI("Freeing packet.");
+        av_free_packet(session->packet);
+    }
+}
+
+/**
+ * Close one destination's connection and free its output context. Its ring and counters stay.
+ */
+void release_destination(Destination *destination) {
+    destination->isConnectionOpen = 0;
+    //  A rebuilt context starts from the session's latest parameter sets anyway.
+    av_freep(&destination->parameterSets);
+    destination->lastDts[0] = 0;
+    destination->lastDts[1] = 1;
 
     //  Write the trailer to the file or stream.
     //av_write_trailer(outputFormatContext);
 
-    if (videoStream) {
+    if (destination->videoStream) {
         LOGI("Closing video stream.");
-        avcodec_close(videoStream->codec);
+        avcodec_close(destination->videoStream->codec);
     }
-    if (audioStream) {
+    if (destination->audioStream) {
         LOGI("Closing audio stream.");
-        avcodec_close(audioStream->codec);
+        avcodec_close(destination->audioStream->codec);
     }
-    if (outputFormatContext) {
+    //  Saying goodbye to a stalled server mustn't hang the reconnect or the stop.
+    watchdog_arm(&destination->watchdog, WATCHDOG_CLOSE, clock_now_ns());
+    if (destination->rtmpPublisher) {
+        //  Unpublishes and sends anything still coalescing before the socket goes.
+        rtmp_publisher_close(&destination->rtmpPublisher);
+    }
+    if (destination->outputFormatContext) {
         LOGI("Freeing output context.");
-        if (outputFormatContext && !(outputFormatContext->oformat->flags & AVFMT_NOFILE))
-            avio_close(outputFormatContext->pb);
-        avformat_free_context(outputFormatContext);
+        if (destination->socketIo) {
+            //  Sends anything still coalescing before the socket goes.
+            socket_io_close(&destination->socketIo);
+            destination->outputFormatContext->pb = NULL;
+        } else if (!(destination->outputFormatContext->oformat->flags & AVFMT_NOFILE))
+            avio_close(destination->outputFormatContext->pb);
+        avformat_free_context(destination->outputFormatContext);
+        destination->outputFormatContext = NULL;
     }
-    if (packet) {
-        LOGI("Freeing packet.");
-        av_free_packet(packet);
+    watchdog_disarm(&destination->watchdog, 0);
+    destination->videoStream = NULL;
+    destination->audioStream = NULL;
+}
+
+/**
+ * Free the session allocated in init(). release_resources() must have been called first.
+ */
+void free_session(RtmpSession *session) {
+    for (int i = 0; i < session->numDestinations; i++) {
+        if (session->destinations[i].isRingAllocated) {
+            packet_ring_free(&session->destinations[i].packetRing);
+        }
+        av_freep(&session->destinations[i].primePackets);
+        av_freep(&session->destinations[i].parameterSets);
+        av_freep(&session->destinations[i].partUrl);
     }
-    LOGI("De-initializing network.");
-    avformat_network_deinit();
+    if (session->isGopCacheReady) {
+        gop_cache_uninit(&session->gopCache);
+    }
+    for (int i = 0; i < session->metadata.numOutputFiles; i++) {
+        av_freep(&session->metadata.outputFiles[i]);
+    }
+    recycler_put_packet(session->packet);
+    session->packet = NULL;
+    if (session->isBufferPoolReady) {
+        buffer_pool_uninit(&session->bufferPool);
+    }
+    av_freep(&session->metadata.outputFormatName);
+    av_freep(&session->metadata.recordingFile);
+    av_freep(&session->configData);
+    pthread_mutex_destroy(&session->recommendationLock);
+    pthread_mutex_destroy(&session->configLock);
+    av_free(session);
+}
+
+/**
+ * Whether the destination is published with RtmpPublisher. That takes FLV's length-prefixed
+ * payloads as they are, so it needs an avcC; until the config frame arrives, pass false for
+ * hasConfig to get whether it would be.
+ */
+static bool uses_native_rtmp(Destination *destination, bool hasConfig) {
+    return destination->session->metadata.nativeRtmp && !destination->isRecording
+           && (!hasConfig || destination->session->isLengthPrefixed)
+           && rtmp_publisher_supports_url(destination->url);
+}
+
+/**
+ * Whether the destination's bytes go through our own SocketIo rather than FFmpeg's protocols.
+ */
+static bool uses_socket_io(Destination *destination) {
+    return destination->session->metadata.socketIoMode != SOCKET_IO_OFF
+           && !destination->isRecording && socket_io_supports_url(destination->url);
 }
 
-int openConnection(JNIEnv *env){
-    if (isConnectionOpen == 0) {
+/**
+ * Body of a pre-dial thread: connect, and for RTMP handshake and publish, the way
+ * openConnection() would, so only the header is left once the config frame arrives.
+ */
+static void *predial_loop(void *arg) {
+    Destination *destination = arg;
+    Metadata *metadata = &destination->session->metadata;
+    int64_t startNs = clock_now_ns();
+    int ret;
+    watchdog_arm(&destination->watchdog, WATCHDOG_CONNECT, startNs);
+    if (uses_native_rtmp(destination, false)) {
+        ret = rtmp_publisher_open(&destination->predialedPublisher, destination->url,
+                                  metadata->socketIoMode != SOCKET_IO_OFF
+                                  ? metadata->socketIoMode : SOCKET_IO_LOW_LATENCY,
+                                  metadata->socketCoalesceMs, metadata->socketCoalesceKb,
+                                  metadata->socketSendBufferKb, &destination->socketStats,
+                                  &destination->rtmpStats, &destination->interruptCallback);
+    } else if (uses_socket_io(destination)) {
+        ret = socket_io_open(&destination->predialedSocketIo, destination->url,
+                             metadata->socketIoMode, metadata->socketCoalesceMs,
+                             metadata->socketCoalesceKb, metadata->socketSendBufferKb,
+                             &destination->socketStats, &destination->interruptCallback);
+    } else {
+        ret = avio_open2(&destination->predialedPb, destination->url, AVIO_FLAG_WRITE,
+                         &destination->interruptCallback, NULL);
+    }
+    ret = watchdog_disarm(&destination->watchdog, ret);
+    int64_t nowNs = clock_now_ns();
+    if (ret < 0) {
+        LOGE("Couldn't pre-dial %s; it will be dialed again when streaming starts.",
+             destination->url);
+        return NULL;
+    }
+    destination->predialDoneNs = nowNs;
+    __atomic_store_n(&destination->predialNs, nowNs - startNs, __ATOMIC_RELAXED);
+    LOGI("Pre-dialed %s in %lld ms.", destination->url, (long long) ((nowNs - startNs) / 1000000));
+    return NULL;
+}
+
+/**
+ * Start dialing every live destination in the background. Formats that open their own
+ * connections (AVFMT_NOFILE) are left to openConnection().
+ */
+void start_predials(RtmpSession *session) {
+    for (int i = 0; i < session->numDestinations; i++) {
+        Destination *destination = &session->destinations[i];
+        AVOutputFormat *format = av_guess_format(destination->formatName, destination->url,
+                                                 NULL);
+        if (destination->isRecording || destination->isPredialStarted || !format
+            || (format->flags & AVFMT_NOFILE)) {
+            continue;
+        }
+        destination->stopPredialRequested = 0;
+        destination->predialNs = 0;
+        destination->usedPredial = false;
+        if (pthread_create(&destination->predialThread, NULL, predial_loop, destination) == 0) {
+            destination->isPredialStarted = true;
+        }
+    }
+}
+
+/**
+ * Close whatever pre-dialed connection the destination didn't use.
+ */
+static void close_predial(Destination *destination) {
+    rtmp_publisher_close(&destination->predialedPublisher);
+    socket_io_close(&destination->predialedSocketIo);
+    avio_closep(&destination->predialedPb);
+}
+
+/**
+ * Wait for the destination's pre-dial, if it has one, and keep its connection unless it has
+ * sat unused so long the server has probably dropped it.
+ */
+static void take_predial(Destination *destination) {
+    if (!destination->isPredialStarted) {
+        return;
+    }
+    pthread_join(destination->predialThread, NULL);
+    destination->isPredialStarted = false;
+    if (destination->predialDoneNs
+        && clock_now_ns() - destination->predialDoneNs > PREDIAL_MAX_IDLE_MS * 1000000LL) {
+        LOGI("Pre-dialed connection to %s went stale, dialing again.", destination->url);
+        close_predial(destination);
+    }
+}
+
+/**
+ * Stop pre-dials that never got used, when the session stops before its first config frame.
+ * The sender threads must have been stopped first, since they join their pre-dials too.
+ */
+void cancel_predials(RtmpSession *session) {
+    for (int i = 0; i < session->numDestinations; i++) {
+        Destination *destination = &session->destinations[i];
+        __atomic_store_n(&destination->stopPredialRequested, 1, __ATOMIC_RELEASE);
+        take_predial(destination);
+        close_predial(destination);
+        clear_stall(destination);
+    }
+}
+
+/**
+ * Publish the destination with RtmpPublisher rather than through its output context, which then
+ * only supplies the stream parameters and extradata. Returns 0 or a negative AVERROR.
+ */
+static int open_native_rtmp(Destination *destination) {
+    Metadata *metadata = &destination->session->metadata;
+    AVCodecContext *video = destination->videoStream ? destination->videoStream->codec : NULL;
+    AVCodecContext *audio = destination->audioStream ? destination->audioStream->codec : NULL;
+    TRACE_BEGIN(TRACE_HEADER_WRITE, TRACE_STREAM_NONE, 0, 0);
+    int64_t startNs = clock_now_ns();
+    int ret = 0;
+    if (destination->predialedPublisher) {
+        destination->rtmpPublisher = destination->predialedPublisher;
+        destination->predialedPublisher = NULL;
+        destination->usedPredial = true;
+    } else {
+        watchdog_arm(&destination->watchdog, WATCHDOG_CONNECT, startNs);
+        ret = rtmp_publisher_open(&destination->rtmpPublisher, destination->url,
+                                  metadata->socketIoMode != SOCKET_IO_OFF
+                                  ? metadata->socketIoMode : SOCKET_IO_LOW_LATENCY,
+                                  metadata->socketCoalesceMs, metadata->socketCoalesceKb,
+                                  metadata->socketSendBufferKb, &destination->socketStats,
+                                  &destination->rtmpStats, &destination->interruptCallback);
+        ret = watchdog_disarm(&destination->watchdog, ret);
+    }
+    if (ret == 0) {
+        watchdog_arm(&destination->watchdog, WATCHDOG_HEADER, clock_now_ns());
+        ret = rtmp_publisher_write_header(destination->rtmpPublisher, metadata->videoWidth,
+                                          metadata->videoHeight, metadata->videoBitrate,
+                                          video ? video->extradata : NULL,
+                                          video ? video->extradata_size : 0,
+                                          metadata->audioSampleRate, metadata->numAudioChannels,
+                                          metadata->audioBitRate,
+                                          audio ? audio->extradata : NULL,
+                                          audio ? audio->extradata_size : 0);
+        ret = watchdog_disarm(&destination->watchdog, ret);
+    }
+    TRACE_END(TRACE_HEADER_WRITE, TRACE_STREAM_NONE, 0, ret);
+    histogram_record(&destination->stats.headerWrite, clock_now_ns() - startNs);
+    if (ret < 0) {
+        LOGE("Couldn't publish to %s.", destination->url);
+        rtmp_publisher_close(&destination->rtmpPublisher);
+        return ret;
+    }
+    //  A reconnect carries on from the timestamps the server has already seen.
+    if (destination->hasMuxerBase) {
+        rtmp_publisher_set_base_timestamp(destination->rtmpPublisher,
+                                          destination->muxerBaseDtsUs / 1000);
+    }
+    LOGI("Publishing to %s.", destination->url);
+    destination->isConnectionOpen = 1;
+    return 0;
+}
+
+/**
+ * Open the destination's connection and write the header. Runs on the sender thread, so failures
+ * are reported through the return value rather than a Java exception.
+ */
+int openConnection(Destination *destination){
+    AVFormatContext *outputFormatContext = destination->outputFormatContext;
+    Metadata *metadata = &destination->session->metadata;
+    take_predial(destination);
+    if (uses_native_rtmp(destination, true)) {
+        int ret = open_native_rtmp(destination);
+        close_predial(destination);
+        return ret == 0 ? 0 : 1;
+    }
+    if (destination->isConnectionOpen == 0) {
         if (!(outputFormatContext->oformat->flags & AVFMT_NOFILE)) {
-            if (!avio_open(&outputFormatContext->pb, metadata.outputFile, AVIO_FLAG_WRITE)){
-                LOGI("Opened connection success.");
-                isConnectionOpen = 1;
+            int ret = 0;
+            watchdog_arm(&destination->watchdog, WATCHDOG_CONNECT, clock_now_ns());
+            if (uses_socket_io(destination)) {
+                if (destination->predialedSocketIo) {
+                    destination->socketIo = destination->predialedSocketIo;
+                    destination->predialedSocketIo = NULL;
+                    destination->usedPredial = true;
+                } else {
+                    ret = socket_io_open(&destination->socketIo, destination->url,
+                                         metadata->socketIoMode, metadata->socketCoalesceMs,
+                                         metadata->socketCoalesceKb,
+                                         metadata->socketSendBufferKb, &destination->socketStats,
+                                         &destination->interruptCallback);
+                }
+                if (ret == 0) {
+                    outputFormatContext->pb = destination->socketIo->avio;
+                    outputFormatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+                }
+            } else if (destination->predialedPb) {
+                outputFormatContext->pb = destination->predialedPb;
+                destination->predialedPb = NULL;
+                destination->usedPredial = true;
+            } else {
+                ret = avio_open2(&outputFormatContext->pb, destination->url, AVIO_FLAG_WRITE,
+                                 destination->isRecording ? NULL : &destination->interruptCallback,
+                                 NULL);
+            }
+            ret = watchdog_disarm(&destination->watchdog, ret);
+            //  Whatever was pre-dialed for a path we didn't take.
+            close_predial(destination);
+            if (!ret){
+                LOGI("Opened connection to %s.", destination->url);
+                destination->isConnectionOpen = 1;
             } else{
-                jclass exc = (*env)->FindClass(env, "java/lang/Exception");
-                (*env)->ThrowNew(env, exc, "Internet connection is not available.");
-                release_resources();
+                LOGE("Internet connection is not available.");
                 return 1;
             }
         } else {
-            isConnectionOpen = 1;
+            destination->isConnectionOpen = 1;
         }
     }
 
     // Write the header to the stream.
-    if(avformat_write_header(outputFormatContext, NULL) < 0){
-        jclass exc = (*env)->FindClass(env, "java/lang/Exception");
-        (*env)->ThrowNew(env, exc, "Couldn't write header to file.");
-        release_resources();
+    AVDictionary *options = NULL;
+    if (destination->isFragmented) {
+        av_dict_set(&options, "movflags", RECORDING_FRAGMENT_FLAGS, 0);
+    }
+    TRACE_BEGIN(TRACE_HEADER_WRITE, TRACE_STREAM_NONE, 0, 0);
+    int64_t startNs = clock_now_ns();
+    watchdog_arm(&destination->watchdog, WATCHDOG_HEADER, startNs);
+    int ret = watchdog_disarm(&destination->watchdog,
+                              avformat_write_header(outputFormatContext, &options));
+    TRACE_END(TRACE_HEADER_WRITE, TRACE_STREAM_NONE, 0, ret);
+    histogram_record(&destination->stats.headerWrite, clock_now_ns() - startNs);
+    av_dict_free(&options);
+    if(ret < 0){
+        LOGE("Couldn't write header to %s.", destination->url);
         return 1;
     }
 
     return 0;
-}
\ No newline at end of file
+}
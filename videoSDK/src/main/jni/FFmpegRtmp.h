@@ -4,11 +4,15 @@
 #ifdef ANDROID
 #include <jni.h>
 #include <android/log.h>
+#include "JniOnLoad.h"
 #endif
 
 #include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "libavutil/opt.h"
+#include "libavutil/avstring.h"
 #include "libavcodec/avcodec.h"
 #include "libavformat/avformat.h"
 #include "libavutil/channel_layout.h"
@@ -17,6 +21,25 @@
 #include "libavutil/mathematics.h"
 #include "libavutil/samplefmt.h"
 #include "put_bits.h"
+#include "Clock.h"
+#include "PacketRing.h"
+#include "BandwidthEstimator.h"
+#include "DropPolicy.h"
+#include "BufferPool.h"
+#include "Reconnect.h"
+#include "NalUtils.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "SocketIo.h"
+#include "RtmpPublisher.h"
+#include "KeyFrameRequest.h"
+#include "GopCache.h"
+#include "FFmpegInit.h"
+#include "Watchdog.h"
+#include "DecodeTime.h"
+
+//  Most destinations we can fan a single encode out to.
+#define MAX_DESTINATIONS 4
 
 typedef struct metadata_t {
     //  Video codec options
@@ -28,13 +51,43 @@ typedef struct metadata_t {
     int audioBitRate;
     int numAudioChannels;
     //  Format options
-    const char *outputFormatName;
-    const char *outputFile;
+    char *outputFormatName;
+    char *outputFiles[MAX_DESTINATIONS];
+    int numOutputFiles;
+    //  Queue policy options, in ms of queued media. 0 disables that stage.
+    int dropNonReferenceMs;
+    int dropGopMs;
+    //  Reconnect backoff options. 0 attempts disables reconnecting.
+    int reconnectInitialDelayMs;
+    int reconnectMaxDelayMs;
+    int reconnectMaxAttempts;
+    //  Optional local recording of the same packets, as MP4 or fragmented MP4.
+    char *recordingFile;
+    bool fragmentRecording;
+    //  How tcp:// destinations are written: SOCKET_IO_OFF leaves them to FFmpeg, otherwise one
+    //  of the SocketIo modes with its coalescing limits and send buffer (0 takes the defaults).
+    int socketIoMode;
+    int socketCoalesceMs;
+    int socketCoalesceKb;
+    int socketSendBufferKb;
+    //  Publish rtmp:// destinations with RtmpPublisher instead of FFmpeg's flv muxer and rtmp
+    //  protocol. Its socket uses the SocketIo mode above, or low latency when that's off.
+    bool nativeRtmp;
+    //  Least time between asking the encoder for a sync frame; 0 never asks.
+    int keyFrameRequestIntervalMs;
+    //  Memory the session's GOP cache may hold, in KB; 0 turns it off.
+    int gopCacheKb;
+    //  Longest a live destination may block connecting (for RTMP, up to publishing), writing
+    //  its header, or writing one packet, before it's treated as stalled and reconnected.
+    //  0 lets that operation block indefinitely.
+    int connectTimeoutMs;
+    int headerTimeoutMs;
+    int packetTimeoutMs;
+    //  Frames the video encoder may reorder (B-frames). Decode times are derived with a window
+    //  this deep when packets don't come with their own; 0 means decode order is display order.
+    int videoReorderDepth;
 } Metadata;
 
-
-Metadata metadata;
-
 enum AVPixelFormat VIDEO_PIX_FMT = AV_PIX_FMT_YUV420P;
 enum AVCodecID VIDEO_CODEC_ID = AV_CODEC_ID_H264;
 enum AVCodecID AUDIO_CODEC_ID = AV_CODEC_ID_AAC;
@@ -45,26 +98,292 @@ enum AVSampleFormat AUDIO_SAMPLE_FMT = AV_SAMPLE_FMT_S16;
 //  This will be automatically set after calling write_header(), but we init it to something.
 #define flvDestTimebase (AVRational) {1, 1000000}
 
-AVFormatContext *outputFormatContext;
-AVStream *audioStream = NULL, *videoStream = NULL;
-AVPacket *packet = NULL;
+//  Packets go from the encoder thread into one ring per destination and are written out by that
+//  destination's sender thread, so a stalled connection never blocks MediaCodec or the other
+//  destinations. Sized for a few seconds of 720p.
+#define RING_NUM_SLOTS 512
+//  A recording never sheds packets on purpose, so it gets more room to ride out slow storage.
+#define RECORDING_RING_NUM_SLOTS 2048
+//  Container and flags for local recordings. Fragmented files stay playable up to the last
+//  fragment if the app dies before the trailer is written.
+#define RECORDING_FORMAT_NAME "mp4"
+#define RECORDING_FRAGMENT_FLAGS "frag_keyframe+empty_moov+default_base_moof"
+//  Room for the "-<n>" that later parts of a recording get in front of the extension.
+#define RECORDING_PART_SUFFIX_SIZE 16
+//  How long a sender thread naps when it finds its ring empty.
+#define SENDER_IDLE_SLEEP_US 1000
+//  A pre-dialed connection left unused for longer than this is dialed again instead; servers
+//  tend to drop publishers that go quiet.
+#define PREDIAL_MAX_IDLE_MS 30000
+//  Room a stats snapshot starts out with. Busier sessions get a buffer twice as big until the
+//  snapshot fits, up to STATS_JSON_MAX_SIZE.
+#define STATS_JSON_SIZE 16384
+#define STATS_JSON_MAX_SIZE (1 << 20)
+
+struct rtmp_session_t;
+
+/**
+ * One place the encoded stream is sent to: an RTMP URL or a file. Each destination has its own
+ * output context, queue and sender thread, and the sender thread owns outputFormatContext while
+ * it runs.
+ */
+typedef struct destination_t {
+    struct rtmp_session_t *session;
+    int index;
+    const char *url;
+    const char *formatName;
+    //  A local file rather than a live destination: nothing is dropped, it isn't reconnected
+    //  or bitrate-adapted, and the file is finalized when its writer thread stops.
+    bool isRecording;
+    bool isFragmented;
+    //  Recordings only. A rebuild restarts the writer thread, and rather than overwrite the file
+    //  it just finalized, it goes on in a new part ("rec-1.mp4", "rec-2.mp4", ...). partUrl holds
+    //  that name and is rewritten in place, so url stays readable from the stats thread.
+    char *partUrl;
+    int numParts;
+    //  Deadlines for the blocking network calls and the stalls they catch. interruptCallback
+    //  checks them, and the stop flags, for FFmpeg's protocols and our own sockets alike.
+    Watchdog watchdog;
+    AVIOInterruptCB interruptCallback;
+
+    AVFormatContext *outputFormatContext;
+    AVStream *audioStream, *videoStream;
+    int isConnectionOpen;
+    //  Our own socket behind outputFormatContext->pb, or NULL when FFmpeg opened the URL.
+    SocketIo *socketIo;
+    SocketIoStats socketStats;
+    //  Our own RTMP connection, in which case outputFormatContext only describes the streams.
+    RtmpPublisher *rtmpPublisher;
+    RtmpPublisherStats rtmpStats;
+    //  A connection dialed (and for RTMP, published) by start() while the camera warms up, so
+    //  openConnection() only has the header left to write once the config frame arrives. At
+    //  most one of these is set. The pre-dial thread owns them until it's joined.
+    pthread_t predialThread;
+    bool isPredialStarted;
+    int stopPredialRequested;
+    AVIOContext *predialedPb;
+    SocketIo *predialedSocketIo;
+    RtmpPublisher *predialedPublisher;
+    int64_t predialDoneNs;
+    //  How long the pre-dial took, and whether openConnection() got to use it.
+    int64_t predialNs;
+    bool usedPredial;
+    int64_t lastDts[2];
+
+    PacketRing packetRing;
+    bool isRingAllocated;
+    pthread_t senderThread;
+    bool isSenderStarted;
+    int isSenderRunning;
+    int stopSenderRequested;
+    //  The sender thread stays attached to the VM for its lifetime so callbacks are cheap.
+    JNIEnv *senderEnv;
+    BandwidthEstimator bandwidthEstimator;
+    DropPolicy dropPolicy;
+
+    //  A dropped connection is rebuilt on the sender thread. The stream resumes from the
+    //  session's cached GOP, copied here, with timestamps shifted so the server sees one
+    //  continuous timeline.
+    ReconnectPolicy reconnectPolicy;
+    RingPacket *primePackets;
+    //  Submit time of the last packet primePackets was filled through.
+    int64_t primedThroughNs;
+    int64_t ptsOffsetUs;
+    int64_t lastWrittenDtsUs;
+    bool hasWritten;
+    bool isRebasePending;
+    //  Set after joining with nothing cached: video waits for the next keyframe.
+    bool isAwaitingKeyFrame;
+    //  Producer side: a full ring cost this destination a video packet, so the rest of that GOP
+    //  isn't queued either. Video starts again at the next keyframe, live or recording alike.
+    bool isSkippingToKeyFrame;
+
+    //  New parameter sets arrive through the ring and are switched to on the same connection.
+    //  FLV gets a new sequence header; other containers get them length-prefixed ahead of the
+    //  next keyframe, held here until it comes. isConfigMissed is set by the producer when the
+    //  ring had no room for them, and the destination rebuilds instead; a recording takes them
+    //  from the session at the first video submitted after configMissedNs.
+    uint8_t *parameterSets;
+    int parameterSetsSize;
+    int isConfigMissed;
+    int64_t configMissedNs;
+    //  FLV, muxed by FFmpeg or sent by our own publisher, is stamped from the destination's
+    //  first packet, so it starts at 0. The base outlives the connection: after a reconnect the
+    //  rebased timeline carries on from where the server left off, and only a new config frame
+    //  starts it over. A sequence header we write ourselves between the muxer's packets is
+    //  stamped the same way.
+    int64_t muxerBaseDtsUs;
+    bool hasMuxerBase;
+
+    //  Written by the sender thread only, read by getDestinationStats().
+    DestinationStats stats;
+    uint64_t writeErrors;
+    int64_t firstWriteTimeNs;
+    int64_t lastWriteTimeNs;
+} Destination;
+
+/**
+ * Everything belonging to one encoder's output. Java holds the pointer as a long handle returned
+ * by init() and passes it back on every call, so several sessions can run side by side. A session
+ * is fed by one producer thread at a time, which copies each packet once and hands a reference
+ * to every destination.
+ */
+typedef struct rtmp_session_t {
+    Metadata metadata;
+    AVPacket *packet;
+    //  Time each packet spends in the JNI call that hands it over: copy, convert and fan out.
+    LatencyHistogram submitLatency;
+    //  Payloads are copied into pooled buffers so steady-state streaming doesn't allocate.
+    BufferPool bufferPool;
+    bool isBufferPoolReady;
+    //  The newest GOP, for outputs that join mid-stream. Only the producer writes it; a sender
+    //  meets its snapshot and its ring without a gap by the packets' submit times.
+    GopCache gopCache;
+    bool isGopCacheReady;
+    //  Decode times for each stream, and the newest video one for stamping new parameter sets.
+    DecodeTime videoDecodeTime;
+    DecodeTime audioDecodeTime;
+    int64_t lastVideoDts;
+
+    bool foundKeyFrame;
+    bool foundConfigFrame;
+    //  The latest SPS/PPS, kept so sender threads can rebuild their output contexts on their own.
+    //  It's an avcC record when one could be built from it, and then video payloads are queued
+    //  length-prefixed too; otherwise it's the raw Annex-B bytes and so are the payloads.
+    //  Swapped under configLock while senders are running.
+    pthread_mutex_t configLock;
+    uint8_t *configData;
+    int configSize;
+    bool isLengthPrefixed;
+
+    //  When start() was called and the latest config frame arrived, for time to first byte.
+    int64_t startTimeNs;
+    int64_t configTimeNs;
+
+    //  The live destinations, followed by the local recording if there is one.
+    Destination destinations[MAX_DESTINATIONS + 1];
+    int numDestinations;
+
+    jobject wrapperInstance;
+
+    //  The encoder has to satisfy the slowest destination, so the sender threads combine their
+    //  estimates here under the lock before telling Java.
+    pthread_mutex_t recommendationLock;
+    int recommendedBitrate;
+    int qualityStep;
+
+    //  Start-up, reconnects and dropped GOPs ask the encoder for a keyframe instead of waiting
+    //  out the rest of the GOP.
+    KeyFrameRequester keyFrameRequester;
+    //  Destinations stalled right now; the session counts as degraded while there are any.
+    int numStalledDestinations;
+} RtmpSession;
+
+//  Most packets writePackets() takes descriptors for in one go; bigger batches loop.
+#define BATCH_MAX_PACKETS 32
+//  Each packet in a batch is described by four longs: offset, size, pts, flags.
+#define BATCH_DESCRIPTOR_LONGS 4
+#define BATCH_FLAG_VIDEO 1
+#define BATCH_FLAG_KEY_FRAME 2
+#define BATCH_FLAG_CONFIG_FRAME 4
+//  The packet's composition offset (pts - dts, in microseconds) is in the flags' upper 32 bits.
+#define BATCH_FLAG_HAS_DTS 8
+#define BATCH_CTS_SHIFT 32
+
+/**
+ * Class members we call or read from native code, looked up once instead of on every call.
+ * The wrapper's IDs are resolved in JNI_OnLoad; the Metadata class is only known once init()
+ * hands us an instance, so its IDs are resolved on the first call.
+ */
+typedef struct jni_cache_t {
+    jmethodID connectionDroppedMethod;
+    //  Whether it's onConnectionDropped(int destination) rather than the older no-argument one.
+    bool isConnectionDroppedIndexed;
+    //  Optional; NULL when the Java class doesn't implement it.
+    jmethodID bitrateRecommendationMethod;
+    jmethodID reconnectingMethod;
+    jmethodID reconnectedMethod;
+    jmethodID keyFrameRequestMethod;
+    bool isWrapperResolved;
+
+    jfieldID videoHeight;
+    jfieldID videoWidth;
+    jfieldID videoBitrate;
+    jfieldID audioBitRate;
+    jfieldID audioSampleRate;
+    jfieldID numAudioChannels;
+    jfieldID outputFormatName;
+    jfieldID outputFile;
+    //  Optional fields are NULL when the Metadata class doesn't have them.
+    jfieldID outputFiles;
+    jfieldID dropNonReferenceMs;
+    jfieldID dropGopMs;
+    jfieldID reconnectInitialDelayMs;
+    jfieldID reconnectMaxDelayMs;
+    jfieldID reconnectMaxAttempts;
+    jfieldID recordingFile;
+    jfieldID fragmentRecording;
+    jfieldID socketIoMode;
+    jfieldID socketCoalesceMs;
+    jfieldID socketCoalesceKb;
+    jfieldID socketSendBufferKb;
+    jfieldID nativeRtmp;
+    jfieldID keyFrameRequestIntervalMs;
+    jfieldID gopCacheKb;
+    jfieldID connectTimeoutMs;
+    jfieldID headerTimeoutMs;
+    jfieldID packetTimeoutMs;
+    jfieldID videoReorderDepth;
+    bool isMetadataResolved;
+} JniCache;
 
-int isConnectionOpen = 0;
-int frameCount = 0;
-bool foundKeyFrame = false;
-bool foundConfigFrame = false;
-int64_t lastPts[2];
+//  There's only ever one VM per process, so this is shared by all sessions.
+JavaVM *javaVM = NULL;
+JniCache jniCache;
 
-void release_resources();
+void release_resources(RtmpSession *session);
+void release_destination(Destination *destination);
+void free_session(RtmpSession *session);
 char *get_error_string(int errorNum, char *errBuf);
-void populate_metadata_from_java(JNIEnv *env, jobject jOpts);
-static AVStream *add_stream(AVFormatContext *oc, AVCodec **codec, enum AVCodecID codec_id);
-extern void initConnection(JNIEnv *env);
-int openConnection(JNIEnv *env);
+void populate_metadata_from_java(JNIEnv *env, jobject jOpts, Metadata *metadata);
+static AVStream *add_stream(RtmpSession *session, Destination *destination, AVCodec **codec,
+                            enum AVCodecID codec_id);
+extern void initConnection(JNIEnv *env, RtmpSession *session);
+int init_destination(JNIEnv *env, RtmpSession *session, Destination *destination);
+int build_destination(RtmpSession *session, Destination *destination);
+int openConnection(Destination *destination);
+void resolve_wrapper_ids(JNIEnv *env, jclass wrapperClass);
+void resolve_metadata_ids(JNIEnv *env, jclass metadataClass);
+void submit_packet(JNIEnv *env, RtmpSession *session, jobject instance, uint8_t *data, int size,
+                   int64_t pts, int64_t dts, bool isVideo, bool isKeyFrame, bool isConfigFrame);
+int start_senders(JNIEnv *env, RtmpSession *session, jobject instance);
+void stop_senders(JNIEnv *env, RtmpSession *session);
+void *sender_loop(void *arg);
+int destination_interrupted(void *opaque);
+void clear_stall(Destination *destination);
+void run_destination(Destination *destination);
+void run_recording(Destination *destination);
+int reconnect_destination(Destination *destination);
+int prime_from_gop_cache(Destination *destination, bool isRejoining);
+void start_predials(RtmpSession *session);
+void cancel_predials(RtmpSession *session);
+void discard_ring(Destination *destination);
+int write_ring_packet(Destination *destination, RingPacket *ringPacket);
+int write_config_packet(Destination *destination, RingPacket *ringPacket);
+int hold_parameter_sets(Destination *destination, const uint8_t *avcC, int size);
+bool hot_swap_config(RtmpSession *session, const uint8_t *data, int size,
+                     int64_t submitTimeNs);
+static bool is_flv(AVFormatContext *oc);
+void notify_connection_dropped(Destination *destination);
+void notify_reconnect(Destination *destination, jmethodID method, int attempt);
+void update_bitrate_recommendation(Destination *destination);
+int format_stats(RtmpSession *session, char *buf, int size);
+char *alloc_stats(RtmpSession *session);
+void log_stats(RtmpSession *session);
 
 #ifndef ANDROID
 #define LOGE(...)  printf(__VA_ARGS__)
-#define LOGI(...)  printf(stderr, __VA_ARGS__)
+#define LOGI(...)  fprintf(stderr, __VA_ARGS__)
 #else
 #define LOG_TAG "FFmpegRtmp"
 #define LOGI(...)  __android_log_print(ANDROID_LOG_INFO,LOG_TAG,__VA_ARGS__)
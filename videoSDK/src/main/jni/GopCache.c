@@ -0,0 +1,201 @@
+#include <string.h>
+#include "libavutil/error.h"
+#include "libavutil/mem.h"
+#include "GopCache.h"
+
+/**
+ * Allocate the entries for a budget in KB (0 disables the cache). Returns 0 or a negative
+ * AVERROR.
+ */
+int gop_cache_init(GopCache *cache, int budgetKb) {
+    memset(cache, 0, sizeof(*cache));
+    cache->budgetBytes = (int64_t) budgetKb * 1024;
+    if (cache->budgetBytes <= 0) {
+        return 0;
+    }
+    cache->entries = av_malloc_array(GOP_CACHE_NUM_SLOTS * GOP_CACHE_MAX_PACKETS,
+                                     sizeof(GopCacheEntry));
+    if (!cache->entries) {
+        return AVERROR(ENOMEM);
+    }
+    for (int i = 0; i < GOP_CACHE_NUM_SLOTS; i++) {
+        cache->slots[i].entries = cache->entries + i * GOP_CACHE_MAX_PACKETS;
+    }
+    return 0;
+}
+
+/**
+ * Drop the slot's references and make it free to fill again.
+ */
+static void release_slot(GopCacheSlot *slot) {
+    for (int i = 0; i < slot->numEntries; i++) {
+        av_buffer_unref(&slot->entries[i].buf);
+    }
+    __atomic_store_n(&slot->numEntries, 0, __ATOMIC_RELAXED);
+    slot->bytes = 0;
+    slot->isRetired = false;
+}
+
+/**
+ * Release every retired slot no output is copying out of anymore.
+ */
+static void collect_retired(GopCache *cache) {
+    for (int i = 0; i < GOP_CACHE_NUM_SLOTS; i++) {
+        GopCacheSlot *slot = &cache->slots[i];
+        //  Pairs with the reader's increment in gop_cache_snapshot(): either it sees the slot
+        //  is no longer current, or we see it reading.
+        if (slot->isRetired && !__atomic_load_n(&slot->readers, __ATOMIC_SEQ_CST)) {
+            release_slot(slot);
+        }
+    }
+}
+
+/**
+ * Drop every cached reference and free the entries. No output may be taking a snapshot.
+ */
+void gop_cache_uninit(GopCache *cache) {
+    __atomic_store_n(&cache->current, NULL, __ATOMIC_RELAXED);
+    for (int i = 0; i < GOP_CACHE_NUM_SLOTS; i++) {
+        if (cache->slots[i].entries) {
+            release_slot(&cache->slots[i]);
+        }
+    }
+    av_freep(&cache->entries);
+}
+
+/**
+ * Return a slot that's neither published nor still being read, or NULL.
+ */
+static GopCacheSlot *take_free_slot(GopCache *cache) {
+    collect_retired(cache);
+    for (int i = 0; i < GOP_CACHE_NUM_SLOTS; i++) {
+        GopCacheSlot *slot = &cache->slots[i];
+        if (!slot->isRetired && slot != cache->current) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Remember a packet the producer is about to queue. A video keyframe starts a new GOP;
+ * anything else is appended to the current one, if there is one. Producer only.
+ */
+void gop_cache_add(GopCache *cache, AVBufferRef *buf, int size, int64_t pts, int64_t dts,
+                   bool isVideo, bool isKeyFrame, int64_t submitTimeNs) {
+    if (!cache->entries || !buf) {
+        return;
+    }
+    GopCacheSlot *slot = cache->current;
+    if (isVideo && isKeyFrame) {
+        gop_cache_clear(cache);
+        cache->isOverflowed = false;
+        __atomic_store_n(&cache->gops, cache->gops + 1, __ATOMIC_RELAXED);
+        //  Filled before it's published, so nobody ever copies a GOP without its keyframe.
+        if (!(slot = take_free_slot(cache))) {
+            //  Outputs are still copying every older GOP. Rather than wait for them, this one
+            //  isn't cached.
+            cache->isOverflowed = true;
+            __atomic_store_n(&cache->overflows, cache->overflows + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } else if (!slot || cache->isOverflowed) {
+        //  Nothing to decode it against.
+        return;
+    } else {
+        collect_retired(cache);
+    }
+    if (slot->numEntries == GOP_CACHE_MAX_PACKETS || slot->bytes + size > cache->budgetBytes) {
+        //  Joining from part of a GOP would decode wrong, so keep none of it.
+        gop_cache_clear(cache);
+        cache->isOverflowed = true;
+        __atomic_store_n(&cache->overflows, cache->overflows + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    GopCacheEntry *entry = &slot->entries[slot->numEntries];
+    if (!(entry->buf = av_buffer_ref(buf))) {
+        gop_cache_clear(cache);
+        cache->isOverflowed = true;
+        return;
+    }
+    entry->pts = pts;
+    entry->dts = dts;
+    entry->submitTimeNs = submitTimeNs;
+    entry->size = size;
+    entry->isVideo = isVideo;
+    entry->isKeyFrame = isKeyFrame;
+    slot->bytes += size;
+    //  Readers only look below numEntries, so the entry is complete before they can see it.
+    __atomic_store_n(&slot->numEntries, slot->numEntries + 1, __ATOMIC_RELEASE);
+    if (slot != cache->current) {
+        __atomic_store_n(&cache->current, slot, __ATOMIC_SEQ_CST);
+    }
+    if ((uint64_t) slot->bytes > cache->maxBytes) {
+        __atomic_store_n(&cache->maxBytes, (uint64_t) slot->bytes, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Stop handing out the cached GOP, when the encoder starts a new timeline. Producer only.
+ */
+void gop_cache_clear(GopCache *cache) {
+    GopCacheSlot *slot = cache->current;
+    if (!slot) {
+        return;
+    }
+    __atomic_store_n(&cache->current, NULL, __ATOMIC_SEQ_CST);
+    //  Outputs copying out of it keep it until they're done; the next call that finds it
+    //  unread drops its references.
+    slot->isRetired = true;
+    collect_retired(cache);
+}
+
+/**
+ * Copy the cached GOP into packets (room for GOP_CACHE_MAX_PACKETS), each with a new reference
+ * and nowNs as its submit and enqueue time. Safe from any thread, alongside the producer.
+ * lastSubmitTimeNs is set to when the producer was handed the last packet copied: everything
+ * it queued up to then is in the snapshot or older. Returns how many packets were copied, 0 if
+ * there's no complete GOP to give.
+ */
+int gop_cache_snapshot(GopCache *cache, RingPacket *packets, int64_t nowNs,
+                       int64_t *lastSubmitTimeNs) {
+    GopCacheSlot *slot;
+    for (;;) {
+        if (!(slot = __atomic_load_n(&cache->current, __ATOMIC_SEQ_CST))) {
+            return 0;
+        }
+        __atomic_fetch_add(&slot->readers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&cache->current, __ATOMIC_SEQ_CST) == slot) {
+            break;
+        }
+        //  Retired before we got hold of it, and maybe already refilled; look again.
+        __atomic_fetch_sub(&slot->readers, 1, __ATOMIC_RELEASE);
+    }
+    //  The producer may carry on appending; we copy what was there when we looked.
+    int numEntries = __atomic_load_n(&slot->numEntries, __ATOMIC_ACQUIRE);
+    int numPackets = 0;
+    for (int i = 0; i < numEntries; i++) {
+        GopCacheEntry *entry = &slot->entries[i];
+        RingPacket *packet = &packets[numPackets];
+        if (!(packet->buf = av_buffer_ref(entry->buf))) {
+            //  Stopping short is fine; it's still a GOP from its start.
+            break;
+        }
+        packet->data = packet->buf->data;
+        packet->size = entry->size;
+        packet->pts = entry->pts;
+        packet->dts = entry->dts;
+        packet->isVideo = entry->isVideo;
+        packet->isKeyFrame = entry->isKeyFrame;
+        packet->isConfig = 0;
+        packet->submitTimeNs = nowNs;
+        packet->enqueueTimeNs = nowNs;
+        *lastSubmitTimeNs = entry->submitTimeNs;
+        numPackets++;
+    }
+    __atomic_fetch_sub(&slot->readers, 1, __ATOMIC_RELEASE);
+    if (numPackets) {
+        __atomic_fetch_add(&cache->snapshots, 1, __ATOMIC_RELAXED);
+    }
+    return numPackets;
+}
@@ -0,0 +1,104 @@
+#ifndef GOP_CACHE_H
+#define GOP_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "libavutil/buffer.h"
+#include "PacketRing.h"
+
+//  Payload bytes the cache may hold on to. A GOP bigger than this isn't cached, and outputs
+//  joining during it wait for the next keyframe instead. 0 disables the cache.
+#define DEFAULT_GOP_CACHE_KB 8192
+//  Most packets, audio and video, in one cached GOP: 10 s at 30 fps with AAC alongside.
+#define GOP_CACHE_MAX_PACKETS 1024
+//  GOPs the cache has room for: the one being built, and ones outputs may still be copying.
+#define GOP_CACHE_NUM_SLOTS 3
+
+/**
+ * One cached packet, with its own reference to the payload. Only what's needed to send it
+ * again is kept, so a GOP's worth of entries stays small.
+ */
+typedef struct gop_cache_entry_t {
+    AVBufferRef *buf;
+    int64_t pts;
+    int64_t dts;
+    //  When the producer was handed the packet, which orders it against what's in the rings.
+    int64_t submitTimeNs;
+    int32_t size;
+    uint8_t isVideo;
+    uint8_t isKeyFrame;
+} GopCacheEntry;
+
+/**
+ * One GOP's entries. While it's published the producer only ever appends to it, so the entries
+ * below numEntries don't change under a reader; once it's retired its references are dropped as
+ * soon as no reader is left.
+ */
+typedef struct gop_cache_slot_t {
+    GopCacheEntry *entries;
+    int numEntries;
+    int64_t bytes;
+    //  Outputs copying out of it right now.
+    int readers;
+    //  Written by the producer only.
+    bool isRetired;
+} GopCacheSlot;
+
+/**
+ * The session's newest keyframe and every audio and video packet since, so an output that
+ * (re)joins mid-stream can start from a decodable picture straight away. The SPS/PPS are the
+ * session's config frame, which every output context is built from anyway. The cache belongs to
+ * the producer, which fills a slot and publishes it; outputs take snapshots of the published
+ * slot without a lock, so the producer never waits on one.
+ */
+typedef struct gop_cache_t {
+    GopCacheEntry *entries;
+    GopCacheSlot slots[GOP_CACHE_NUM_SLOTS];
+    //  The slot outputs copy from, or NULL.
+    GopCacheSlot *current;
+    int64_t budgetBytes;
+    //  Set when the current GOP outgrew the budget or the entries, or no slot was free for it;
+    //  cleared by the next keyframe.
+    bool isOverflowed;
+
+    //  Read from anywhere.
+    uint64_t gops;
+    uint64_t overflows;
+    uint64_t snapshots;
+    uint64_t maxBytes;
+} GopCache;
+
+/**
+ * Allocate the entries for a budget in KB (0 disables the cache). Returns 0 or a negative
+ * AVERROR.
+ */
+int gop_cache_init(GopCache *cache, int budgetKb);
+
+/**
+ * Drop every cached reference and free the entries. No output may be taking a snapshot.
+ */
+void gop_cache_uninit(GopCache *cache);
+
+/**
+ * Remember a packet the producer is about to queue. A video keyframe starts a new GOP;
+ * anything else is appended to the current one, if there is one. Producer only.
+ */
+void gop_cache_add(GopCache *cache, AVBufferRef *buf, int size, int64_t pts, int64_t dts,
+                   bool isVideo, bool isKeyFrame, int64_t submitTimeNs);
+
+/**
+ * Stop handing out the cached GOP, when the encoder starts a new timeline. Producer only.
+ */
+void gop_cache_clear(GopCache *cache);
+
+/**
+ * Copy the cached GOP into packets (room for GOP_CACHE_MAX_PACKETS), each with a new reference
+ * and nowNs as its submit and enqueue time. Safe from any thread, alongside the producer.
+ * lastSubmitTimeNs is set to when the producer was handed the last packet copied: everything
+ * it queued up to then is in the snapshot or older. Returns how many packets were copied, 0 if
+ * there's no complete GOP to give.
+ */
+int gop_cache_snapshot(GopCache *cache, RingPacket *packets, int64_t nowNs,
+                       int64_t *lastSubmitTimeNs);
+
+#endif /* GOP_CACHE_H */
@@ -0,0 +1,50 @@
+#ifdef ANDROID
+#include <stddef.h>
+#include <android/log.h>
+#include "JniOnLoad.h"
+#include "FFmpegInit.h"
+
+#define LOG_TAG "FFmpegWrapper"
+#define LOGE(...)  __android_log_print(ANDROID_LOG_ERROR,LOG_TAG,__VA_ARGS__)
+
+/**
+ * Register each method on its own, so a Java class that lacks one of them (an older build) still
+ * gets the rest. Returns how many were registered.
+ */
+int register_methods(JNIEnv *env, jclass clazz, const JNINativeMethod *methods, int numMethods) {
+    int registered = 0;
+    for (int i = 0; i < numMethods; i++) {
+        if ((*env)->RegisterNatives(env, clazz, &methods[i], 1) == JNI_OK) {
+            registered++;
+        } else {
+            (*env)->ExceptionClear(env);
+            LOGE("Couldn't register %s%s.", methods[i].name, methods[i].signature);
+        }
+    }
+    return registered;
+}
+
+/**
+ * Bind every native up front and resolve the IDs we need, so none of the hot paths have to look
+ * anything up by name. FFmpeg is initialized here too, long before the first session needs it.
+ * If the wrapper class isn't visible from here, the library still loads: the natives are then
+ * bound by name on first use, and init() and start() do the rest.
+ */
+JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *vm, void  __unused *reserved) {
+    JNIEnv *env = NULL;
+    if ((*vm)->GetEnv(vm, (void **) &env, JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
+    jclass wrapperClass = (*env)->FindClass(env, WRAPPER_CLASS);
+    if (!wrapperClass) {
+        (*env)->ExceptionClear(env);
+        LOGE("Couldn't find %s, leaving the natives to be looked up by name.", WRAPPER_CLASS);
+        return JNI_VERSION_1_6;
+    }
+    ffmpeg_global_init();
+    register_rtmp_natives(vm, env, wrapperClass);
+    register_muxer_natives(env, wrapperClass);
+    (*env)->DeleteLocalRef(env, wrapperClass);
+    return JNI_VERSION_1_6;
+}
+#endif
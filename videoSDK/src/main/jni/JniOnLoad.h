@@ -0,0 +1,25 @@
+#ifndef JNI_ONLOAD_H
+#define JNI_ONLOAD_H
+
+#include <jni.h>
+
+//  The Java class all our natives belong to.
+#define WRAPPER_CLASS "com/infinitetakes/stream/videoSDK/FFmpegWrapper"
+
+/**
+ * Register each method on its own, so a Java class that lacks one of them (an older build) still
+ * gets the rest. Returns how many were registered.
+ */
+int register_methods(JNIEnv *env, jclass clazz, const JNINativeMethod *methods, int numMethods);
+
+/**
+ * Register the live streaming natives and cache the method IDs they call back into.
+ */
+int register_rtmp_natives(JavaVM *vm, JNIEnv *env, jclass wrapperClass);
+
+/**
+ * Register the stitching natives.
+ */
+int register_muxer_natives(JNIEnv *env, jclass wrapperClass);
+
+#endif /* JNI_ONLOAD_H */
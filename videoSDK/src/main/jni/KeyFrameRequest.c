@@ -0,0 +1,66 @@
+#include <string.h>
+#include "KeyFrameRequest.h"
+
+/**
+ * Set the least interval between requests (0 disables them) and clear the counters.
+ */
+void key_frame_requester_init(KeyFrameRequester *requester, int minIntervalMs) {
+    memset(requester, 0, sizeof(*requester));
+    requester->minIntervalNs = (int64_t) minIntervalMs * 1000000;
+}
+
+/**
+ * Note that a keyframe is needed. Safe from any thread and cheap enough to call on every
+ * packet; a need that's already pending is left as it is.
+ */
+void key_frame_requester_need(KeyFrameRequester *requester, int reason, int64_t nowNs) {
+    if (requester->minIntervalNs <= 0
+        || __atomic_load_n(&requester->pendingSinceNs, __ATOMIC_RELAXED)) {
+        return;
+    }
+    int64_t expected = 0;
+    //  Only the first of several threads needing one at once gets to set the reason.
+    if (__atomic_compare_exchange_n(&requester->pendingSinceNs, &expected, nowNs, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&requester->pendingReason, reason, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&requester->needs[reason], 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Return the reason to ask the encoder for a sync frame now, or -1 if nothing is needed or the
+ * last request was too recent. A need still unanswered after the interval is asked for again.
+ */
+int key_frame_requester_poll(KeyFrameRequester *requester, int64_t nowNs) {
+    int64_t pendingSinceNs = __atomic_load_n(&requester->pendingSinceNs, __ATOMIC_ACQUIRE);
+    if (!pendingSinceNs) {
+        return -1;
+    }
+    if (requester->lastRequestNs && nowNs - requester->lastRequestNs < requester->minIntervalNs) {
+        if (requester->requestedForNs != pendingSinceNs
+            && requester->coalescedForNs != pendingSinceNs) {
+            requester->coalescedForNs = pendingSinceNs;
+            __atomic_store_n(&requester->coalesced, requester->coalesced + 1, __ATOMIC_RELAXED);
+        }
+        return -1;
+    }
+    requester->lastRequestNs = nowNs;
+    requester->requestedForNs = pendingSinceNs;
+    __atomic_store_n(&requester->requests, requester->requests + 1, __ATOMIC_RELAXED);
+    return __atomic_load_n(&requester->pendingReason, __ATOMIC_RELAXED);
+}
+
+/**
+ * Note that the encoder delivered a keyframe, which answers whatever need was pending.
+ */
+void key_frame_requester_on_key_frame(KeyFrameRequester *requester, int64_t nowNs) {
+    if (!__atomic_load_n(&requester->pendingSinceNs, __ATOMIC_RELAXED)) {
+        return;
+    }
+    int64_t pendingSinceNs = __atomic_exchange_n(&requester->pendingSinceNs, 0,
+                                                 __ATOMIC_ACQ_REL);
+    if (pendingSinceNs) {
+        __atomic_store_n(&requester->answered, requester->answered + 1, __ATOMIC_RELAXED);
+        histogram_record(&requester->latency, nowNs - pendingSinceNs);
+    }
+}
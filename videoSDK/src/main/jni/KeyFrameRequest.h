@@ -0,0 +1,68 @@
+#ifndef KEY_FRAME_REQUEST_H
+#define KEY_FRAME_REQUEST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "Stats.h"
+
+//  Least time between two sync frame requests to the encoder. Needs that come up in between
+//  wait for the next request, or are answered by the keyframe already on its way. 0 disables
+//  requests.
+#define DEFAULT_KEY_FRAME_REQUEST_INTERVAL_MS 1000
+
+//  Why a keyframe was needed, passed on to Java.
+#define KEY_FRAME_REASON_START 0
+#define KEY_FRAME_REASON_RECONNECT 1
+#define KEY_FRAME_REASON_QUEUE_FULL 2
+#define KEY_FRAME_REASON_GOP_DROPPED 3
+#define KEY_FRAME_NUM_REASONS 4
+
+/**
+ * Collects the moments the stream needs a keyframe (start, a reconnect with nothing cached, a
+ * GOP broken by a full queue or the drop policy) and turns them into rate-limited requests to
+ * the encoder. Needs are raised from any thread; requests are made and keyframes seen on the
+ * producer thread, which owns everything not marked otherwise.
+ */
+typedef struct key_frame_requester_t {
+    int64_t minIntervalNs;
+    //  When the oldest unanswered need came up, or 0. Set from any thread.
+    int64_t pendingSinceNs;
+    int pendingReason;
+    //  Which need the last request was for, and when it was made.
+    int64_t requestedForNs;
+    int64_t lastRequestNs;
+    int64_t coalescedForNs;
+
+    //  Read from anywhere. needs is also written from any thread.
+    uint64_t needs[KEY_FRAME_NUM_REASONS];
+    uint64_t requests;
+    //  Needs that found the last request too recent and had to wait for the interval.
+    uint64_t coalesced;
+    //  Keyframes that answered a need, and how long after the need they arrived.
+    uint64_t answered;
+    LatencyHistogram latency;
+} KeyFrameRequester;
+
+/**
+ * Set the least interval between requests (0 disables them) and clear the counters.
+ */
+void key_frame_requester_init(KeyFrameRequester *requester, int minIntervalMs);
+
+/**
+ * Note that a keyframe is needed. Safe from any thread and cheap enough to call on every
+ * packet; a need that's already pending is left as it is.
+ */
+void key_frame_requester_need(KeyFrameRequester *requester, int reason, int64_t nowNs);
+
+/**
+ * Return the reason to ask the encoder for a sync frame now, or -1 if nothing is needed or the
+ * last request was too recent. A need still unanswered after the interval is asked for again.
+ */
+int key_frame_requester_poll(KeyFrameRequester *requester, int64_t nowNs);
+
+/**
+ * Note that the encoder delivered a keyframe, which answers whatever need was pending.
+ */
+void key_frame_requester_on_key_frame(KeyFrameRequester *requester, int64_t nowNs);
+
+#endif /* KEY_FRAME_REQUEST_H */
@@ -0,0 +1,276 @@
+#include <string.h>
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+#include "NalUtils.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+static inline uint32_t read_be32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline void write_be32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t) (value >> 24);
+    p[1] = (uint8_t) (value >> 16);
+    p[2] = (uint8_t) (value >> 8);
+    p[3] = (uint8_t) value;
+}
+
+/**
+ * Scalar start code search. Looks at the third byte first: anything above 1 there rules out
+ * a start code at all three positions, so most of the time we move three bytes at once.
+ */
+static const uint8_t *find_start_code_scalar(const uint8_t *p, const uint8_t *end) {
+    while (p + 2 < end) {
+        if (p[2] > 1) {
+            p += 3;
+        } else if (p[1]) {
+            p += 2;
+        } else if (p[0] || p[2] != 1) {
+            p++;
+        } else {
+            return p;
+        }
+    }
+    return end;
+}
+
+/**
+ * Find the next Annex-B start code (00 00 01) at or after p. Returns a pointer to its first byte,
+ * or end if there isn't one. Uses SSE2 or NEON when the target has them.
+ */
+const uint8_t *nal_find_start_code(const uint8_t *p, const uint8_t *end) {
+    //  Test 16 positions at a time: a start code begins at i when bytes i and i+1 are both zero
+    //  and byte i+2 is one, so compare three overlapping loads. Emulation prevention keeps
+    //  00 00 out of slice data, so the vector loop only stops for real start codes.
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    while (p + 18 <= end) {
+        __m128i b0 = _mm_loadu_si128((const __m128i *) p);
+        __m128i b1 = _mm_loadu_si128((const __m128i *) (p + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i *) (p + 2));
+        __m128i match = _mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(b0, b1), zero),
+                                      _mm_cmpeq_epi8(b2, one));
+        int mask = _mm_movemask_epi8(match);
+        if (mask) {
+            return p + __builtin_ctz((unsigned int) mask);
+        }
+        p += 16;
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    while (p + 18 <= end) {
+        uint8x16_t b0 = vld1q_u8(p);
+        uint8x16_t b1 = vld1q_u8(p + 1);
+        uint8x16_t b2 = vld1q_u8(p + 2);
+        uint8x16_t match = vandq_u8(vceqq_u8(vorrq_u8(b0, b1), zero), vceqq_u8(b2, one));
+        uint64x2_t lanes = vreinterpretq_u64_u8(match);
+        if (vgetq_lane_u64(lanes, 0) | vgetq_lane_u64(lanes, 1)) {
+            //  There's no cheap movemask on ARMv7; the scalar search pins it down within these
+            //  16 positions.
+            return find_start_code_scalar(p, p + 18);
+        }
+        p += 16;
+    }
+#endif
+    return find_start_code_scalar(p, end);
+}
+
+/**
+ * Find the next NAL unit of an Annex-B buffer at or after p. Returns its first byte (the NAL
+ * header) and sets *unitEnd to the byte after its last one, or returns NULL if there are no more.
+ * The zero that makes a start code four bytes long isn't counted as part of the previous unit.
+ */
+const uint8_t *nal_next_unit(const uint8_t *p, const uint8_t *end, const uint8_t **unitEnd) {
+    const uint8_t *startCode = nal_find_start_code(p, end);
+    if (startCode + 3 > end) {
+        return NULL;
+    }
+    const uint8_t *unit = startCode + 3;
+    const uint8_t *next = nal_find_start_code(unit, end);
+    if (next < end && next > unit && next[-1] == 0) {
+        next--;
+    }
+    *unitEnd = next;
+    return unit;
+}
+
+/**
+ * Return how many bytes an Annex-B buffer takes once every start code is replaced with a
+ * four-byte length.
+ */
+int nal_avcc_size(const uint8_t *data, int size) {
+    const uint8_t *end = data + size;
+    const uint8_t *unitEnd = data;
+    const uint8_t *unit;
+    int avccSize = 0;
+    while ((unit = nal_next_unit(unitEnd, end, &unitEnd))) {
+        avccSize += 4 + (int) (unitEnd - unit);
+    }
+    return avccSize;
+}
+
+/**
+ * Rewrite an Annex-B buffer into dst as four-byte length-prefixed NAL units (the framing MP4 and
+ * FLV store). dst must hold nal_avcc_size() bytes. Returns the number of bytes written.
+ */
+int nal_annexb_to_avcc(const uint8_t *src, int size, uint8_t *dst) {
+    const uint8_t *end = src + size;
+    const uint8_t *unitEnd = src;
+    const uint8_t *unit;
+    uint8_t *out = dst;
+    while ((unit = nal_next_unit(unitEnd, end, &unitEnd))) {
+        uint32_t length = (uint32_t) (unitEnd - unit);
+        write_be32(out, length);
+        memcpy(out + 4, unit, length);
+        out += 4 + length;
+    }
+    return (int) (out - dst);
+}
+
+/**
+ * Rewrite an Annex-B buffer to length-prefixed form in place. That works when every unit has a
+ * four-byte start code, which is what MediaCodec produces. Returns the size (unchanged), or
+ * AVERROR(EINVAL) if a unit doesn't, in which case the buffer is left part-converted and has to
+ * be converted again from the original with nal_annexb_to_avcc().
+ */
+int nal_annexb_to_avcc_in_place(uint8_t *data, int size) {
+    const uint8_t *end = data + size;
+    const uint8_t *unitEnd = data;
+    const uint8_t *unit;
+    //  Each length has to land exactly on a four-byte start code that directly follows the
+    //  previous unit; a three-byte code has no room for it and extra zeros would be left over.
+    uint8_t *lengthAt = data;
+    while ((unit = nal_next_unit(unitEnd, end, &unitEnd))) {
+        if (unit - 4 != lengthAt) {
+            return AVERROR(EINVAL);
+        }
+        write_be32(lengthAt, (uint32_t) (unitEnd - unit));
+        lengthAt = (uint8_t *) unitEnd;
+    }
+    return lengthAt == end ? size : AVERROR(EINVAL);
+}
+
+/**
+ * Build an avcC (AVCDecoderConfigurationRecord) from an Annex-B buffer holding the SPS and PPS.
+ * out must hold size + NAL_AVCC_RECORD_OVERHEAD bytes. Returns the record's size, or
+ * AVERROR_INVALIDDATA if there isn't a usable SPS and PPS.
+ */
+int nal_build_avcc(const uint8_t *config, int size, uint8_t *out) {
+    const uint8_t *end = config + size;
+    const uint8_t *unitEnd;
+    const uint8_t *unit;
+    const uint8_t *sps = NULL;
+    int numSps = 0, numPps = 0;
+    int written = 6;
+
+    //  SPSs go first, then the PPS count and the PPSs.
+    for (unitEnd = config; (unit = nal_next_unit(unitEnd, end, &unitEnd));) {
+        if (unitEnd - unit < 4 || (unit[0] & 0x1f) != NAL_SPS || numSps == 31) {
+            continue;
+        }
+        if (!sps) {
+            sps = unit;
+        }
+        out[written] = (uint8_t) ((unitEnd - unit) >> 8);
+        out[written + 1] = (uint8_t) (unitEnd - unit);
+        memcpy(out + written + 2, unit, (size_t) (unitEnd - unit));
+        written += 2 + (int) (unitEnd - unit);
+        numSps++;
+    }
+    int numPpsAt = written++;
+    for (unitEnd = config; (unit = nal_next_unit(unitEnd, end, &unitEnd));) {
+        if (unitEnd - unit < 2 || (unit[0] & 0x1f) != NAL_PPS || numPps == 255) {
+            continue;
+        }
+        out[written] = (uint8_t) ((unitEnd - unit) >> 8);
+        out[written + 1] = (uint8_t) (unitEnd - unit);
+        memcpy(out + written + 2, unit, (size_t) (unitEnd - unit));
+        written += 2 + (int) (unitEnd - unit);
+        numPps++;
+    }
+    if (!numSps || !numPps) {
+        return AVERROR_INVALIDDATA;
+    }
+
+    out[0] = 1;
+    //  Profile, compatibility flags and level come straight from the first SPS.
+    out[1] = sps[1];
+    out[2] = sps[2];
+    out[3] = sps[3];
+    //  Six reserved bits, then lengthSizeMinusOne: our units have four-byte lengths.
+    out[4] = 0xff;
+    out[5] = (uint8_t) (0xe0 | numSps);
+    out[numPpsAt] = (uint8_t) numPps;
+    return written;
+}
+
+/**
+ * Unpack the SPSs and PPSs of an avcC record into out as four-byte length-prefixed NAL units,
+ * the way they're carried in-band ahead of a keyframe. out must hold 2 * size bytes. Returns the
+ * number of bytes written, or AVERROR_INVALIDDATA if the record is cut short.
+ */
+int nal_avcc_parameter_sets(const uint8_t *avcC, int size, uint8_t *out) {
+    const uint8_t *p = avcC + 5;
+    const uint8_t *end = avcC + size;
+    int written = 0;
+    //  The SPS count is in the low bits of byte 5; the PPS count is a byte after the SPSs.
+    for (int list = 0; list < 2; list++) {
+        if (p >= end) {
+            return AVERROR_INVALIDDATA;
+        }
+        int count = list == 0 ? *p & 0x1f : *p;
+        p++;
+        for (int i = 0; i < count; i++) {
+            if (end - p < 2 || end - p - 2 < ((p[0] << 8) | p[1])) {
+                return AVERROR_INVALIDDATA;
+            }
+            int length = (p[0] << 8) | p[1];
+            out[written] = 0;
+            out[written + 1] = 0;
+            out[written + 2] = p[0];
+            out[written + 3] = p[1];
+            memcpy(out + written + 4, p + 2, (size_t) length);
+            written += 4 + length;
+            p += 2 + length;
+        }
+    }
+    return written;
+}
+
+/**
+ * Return whether an H.264 access unit is a non-reference picture (nal_ref_idc == 0 on its
+ * slices), in Annex-B or length-prefixed form. Anything we can't parse is treated as a reference
+ * picture.
+ */
+bool nal_is_non_reference(const uint8_t *data, int size, bool isLengthPrefixed) {
+    const uint8_t *end = data + size;
+    const uint8_t *unitEnd = data;
+    const uint8_t *unit;
+    while (true) {
+        if (isLengthPrefixed) {
+            if (unitEnd + 5 > end) {
+                return false;
+            }
+            uint32_t length = read_be32(unitEnd);
+            unit = unitEnd + 4;
+            if (!length || length > (uint32_t) (end - unit)) {
+                return false;
+            }
+            unitEnd = unit + length;
+        } else if (!(unit = nal_next_unit(unitEnd, end, &unitEnd)) || unit == end) {
+            return false;
+        }
+        int type = unit[0] & 0x1f;
+        if (type == NAL_SLICE || type == NAL_IDR_SLICE) {
+            //  All slices of a picture share nal_ref_idc, so the first one decides.
+            return ((unit[0] >> 5) & 0x3) == 0;
+        }
+    }
+}
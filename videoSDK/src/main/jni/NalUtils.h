@@ -0,0 +1,69 @@
+#ifndef NAL_UTILS_H
+#define NAL_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//  H.264 NAL unit types we look at.
+#define NAL_SLICE 1
+#define NAL_IDR_SLICE 5
+#define NAL_SPS 7
+#define NAL_PPS 8
+//  An avcC record is at most this many bytes bigger than the Annex-B SPS/PPS it's built from.
+#define NAL_AVCC_RECORD_OVERHEAD 7
+
+/**
+ * Find the next Annex-B start code (00 00 01) at or after p. Returns a pointer to its first byte,
+ * or end if there isn't one. Uses SSE2 or NEON when the target has them.
+ */
+const uint8_t *nal_find_start_code(const uint8_t *p, const uint8_t *end);
+
+/**
+ * Find the next NAL unit of an Annex-B buffer at or after p. Returns its first byte (the NAL
+ * header) and sets *unitEnd to the byte after its last one, or returns NULL if there are no more.
+ * The zero that makes a start code four bytes long isn't counted as part of the previous unit.
+ */
+const uint8_t *nal_next_unit(const uint8_t *p, const uint8_t *end, const uint8_t **unitEnd);
+
+/**
+ * Return how many bytes an Annex-B buffer takes once every start code is replaced with a
+ * four-byte length.
+ */
+int nal_avcc_size(const uint8_t *data, int size);
+
+/**
+ * Rewrite an Annex-B buffer into dst as four-byte length-prefixed NAL units (the framing MP4 and
+ * FLV store). dst must hold nal_avcc_size() bytes. Returns the number of bytes written.
+ */
+int nal_annexb_to_avcc(const uint8_t *src, int size, uint8_t *dst);
+
+/**
+ * Rewrite an Annex-B buffer to length-prefixed form in place. That works when every unit has a
+ * four-byte start code, which is what MediaCodec produces. Returns the size (unchanged), or
+ * AVERROR(EINVAL) if a unit doesn't, in which case the buffer is left part-converted and has to
+ * be converted again from the original with nal_annexb_to_avcc().
+ */
+int nal_annexb_to_avcc_in_place(uint8_t *data, int size);
+
+/**
+ * Build an avcC (AVCDecoderConfigurationRecord) from an Annex-B buffer holding the SPS and PPS.
+ * out must hold size + NAL_AVCC_RECORD_OVERHEAD bytes. Returns the record's size, or
+ * AVERROR_INVALIDDATA if there isn't a usable SPS and PPS.
+ */
+int nal_build_avcc(const uint8_t *config, int size, uint8_t *out);
+
+/**
+ * Unpack the SPSs and PPSs of an avcC record into out as four-byte length-prefixed NAL units,
+ * the way they're carried in-band ahead of a keyframe. out must hold 2 * size bytes. Returns the
+ * number of bytes written, or AVERROR_INVALIDDATA if the record is cut short.
+ */
+int nal_avcc_parameter_sets(const uint8_t *avcC, int size, uint8_t *out);
+
+/**
+ * Return whether an H.264 access unit is a non-reference picture (nal_ref_idc == 0 on its
+ * slices), in Annex-B or length-prefixed form. Anything we can't parse is treated as a reference
+ * picture.
+ */
+bool nal_is_non_reference(const uint8_t *data, int size, bool isLengthPrefixed);
+
+#endif /* NAL_UTILS_H */
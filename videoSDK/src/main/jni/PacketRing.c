@@ -0,0 +1,156 @@
+#include <string.h>
+#include "libavutil/error.h"
+#include "libavutil/mem.h"
+#include "Clock.h"
+#include "PacketRing.h"
+
+#define LOAD_ACQUIRE(ptr)           __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define LOAD_RELAXED(ptr)           __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define STORE_RELEASE(ptr, value)   __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+#define STORE_RELAXED(ptr, value)   __atomic_store_n(ptr, value, __ATOMIC_RELAXED)
+
+/**
+ * Allocate the slots. The slot count must be a power of two.
+ * Returns 0 on success or a negative AVERROR.
+ */
+int packet_ring_init(PacketRing *ring, uint32_t numSlots) {
+    memset(ring, 0, sizeof(PacketRing));
+    if (!numSlots || (numSlots & (numSlots - 1))) {
+        return AVERROR(EINVAL);
+    }
+    ring->slots = av_mallocz(sizeof(RingPacket) * numSlots);
+    if (!ring->slots) {
+        return AVERROR(ENOMEM);
+    }
+    ring->numSlots = numSlots;
+    return 0;
+}
+
+/**
+ * Release the memory held by the ring, including any queued references. Neither side may be
+ * using it anymore.
+ */
+void packet_ring_free(PacketRing *ring) {
+    if (ring->slots) {
+        packet_ring_clear(ring);
+    }
+    av_freep(&ring->slots);
+    ring->numSlots = 0;
+}
+
+/**
+ * Producer side: publish a packet whose payload is held by buf. On success the ring takes over
+ * the reference and 0 is returned. If the ring is full (or buf is NULL) the packet is counted as
+ * dropped, a negative AVERROR is returned and the caller keeps the reference.
+ */
+int packet_ring_push(PacketRing *ring, AVBufferRef *buf, int size, int64_t pts, int64_t dts,
+                     int isVideo, int isKeyFrame, int isConfig, int64_t submitTimeNs) {
+    int64_t startNs = clock_now_ns();
+    uint32_t head = ring->head;
+
+    if (!buf) {
+        STORE_RELAXED(&ring->dropped, ring->dropped + 1);
+        return AVERROR(ENOMEM);
+    }
+    //  Only go back to the consumer's index when the cached copy says we're full.
+    if (head - ring->cachedTail >= ring->numSlots) {
+        ring->cachedTail = LOAD_ACQUIRE(&ring->tail);
+        if (head - ring->cachedTail >= ring->numSlots) {
+            STORE_RELAXED(&ring->dropped, ring->dropped + 1);
+            return AVERROR(EAGAIN);
+        }
+    }
+
+    RingPacket *slot = &ring->slots[head & (ring->numSlots - 1)];
+    slot->buf = buf;
+    slot->data = buf->data;
+    slot->size = size;
+    slot->pts = pts;
+    slot->dts = dts;
+    slot->isVideo = isVideo;
+    slot->isKeyFrame = isKeyFrame;
+    slot->isConfig = isConfig;
+    slot->submitTimeNs = submitTimeNs;
+    slot->enqueueTimeNs = clock_now_ns();
+    //  Publishing the head makes the slot visible to the consumer.
+    STORE_RELEASE(&ring->head, head + 1);
+
+    uint32_t depth = head + 1 - ring->cachedTail;
+    if (depth > ring->maxDepth) {
+        STORE_RELAXED(&ring->maxDepth, depth);
+    }
+    uint64_t elapsedNs = (uint64_t) (slot->enqueueTimeNs - startNs);
+    STORE_RELAXED(&ring->pushed, ring->pushed + 1);
+    STORE_RELAXED(&ring->enqueueNsTotal, ring->enqueueNsTotal + elapsedNs);
+    if (elapsedNs > ring->enqueueNsMax) {
+        STORE_RELAXED(&ring->enqueueNsMax, elapsedNs);
+    }
+    return 0;
+}
+
+/**
+ * Consumer side: return the oldest packet without removing it, or NULL if the ring is empty.
+ */
+RingPacket *packet_ring_peek(PacketRing *ring) {
+    uint32_t tail = ring->tail;
+    if (tail == LOAD_ACQUIRE(&ring->head)) {
+        return NULL;
+    }
+    return &ring->slots[tail & (ring->numSlots - 1)];
+}
+
+/**
+ * Consumer side: return the most recently published packet, or NULL if the ring is empty.
+ * Together with packet_ring_peek() this gives the span of media currently queued.
+ */
+RingPacket *packet_ring_peek_newest(PacketRing *ring) {
+    uint32_t head = LOAD_ACQUIRE(&ring->head);
+    if (ring->tail == head) {
+        return NULL;
+    }
+    return &ring->slots[(head - 1) & (ring->numSlots - 1)];
+}
+
+/**
+ * Consumer side: release the packet returned by packet_ring_peek() and its buffer reference.
+ */
+void packet_ring_pop(PacketRing *ring) {
+    uint32_t tail = ring->tail;
+    RingPacket *slot = &ring->slots[tail & (ring->numSlots - 1)];
+    uint64_t queuedNs = (uint64_t) (clock_now_ns() - slot->enqueueTimeNs);
+
+    STORE_RELAXED(&ring->popped, ring->popped + 1);
+    STORE_RELAXED(&ring->queueNsTotal, ring->queueNsTotal + queuedNs);
+    if (queuedNs > ring->queueNsMax) {
+        STORE_RELAXED(&ring->queueNsMax, queuedNs);
+    }
+    //  The buffer is freed here once the last ring holding it lets go.
+    av_buffer_unref(&slot->buf);
+    STORE_RELEASE(&ring->tail, tail + 1);
+}
+
+/**
+ * Consumer side: drop everything currently queued.
+ */
+void packet_ring_clear(PacketRing *ring) {
+    while (packet_ring_peek(ring)) {
+        packet_ring_pop(ring);
+    }
+}
+
+/**
+ * Read the counters. Safe to call from any thread; the values are only loosely consistent.
+ */
+void packet_ring_get_stats(PacketRing *ring, PacketRingStats *stats) {
+    uint32_t head = LOAD_ACQUIRE(&ring->head);
+    uint32_t tail = LOAD_ACQUIRE(&ring->tail);
+    stats->depth = head - tail;
+    stats->maxDepth = LOAD_RELAXED(&ring->maxDepth);
+    stats->pushed = LOAD_RELAXED(&ring->pushed);
+    stats->popped = LOAD_RELAXED(&ring->popped);
+    stats->dropped = LOAD_RELAXED(&ring->dropped);
+    stats->enqueueNsTotal = LOAD_RELAXED(&ring->enqueueNsTotal);
+    stats->enqueueNsMax = LOAD_RELAXED(&ring->enqueueNsMax);
+    stats->queueNsTotal = LOAD_RELAXED(&ring->queueNsTotal);
+    stats->queueNsMax = LOAD_RELAXED(&ring->queueNsMax);
+}
@@ -0,0 +1,120 @@
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "libavutil/buffer.h"
+
+//  Keep the producer and consumer indexes on separate cache lines so they don't ping-pong.
+#define RING_CACHE_LINE 64
+
+/**
+ * One encoded packet sitting in the ring. The slot holds its own reference to the payload, so
+ * the same buffer can sit in several rings at once without being copied.
+ */
+typedef struct ring_packet_t {
+    AVBufferRef *buf;
+    uint8_t *data;
+    int size;
+    //  Presentation time in Android (microsecond) units.
+    int64_t pts;
+    //  Decode time in the same units; no later than pts, and increasing within each stream.
+    int64_t dts;
+    int isVideo;
+    int isKeyFrame;
+    //  New parameter sets (an avcC) to switch to, rather than media.
+    int isConfig;
+    //  Time the packet was handed to us over JNI, for end-to-end latency.
+    int64_t submitTimeNs;
+    //  Time the producer pushed the packet, used to measure time spent in the queue.
+    int64_t enqueueTimeNs;
+} RingPacket;
+
+/**
+ * Snapshot of the ring counters. All latencies are in nanoseconds.
+ */
+typedef struct packet_ring_stats_t {
+    uint32_t depth;
+    uint32_t maxDepth;
+    uint64_t pushed;
+    uint64_t popped;
+    uint64_t dropped;
+    uint64_t enqueueNsTotal;
+    uint64_t enqueueNsMax;
+    uint64_t queueNsTotal;
+    uint64_t queueNsMax;
+} PacketRingStats;
+
+/**
+ * Single-producer/single-consumer ring of packets. The producer (the MediaCodec drain thread)
+ * hands over a buffer reference and publishes a descriptor. The consumer (a sender thread)
+ * reads descriptors in order and drops its reference once the packet is written.
+ * Neither side takes a lock or makes a syscall.
+ */
+typedef struct packet_ring_t {
+    RingPacket *slots;
+    uint32_t numSlots;
+
+    //  Written by the producer only.
+    uint32_t head __attribute__((aligned(RING_CACHE_LINE)));
+    uint32_t cachedTail;
+    uint32_t maxDepth;
+    uint64_t pushed;
+    uint64_t dropped;
+    uint64_t enqueueNsTotal;
+    uint64_t enqueueNsMax;
+
+    //  Written by the consumer only.
+    uint32_t tail __attribute__((aligned(RING_CACHE_LINE)));
+    uint64_t popped;
+    uint64_t queueNsTotal;
+    uint64_t queueNsMax;
+} PacketRing;
+
+/**
+ * Allocate the slots. The slot count must be a power of two.
+ * Returns 0 on success or a negative AVERROR.
+ */
+int packet_ring_init(PacketRing *ring, uint32_t numSlots);
+
+/**
+ * Release the memory held by the ring, including any queued references. Neither side may be
+ * using it anymore.
+ */
+void packet_ring_free(PacketRing *ring);
+
+/**
+ * Producer side: publish a packet whose payload is held by buf. On success the ring takes over
+ * the reference and 0 is returned. If the ring is full (or buf is NULL) the packet is counted as
+ * dropped, a negative AVERROR is returned and the caller keeps the reference.
+ */
+int packet_ring_push(PacketRing *ring, AVBufferRef *buf, int size, int64_t pts, int64_t dts,
+                     int isVideo, int isKeyFrame, int isConfig, int64_t submitTimeNs);
+
+/**
+ * Consumer side: return the oldest packet without removing it, or NULL if the ring is empty.
+ */
+RingPacket *packet_ring_peek(PacketRing *ring);
+
+/**
+ * Consumer side: return the most recently published packet, or NULL if the ring is empty.
+ * Together with packet_ring_peek() this gives the span of media currently queued.
+ */
+RingPacket *packet_ring_peek_newest(PacketRing *ring);
+
+/**
+ * Consumer side: release the packet returned by packet_ring_peek() and its buffer reference.
+ */
+void packet_ring_pop(PacketRing *ring);
+
+/**
+ * Consumer side: drop everything currently queued.
+ */
+void packet_ring_clear(PacketRing *ring);
+
+/**
+ * Read the counters. Safe to call from any thread; the values are only loosely consistent.
+ */
+void packet_ring_get_stats(PacketRing *ring, PacketRingStats *stats);
+
+#endif /* PACKET_RING_H */
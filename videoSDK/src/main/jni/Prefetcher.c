@@ -0,0 +1,261 @@
+#include <string.h>
+#include "Clock.h"
+#include "Trace.h"
+#include "Prefetcher.h"
+
+/**
+ * Put an emptied queue entry on the free list. The caller holds the lock.
+ */
+static void put_entry(Prefetcher *prefetcher, AVPacketList *entry) {
+    entry->next = prefetcher->freeEntries;
+    prefetcher->freeEntries = entry;
+}
+
+/**
+ * Free input's queued packets. The caller holds the lock.
+ */
+static void drain_input(Prefetcher *prefetcher, PrefetchInput *input) {
+    while (input->head) {
+        AVPacketList *entry = input->head;
+        input->head = entry->next;
+        prefetcher->bytes -= entry->pkt.size;
+        av_packet_unref(&entry->pkt);
+        put_entry(prefetcher, entry);
+    }
+    input->tail = NULL;
+}
+
+/**
+ * Pick the input to read from next: the first pair with anything left to read, and within it
+ * the input that's furthest behind. Returns -1 when everything is read. The caller holds the
+ * lock.
+ */
+static int next_input(Prefetcher *prefetcher) {
+    for (int i = 0; i < prefetcher->numInputs; i += 2) {
+        int best = -1;
+        for (int j = i; j < i + 2 && j < prefetcher->numInputs; j++) {
+            PrefetchInput *input = &prefetcher->inputs[j];
+            if (input->isEOF || input->isDone) {
+                continue;
+            }
+            if (best < 0 || input->lastReadMs < prefetcher->inputs[best].lastReadMs) {
+                best = j;
+            }
+        }
+        if (best >= 0) {
+            return best;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Reader thread: read the inputs in order until they're all read or we're stopped.
+ */
+static void *prefetch_loop(void *arg) {
+    Prefetcher *prefetcher = arg;
+    AVPacket packet;
+    av_init_packet(&packet);
+    pthread_mutex_lock(&prefetcher->lock);
+    while (!prefetcher->isStopRequested) {
+        int index = next_input(prefetcher);
+        if (index < 0) {
+            break;
+        }
+        //  Past the budget only the writer waiting on an empty queue gets us reading again.
+        if (prefetcher->bytes >= prefetcher->budgetBytes && !prefetcher->isWriterWaiting) {
+            int64_t startNs = clock_now_ns();
+            pthread_cond_wait(&prefetcher->readCond, &prefetcher->lock);
+            prefetcher->readerWaitNs += clock_now_ns() - startNs;
+            continue;
+        }
+        PrefetchInput *input = &prefetcher->inputs[index];
+        prefetcher->readingInput = index;
+        AVPacketList *entry = prefetcher->freeEntries;
+        if (entry) {
+            prefetcher->freeEntries = entry->next;
+            entry->next = NULL;
+        }
+        pthread_mutex_unlock(&prefetcher->lock);
+
+        int ret = AVERROR_EOF;
+        if (input->format) {
+            AVStream *stream = input->format->streams[0];
+            int traceStream = stream->codec->codec_type == AVMEDIA_TYPE_VIDEO
+                              ? TRACE_STREAM_VIDEO : TRACE_STREAM_AUDIO;
+            if (!entry) {
+                entry = av_mallocz(sizeof(AVPacketList));
+            }
+            //  The demuxer's reference goes straight into the queue entry.
+            TRACE_BEGIN(TRACE_MUX_READ, traceStream, 0, 0);
+            ret = entry ? av_read_frame(input->format, &entry->pkt) : AVERROR(ENOMEM);
+            TRACE_END(TRACE_MUX_READ, traceStream, entry ? entry->pkt.pts : 0,
+                      entry ? entry->pkt.size : 0);
+            //  Queued packets have to own their data; only a demuxer that kept it costs a copy.
+            if (ret >= 0 && !entry->pkt.buf) {
+                ret = av_packet_ref(&packet, &entry->pkt);
+                av_packet_unref(&entry->pkt);
+                if (ret >= 0) {
+                    av_packet_move_ref(&entry->pkt, &packet);
+                }
+            }
+            if (ret >= 0 && entry->pkt.pts != AV_NOPTS_VALUE) {
+                input->lastReadMs = av_rescale_q(entry->pkt.pts, stream->time_base,
+                                                 (AVRational) {1, 1000});
+            }
+        }
+
+        if (entry && ret < 0) {
+            av_packet_unref(&entry->pkt);
+        }
+        pthread_mutex_lock(&prefetcher->lock);
+        prefetcher->readingInput = -1;
+        if (entry && ret < 0) {
+            put_entry(prefetcher, entry);
+            entry = NULL;
+        }
+        if (entry) {
+            if (input->tail) {
+                input->tail->next = entry;
+            } else {
+                input->head = entry;
+            }
+            input->tail = entry;
+            prefetcher->bytes += entry->pkt.size;
+            prefetcher->bytesRead += entry->pkt.size;
+            prefetcher->maxBytes = FFMAX(prefetcher->maxBytes, prefetcher->bytes);
+            if (input->isDone) {
+                drain_input(prefetcher, input);
+            }
+        } else {
+            input->isEOF = true;
+            input->error = ret == AVERROR_EOF ? 0 : ret;
+        }
+        pthread_cond_broadcast(&prefetcher->writeCond);
+    }
+    prefetcher->readingInput = -1;
+    pthread_cond_broadcast(&prefetcher->writeCond);
+    pthread_mutex_unlock(&prefetcher->lock);
+    return NULL;
+}
+
+/**
+ * Take over reading formats (NULL entries are treated as empty inputs) and start the reader
+ * thread. The formats stay the caller's to close, after prefetcher_finish() or _stop().
+ * Returns 0 or a negative AVERROR.
+ */
+int prefetcher_start(Prefetcher *prefetcher, AVFormatContext *formats[], int numFormats,
+                     int64_t budgetBytes) {
+    memset(prefetcher, 0, sizeof(*prefetcher));
+    prefetcher->readingInput = -1;
+    prefetcher->budgetBytes = budgetBytes;
+    if (numFormats > 0
+        && !(prefetcher->inputs = av_mallocz_array((size_t) numFormats, sizeof(PrefetchInput)))) {
+        return AVERROR(ENOMEM);
+    }
+    prefetcher->numInputs = numFormats;
+    for (int i = 0; i < numFormats; i++) {
+        prefetcher->inputs[i].format = formats[i];
+    }
+    pthread_mutex_init(&prefetcher->lock, NULL);
+    pthread_cond_init(&prefetcher->readCond, NULL);
+    pthread_cond_init(&prefetcher->writeCond, NULL);
+    prefetcher->isInitialized = true;
+    if (pthread_create(&prefetcher->thread, NULL, prefetch_loop, prefetcher) != 0) {
+        prefetcher_stop(prefetcher);
+        return AVERROR(EAGAIN);
+    }
+    prefetcher->isThreadStarted = true;
+    return 0;
+}
+
+/**
+ * Writer side: move the next packet of input index into packet, waiting for the reader if need
+ * be.
+ * Returns 0, AVERROR_EOF at the end of the input, or the error reading it failed with.
+ */
+int prefetcher_read(Prefetcher *prefetcher, int index, AVPacket *packet) {
+    PrefetchInput *input = &prefetcher->inputs[index];
+    int ret = 0;
+    pthread_mutex_lock(&prefetcher->lock);
+    if (!input->head && !input->isEOF) {
+        int64_t startNs = clock_now_ns();
+        TRACE_BEGIN(TRACE_MUX_WAIT, TRACE_STREAM_NONE, index, 0);
+        prefetcher->isWriterWaiting = true;
+        pthread_cond_signal(&prefetcher->readCond);
+        while (!input->head && !input->isEOF) {
+            pthread_cond_wait(&prefetcher->writeCond, &prefetcher->lock);
+        }
+        prefetcher->isWriterWaiting = false;
+        prefetcher->writerWaitNs += clock_now_ns() - startNs;
+        TRACE_END(TRACE_MUX_WAIT, TRACE_STREAM_NONE, index, 0);
+    }
+    AVPacketList *entry = input->head;
+    if (entry) {
+        input->head = entry->next;
+        if (!input->head) {
+            input->tail = NULL;
+        }
+        prefetcher->bytes -= entry->pkt.size;
+        av_packet_move_ref(packet, &entry->pkt);
+        put_entry(prefetcher, entry);
+        //  There's room for the reader again.
+        pthread_cond_signal(&prefetcher->readCond);
+    } else {
+        ret = input->error < 0 ? input->error : AVERROR_EOF;
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    return ret;
+}
+
+/**
+ * Writer side: drop whatever is left of input index and make sure the reader is done with it,
+ * so its format can be closed.
+ */
+void prefetcher_finish(Prefetcher *prefetcher, int index) {
+    if (index < 0 || index >= prefetcher->numInputs) {
+        return;
+    }
+    PrefetchInput *input = &prefetcher->inputs[index];
+    pthread_mutex_lock(&prefetcher->lock);
+    input->isDone = true;
+    drain_input(prefetcher, input);
+    while (prefetcher->readingInput == index) {
+        pthread_cond_wait(&prefetcher->writeCond, &prefetcher->lock);
+    }
+    input->format = NULL;
+    pthread_cond_signal(&prefetcher->readCond);
+    pthread_mutex_unlock(&prefetcher->lock);
+}
+
+/**
+ * Stop the reader thread and free every queued packet. Safe after a failed start too.
+ */
+void prefetcher_stop(Prefetcher *prefetcher) {
+    if (!prefetcher->isInitialized) {
+        av_freep(&prefetcher->inputs);
+        return;
+    }
+    pthread_mutex_lock(&prefetcher->lock);
+    prefetcher->isStopRequested = true;
+    pthread_cond_signal(&prefetcher->readCond);
+    pthread_mutex_unlock(&prefetcher->lock);
+    if (prefetcher->isThreadStarted) {
+        pthread_join(prefetcher->thread, NULL);
+        prefetcher->isThreadStarted = false;
+    }
+    for (int i = 0; i < prefetcher->numInputs; i++) {
+        drain_input(prefetcher, &prefetcher->inputs[i]);
+    }
+    while (prefetcher->freeEntries) {
+        AVPacketList *entry = prefetcher->freeEntries;
+        prefetcher->freeEntries = entry->next;
+        av_free(entry);
+    }
+    av_freep(&prefetcher->inputs);
+    prefetcher->numInputs = 0;
+    pthread_mutex_destroy(&prefetcher->lock);
+    pthread_cond_destroy(&prefetcher->readCond);
+    pthread_cond_destroy(&prefetcher->writeCond);
+    prefetcher->isInitialized = false;
+}
@@ -0,0 +1,88 @@
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "libavformat/avformat.h"
+
+//  Demuxed packets held ahead of the writer, across every input. Enough to cover opening the
+//  next clip pair and a seek or two without reading the whole session into memory.
+#define PREFETCH_BUDGET_BYTES (16 * 1024 * 1024)
+
+/**
+ * One input's queue of packets read ahead of the writer.
+ */
+typedef struct prefetch_input_t {
+    AVFormatContext *format;
+    AVPacketList *head;
+    AVPacketList *tail;
+    //  How far into the input the reader is, for keeping a pair's two inputs level.
+    int64_t lastReadMs;
+    //  Read to the end (or failed with error); whatever's queued is all there is.
+    bool isEOF;
+    int error;
+    //  The writer is finished with it; the reader leaves it alone.
+    bool isDone;
+} PrefetchInput;
+
+/**
+ * Reads the stitch inputs on its own thread, pair by pair in stitch order, into queues the
+ * writer takes packets from. Within a pair the reader keeps the two inputs level in time, since
+ * the writer interleaves them; once both are read it moves on to the next pair, so opening and
+ * reading it overlaps with writing the current one. Reading pauses once the queues hold the
+ * budget, unless the writer is waiting on an empty one.
+ */
+typedef struct prefetcher_t {
+    bool isInitialized;
+    pthread_t thread;
+    bool isThreadStarted;
+    pthread_mutex_t lock;
+    pthread_cond_t readCond;
+    pthread_cond_t writeCond;
+    PrefetchInput *inputs;
+    int numInputs;
+    //  Queue entries the writer is done with, kept for the reader to fill again rather than
+    //  allocating one per packet.
+    AVPacketList *freeEntries;
+    int64_t bytes;
+    int64_t budgetBytes;
+    //  The input a read is in progress on, -1 for none, so finishing one can wait it out.
+    int readingInput;
+    bool isWriterWaiting;
+    bool isStopRequested;
+
+    //  Totals, once stopped.
+    int64_t bytesRead;
+    int64_t maxBytes;
+    int64_t writerWaitNs;
+    int64_t readerWaitNs;
+} Prefetcher;
+
+/**
+ * Take over reading formats (NULL entries are treated as empty inputs) and start the reader
+ * thread. The formats stay the caller's to close, after prefetcher_finish() or _stop().
+ * Returns 0 or a negative AVERROR.
+ */
+int prefetcher_start(Prefetcher *prefetcher, AVFormatContext *formats[], int numFormats,
+                     int64_t budgetBytes);
+
+/**
+ * Writer side: move the next packet of input index into packet, waiting for the reader if need
+ * be.
+ * Returns 0, AVERROR_EOF at the end of the input, or the error reading it failed with.
+ */
+int prefetcher_read(Prefetcher *prefetcher, int index, AVPacket *packet);
+
+/**
+ * Writer side: drop whatever is left of input index and make sure the reader is done with it,
+ * so its format can be closed.
+ */
+void prefetcher_finish(Prefetcher *prefetcher, int index);
+
+/**
+ * Stop the reader thread and free every queued packet. Safe after a failed start too.
+ */
+void prefetcher_stop(Prefetcher *prefetcher);
+
+#endif /* PREFETCHER_H */
@@ -0,0 +1,113 @@
+#include <string.h>
+#include <unistd.h>
+#include "Clock.h"
+#include "Trace.h"
+#include "ProbePool.h"
+
+/**
+ * Open and probe one input, timing it. Probing is skipped when the clip's sidecar is current,
+ * and the sidecar is (re)written when it wasn't.
+ */
+static void probe_input(ProbedInput *input, int index) {
+    int64_t startNs = clock_now_ns();
+    TRACE_BEGIN(TRACE_PROBE, TRACE_STREAM_NONE, index, 0);
+    input->isIndexHit = clip_index_load(&input->index, input->path) >= 0;
+    input->result = avformat_open_input(&input->format, input->path, NULL, NULL);
+    if (input->result >= 0 && input->isIndexHit
+        && clip_index_apply(&input->index, input->format) < 0) {
+        clip_index_release(&input->index);
+        input->isIndexHit = false;
+    }
+    if (input->result >= 0 && !input->isIndexHit) {
+        input->result = avformat_find_stream_info(input->format, NULL);
+        if (input->result >= 0 && input->format->nb_streams
+            && clip_index_build(&input->index, input->path, input->format) >= 0) {
+            //  If it can't be saved, the clip is just probed again next time.
+            clip_index_save(&input->index, input->path);
+            input->hasIndex = true;
+        }
+    }
+    input->hasIndex |= input->isIndexHit;
+    if (input->result >= 0 && !input->format->nb_streams) {
+        input->result = AVERROR_STREAM_NOT_FOUND;
+    }
+    if (input->result < 0) {
+        avformat_close_input(&input->format);
+    }
+    TRACE_END(TRACE_PROBE, TRACE_STREAM_NONE, index, input->result);
+    input->probeNs = clock_now_ns() - startNs;
+}
+
+/**
+ * Worker: claim inputs one at a time until there are none left.
+ */
+static void *probe_loop(void *arg) {
+    ProbePool *pool = arg;
+    int index;
+    while ((index = __atomic_fetch_add(&pool->nextInput, 1, __ATOMIC_RELAXED))
+           < pool->numInputs) {
+        probe_input(&pool->inputs[index], index);
+    }
+    return NULL;
+}
+
+/**
+ * Open and probe every file in files on up to maxThreads threads (0 picks from the CPU count),
+ * including the calling one, and wait for them all. Files that fail are left with a NULL format
+ * and their error in result. Returns 0, or a negative AVERROR if the pool couldn't be set up.
+ */
+int probe_pool_run(ProbePool *pool, int numFiles, char *files[], int maxThreads) {
+    memset(pool, 0, sizeof(*pool));
+    if (numFiles <= 0) {
+        return 0;
+    }
+    if (!(pool->inputs = av_mallocz_array((size_t) numFiles, sizeof(ProbedInput)))) {
+        return AVERROR(ENOMEM);
+    }
+    pool->numInputs = numFiles;
+    for (int i = 0; i < numFiles; i++) {
+        pool->inputs[i].path = files[i];
+    }
+    if (maxThreads <= 0) {
+        maxThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    maxThreads = FFMIN(FFMIN(maxThreads, numFiles), PROBE_POOL_MAX_THREADS);
+
+    int64_t startNs = clock_now_ns();
+    //  The calling thread is one of the workers, so a failed thread start only costs overlap.
+    for (int i = 1; i < maxThreads; i++) {
+        if (pthread_create(&pool->threads[pool->numThreads], NULL, probe_loop, pool) == 0) {
+            pool->numThreads++;
+        }
+    }
+    probe_loop(pool);
+    for (int i = 0; i < pool->numThreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool->wallNs = clock_now_ns() - startNs;
+    return 0;
+}
+
+/**
+ * Hand over input index's context; the caller releases it. NULL if it didn't open or was taken.
+ */
+AVFormatContext *probe_pool_take(ProbePool *pool, int index) {
+    if (index < 0 || index >= pool->numInputs) {
+        return NULL;
+    }
+    AVFormatContext *format = pool->inputs[index].format;
+    pool->inputs[index].format = NULL;
+    return format;
+}
+
+/**
+ * Close whatever inputs weren't taken and free the pool's memory.
+ */
+void probe_pool_release(ProbePool *pool) {
+    for (int i = 0; i < pool->numInputs; i++) {
+        avformat_close_input(&pool->inputs[i].format);
+        clip_index_release(&pool->inputs[i].index);
+    }
+    av_freep(&pool->inputs);
+    pool->numInputs = 0;
+}
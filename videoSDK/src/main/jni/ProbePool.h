@@ -0,0 +1,64 @@
+#ifndef PROBE_POOL_H
+#define PROBE_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include "libavformat/avformat.h"
+#include "ClipIndex.h"
+
+//  Most threads that open inputs at once. Probing is mostly waiting on storage, so a few
+//  overlap well, and more just compete for the same flash.
+#define PROBE_POOL_MAX_THREADS 4
+
+/**
+ * One input file, opened and probed, waiting to be stitched.
+ */
+typedef struct probed_input_t {
+    const char *path;
+    //  NULL if it couldn't be opened; result says why.
+    AVFormatContext *format;
+    int result;
+    //  Time spent opening and probing this file alone.
+    int64_t probeNs;
+    //  The clip's sidecar, loaded (a hit, so probing was skipped) or built from the probe.
+    ClipIndex index;
+    bool hasIndex;
+    bool isIndexHit;
+} ProbedInput;
+
+/**
+ * Opens and probes a list of files on a small pool of threads, each taking the next unclaimed
+ * file until none are left. The contexts stay open for whoever stitches them, so no file is
+ * opened twice. A clip with a current sidecar index is only opened, not probed; one without gets
+ * its sidecar written for next time.
+ */
+typedef struct probe_pool_t {
+    ProbedInput *inputs;
+    int numInputs;
+    //  Index of the next unclaimed input, shared by the workers.
+    int nextInput;
+    int numThreads;
+    pthread_t threads[PROBE_POOL_MAX_THREADS];
+    //  Time from the first open to the last probe finishing.
+    int64_t wallNs;
+} ProbePool;
+
+/**
+ * Open and probe every file in files on up to maxThreads threads (0 picks from the CPU count),
+ * including the calling one, and wait for them all. Files that fail are left with a NULL format
+ * and their error in result. Returns 0, or a negative AVERROR if the pool couldn't be set up.
+ */
+int probe_pool_run(ProbePool *pool, int numFiles, char *files[], int maxThreads);
+
+/**
+ * Hand over input index's context; the caller releases it. NULL if it didn't open or was taken.
+ */
+AVFormatContext *probe_pool_take(ProbePool *pool, int index);
+
+/**
+ * Close whatever inputs weren't taken and free the pool's memory.
+ */
+void probe_pool_release(ProbePool *pool);
+
+#endif /* PROBE_POOL_H */
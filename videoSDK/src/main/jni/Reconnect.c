@@ -0,0 +1,56 @@
+#include "Reconnect.h"
+
+/**
+ * Set up the backoff (delays in ms) and clear the counters. seed only has to differ between
+ * destinations.
+ */
+void reconnect_policy_init(ReconnectPolicy *policy, int initialDelayMs, int maxDelayMs,
+                           int maxAttempts, uint32_t seed) {
+    policy->initialDelayNs = (int64_t) initialDelayMs * 1000000;
+    policy->maxDelayNs = (int64_t) maxDelayMs * 1000000;
+    if (policy->maxDelayNs < policy->initialDelayNs) {
+        policy->maxDelayNs = policy->initialDelayNs;
+    }
+    policy->maxAttempts = maxAttempts;
+    policy->attempt = 0;
+    //  xorshift gets stuck on zero.
+    policy->seed = seed ? seed : 1;
+    policy->reconnects = 0;
+}
+
+/**
+ * Start the next attempt of the current outage and return how long to wait before it, in ns.
+ * Returns -1 once the attempts are used up.
+ */
+int64_t reconnect_policy_next_delay_ns(ReconnectPolicy *policy) {
+    if (policy->attempt >= policy->maxAttempts) {
+        return -1;
+    }
+    int64_t delayNs = policy->initialDelayNs;
+    for (int i = 0; i < policy->attempt && delayNs < policy->maxDelayNs; i++) {
+        delayNs *= 2;
+    }
+    if (delayNs > policy->maxDelayNs) {
+        delayNs = policy->maxDelayNs;
+    }
+    policy->attempt++;
+
+    policy->seed ^= policy->seed << 13;
+    policy->seed ^= policy->seed >> 17;
+    policy->seed ^= policy->seed << 5;
+    int64_t jitterUs = delayNs / 1000 * RECONNECT_JITTER_PERCENT / 100;
+    if (jitterUs > 0) {
+        delayNs += ((int64_t) (policy->seed % (uint64_t) (2 * jitterUs + 1)) - jitterUs) * 1000;
+    }
+    return delayNs;
+}
+
+/**
+ * Record that the connection is back, so the next outage starts from the initial delay again.
+ */
+void reconnect_policy_on_connected(ReconnectPolicy *policy) {
+    if (policy->attempt > 0) {
+        __atomic_store_n(&policy->reconnects, policy->reconnects + 1, __ATOMIC_RELAXED);
+    }
+    policy->attempt = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef RECONNECT_H
+#define RECONNECT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//  Default backoff between reconnect attempts. The delay doubles after every failed attempt.
+#define DEFAULT_RECONNECT_INITIAL_DELAY_MS 250
+#define DEFAULT_RECONNECT_MAX_DELAY_MS 8000
+#define DEFAULT_RECONNECT_MAX_ATTEMPTS 10
+//  Each delay is randomized by up to this percentage either way, so destinations that dropped
+//  together don't all redial in lockstep.
+#define RECONNECT_JITTER_PERCENT 20
+//  Gap left between the last timestamp sent before a drop and the first one after it.
+#define RESUME_GAP_US 33333
+
+/**
+ * Exponential backoff for one destination's reconnect attempts.
+ * Owned by one sender thread; reconnects is read from elsewhere.
+ */
+typedef struct reconnect_policy_t {
+    int64_t initialDelayNs;
+    int64_t maxDelayNs;
+    //  Attempts per outage; 0 disables reconnecting.
+    int maxAttempts;
+    int attempt;
+    uint32_t seed;
+    //  Outages we recovered from.
+    uint64_t reconnects;
+} ReconnectPolicy;
+
+/**
+ * Set up the backoff (delays in ms) and clear the counters. seed only has to differ between
+ * destinations.
+ */
+void reconnect_policy_init(ReconnectPolicy *policy, int initialDelayMs, int maxDelayMs,
+                           int maxAttempts, uint32_t seed);
+
+/**
+ * Start the next attempt of the current outage and return how long to wait before it, in ns.
+ * Returns -1 once the attempts are used up.
+ */
+int64_t reconnect_policy_next_delay_ns(ReconnectPolicy *policy);
+
+/**
+ * Record that the connection is back, so the next outage starts from the initial delay again.
+ */
+void reconnect_policy_on_connected(ReconnectPolicy *policy);
+
+#endif /* RECONNECT_H */
@@ -0,0 +1,191 @@
+#include <string.h>
+#include "RenderPlan.h"
+
+/**
+ * Return whether clips with params can be encoded to, so the clips that don't match them can
+ * be made to.
+ */
+static bool can_encode(const ClipParams *params) {
+    //  Encoders put out Annex-B, which only becomes four-byte lengths.
+    if (params->nalLengthSize && params->nalLengthSize != 4) {
+        return false;
+    }
+    AVCodec *codec = avcodec_find_encoder(params->codecId);
+    if (!codec) {
+        return false;
+    }
+    if (!codec->pix_fmts) {
+        return true;
+    }
+    for (const enum AVPixelFormat *pixFmt = codec->pix_fmts; *pixFmt != AV_PIX_FMT_NONE;
+         pixFmt++) {
+        if (*pixFmt == params->pixFmt) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Return whether headers that differ between clips with params can be put in-band instead.
+ */
+static bool can_carry_headers(const ClipParams *params) {
+    switch (params->codecId) {
+        case AV_CODEC_ID_MPEG4:
+            return true;
+        case AV_CODEC_ID_H264:
+            return params->nalLengthSize == 0 || params->nalLengthSize == 4;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Fill params for the clip opened as format, from its index if it has one (NULL otherwise).
+ */
+void render_clip_params(ClipParams *params, AVFormatContext *format, const ClipIndex *index) {
+    memset(params, 0, sizeof(*params));
+    //  The index has been checked against the extradata, which is still there to look at.
+    AVCodecContext *codec = format->streams[0]->codec;
+    if (codec->codec_id == AV_CODEC_ID_H264 && codec->extradata_size >= 5
+        && codec->extradata[0] == 1) {
+        params->nalLengthSize = (codec->extradata[4] & 3) + 1;
+    }
+    if (index) {
+        const ClipStreamIndex *stream = &index->streams[0];
+        params->codecId = (enum AVCodecID) stream->codecId;
+        params->width = stream->width;
+        params->height = stream->height;
+        params->pixFmt = (enum AVPixelFormat) stream->pixFmt;
+        params->extradataSize = stream->extradataSize;
+        params->extradataHash = stream->extradataHash;
+        return;
+    }
+    params->codecId = codec->codec_id;
+    params->width = codec->width;
+    params->height = codec->height;
+    params->pixFmt = codec->pix_fmt;
+    params->extradataSize = codec->extradata_size;
+    params->extradataHash = clip_index_hash(codec->extradata, (size_t) codec->extradata_size);
+}
+
+/**
+ * Return whether clips with these parameters can share a track. Clips that differ only in their
+ * headers can, when those can be put in-band ahead of each keyframe: MPEG-4 part 2's as they
+ * are, and H.264's when both are Annex-B or both use four-byte lengths.
+ */
+bool render_params_match(const ClipParams *a, const ClipParams *b) {
+    if (a->codecId != b->codecId || a->width != b->width || a->height != b->height
+        || a->pixFmt != b->pixFmt || a->nalLengthSize != b->nalLengthSize) {
+        return false;
+    }
+    return can_carry_headers(a)
+           || (a->extradataSize == b->extradataSize && a->extradataHash == b->extradataHash);
+}
+
+/**
+ * Mark which video clips don't match the reference, and add up the durations.
+ */
+static void classify_clips(RenderPlan *plan, const ClipParams *params) {
+    plan->copyMs = 0;
+    plan->encodeMs = 0;
+    for (int i = 0; i < plan->numClips; i++) {
+        RenderClip *clip = &plan->clips[i];
+        if (!clip->isVideo) {
+            continue;
+        }
+        clip->isEncoded = plan->reference < 0 || !render_params_match(&params[i], &plan->params);
+        if (clip->isEncoded) {
+            plan->encodeMs += clip->durationMs;
+        } else {
+            plan->copyMs += clip->durationMs;
+        }
+    }
+}
+
+/**
+ * Plan the stitch of the numClips clips opened as formats (NULL for any that failed), whose
+ * probe results, indexes included, are inputs. Returns 0 or a negative AVERROR.
+ */
+int render_plan_build(RenderPlan *plan, AVFormatContext **formats, const ProbedInput *inputs,
+                      int numClips) {
+    memset(plan, 0, sizeof(*plan));
+    plan->reference = -1;
+    plan->numClips = numClips;
+    ClipParams *params = NULL;
+    if (numClips) {
+        plan->clips = av_mallocz_array((size_t) numClips, sizeof(RenderClip));
+        params = av_mallocz_array((size_t) numClips, sizeof(ClipParams));
+        if (!plan->clips || !params) {
+            av_free(params);
+            render_plan_release(plan);
+            return AVERROR(ENOMEM);
+        }
+    }
+    int numGroups = 0;
+    for (int i = 0; i < numClips; i++) {
+        RenderClip *clip = &plan->clips[i];
+        const ClipIndex *index = inputs[i].hasIndex ? &inputs[i].index : NULL;
+        if (!formats[i]) {
+            continue;
+        }
+        enum AVMediaType codecType = index ? (enum AVMediaType) index->streams[0].codecType
+                                           : formats[i]->streams[0]->codec->codec_type;
+        if (codecType != AVMEDIA_TYPE_VIDEO) {
+            continue;
+        }
+        clip->isVideo = true;
+        int64_t duration = index ? index->duration : formats[i]->duration;
+        clip->durationMs = duration > 0 ? av_rescale_q(duration, AV_TIME_BASE_Q,
+                                                       (AVRational) {1, 1000}) : 0;
+        render_clip_params(&params[i], formats[i], index);
+        //  Each group is counted once, at its first clip.
+        bool isFirstOfGroup = true;
+        for (int j = 0; j < i && isFirstOfGroup; j++) {
+            isFirstOfGroup = !plan->clips[j].isVideo
+                             || !render_params_match(&params[j], &params[i]);
+        }
+        numGroups += isFirstOfGroup;
+    }
+    int64_t bestMs = -1;
+    for (int i = 0; i < numClips; i++) {
+        if (!plan->clips[i].isVideo) {
+            continue;
+        }
+        int64_t groupMs = 0;
+        bool isFirstOfGroup = true;
+        for (int j = 0; j < numClips; j++) {
+            if (plan->clips[j].isVideo && render_params_match(&params[j], &params[i])) {
+                isFirstOfGroup &= j >= i;
+                groupMs += plan->clips[j].durationMs;
+            }
+        }
+        //  A lone group needs no encoder; otherwise the others have to be encoded into it.
+        if (isFirstOfGroup && groupMs > bestMs && (numGroups == 1 || can_encode(&params[i]))) {
+            bestMs = groupMs;
+            plan->reference = i;
+        }
+    }
+    if (plan->reference >= 0) {
+        plan->params = params[plan->reference];
+    }
+    classify_clips(plan, params);
+    av_free(params);
+    return 0;
+}
+
+/**
+ * Give up on copying: mark every video clip to be re-encoded, with no reference.
+ */
+void render_plan_encode_all(RenderPlan *plan) {
+    plan->reference = -1;
+    classify_clips(plan, NULL);
+}
+
+/**
+ * Free the plan.
+ */
+void render_plan_release(RenderPlan *plan) {
+    av_freep(&plan->clips);
+    plan->numClips = 0;
+}
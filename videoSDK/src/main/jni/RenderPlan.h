@@ -0,0 +1,83 @@
+#ifndef RENDER_PLAN_H
+#define RENDER_PLAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+#include "ClipIndex.h"
+#include "ProbePool.h"
+
+/**
+ * What a video clip has to share with the output for its packets to be copied into the same
+ * track: the codec, the picture, the framing, and the global headers (compared by hash) unless
+ * they can go in-band ahead of the clip's keyframes instead.
+ */
+typedef struct clip_params_t {
+    enum AVCodecID codecId;
+    int width;
+    int height;
+    enum AVPixelFormat pixFmt;
+    //  For H.264 with an avcC, how many bytes its NAL unit lengths take; 0 for Annex-B.
+    int nalLengthSize;
+    int extradataSize;
+    uint64_t extradataHash;
+} ClipParams;
+
+/**
+ * What happens to one input.
+ */
+typedef struct render_clip_t {
+    bool isVideo;
+    //  Whether its video goes through the encoder rather than being copied.
+    bool isEncoded;
+    int64_t durationMs;
+} RenderClip;
+
+/**
+ * Which video clips of a stitch are copied as they are and which are re-encoded. The output's
+ * video takes the parameters of the biggest group of matching clips, by duration, that there's
+ * an encoder for, so the rest can be re-encoded to match and only they cost any encoding. If no
+ * group can be encoded to, all the video is re-encoded to MPEG-4.
+ */
+typedef struct render_plan_t {
+    RenderClip *clips;
+    int numClips;
+    //  The clip the output's video parameters come from, or -1 if all the video is re-encoded.
+    int reference;
+    ClipParams params;
+    //  How much video is copied and how much re-encoded, in ms.
+    int64_t copyMs;
+    int64_t encodeMs;
+} RenderPlan;
+
+/**
+ * Fill params for the clip opened as format, from its index if it has one (NULL otherwise).
+ */
+void render_clip_params(ClipParams *params, AVFormatContext *format, const ClipIndex *index);
+
+/**
+ * Return whether clips with these parameters can share a track. Clips that differ only in their
+ * headers can, when those can be put in-band ahead of each keyframe: MPEG-4 part 2's as they
+ * are, and H.264's when both are Annex-B or both use four-byte lengths.
+ */
+bool render_params_match(const ClipParams *a, const ClipParams *b);
+
+/**
+ * Plan the stitch of the numClips clips opened as formats (NULL for any that failed), whose
+ * probe results, indexes included, are inputs. Returns 0 or a negative AVERROR.
+ */
+int render_plan_build(RenderPlan *plan, AVFormatContext **formats, const ProbedInput *inputs,
+                      int numClips);
+
+/**
+ * Give up on copying: mark every video clip to be re-encoded, with no reference.
+ */
+void render_plan_encode_all(RenderPlan *plan);
+
+/**
+ * Free the plan.
+ */
+void render_plan_release(RenderPlan *plan);
+
+#endif /* RENDER_PLAN_H */
@@ -0,0 +1,586 @@
+/**
+ * Interop check and benchmark for RtmpPublisher against a stand-in RTMP server on loopback. Not
+ * part of the library; build it on Linux against a host FFmpeg 3.x with something like
+ *
+ *     gcc --std=c99 -D_GNU_SOURCE -O2 -I. RtmpBenchmark.c RtmpPublisher.c SocketIo.c Stats.c \
+ *         -o rtmp_benchmark -lavformat -lavcodec -lavutil -lpthread
+ *
+ * and run it with no arguments. Add -DWITH_LIBAVFORMAT to also push the same packets through
+ * libavformat's flv muxer and rtmp protocol for comparison. The server does the plain handshake,
+ * answers connect/createStream/publish, changes its chunk size, pings and acknowledges, and
+ * checks every media payload arrives intact. Reports CPU time of the sending thread per Mbit,
+ * and dumps the publisher's side of a stats snapshot: the same per-stream counters and header
+ * and packet write histograms getStats() reports for a destination.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "libavformat/avformat.h"
+#include "libavutil/intfloat.h"
+#include "libavutil/intreadwrite.h"
+#include "Clock.h"
+#include "RtmpPublisher.h"
+#include "Stats.h"
+
+//  30 s of 30 fps video with a keyframe every 2 s, and two AAC packets per frame. Keyframes
+//  are over the chunk size, so they go out as a chunk and a continuation.
+#define NUM_VIDEO_PACKETS 900
+#define KEY_FRAME_INTERVAL 60
+#define KEY_FRAME_SIZE (96 * 1024)
+#define INTER_FRAME_SIZE (8 * 1024)
+#define AUDIO_PACKETS_PER_VIDEO 2
+#define AUDIO_PACKET_SIZE 256
+//  What the server acknowledges after, and the chunk size it switches to.
+#define SERVER_WINDOW_ACK_SIZE 2500000
+#define SERVER_CHUNK_SIZE 4096
+#define SERVER_MAX_MESSAGE_SIZE (1024 * 1024)
+//  Room for the stats snapshot of one run.
+#define STATS_JSON_SIZE 4096
+
+static const uint8_t AVCC[] = {1, 0x42, 0xc0, 0x1f, 0xff, 0xe1, 0, 4, 0x67, 0x42, 0xc0, 0x1f,
+                               1, 0, 4, 0x68, 0xce, 0x3c, 0x80};
+static const uint8_t AUDIO_CONFIG[] = {0x12, 0x10};
+
+typedef struct server_t {
+    int listenFd;
+    int fd;
+    int inChunkSize;
+    uint64_t received;
+    uint64_t acknowledged;
+    //  What arrived: media payloads (after the FLV body header) and their checksum.
+    int videoPackets;
+    int audioPackets;
+    int sequenceHeaders;
+    int metadata;
+    int pingResponses;
+    uint64_t mediaBytes;
+    uint32_t checksum;
+    bool isPublishing;
+    bool isBroken;
+} Server;
+
+typedef struct server_chunk_stream_t {
+    uint32_t length;
+    uint8_t type;
+    uint32_t timestamp;
+    uint32_t delta;
+    uint32_t received;
+    uint8_t *message;
+} ServerChunkStream;
+
+static uint32_t checksum_update(uint32_t checksum, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        checksum = (checksum ^ data[i]) * 16777619u;
+    }
+    return checksum;
+}
+
+static bool read_exact(Server *server, uint8_t *buf, int size) {
+    for (int received = 0; received < size;) {
+        ssize_t length = read(server->fd, buf + received, (size_t) (size - received));
+        if (length <= 0) {
+            return false;
+        }
+        received += (int) length;
+        server->received += (uint64_t) length;
+    }
+    return true;
+}
+
+/**
+ * Send a message as type-0 and type-3 chunks of SERVER_CHUNK_SIZE.
+ */
+static void server_send(Server *server, int csid, uint8_t type, uint32_t streamId,
+                        const uint8_t *body, int size) {
+    uint8_t header[12];
+    header[0] = (uint8_t) csid;
+    AV_WB24(header + 1, 0);
+    AV_WB24(header + 4, size);
+    header[7] = type;
+    AV_WL32(header + 8, streamId);
+    if (write(server->fd, header, sizeof(header)) != sizeof(header)) {
+        server->isBroken = true;
+    }
+    for (int offset = 0; offset < size; offset += SERVER_CHUNK_SIZE) {
+        uint8_t continuation = (uint8_t) (0xc0 | csid);
+        if (offset && write(server->fd, &continuation, 1) != 1) {
+            server->isBroken = true;
+        }
+        int length = size - offset < SERVER_CHUNK_SIZE ? size - offset : SERVER_CHUNK_SIZE;
+        if (write(server->fd, body + offset, (size_t) length) != length) {
+            server->isBroken = true;
+        }
+    }
+}
+
+static void server_send_u32(Server *server, uint8_t type, uint32_t value, int extra) {
+    uint8_t body[5];
+    AV_WB32(body, value);
+    body[4] = (uint8_t) extra;
+    server_send(server, 2, type, 0, body, extra >= 0 ? 5 : 4);
+}
+
+static int put_string(uint8_t *p, const char *value) {
+    int length = (int) strlen(value);
+    p[0] = 2;
+    AV_WB16(p + 1, length);
+    memcpy(p + 3, value, (size_t) length);
+    return 3 + length;
+}
+
+static int put_number(uint8_t *p, double value) {
+    p[0] = 0;
+    AV_WB64(p + 1, av_double2int(value));
+    return 9;
+}
+
+static int put_status(uint8_t *p, const char *code) {
+    int length = 0;
+    p[length++] = 3;
+    AV_WB16(p + length, 5);
+    memcpy(p + length + 2, "level", 5);
+    length += 7;
+    length += put_string(p + length, "status");
+    AV_WB16(p + length, 4);
+    memcpy(p + length + 2, "code", 4);
+    length += 6;
+    length += put_string(p + length, code);
+    AV_WB24(p + length, 9);
+    return length + 3;
+}
+
+/**
+ * Answer the commands a publisher sends while setting up.
+ */
+static void server_command(Server *server, const uint8_t *message, uint32_t size) {
+    uint8_t reply[512];
+    char name[32] = {0};
+    if (size < 3 || message[0] != 2 || AV_RB16(message + 1) >= sizeof(name)
+        || size < 3u + AV_RB16(message + 1) + 9) {
+        return;
+    }
+    int nameLength = AV_RB16(message + 1);
+    memcpy(name, message + 3, (size_t) nameLength);
+    double transactionId = av_int2double(AV_RB64(message + 3 + nameLength + 1));
+    int length = 0;
+    if (!strcmp(name, "connect")) {
+        server_send_u32(server, 5, SERVER_WINDOW_ACK_SIZE, -1);
+        server_send_u32(server, 6, SERVER_WINDOW_ACK_SIZE, 2);
+        server_send_u32(server, 1, SERVER_CHUNK_SIZE, -1);
+        length += put_string(reply, "_result");
+        length += put_number(reply + length, transactionId);
+        reply[length++] = 5;
+        length += put_status(reply + length, "NetConnection.Connect.Success");
+        server_send(server, 3, 20, 0, reply, length);
+    } else if (!strcmp(name, "createStream")) {
+        length += put_string(reply, "_result");
+        length += put_number(reply + length, transactionId);
+        reply[length++] = 5;
+        length += put_number(reply + length, 1);
+        server_send(server, 3, 20, 0, reply, length);
+    } else if (!strcmp(name, "publish")) {
+        length += put_string(reply, "onStatus");
+        length += put_number(reply + length, 0);
+        reply[length++] = 5;
+        length += put_status(reply + length, "NetStream.Publish.Start");
+        server_send(server, 5, 20, 1, reply, length);
+        //  And a ping, which has to come back.
+        uint8_t ping[6] = {0, 6, 0, 0, 0x12, 0x34};
+        server_send(server, 2, 4, 0, ping, sizeof(ping));
+        server->isPublishing = true;
+    }
+}
+
+static void server_message(Server *server, uint8_t type, const uint8_t *message, uint32_t size) {
+    switch (type) {
+        case 1:
+            server->inChunkSize = (int) (AV_RB32(message) & 0x7fffffff);
+            break;
+        case 4:
+            if (size >= 6 && AV_RB16(message) == 7 && AV_RB32(message + 2) == 0x1234) {
+                server->pingResponses++;
+            }
+            break;
+        case 8:
+        case 9:
+            if (size >= 2 && message[1] == 0) {
+                server->sequenceHeaders++;
+                break;
+            }
+            if (type == 9) {
+                server->videoPackets++;
+            } else {
+                server->audioPackets++;
+            }
+            int prefix = type == 9 ? 5 : 2;
+            server->mediaBytes += size - (uint32_t) prefix;
+            server->checksum = checksum_update(server->checksum, message + prefix,
+                                               size - (uint32_t) prefix);
+            break;
+        case 18:
+            server->metadata++;
+            break;
+        case 20:
+            server_command(server, message, size);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Accept one publisher and read it to the end.
+ */
+static void *run_server(void *arg) {
+    Server *server = arg;
+    ServerChunkStream streams[64];
+    memset(streams, 0, sizeof(streams));
+    server->fd = accept(server->listenFd, NULL, NULL);
+    if (server->fd < 0) {
+        server->isBroken = true;
+        return NULL;
+    }
+
+    //  Plain handshake. S1's version field is zero, which tells clients not to expect a digest.
+    uint8_t *handshake = calloc(1, 1 + 2 * 1536);
+    if (!handshake || !read_exact(server, handshake, 1537)) {
+        server->isBroken = true;
+        free(handshake);
+        return NULL;
+    }
+    memmove(handshake + 1 + 1536, handshake + 1, 1536);
+    memset(handshake + 1, 0, 1536);
+    if (write(server->fd, handshake, 1 + 2 * 1536) != 1 + 2 * 1536
+        || !read_exact(server, handshake, 1536)) {
+        server->isBroken = true;
+    }
+    free(handshake);
+
+    uint8_t header[16];
+    while (!server->isBroken && read_exact(server, header, 1)) {
+        int format = header[0] >> 6;
+        int csid = header[0] & 0x3f;
+        static const int SIZES[4] = {11, 7, 3, 0};
+        if (csid < 2 || !read_exact(server, header + 1, SIZES[format])) {
+            server->isBroken = csid < 2;
+            break;
+        }
+        ServerChunkStream *stream = &streams[csid];
+        uint32_t timestampField = format < 3 ? AV_RB24(header + 1) : 0;
+        if (format < 2) {
+            stream->length = AV_RB24(header + 4);
+            stream->type = header[7];
+        }
+        if (timestampField == 0xffffff && !read_exact(server, header + 12, 4)) {
+            break;
+        }
+        if (format == 0) {
+            stream->timestamp = timestampField;
+        } else if (format < 3) {
+            stream->delta = timestampField;
+        }
+        if (stream->received == 0 && format != 0) {
+            stream->timestamp += stream->delta;
+        }
+        if (stream->length > SERVER_MAX_MESSAGE_SIZE) {
+            server->isBroken = true;
+            break;
+        }
+        if (!stream->message && !(stream->message = malloc(SERVER_MAX_MESSAGE_SIZE))) {
+            server->isBroken = true;
+            break;
+        }
+        uint32_t chunkSize = stream->length - stream->received;
+        if (chunkSize > (uint32_t) server->inChunkSize) {
+            chunkSize = (uint32_t) server->inChunkSize;
+        }
+        if (!read_exact(server, stream->message + stream->received, (int) chunkSize)) {
+            break;
+        }
+        stream->received += chunkSize;
+        if (stream->received == stream->length) {
+            stream->received = 0;
+            server_message(server, stream->type, stream->message, stream->length);
+        }
+        if (server->received - server->acknowledged >= SERVER_WINDOW_ACK_SIZE) {
+            server->acknowledged = server->received;
+            server_send_u32(server, 3, (uint32_t) server->received, -1);
+        }
+    }
+    for (int i = 0; i < 64; i++) {
+        free(streams[i].message);
+    }
+    close(server->fd);
+    return NULL;
+}
+
+static int start_server(Server *server, pthread_t *thread) {
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    memset(server, 0, sizeof(*server));
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server->inChunkSize = 128;
+    server->checksum = 2166136261u;
+    server->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listenFd < 0
+        || bind(server->listenFd, (struct sockaddr *) &address, addressLength) < 0
+        || listen(server->listenFd, 1) < 0
+        || getsockname(server->listenFd, (struct sockaddr *) &address, &addressLength) < 0) {
+        return -1;
+    }
+    pthread_create(thread, NULL, run_server, server);
+    return ntohs(address.sin_port);
+}
+
+static int64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static AVBufferRef *make_packet(int size, int seed) {
+    AVBufferRef *buf = av_buffer_alloc(size);
+    if (buf) {
+        for (int i = 0; i < size; i++) {
+            buf->data[i] = (uint8_t) (i * 31 + seed);
+        }
+        //  One length-prefixed NAL unit.
+        AV_WB32(buf->data, (uint32_t) size - 4);
+    }
+    return buf;
+}
+
+/**
+ * Check what the server got against what was sent, and print the cost.
+ */
+static int report(const char *name, Server *server, int64_t cpuNs, uint64_t expectedBytes,
+                  uint32_t expectedChecksum) {
+    double mbits = server->mediaBytes * 8 / 1e6;
+    printf("%-24s %7.1f ms CPU  %6.1f us/Mbit  %d video, %d audio, %d pings answered\n", name,
+           cpuNs / 1e6, cpuNs / 1e3 / mbits, server->videoPackets, server->audioPackets,
+           server->pingResponses);
+    if (server->isBroken || server->mediaBytes != expectedBytes
+        || server->checksum != expectedChecksum
+        || server->videoPackets != NUM_VIDEO_PACKETS
+        || server->audioPackets != NUM_VIDEO_PACKETS * AUDIO_PACKETS_PER_VIDEO
+        || server->sequenceHeaders != 2 || !server->metadata) {
+        fprintf(stderr, "%s: the server didn't get what was sent.\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Time one write into the given histogram and count it if it went out.
+ */
+static int timed_write(RtmpPublisher *publisher, DestinationStats *writeStats, bool isVideo,
+                       bool isKeyFrame, int64_t dts, AVBufferRef *buf) {
+    int64_t startNs = clock_now_ns();
+    int ret = rtmp_publisher_write_packet(publisher, isVideo, isKeyFrame, dts, 0, buf->data,
+                                          buf->size, buf);
+    histogram_record(&writeStats->packetWrite, clock_now_ns() - startNs);
+    if (ret == 0) {
+        stats_count_packet(writeStats, isVideo ? STATS_STREAM_VIDEO : STATS_STREAM_AUDIO,
+                           buf->size);
+    }
+    return ret;
+}
+
+/**
+ * Print the run's stats snapshot as one line of JSON.
+ */
+static int dump_stats(const char *name, DestinationStats *writeStats) {
+    char json[STATS_JSON_SIZE];
+    int length = stats_append(json, sizeof(json), 0, "{");
+    length = stats_append_destination(json, sizeof(json), length, writeStats);
+    length = stats_append(json, sizeof(json), length, "}");
+    if (length >= (int) sizeof(json) - 1) {
+        fprintf(stderr, "%s: the stats snapshot didn't fit.\n", name);
+        return 1;
+    }
+    printf("%-24s %s\n", "", json);
+    return 0;
+}
+
+static int run_native(const char *name, int mode, AVBufferRef *keyFrame, AVBufferRef *frame,
+                      AVBufferRef *audio, uint64_t expectedBytes, uint32_t expectedChecksum) {
+    Server server;
+    pthread_t serverThread;
+    int port = start_server(&server, &serverThread);
+    if (port < 0) {
+        return 1;
+    }
+    char url[128];
+    snprintf(url, sizeof(url), "rtmp://127.0.0.1:%d/live/benchmark", port);
+    SocketIoStats socketStats = {0};
+    RtmpPublisherStats stats = {0};
+    RtmpPublisher *publisher = NULL;
+    DestinationStats writeStats = {0};
+
+    int64_t startNs = thread_cpu_ns();
+    int64_t headerStartNs = clock_now_ns();
+    int ret = rtmp_publisher_open(&publisher, url, mode, 0, 0, 0, &socketStats, &stats, NULL);
+    if (ret == 0) {
+        ret = rtmp_publisher_write_header(publisher, 1280, 720, 2000000, AVCC, sizeof(AVCC),
+                                          44100, 2, 128000, AUDIO_CONFIG, sizeof(AUDIO_CONFIG));
+    }
+    //  Connecting and publishing count towards the header, as they do for a destination.
+    histogram_record(&writeStats.headerWrite, clock_now_ns() - headerStartNs);
+    for (int i = 0; i < NUM_VIDEO_PACKETS && ret == 0; i++) {
+        bool isKeyFrame = i % KEY_FRAME_INTERVAL == 0;
+        ret = timed_write(publisher, &writeStats, true, isKeyFrame, i * 33,
+                          isKeyFrame ? keyFrame : frame);
+        for (int j = 0; j < AUDIO_PACKETS_PER_VIDEO && ret == 0; j++) {
+            ret = timed_write(publisher, &writeStats, false, false, i * 33 + j * 16, audio);
+        }
+    }
+    //  Give the ping a moment to arrive and be answered before hanging up.
+    for (int i = 0; i < 50 && ret == 0 && !server.pingResponses; i++) {
+        usleep(1000);
+        ret = rtmp_publisher_poll(publisher);
+    }
+    rtmp_publisher_close(&publisher);
+    int64_t cpuNs = thread_cpu_ns() - startNs;
+    pthread_join(serverThread, NULL);
+    close(server.listenFd);
+    if (ret < 0) {
+        fprintf(stderr, "%s: publishing failed: %d\n", name, ret);
+        return 1;
+    }
+    printf("%-24s %llu chunks for %llu messages, %llu headers compressed, %llu sendmsg calls\n",
+           "", (unsigned long long) stats.chunks, (unsigned long long) stats.messages,
+           (unsigned long long) stats.compressedHeaders,
+           (unsigned long long) socketStats.writevCalls);
+    int failed = dump_stats(name, &writeStats);
+    return report(name, &server, cpuNs, expectedBytes, expectedChecksum) | failed;
+}
+
+#ifdef WITH_LIBAVFORMAT
+static AVStream *add_benchmark_stream(AVFormatContext *oc, enum AVMediaType type) {
+    AVStream *stream = avformat_new_stream(oc, NULL);
+    if (!stream) {
+        return NULL;
+    }
+    const uint8_t *config = type == AVMEDIA_TYPE_VIDEO ? AVCC : AUDIO_CONFIG;
+    int configSize = type == AVMEDIA_TYPE_VIDEO ? sizeof(AVCC) : sizeof(AUDIO_CONFIG);
+    stream->codec->codec_type = type;
+    stream->codec->codec_id = type == AVMEDIA_TYPE_VIDEO ? AV_CODEC_ID_H264 : AV_CODEC_ID_AAC;
+    stream->codec->width = 1280;
+    stream->codec->height = 720;
+    stream->codec->sample_rate = 44100;
+    stream->codec->channels = 2;
+    stream->time_base = (AVRational) {1, 1000};
+    stream->codec->extradata = av_mallocz(configSize + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (stream->codec->extradata) {
+        memcpy(stream->codec->extradata, config, (size_t) configSize);
+        stream->codec->extradata_size = configSize;
+    }
+    return stream;
+}
+
+static int run_libavformat(AVBufferRef *keyFrame, AVBufferRef *frame, AVBufferRef *audio,
+                           uint64_t expectedBytes, uint32_t expectedChecksum) {
+    Server server;
+    pthread_t serverThread;
+    int port = start_server(&server, &serverThread);
+    if (port < 0) {
+        return 1;
+    }
+    char url[128];
+    snprintf(url, sizeof(url), "rtmp://127.0.0.1:%d/live/benchmark", port);
+    AVFormatContext *oc = NULL;
+    int64_t startNs = thread_cpu_ns();
+    int ret = avformat_alloc_output_context2(&oc, NULL, "flv", url);
+    AVStream *videoStream = ret >= 0 ? add_benchmark_stream(oc, AVMEDIA_TYPE_VIDEO) : NULL;
+    AVStream *audioStream = ret >= 0 ? add_benchmark_stream(oc, AVMEDIA_TYPE_AUDIO) : NULL;
+    if (!videoStream || !audioStream) {
+        ret = AVERROR(ENOMEM);
+    }
+    if (ret >= 0) {
+        ret = avio_open(&oc->pb, url, AVIO_FLAG_WRITE);
+    }
+    if (ret >= 0) {
+        ret = avformat_write_header(oc, NULL);
+    }
+    for (int i = 0; i < NUM_VIDEO_PACKETS && ret >= 0; i++) {
+        AVPacket packet;
+        bool isKeyFrame = i % KEY_FRAME_INTERVAL == 0;
+        AVBufferRef *video = isKeyFrame ? keyFrame : frame;
+        av_init_packet(&packet);
+        packet.data = video->data;
+        packet.size = video->size;
+        packet.stream_index = videoStream->index;
+        packet.pts = packet.dts = av_rescale_q(i * 33, (AVRational) {1, 1000},
+                                               videoStream->time_base);
+        packet.flags = isKeyFrame ? AV_PKT_FLAG_KEY : 0;
+        ret = av_write_frame(oc, &packet);
+        for (int j = 0; j < AUDIO_PACKETS_PER_VIDEO && ret >= 0; j++) {
+            av_init_packet(&packet);
+            packet.data = audio->data;
+            packet.size = audio->size;
+            packet.stream_index = audioStream->index;
+            packet.pts = packet.dts = av_rescale_q(i * 33 + j * 16, (AVRational) {1, 1000},
+                                                   audioStream->time_base);
+            ret = av_write_frame(oc, &packet);
+        }
+    }
+    if (oc) {
+        avio_closep(&oc->pb);
+        avformat_free_context(oc);
+    }
+    int64_t cpuNs = thread_cpu_ns() - startNs;
+    pthread_join(serverThread, NULL);
+    close(server.listenFd);
+    if (ret < 0) {
+        fprintf(stderr, "libavformat: publishing failed: %d\n", ret);
+        return 1;
+    }
+    return report("libavformat flv + rtmp", &server, cpuNs, expectedBytes, expectedChecksum);
+}
+#endif
+
+int main(void) {
+    //  The server may still be answering when a publisher hangs up.
+    signal(SIGPIPE, SIG_IGN);
+    AVBufferRef *keyFrame = make_packet(KEY_FRAME_SIZE, 1);
+    AVBufferRef *frame = make_packet(INTER_FRAME_SIZE, 2);
+    AVBufferRef *audio = make_packet(AUDIO_PACKET_SIZE, 3);
+    if (!keyFrame || !frame || !audio) {
+        return 1;
+    }
+    uint64_t expectedBytes = 0;
+    uint32_t expectedChecksum = 2166136261u;
+    for (int i = 0; i < NUM_VIDEO_PACKETS; i++) {
+        AVBufferRef *video = i % KEY_FRAME_INTERVAL == 0 ? keyFrame : frame;
+        expectedBytes += (uint64_t) video->size;
+        expectedChecksum = checksum_update(expectedChecksum, video->data, (size_t) video->size);
+        for (int j = 0; j < AUDIO_PACKETS_PER_VIDEO; j++) {
+            expectedBytes += (uint64_t) audio->size;
+            expectedChecksum = checksum_update(expectedChecksum, audio->data,
+                                               (size_t) audio->size);
+        }
+    }
+
+    int failed = run_native("native, low latency", SOCKET_IO_LOW_LATENCY, keyFrame, frame, audio,
+                            expectedBytes, expectedChecksum);
+    failed |= run_native("native, throughput", SOCKET_IO_THROUGHPUT, keyFrame, frame, audio,
+                         expectedBytes, expectedChecksum);
+#ifdef WITH_LIBAVFORMAT
+    av_register_all();
+    avformat_network_init();
+    failed |= run_libavformat(keyFrame, frame, audio, expectedBytes, expectedChecksum);
+#endif
+    av_buffer_unref(&keyFrame);
+    av_buffer_unref(&frame);
+    av_buffer_unref(&audio);
+    return failed;
+}
@@ -0,0 +1,1048 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include "libavformat/avformat.h"
+#include "libavutil/avstring.h"
+#include "libavutil/intfloat.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/mem.h"
+#include "Clock.h"
+#include "RtmpPublisher.h"
+
+#define ADD_RELAXED(p, n) __atomic_store_n(p, *(p) + (n), __ATOMIC_RELAXED)
+
+#define RTMP_HANDSHAKE_SIZE 1536
+#define RTMP_VERSION 3
+
+//  Message types.
+#define RTMP_MSG_SET_CHUNK_SIZE 1
+#define RTMP_MSG_ABORT 2
+#define RTMP_MSG_ACK 3
+#define RTMP_MSG_USER_CONTROL 4
+#define RTMP_MSG_WINDOW_ACK_SIZE 5
+#define RTMP_MSG_SET_PEER_BANDWIDTH 6
+#define RTMP_MSG_AUDIO 8
+#define RTMP_MSG_VIDEO 9
+#define RTMP_MSG_DATA_AMF0 18
+#define RTMP_MSG_COMMAND_AMF0 20
+
+#define RTMP_USER_CONTROL_PING_REQUEST 6
+#define RTMP_USER_CONTROL_PING_RESPONSE 7
+
+//  Timestamps from here up go in an extended timestamp field.
+#define RTMP_EXTENDED_TIMESTAMP 0xffffff
+
+#define AMF_NUMBER 0x00
+#define AMF_BOOLEAN 0x01
+#define AMF_STRING 0x02
+#define AMF_OBJECT 0x03
+#define AMF_NULL 0x05
+#define AMF_UNDEFINED 0x06
+#define AMF_ECMA_ARRAY 0x08
+#define AMF_OBJECT_END 0x09
+#define AMF_STRICT_ARRAY 0x0a
+#define AMF_DATE 0x0b
+#define AMF_LONG_STRING 0x0c
+//  Nesting we follow when skipping a value from the server.
+#define AMF_MAX_DEPTH 8
+
+//  Room for any command or metadata message we send.
+#define RTMP_COMMAND_SIZE 2048
+
+//  FLV tag body headers: codec and frame type, then the AVC or AAC packet type.
+#define FLV_VIDEO_KEY_FRAME_AVC 0x17
+#define FLV_VIDEO_INTER_FRAME_AVC 0x27
+#define FLV_AUDIO_AAC 0xaf
+#define FLV_SEQUENCE_HEADER 0
+#define FLV_MEDIA_PACKET 1
+#define FLV_CODEC_ID_AVC 7
+#define FLV_CODEC_ID_AAC 10
+
+/**
+ * A message body being built. Writes past the end set isOverflow rather than overrunning.
+ */
+typedef struct amf_writer_t {
+    uint8_t buf[RTMP_COMMAND_SIZE];
+    int length;
+    bool isOverflow;
+} AmfWriter;
+
+/**
+ * Reads values out of a message from the server. Running off the end sets isInvalid.
+ */
+typedef struct amf_reader_t {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool isInvalid;
+} AmfReader;
+
+static uint8_t *amf_reserve(AmfWriter *writer, int size) {
+    if (writer->length + size > RTMP_COMMAND_SIZE) {
+        writer->isOverflow = true;
+        return NULL;
+    }
+    uint8_t *p = writer->buf + writer->length;
+    writer->length += size;
+    return p;
+}
+
+static void amf_put_byte(AmfWriter *writer, uint8_t value) {
+    uint8_t *p = amf_reserve(writer, 1);
+    if (p) {
+        *p = value;
+    }
+}
+
+static void amf_put_key(AmfWriter *writer, const char *key) {
+    int length = (int) strlen(key);
+    uint8_t *p = amf_reserve(writer, 2 + length);
+    if (p) {
+        AV_WB16(p, length);
+        memcpy(p + 2, key, (size_t) length);
+    }
+}
+
+static void amf_put_string(AmfWriter *writer, const char *value) {
+    amf_put_byte(writer, AMF_STRING);
+    amf_put_key(writer, value);
+}
+
+static void amf_put_number(AmfWriter *writer, double value) {
+    uint8_t *p = amf_reserve(writer, 9);
+    if (p) {
+        p[0] = AMF_NUMBER;
+        AV_WB64(p + 1, av_double2int(value));
+    }
+}
+
+static void amf_put_boolean(AmfWriter *writer, bool value) {
+    amf_put_byte(writer, AMF_BOOLEAN);
+    amf_put_byte(writer, value ? 1 : 0);
+}
+
+static void amf_put_object_end(AmfWriter *writer) {
+    uint8_t *p = amf_reserve(writer, 3);
+    if (p) {
+        AV_WB24(p, AMF_OBJECT_END);
+    }
+}
+
+static bool amf_need(AmfReader *reader, int size) {
+    if (reader->isInvalid || reader->end - reader->p < size) {
+        reader->isInvalid = true;
+        return false;
+    }
+    return true;
+}
+
+static bool amf_read_number(AmfReader *reader, double *value) {
+    if (!amf_need(reader, 9) || reader->p[0] != AMF_NUMBER) {
+        return false;
+    }
+    *value = av_int2double(AV_RB64(reader->p + 1));
+    reader->p += 9;
+    return true;
+}
+
+/**
+ * Read a string value into value, truncating it to fit.
+ */
+static bool amf_read_string(AmfReader *reader, char *value, int size) {
+    if (!amf_need(reader, 3) || reader->p[0] != AMF_STRING) {
+        return false;
+    }
+    int length = AV_RB16(reader->p + 1);
+    reader->p += 3;
+    if (!amf_need(reader, length)) {
+        return false;
+    }
+    int copied = FFMIN(length, size - 1);
+    memcpy(value, reader->p, (size_t) copied);
+    value[copied] = 0;
+    reader->p += length;
+    return true;
+}
+
+static void amf_skip(AmfReader *reader, int depth);
+
+/**
+ * Skip the key/value pairs of an object or ECMA array, up to and including its end marker.
+ */
+static void amf_skip_properties(AmfReader *reader, int depth) {
+    while (amf_need(reader, 3)) {
+        int keyLength = AV_RB16(reader->p);
+        if (keyLength == 0 && reader->p[2] == AMF_OBJECT_END) {
+            reader->p += 3;
+            return;
+        }
+        reader->p += 2;
+        if (!amf_need(reader, keyLength)) {
+            return;
+        }
+        reader->p += keyLength;
+        amf_skip(reader, depth + 1);
+    }
+}
+
+static void amf_skip(AmfReader *reader, int depth) {
+    if (depth > AMF_MAX_DEPTH || !amf_need(reader, 1)) {
+        reader->isInvalid = true;
+        return;
+    }
+    uint8_t type = *reader->p++;
+    switch (type) {
+        case AMF_NUMBER:
+            if (amf_need(reader, 8)) reader->p += 8;
+            break;
+        case AMF_BOOLEAN:
+            if (amf_need(reader, 1)) reader->p += 1;
+            break;
+        case AMF_STRING:
+            if (amf_need(reader, 2) && amf_need(reader, 2 + AV_RB16(reader->p))) {
+                reader->p += 2 + AV_RB16(reader->p);
+            }
+            break;
+        case AMF_LONG_STRING:
+            if (amf_need(reader, 4) && amf_need(reader, 4 + (int) AV_RB32(reader->p))) {
+                reader->p += 4 + AV_RB32(reader->p);
+            }
+            break;
+        case AMF_DATE:
+            if (amf_need(reader, 10)) reader->p += 10;
+            break;
+        case AMF_NULL:
+        case AMF_UNDEFINED:
+            break;
+        case AMF_ECMA_ARRAY:
+            if (amf_need(reader, 4)) {
+                reader->p += 4;
+                amf_skip_properties(reader, depth);
+            }
+            break;
+        case AMF_OBJECT:
+            amf_skip_properties(reader, depth);
+            break;
+        case AMF_STRICT_ARRAY:
+            if (amf_need(reader, 4)) {
+                uint32_t count = AV_RB32(reader->p);
+                reader->p += 4;
+                for (uint32_t i = 0; i < count && !reader->isInvalid; i++) {
+                    amf_skip(reader, depth + 1);
+                }
+            }
+            break;
+        default:
+            reader->isInvalid = true;
+    }
+}
+
+/**
+ * Find key among the properties of the object at the reader and copy its string value.
+ */
+static bool amf_find_string(AmfReader *reader, const char *key, char *value, int size) {
+    if (!amf_need(reader, 1) || *reader->p != AMF_OBJECT) {
+        return false;
+    }
+    reader->p++;
+    int keyLength = (int) strlen(key);
+    while (amf_need(reader, 3)) {
+        int length = AV_RB16(reader->p);
+        if (length == 0 && reader->p[2] == AMF_OBJECT_END) {
+            return false;
+        }
+        reader->p += 2;
+        if (!amf_need(reader, length)) {
+            return false;
+        }
+        bool isKey = length == keyLength && memcmp(reader->p, key, (size_t) length) == 0;
+        reader->p += length;
+        if (isKey) {
+            return amf_read_string(reader, value, size);
+        }
+        amf_skip(reader, 1);
+    }
+    return false;
+}
+
+/**
+ * Return whether url is an rtmp:// URL we can publish to ourselves.
+ */
+bool rtmp_publisher_supports_url(const char *url) {
+    return url && strncmp(url, "rtmp://", 7) == 0;
+}
+
+/**
+ * Send one message on csid as chunks. The body is prefix followed by payload: the prefix is
+ * copied, the payload is sent from buf if given. Each chunk header is built in place in the
+ * socket's staging area, with the message header cut down to whatever changed since the last
+ * message on this chunk stream.
+ */
+static int send_message(RtmpPublisher *publisher, int csid, uint8_t type, uint32_t streamId,
+                        uint32_t timestamp, const uint8_t *prefix, int prefixSize,
+                        const uint8_t *payload, int payloadSize, AVBufferRef *buf) {
+    static const int MESSAGE_HEADER_SIZES[4] = {11, 7, 3, 0};
+    RtmpOutChunkStream *chunkStream = &publisher->out[csid];
+    uint32_t length = (uint32_t) (prefixSize + payloadSize);
+    uint32_t delta = timestamp - chunkStream->timestamp;
+    int format;
+    if (!chunkStream->hasSent || chunkStream->streamId != streamId
+        || timestamp < chunkStream->timestamp || delta >= RTMP_EXTENDED_TIMESTAMP) {
+        format = 0;
+    } else if (chunkStream->length != length || chunkStream->type != type) {
+        format = 1;
+    } else if (!chunkStream->hasDelta || chunkStream->timestampDelta != delta) {
+        format = 2;
+    } else {
+        format = 3;
+    }
+    uint32_t timestampField = format == 0 ? timestamp : delta;
+    bool isExtended = timestampField >= RTMP_EXTENDED_TIMESTAMP;
+
+    uint8_t *header;
+    int headerSize = 1 + MESSAGE_HEADER_SIZES[format] + (isExtended ? 4 : 0);
+    int ret = socket_io_reserve(publisher->io, headerSize, &header);
+    if (ret < 0) {
+        return ret;
+    }
+    header[0] = (uint8_t) (format << 6 | csid);
+    if (format < 3) {
+        AV_WB24(header + 1, isExtended ? RTMP_EXTENDED_TIMESTAMP : timestampField);
+    }
+    if (format < 2) {
+        AV_WB24(header + 4, length);
+        header[7] = type;
+    }
+    if (format == 0) {
+        //  The one little-endian field in the protocol.
+        AV_WL32(header + 8, streamId);
+    }
+    if (isExtended) {
+        AV_WB32(header + headerSize - 4, timestampField);
+    }
+
+    chunkStream->hasSent = true;
+    chunkStream->hasDelta = format != 0;
+    chunkStream->timestampDelta = format != 0 ? delta : 0;
+    chunkStream->streamId = streamId;
+    chunkStream->length = length;
+    chunkStream->type = type;
+    chunkStream->timestamp = timestamp;
+    ADD_RELAXED(&publisher->stats->messages, 1);
+    if (format != 0) {
+        ADD_RELAXED(&publisher->stats->compressedHeaders, 1);
+    }
+
+    uint32_t offset = 0;
+    for (bool isFirst = true; isFirst || offset < length; isFirst = false) {
+        if (!isFirst) {
+            //  A type-3 header: everything carries over from the message's first chunk.
+            if ((ret = socket_io_reserve(publisher->io, isExtended ? 5 : 1, &header)) < 0) {
+                return ret;
+            }
+            header[0] = (uint8_t) (3 << 6 | csid);
+            if (isExtended) {
+                AV_WB32(header + 1, timestampField);
+            }
+            ADD_RELAXED(&publisher->stats->continuationChunks, 1);
+        }
+        ADD_RELAXED(&publisher->stats->chunks, 1);
+        uint32_t chunkEnd = FFMIN(offset + (uint32_t) publisher->outChunkSize, length);
+        if (offset < (uint32_t) prefixSize) {
+            uint32_t end = FFMIN(chunkEnd, (uint32_t) prefixSize);
+            if ((ret = socket_io_write(publisher->io, prefix + offset, (int) (end - offset),
+                                       NULL)) < 0) {
+                return ret;
+            }
+        }
+        if (chunkEnd > (uint32_t) prefixSize) {
+            uint32_t start = FFMAX(offset, (uint32_t) prefixSize) - (uint32_t) prefixSize;
+            uint32_t end = chunkEnd - (uint32_t) prefixSize;
+            if ((ret = socket_io_write(publisher->io, payload + start, (int) (end - start),
+                                       buf)) < 0) {
+                return ret;
+            }
+        }
+        offset = chunkEnd;
+    }
+    return 0;
+}
+
+static int send_control(RtmpPublisher *publisher, uint8_t type, const uint8_t *body, int size) {
+    int ret = send_message(publisher, RTMP_CSID_CONTROL, type, 0, 0, body, size, NULL, 0, NULL);
+    return ret < 0 ? ret : socket_io_flush(publisher->io);
+}
+
+static int send_command(RtmpPublisher *publisher, AmfWriter *writer, uint32_t streamId) {
+    if (writer->isOverflow) {
+        return AVERROR(ENOBUFS);
+    }
+    int ret = send_message(publisher, RTMP_CSID_COMMAND, RTMP_MSG_COMMAND_AMF0, streamId, 0,
+                           writer->buf, writer->length, NULL, 0, NULL);
+    return ret < 0 ? ret : socket_io_flush(publisher->io);
+}
+
+/**
+ * Start a command message: its name, transaction ID and a null command object.
+ */
+static void begin_command(AmfWriter *writer, const char *name, double transactionId) {
+    writer->length = 0;
+    writer->isOverflow = false;
+    amf_put_string(writer, name);
+    amf_put_number(writer, transactionId);
+    amf_put_byte(writer, AMF_NULL);
+}
+
+static int send_acknowledgement(RtmpPublisher *publisher) {
+    uint8_t body[4];
+    AV_WB32(body, (uint32_t) publisher->bytesReceived);
+    publisher->bytesAcknowledged = publisher->bytesReceived;
+    return send_control(publisher, RTMP_MSG_ACK, body, sizeof(body));
+}
+
+/**
+ * Handle the command messages we care about: results of our own commands and onStatus.
+ */
+static void handle_command(RtmpPublisher *publisher, const uint8_t *message, int size) {
+    AmfReader reader = {message, message + size, false};
+    char name[32];
+    double transactionId;
+    if (!amf_read_string(&reader, name, sizeof(name))
+        || !amf_read_number(&reader, &transactionId)) {
+        return;
+    }
+    if (!strcmp(name, "_result") || !strcmp(name, "_error")) {
+        publisher->isResultError = name[1] == 'e';
+        amf_skip(&reader, 0);
+        double streamId;
+        if (amf_read_number(&reader, &streamId)) {
+            publisher->resultStreamId = streamId;
+        }
+        publisher->resultTransactionId = transactionId;
+    } else if (!strcmp(name, "onStatus")) {
+        amf_skip(&reader, 0);
+        if (!amf_find_string(&reader, "code", publisher->statusCode,
+                             sizeof(publisher->statusCode))) {
+            av_strlcpy(publisher->statusCode, "(no code)", sizeof(publisher->statusCode));
+        }
+    }
+}
+
+/**
+ * Act on one complete message from the server.
+ */
+static int handle_message(RtmpPublisher *publisher, RtmpInChunkStream *chunkStream) {
+    const uint8_t *message = chunkStream->message;
+    int size = (int) chunkStream->length;
+    switch (chunkStream->type) {
+        case RTMP_MSG_SET_CHUNK_SIZE:
+            if (size >= 4) {
+                int chunkSize = (int) (AV_RB32(message) & 0x7fffffff);
+                if (chunkSize < 1 || chunkSize > RTMP_MAX_IN_CHUNK_SIZE) {
+                    return AVERROR(ENOSYS);
+                }
+                publisher->inChunkSize = chunkSize;
+            }
+            break;
+        case RTMP_MSG_ABORT:
+            for (int i = 0; size >= 4 && i < RTMP_MAX_IN_CHUNK_STREAMS; i++) {
+                if (publisher->in[i].message && publisher->in[i].csid == (int) AV_RB32(message)) {
+                    publisher->in[i].received = 0;
+                }
+            }
+            break;
+        case RTMP_MSG_ACK:
+            if (size >= 4) {
+                uint32_t sequence = AV_RB32(message);
+                uint64_t acked = publisher->stats->ackedBytes
+                                 + (uint32_t) (sequence - publisher->lastAckSequence);
+                uint64_t sent = __atomic_load_n(&publisher->io->stats->bytesSent,
+                                                __ATOMIC_RELAXED) - publisher->bytesSentAtStart;
+                publisher->lastAckSequence = sequence;
+                __atomic_store_n(&publisher->stats->ackedBytes, acked, __ATOMIC_RELAXED);
+                __atomic_store_n(&publisher->stats->unacknowledgedBytes,
+                                 sent > acked ? sent - acked : 0, __ATOMIC_RELAXED);
+            }
+            break;
+        case RTMP_MSG_USER_CONTROL:
+            if (size >= 6 && AV_RB16(message) == RTMP_USER_CONTROL_PING_REQUEST) {
+                uint8_t body[6];
+                AV_WB16(body, RTMP_USER_CONTROL_PING_RESPONSE);
+                memcpy(body + 2, message + 2, 4);
+                ADD_RELAXED(&publisher->stats->pings, 1);
+                return send_control(publisher, RTMP_MSG_USER_CONTROL, body, sizeof(body));
+            }
+            break;
+        case RTMP_MSG_WINDOW_ACK_SIZE:
+            if (size >= 4) {
+                publisher->windowAckSize = AV_RB32(message);
+                __atomic_store_n(&publisher->stats->windowAckSize, publisher->windowAckSize,
+                                 __ATOMIC_RELAXED);
+            }
+            break;
+        case RTMP_MSG_SET_PEER_BANDWIDTH:
+            //  Answered with our own window, which is the same one.
+            if (size >= 4) {
+                return send_control(publisher, RTMP_MSG_WINDOW_ACK_SIZE, message, 4);
+            }
+            break;
+        case RTMP_MSG_COMMAND_AMF0:
+            handle_command(publisher, message, size);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static RtmpInChunkStream *get_in_chunk_stream(RtmpPublisher *publisher, int csid) {
+    RtmpInChunkStream *unused = NULL;
+    for (int i = 0; i < RTMP_MAX_IN_CHUNK_STREAMS; i++) {
+        RtmpInChunkStream *chunkStream = &publisher->in[i];
+        if (chunkStream->message && chunkStream->csid == csid) {
+            return chunkStream;
+        }
+        if (!chunkStream->message && !unused) {
+            unused = chunkStream;
+        }
+    }
+    if (unused && (unused->message = av_malloc(RTMP_MAX_IN_MESSAGE_SIZE))) {
+        unused->csid = csid;
+        unused->received = 0;
+        return unused;
+    }
+    return NULL;
+}
+
+/**
+ * Take one whole chunk off the front of the read buffer. Returns 1 if one was there, 0 if more
+ * bytes are needed first, or a negative AVERROR.
+ */
+static int parse_chunk(RtmpPublisher *publisher) {
+    static const int MESSAGE_HEADER_SIZES[4] = {11, 7, 3, 0};
+    const uint8_t *start = publisher->readBuffer + publisher->readStart;
+    const uint8_t *end = publisher->readBuffer + publisher->readEnd;
+    const uint8_t *p = start;
+    if (p >= end) {
+        return 0;
+    }
+    int format = p[0] >> 6;
+    int csid = p[0] & 0x3f;
+    p++;
+    if (csid < 2) {
+        //  0 and 1 mean the ID follows in one or two more bytes.
+        int extraBytes = csid + 1;
+        if (end - p < extraBytes) {
+            return 0;
+        }
+        csid = 64 + p[0] + (extraBytes == 2 ? p[1] * 256 : 0);
+        p += extraBytes;
+    }
+    if (end - p < MESSAGE_HEADER_SIZES[format]) {
+        return 0;
+    }
+    RtmpInChunkStream *chunkStream = get_in_chunk_stream(publisher, csid);
+    if (!chunkStream) {
+        return AVERROR(ENOMEM);
+    }
+    uint32_t timestampField = format < 3 ? AV_RB24(p) : 0;
+    uint32_t length = format < 2 ? AV_RB24(p + 3) : chunkStream->length;
+    uint8_t type = format < 2 ? p[6] : chunkStream->type;
+    uint32_t streamId = format == 0 ? AV_RL32(p + 7) : chunkStream->streamId;
+    p += MESSAGE_HEADER_SIZES[format];
+    bool isExtended = format < 3 ? timestampField == RTMP_EXTENDED_TIMESTAMP
+                                 : chunkStream->hasExtendedTimestamp;
+    if (isExtended) {
+        if (end - p < 4) {
+            return 0;
+        }
+        timestampField = AV_RB32(p);
+        p += 4;
+    }
+    if (length > RTMP_MAX_IN_MESSAGE_SIZE) {
+        return AVERROR(ENOSYS);
+    }
+    bool isNewMessage = chunkStream->received == 0;
+    uint32_t chunkSize = FFMIN((uint32_t) publisher->inChunkSize,
+                               length - (isNewMessage ? 0 : chunkStream->received));
+    if ((uint32_t) (end - p) < chunkSize) {
+        return 0;
+    }
+
+    //  The whole chunk is here; only now update the chunk stream.
+    if (format == 0) {
+        chunkStream->timestamp = timestampField;
+        chunkStream->timestampDelta = 0;
+    } else if (format < 3) {
+        chunkStream->timestampDelta = timestampField;
+    }
+    if (format != 0 && isNewMessage) {
+        chunkStream->timestamp += chunkStream->timestampDelta;
+    }
+    chunkStream->length = length;
+    chunkStream->type = type;
+    chunkStream->streamId = streamId;
+    chunkStream->hasExtendedTimestamp = isExtended;
+    memcpy(chunkStream->message + chunkStream->received, p, chunkSize);
+    chunkStream->received += chunkSize;
+    p += chunkSize;
+    publisher->readStart += (int) (p - start);
+    publisher->bytesReceived += (uint64_t) (p - start);
+
+    int ret = 0;
+    if (chunkStream->received == chunkStream->length) {
+        chunkStream->received = 0;
+        ret = handle_message(publisher, chunkStream);
+    }
+    if (ret == 0 && publisher->windowAckSize
+        && publisher->bytesReceived - publisher->bytesAcknowledged >= publisher->windowAckSize) {
+        ret = send_acknowledgement(publisher);
+    }
+    return ret < 0 ? ret : 1;
+}
+
+/**
+ * Handle every whole chunk we have, then read once more, waiting up to timeoutMs, and handle
+ * what that brought. Returns 0 or a negative AVERROR.
+ */
+static int read_messages(RtmpPublisher *publisher, int timeoutMs) {
+    int ret;
+    while ((ret = parse_chunk(publisher)) > 0) {
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if (publisher->readStart > 0) {
+        memmove(publisher->readBuffer, publisher->readBuffer + publisher->readStart,
+                (size_t) (publisher->readEnd - publisher->readStart));
+        publisher->readEnd -= publisher->readStart;
+        publisher->readStart = 0;
+    }
+    ret = socket_io_read(publisher->io, publisher->readBuffer + publisher->readEnd,
+                         (int) sizeof(publisher->readBuffer) - publisher->readEnd, timeoutMs);
+    if (ret <= 0) {
+        return ret;
+    }
+    publisher->readEnd += ret;
+    while ((ret = parse_chunk(publisher)) > 0) {
+    }
+    return ret;
+}
+
+/**
+ * Read messages until the result of the command with transactionId arrives, or the setup
+ * timeout runs out.
+ */
+static int wait_for_result(RtmpPublisher *publisher, double transactionId) {
+    int64_t deadlineNs = clock_now_ns() + (int64_t) RTMP_SETUP_TIMEOUT_MS * 1000000;
+    while (publisher->resultTransactionId != transactionId) {
+        int remainingMs = (int) ((deadlineNs - clock_now_ns()) / 1000000);
+        if (remainingMs <= 0) {
+            return AVERROR(ETIMEDOUT);
+        }
+        int ret = read_messages(publisher, remainingMs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return publisher->isResultError ? AVERROR(EACCES) : 0;
+}
+
+/**
+ * Read messages until an onStatus arrives. Only NetStream.Publish.Start means we can go ahead.
+ */
+static int wait_for_publish(RtmpPublisher *publisher) {
+    int64_t deadlineNs = clock_now_ns() + (int64_t) RTMP_SETUP_TIMEOUT_MS * 1000000;
+    while (!publisher->statusCode[0]) {
+        int remainingMs = (int) ((deadlineNs - clock_now_ns()) / 1000000);
+        if (remainingMs <= 0) {
+            return AVERROR(ETIMEDOUT);
+        }
+        int ret = read_messages(publisher, remainingMs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return strcmp(publisher->statusCode, "NetStream.Publish.Start") ? AVERROR(EACCES) : 0;
+}
+
+/**
+ * Read exactly size bytes within the setup timeout.
+ */
+static int read_fully(RtmpPublisher *publisher, uint8_t *buf, int size) {
+    int64_t deadlineNs = clock_now_ns() + (int64_t) RTMP_SETUP_TIMEOUT_MS * 1000000;
+    for (int received = 0; received < size;) {
+        int remainingMs = (int) ((deadlineNs - clock_now_ns()) / 1000000);
+        if (remainingMs <= 0) {
+            return AVERROR(ETIMEDOUT);
+        }
+        int ret = socket_io_read(publisher->io, buf + received, size - received, remainingMs);
+        if (ret < 0) {
+            return ret;
+        }
+        received += ret;
+    }
+    return 0;
+}
+
+/**
+ * The plain handshake: C0 and C1 out, S0, S1 and S2 back, and S1 echoed as C2.
+ */
+static int handshake(RtmpPublisher *publisher) {
+    uint8_t *buf = av_malloc(1 + 2 * RTMP_HANDSHAKE_SIZE);
+    if (!buf) {
+        return AVERROR(ENOMEM);
+    }
+    buf[0] = RTMP_VERSION;
+    //  C1: our time, zeros, then bytes the server echoes back in S2.
+    memset(buf + 1, 0, 8);
+    uint32_t seed = (uint32_t) clock_now_ns() | 1;
+    for (int i = 9; i < 1 + RTMP_HANDSHAKE_SIZE; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        buf[i] = (uint8_t) seed;
+    }
+    int ret = socket_io_write(publisher->io, buf, 1 + RTMP_HANDSHAKE_SIZE, NULL);
+    if (ret == 0) {
+        ret = socket_io_flush(publisher->io);
+    }
+    if (ret == 0) {
+        ret = read_fully(publisher, buf, 1 + 2 * RTMP_HANDSHAKE_SIZE);
+    }
+    if (ret == 0 && buf[0] != RTMP_VERSION) {
+        ret = AVERROR_INVALIDDATA;
+    }
+    if (ret == 0) {
+        ret = socket_io_write(publisher->io, buf + 1, RTMP_HANDSHAKE_SIZE, NULL);
+    }
+    if (ret == 0) {
+        ret = socket_io_flush(publisher->io);
+    }
+    av_free(buf);
+    return ret;
+}
+
+/**
+ * Split rtmp://host[:port]/app/streamName into its parts. The app is the first path element and
+ * the stream name everything after it, query string included.
+ */
+static int parse_url(RtmpPublisher *publisher, const char *url, char *host, int hostSize,
+                     int *port) {
+    char proto[16], path[1024];
+    av_url_split(proto, sizeof(proto), NULL, 0, host, hostSize, port, path, sizeof(path), url);
+    const char *app = path[0] == '/' ? path + 1 : path;
+    const char *slash = strchr(app, '/');
+    if (strcmp(proto, "rtmp") != 0 || !host[0] || !slash || !slash[1]) {
+        return AVERROR(EINVAL);
+    }
+    if (*port <= 0) {
+        *port = RTMP_DEFAULT_PORT;
+    }
+    snprintf(publisher->app, sizeof(publisher->app), "%.*s", (int) (slash - app), app);
+    av_strlcpy(publisher->streamName, slash + 1, sizeof(publisher->streamName));
+    if (*port == RTMP_DEFAULT_PORT) {
+        snprintf(publisher->tcUrl, sizeof(publisher->tcUrl), "rtmp://%s/%s", host,
+                 publisher->app);
+    } else {
+        snprintf(publisher->tcUrl, sizeof(publisher->tcUrl), "rtmp://%s:%d/%s", host, *port,
+                 publisher->app);
+    }
+    return 0;
+}
+
+/**
+ * connect, createStream and publish, after announcing our chunk size.
+ */
+static int start_publishing(RtmpPublisher *publisher) {
+    AmfWriter *writer = av_malloc(sizeof(AmfWriter));
+    if (!writer) {
+        return AVERROR(ENOMEM);
+    }
+    uint8_t body[4];
+    AV_WB32(body, RTMP_OUT_CHUNK_SIZE);
+    int ret = send_control(publisher, RTMP_MSG_SET_CHUNK_SIZE, body, sizeof(body));
+    publisher->outChunkSize = RTMP_OUT_CHUNK_SIZE;
+
+    if (ret == 0) {
+        writer->length = 0;
+        writer->isOverflow = false;
+        amf_put_string(writer, "connect");
+        amf_put_number(writer, 1);
+        amf_put_byte(writer, AMF_OBJECT);
+        amf_put_key(writer, "app");
+        amf_put_string(writer, publisher->app);
+        amf_put_key(writer, "type");
+        amf_put_string(writer, "nonprivate");
+        amf_put_key(writer, "flashVer");
+        amf_put_string(writer, "FMLE/3.0 (compatible; FFmpegWrapper)");
+        amf_put_key(writer, "tcUrl");
+        amf_put_string(writer, publisher->tcUrl);
+        amf_put_object_end(writer);
+        publisher->resultTransactionId = 0;
+        ret = send_command(publisher, writer, 0);
+    }
+    if (ret == 0) {
+        ret = wait_for_result(publisher, 1);
+    }
+    //  Some servers want the stream released and announced first; neither gets an answer we
+    //  need to wait for.
+    if (ret == 0) {
+        begin_command(writer, "releaseStream", 2);
+        amf_put_string(writer, publisher->streamName);
+        ret = send_command(publisher, writer, 0);
+    }
+    if (ret == 0) {
+        begin_command(writer, "FCPublish", 3);
+        amf_put_string(writer, publisher->streamName);
+        ret = send_command(publisher, writer, 0);
+    }
+    if (ret == 0) {
+        begin_command(writer, "createStream", 4);
+        publisher->resultTransactionId = 0;
+        ret = send_command(publisher, writer, 0);
+    }
+    if (ret == 0) {
+        ret = wait_for_result(publisher, 4);
+    }
+    if (ret == 0) {
+        publisher->streamId = (uint32_t) publisher->resultStreamId;
+        begin_command(writer, "publish", 5);
+        amf_put_string(writer, publisher->streamName);
+        amf_put_string(writer, "live");
+        publisher->statusCode[0] = 0;
+        ret = send_command(publisher, writer, publisher->streamId);
+    }
+    if (ret == 0) {
+        ret = wait_for_publish(publisher);
+    }
+    publisher->isPublishing = ret == 0;
+    av_free(writer);
+    return ret;
+}
+
+/**
+ * Connect to url (rtmp://host[:port]/app/streamName), handshake, and get as far as publishing.
+ * The socket options and interruptCallback are as for socket_io_open(); the callback stays with
+ * the socket for every later write. Returns 0 or a negative AVERROR.
+ */
+int rtmp_publisher_open(RtmpPublisher **publisher, const char *url, int mode, int coalesceMs,
+                        int coalesceKb, int sendBufferKb, SocketIoStats *socketStats,
+                        RtmpPublisherStats *stats, const AVIOInterruptCB *interruptCallback) {
+    RtmpPublisher *p = av_mallocz(sizeof(RtmpPublisher));
+    if (!p) {
+        return AVERROR(ENOMEM);
+    }
+    char host[256];
+    int port = -1;
+    int ret = parse_url(p, url, host, sizeof(host), &port);
+    p->stats = stats;
+    p->inChunkSize = 128;
+    p->outChunkSize = 128;
+    if (ret == 0) {
+        ret = socket_io_connect(&p->io, host, port, mode, coalesceMs, coalesceKb, sendBufferKb,
+                                socketStats, interruptCallback);
+    }
+    if (ret == 0) {
+        p->bytesSentAtStart = __atomic_load_n(&socketStats->bytesSent, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->windowAckSize, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->ackedBytes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->unacknowledgedBytes, 0, __ATOMIC_RELAXED);
+        ret = handshake(p);
+    }
+    if (ret == 0) {
+        ret = start_publishing(p);
+    }
+    if (ret < 0) {
+        rtmp_publisher_close(&p);
+        return ret;
+    }
+    p->lastPollNs = clock_now_ns();
+    *publisher = p;
+    return 0;
+}
+
+/**
+ * Send onMetaData, then the AVC and AAC sequence headers: avcC is an
+ * AVCDecoderConfigurationRecord and audioConfig an AudioSpecificConfig. Either may be NULL to
+ * leave that stream out. Returns 0 or a negative AVERROR.
+ */
+int rtmp_publisher_write_header(RtmpPublisher *publisher, int width, int height,
+                                int videoBitrate, const uint8_t *avcC, int avcCSize,
+                                int sampleRate, int channels, int audioBitrate,
+                                const uint8_t *audioConfig, int audioConfigSize) {
+    AmfWriter *writer = av_malloc(sizeof(AmfWriter));
+    if (!writer) {
+        return AVERROR(ENOMEM);
+    }
+    writer->length = 0;
+    writer->isOverflow = false;
+    amf_put_string(writer, "@setDataFrame");
+    amf_put_string(writer, "onMetaData");
+    uint8_t *count = amf_reserve(writer, 5);
+    if (count) {
+        count[0] = AMF_ECMA_ARRAY;
+        AV_WB32(count + 1, (avcC ? 5 : 0) + (audioConfig ? 5 : 0));
+    }
+    if (avcC) {
+        amf_put_key(writer, "width");
+        amf_put_number(writer, width);
+        amf_put_key(writer, "height");
+        amf_put_number(writer, height);
+        amf_put_key(writer, "videodatarate");
+        amf_put_number(writer, videoBitrate / 1000.0);
+        amf_put_key(writer, "framerate");
+        amf_put_number(writer, 30);
+        amf_put_key(writer, "videocodecid");
+        amf_put_number(writer, FLV_CODEC_ID_AVC);
+    }
+    if (audioConfig) {
+        amf_put_key(writer, "audiodatarate");
+        amf_put_number(writer, audioBitrate / 1000.0);
+        amf_put_key(writer, "audiosamplerate");
+        amf_put_number(writer, sampleRate);
+        amf_put_key(writer, "audiosamplesize");
+        amf_put_number(writer, 16);
+        amf_put_key(writer, "stereo");
+        amf_put_boolean(writer, channels > 1);
+        amf_put_key(writer, "audiocodecid");
+        amf_put_number(writer, FLV_CODEC_ID_AAC);
+    }
+    amf_put_object_end(writer);
+    int ret = writer->isOverflow ? AVERROR(ENOBUFS)
+              : send_message(publisher, RTMP_CSID_COMMAND, RTMP_MSG_DATA_AMF0,
+                             publisher->streamId, 0, writer->buf, writer->length, NULL, 0, NULL);
+    av_free(writer);
+
+    if (ret == 0 && avcC) {
+        const uint8_t prefix[5] = {FLV_VIDEO_KEY_FRAME_AVC, FLV_SEQUENCE_HEADER, 0, 0, 0};
+        ret = send_message(publisher, RTMP_CSID_VIDEO, RTMP_MSG_VIDEO, publisher->streamId, 0,
+                           prefix, sizeof(prefix), avcC, avcCSize, NULL);
+    }
+    if (ret == 0 && audioConfig) {
+        const uint8_t prefix[2] = {FLV_AUDIO_AAC, FLV_SEQUENCE_HEADER};
+        ret = send_message(publisher, RTMP_CSID_AUDIO, RTMP_MSG_AUDIO, publisher->streamId, 0,
+                           prefix, sizeof(prefix), audioConfig, audioConfigSize, NULL);
+    }
+    return ret < 0 ? ret : socket_io_flush(publisher->io);
+}
+
+/**
+ * Send media timestamps relative to baseMs instead of the first one sent, so a stream that
+ * resumes on a new connection carries on from the timeline of the one before.
+ */
+void rtmp_publisher_set_base_timestamp(RtmpPublisher *publisher, int64_t baseMs) {
+    publisher->baseTimestampMs = baseMs;
+    publisher->hasBaseTimestamp = true;
+}
+
+/**
+ * Turn ptsMs into a message timestamp. Unless the base was set, the stream starts from 0 at
+ * the first thing sent.
+ */
+static uint32_t get_timestamp(RtmpPublisher *publisher, int64_t ptsMs) {
+    if (!publisher->hasBaseTimestamp) {
+        publisher->baseTimestampMs = ptsMs;
+        publisher->hasBaseTimestamp = true;
+    }
+    return (uint32_t) FFMAX(ptsMs - publisher->baseTimestampMs, 0);
+}
+
+/**
+ * Send a new AVC sequence header at ptsMs, for an encoder that has changed its parameter sets
+ * (its resolution, say) mid-stream. Video after it is decoded with the new avcC.
+ * Returns 0 or a negative AVERROR.
+ */
+int rtmp_publisher_write_video_config(RtmpPublisher *publisher, int64_t ptsMs,
+                                      const uint8_t *avcC, int avcCSize) {
+    const uint8_t prefix[5] = {FLV_VIDEO_KEY_FRAME_AVC, FLV_SEQUENCE_HEADER, 0, 0, 0};
+    int ret = send_message(publisher, RTMP_CSID_VIDEO, RTMP_MSG_VIDEO, publisher->streamId,
+                           get_timestamp(publisher, ptsMs), prefix, sizeof(prefix), avcC,
+                           avcCSize, NULL);
+    return ret < 0 ? ret : socket_io_end_packet(publisher->io);
+}
+
+/**
+ * Send one audio packet (raw AAC) or video packet (length-prefixed NAL units) at its decode
+ * time dtsMs. ctsMs is how much later video is presented (pts - dts), non-zero with B-frames.
+ * The payload is sent from buf without being copied. Returns 0 or a negative AVERROR.
+ */
+int rtmp_publisher_write_packet(RtmpPublisher *publisher, bool isVideo, bool isKeyFrame,
+                                int64_t dtsMs, int32_t ctsMs, const uint8_t *data, int size,
+                                AVBufferRef *buf) {
+    uint32_t timestamp = get_timestamp(publisher, dtsMs);
+    int ret;
+    if (isVideo) {
+        //  The message timestamp is the decode time; the composition time offset is a signed
+        //  24-bit field after the packet type.
+        const uint8_t prefix[5] = {isKeyFrame ? FLV_VIDEO_KEY_FRAME_AVC
+                                              : FLV_VIDEO_INTER_FRAME_AVC,
+                                   FLV_MEDIA_PACKET, (uint8_t) (ctsMs >> 16),
+                                   (uint8_t) (ctsMs >> 8), (uint8_t) ctsMs};
+        ret = send_message(publisher, RTMP_CSID_VIDEO, RTMP_MSG_VIDEO, publisher->streamId,
+                           timestamp, prefix, sizeof(prefix), data, size, buf);
+    } else {
+        const uint8_t prefix[2] = {FLV_AUDIO_AAC, FLV_MEDIA_PACKET};
+        ret = send_message(publisher, RTMP_CSID_AUDIO, RTMP_MSG_AUDIO, publisher->streamId,
+                           timestamp, prefix, sizeof(prefix), data, size, buf);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if ((ret = socket_io_end_packet(publisher->io)) < 0) {
+        return ret;
+    }
+    //  A sender that never runs dry still has to answer pings.
+    if (clock_now_ns() - publisher->lastPollNs >= (int64_t) RTMP_POLL_INTERVAL_MS * 1000000) {
+        return rtmp_publisher_poll(publisher);
+    }
+    return 0;
+}
+
+/**
+ * Handle whatever the server has sent (pings, acknowledgements, chunk size changes) without
+ * waiting, and send anything the socket has held back too long. Returns 0 or a negative AVERROR.
+ */
+int rtmp_publisher_poll(RtmpPublisher *publisher) {
+    publisher->lastPollNs = clock_now_ns();
+    int ret = read_messages(publisher, 0);
+    return ret < 0 ? ret : socket_io_poll(publisher->io);
+}
+
+/**
+ * Unpublish if we got that far, then close the connection and free the publisher.
+ */
+void rtmp_publisher_close(RtmpPublisher **publisher) {
+    RtmpPublisher *p = *publisher;
+    if (!p) {
+        return;
+    }
+    if (p->isPublishing) {
+        AmfWriter *writer = av_malloc(sizeof(AmfWriter));
+        if (writer) {
+            begin_command(writer, "FCUnpublish", 6);
+            amf_put_string(writer, p->streamName);
+            if (send_command(p, writer, 0) == 0) {
+                begin_command(writer, "deleteStream", 7);
+                amf_put_number(writer, p->streamId);
+                send_command(p, writer, 0);
+            }
+            av_free(writer);
+        }
+    }
+    //  Closing with the server's acknowledgements still unread would reset the connection and
+    //  could cost it the end of the stream, so hang up our side and drain until it closes too.
+    if (p->io && socket_io_flush(p->io) == 0 && shutdown(p->io->fd, SHUT_WR) == 0) {
+        int64_t deadlineNs = clock_now_ns() + RTMP_CLOSE_TIMEOUT_MS * 1000000LL;
+        int64_t remainingMs;
+        while ((remainingMs = (deadlineNs - clock_now_ns()) / 1000000) > 0
+               && socket_io_read(p->io, p->readBuffer, sizeof(p->readBuffer),
+                                 (int) remainingMs) >= 0) {
+        }
+    }
+    socket_io_close(&p->io);
+    for (int i = 0; i < RTMP_MAX_IN_CHUNK_STREAMS; i++) {
+        av_freep(&p->in[i].message);
+    }
+    av_freep(publisher);
+}
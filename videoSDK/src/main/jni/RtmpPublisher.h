@@ -0,0 +1,184 @@
+#ifndef RTMP_PUBLISHER_H
+#define RTMP_PUBLISHER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "libavutil/buffer.h"
+#include "SocketIo.h"
+
+#define RTMP_DEFAULT_PORT 1935
+//  Chunk size we ask for once connected. Big enough that most packets are a single chunk.
+#define RTMP_OUT_CHUNK_SIZE 65536
+//  Biggest chunk we accept from the server; they normally stay at 128 or a few KB.
+#define RTMP_MAX_IN_CHUNK_SIZE 65536
+//  Biggest message we reassemble from the server; we only expect control and command messages.
+#define RTMP_MAX_IN_MESSAGE_SIZE (64 * 1024)
+//  Incoming chunk streams we keep state for at once.
+#define RTMP_MAX_IN_CHUNK_STREAMS 8
+//  How long connect, createStream and publish may each take.
+#define RTMP_SETUP_TIMEOUT_MS 10000
+//  How long closing waits for the server to hang up after we have.
+#define RTMP_CLOSE_TIMEOUT_MS 1000
+//  How often a busy sender looks for pings and acknowledgements between packets.
+#define RTMP_POLL_INTERVAL_MS 100
+
+//  Chunk stream IDs we send on.
+#define RTMP_CSID_CONTROL 2
+#define RTMP_CSID_COMMAND 3
+#define RTMP_CSID_AUDIO 4
+#define RTMP_CSID_VIDEO 6
+#define RTMP_NUM_OUT_CHUNK_STREAMS 7
+
+/**
+ * What we last sent on one chunk stream, so the next message's header can leave out whatever
+ * hasn't changed.
+ */
+typedef struct rtmp_out_chunk_stream_t {
+    bool hasSent;
+    //  Whether timestampDelta is valid for a type-3 header; not after a type-0 one.
+    bool hasDelta;
+    uint32_t streamId;
+    uint32_t length;
+    uint8_t type;
+    uint32_t timestamp;
+    uint32_t timestampDelta;
+} RtmpOutChunkStream;
+
+/**
+ * The header fields and the partly reassembled message on one incoming chunk stream.
+ */
+typedef struct rtmp_in_chunk_stream_t {
+    int csid;
+    uint32_t timestamp;
+    uint32_t timestampDelta;
+    uint32_t length;
+    uint8_t type;
+    uint32_t streamId;
+    bool hasExtendedTimestamp;
+    uint8_t *message;
+    uint32_t received;
+} RtmpInChunkStream;
+
+/**
+ * Counters for one destination's RTMP connection, on top of its SocketIoStats. Written by the
+ * sender thread only, read from anywhere.
+ */
+typedef struct rtmp_publisher_stats_t {
+    uint64_t messages;
+    uint64_t chunks;
+    //  Chunks of a message after its first, which cost one header byte each.
+    uint64_t continuationChunks;
+    //  Message headers shrunk to type 1, 2 or 3 because fields repeated.
+    uint64_t compressedHeaders;
+    //  What the server says it has received of what we sent on this connection, what was still
+    //  unacknowledged when it said so, and how often it says so.
+    uint64_t ackedBytes;
+    uint64_t unacknowledgedBytes;
+    uint32_t windowAckSize;
+    uint32_t pings;
+} RtmpPublisherStats;
+
+/**
+ * A publishing RTMP connection: handshake, connect/createStream/publish, then FLV-bodied audio
+ * and video messages written as chunks straight from the packet buffers. Owned by one sender
+ * thread.
+ */
+typedef struct rtmp_publisher_t {
+    SocketIo *io;
+    char app[256];
+    char streamName[512];
+    char tcUrl[1024];
+    uint32_t streamId;
+    int outChunkSize;
+    int inChunkSize;
+    RtmpOutChunkStream out[RTMP_NUM_OUT_CHUNK_STREAMS];
+    RtmpInChunkStream in[RTMP_MAX_IN_CHUNK_STREAMS];
+
+    uint8_t readBuffer[RTMP_MAX_IN_CHUNK_SIZE + 64];
+    int readStart;
+    int readEnd;
+    //  Bytes read from the server and how many of them we've acknowledged, against the window
+    //  the server asked for.
+    uint64_t bytesReceived;
+    uint64_t bytesAcknowledged;
+    uint32_t windowAckSize;
+    //  The server's view of what we've sent: its last acknowledgement, against what we had sent
+    //  on this connection.
+    uint32_t lastAckSequence;
+    uint64_t bytesSentAtStart;
+    int64_t lastPollNs;
+
+    //  Answers to the setup commands, filled in as messages arrive.
+    bool isPublishing;
+    double resultTransactionId;
+    double resultStreamId;
+    bool isResultError;
+    char statusCode[128];
+
+    //  Media timestamps go out relative to the first one, as the FLV muxer does, unless the
+    //  caller has set the base to carry on an earlier connection's timeline.
+    bool hasBaseTimestamp;
+    int64_t baseTimestampMs;
+
+    RtmpPublisherStats *stats;
+} RtmpPublisher;
+
+/**
+ * Return whether url is an rtmp:// URL we can publish to ourselves.
+ */
+bool rtmp_publisher_supports_url(const char *url);
+
+/**
+ * Connect to url (rtmp://host[:port]/app/streamName), handshake, and get as far as publishing.
+ * The socket options and interruptCallback are as for socket_io_open(); the callback stays with
+ * the socket for every later write. Returns 0 or a negative AVERROR.
+ */
+int rtmp_publisher_open(RtmpPublisher **publisher, const char *url, int mode, int coalesceMs,
+                        int coalesceKb, int sendBufferKb, SocketIoStats *socketStats,
+                        RtmpPublisherStats *stats, const AVIOInterruptCB *interruptCallback);
+
+/**
+ * Send onMetaData, then the AVC and AAC sequence headers: avcC is an
+ * AVCDecoderConfigurationRecord and audioConfig an AudioSpecificConfig. Either may be NULL to
+ * leave that stream out. Returns 0 or a negative AVERROR.
+ */
+int rtmp_publisher_write_header(RtmpPublisher *publisher, int width, int height,
+                                int videoBitrate, const uint8_t *avcC, int avcCSize,
+                                int sampleRate, int channels, int audioBitrate,
+                                const uint8_t *audioConfig, int audioConfigSize);
+
+/**
+ * Send a new AVC sequence header at ptsMs, for an encoder that has changed its parameter sets
+ * (its resolution, say) mid-stream. Video after it is decoded with the new avcC.
+ * Returns 0 or a negative AVERROR.
+ */
+int rtmp_publisher_write_video_config(RtmpPublisher *publisher, int64_t ptsMs,
+                                      const uint8_t *avcC, int avcCSize);
+
+/**
+ * Send media timestamps relative to baseMs instead of the first one sent, so a stream that
+ * resumes on a new connection carries on from the timeline of the one before.
+ */
+void rtmp_publisher_set_base_timestamp(RtmpPublisher *publisher, int64_t baseMs);
+
+/**
+ * Send one audio packet (raw AAC) or video packet (length-prefixed NAL units) at its decode
+ * time dtsMs. ctsMs is how much later video is presented (pts - dts), non-zero with B-frames.
+ * The payload is sent from buf without being copied. Returns 0 or a negative AVERROR.
+ */
+int rtmp_publisher_write_packet(RtmpPublisher *publisher, bool isVideo, bool isKeyFrame,
+                                int64_t dtsMs, int32_t ctsMs, const uint8_t *data, int size,
+                                AVBufferRef *buf);
+
+/**
+ * Handle whatever the server has sent (pings, acknowledgements, chunk size changes) without
+ * waiting, and send anything the socket has held back too long. Returns 0 or a negative AVERROR.
+ */
+int rtmp_publisher_poll(RtmpPublisher *publisher);
+
+/**
+ * Unpublish if we got that far, then close the connection and free the publisher.
+ */
+void rtmp_publisher_close(RtmpPublisher **publisher);
+
+#endif /* RTMP_PUBLISHER_H */
@@ -0,0 +1,406 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include "libavformat/avformat.h"
+#include "libavutil/mem.h"
+#include "Clock.h"
+#include "SocketIo.h"
+
+#define ADD_RELAXED(p, n) __atomic_store_n(p, *(p) + (n), __ATOMIC_RELAXED)
+
+/**
+ * Return whether url is one we can open ourselves (tcp://host:port).
+ */
+bool socket_io_supports_url(const char *url) {
+    return url && strncmp(url, "tcp://", 6) == 0;
+}
+
+/**
+ * Wait up to timeoutMs (forever if negative) for fd to be ready for events, checking the
+ * interrupt callback every SOCKET_IO_WAIT_SLICE_MS. Returns 1 once it's ready, 0 if the time ran
+ * out, or a negative AVERROR (AVERROR_EXIT when interrupted).
+ */
+static int wait_socket(int fd, short events, const AVIOInterruptCB *interruptCallback,
+                       int timeoutMs) {
+    struct pollfd pollFd = {.fd = fd, .events = events};
+    int64_t deadlineNs = clock_now_ns() + (int64_t) timeoutMs * 1000000;
+    for (;;) {
+        int sliceMs = SOCKET_IO_WAIT_SLICE_MS;
+        if (timeoutMs >= 0) {
+            int64_t remainingNs = FFMAX(deadlineNs - clock_now_ns(), 0);
+            sliceMs = (int) FFMIN(sliceMs, (remainingNs + 999999) / 1000000);
+        }
+        int ret = poll(&pollFd, 1, sliceMs);
+        if (ret > 0) {
+            return 1;
+        }
+        if (ret < 0 && errno != EINTR) {
+            return AVERROR(errno);
+        }
+        if (timeoutMs >= 0 && clock_now_ns() >= deadlineNs) {
+            return 0;
+        }
+        if (interruptCallback->callback && interruptCallback->callback(interruptCallback->opaque)) {
+            return AVERROR_EXIT;
+        }
+    }
+}
+
+/**
+ * Resolve host and connect a TCP socket to it. The socket is left non-blocking: sends and reads
+ * wait in poll() so they can be interrupted. Returns the descriptor or a negative AVERROR.
+ */
+static int connect_socket(const char *host, int port, const AVIOInterruptCB *interruptCallback) {
+    struct addrinfo hints, *addresses = NULL;
+    char service[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) {
+        return AVERROR(EHOSTUNREACH);
+    }
+    int ret = AVERROR(ECONNREFUSED);
+    for (struct addrinfo *address = addresses; address; address = address->ai_next) {
+        int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd < 0) {
+            ret = AVERROR(errno);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+            ret = fd;
+            break;
+        }
+        ret = AVERROR(errno);
+        if (errno == EINPROGRESS && (ret = wait_socket(fd, POLLOUT, interruptCallback, -1)) > 0) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (!error) {
+                ret = fd;
+                break;
+            }
+            ret = AVERROR(error);
+        }
+        close(fd);
+        if (ret == AVERROR_EXIT) {
+            break;
+        }
+    }
+    freeaddrinfo(addresses);
+    return ret;
+}
+
+static void add_segment(SocketIo *io, const uint8_t *data, int size) {
+    if (!io->numSegments) {
+        io->firstPendingNs = clock_now_ns();
+    }
+    io->segments[io->numSegments].iov_base = (void *) data;
+    io->segments[io->numSegments].iov_len = (size_t) size;
+    io->numSegments++;
+    io->pendingBytes += size;
+}
+
+/**
+ * Queue size bytes at data to be sent. When buf is given, data must lie inside it and is sent
+ * from there, with a reference held on buf until it's gone; otherwise it's copied. Returns 0 or
+ * a negative AVERROR.
+ */
+int socket_io_write(SocketIo *io, const uint8_t *data, int size, AVBufferRef *buf) {
+    int ret;
+    if (buf) {
+        bool isPinned = io->numPinned && io->pinned[io->numPinned - 1]->buffer == buf->buffer;
+        if (io->numSegments == SOCKET_IO_MAX_SEGMENTS
+            || (!isPinned && io->numPinned == SOCKET_IO_MAX_SEGMENTS)) {
+            if ((ret = socket_io_flush(io)) < 0) {
+                return ret;
+            }
+            isPinned = false;
+        }
+        if (!isPinned) {
+            if (!(io->pinned[io->numPinned] = av_buffer_ref(buf))) {
+                return AVERROR(ENOMEM);
+            }
+            io->numPinned++;
+        }
+        add_segment(io, data, size);
+        ADD_RELAXED(&io->stats->referencedBytes, (uint64_t) size);
+        return 0;
+    }
+
+    for (int copied = 0; copied < size;) {
+        if (io->stagingUsed == SOCKET_IO_STAGING_SIZE
+            || io->numSegments == SOCKET_IO_MAX_SEGMENTS) {
+            if ((ret = socket_io_flush(io)) < 0) {
+                return ret;
+            }
+        }
+        int length = FFMIN(size - copied, SOCKET_IO_STAGING_SIZE - io->stagingUsed);
+        uint8_t *dest = io->staging + io->stagingUsed;
+        memcpy(dest, data + copied, (size_t) length);
+        struct iovec *last = io->numSegments ? &io->segments[io->numSegments - 1] : NULL;
+        if (last && (uint8_t *) last->iov_base + last->iov_len == dest) {
+            //  Straight after the previous copy, so it's the same segment.
+            last->iov_len += (size_t) length;
+            io->pendingBytes += length;
+        } else {
+            add_segment(io, dest, length);
+        }
+        io->stagingUsed += length;
+        copied += length;
+    }
+    ADD_RELAXED(&io->stats->copiedBytes, (uint64_t) size);
+    return 0;
+}
+
+/**
+ * Make room for size bytes in the staging area, queued to be sent in order with everything
+ * else, and point *dest at them so the caller can build a header in place. size must be no more
+ * than SOCKET_IO_STAGING_SIZE. Returns 0 or a negative AVERROR.
+ */
+int socket_io_reserve(SocketIo *io, int size, uint8_t **dest) {
+    int ret;
+    if (io->stagingUsed + size > SOCKET_IO_STAGING_SIZE
+        || io->numSegments == SOCKET_IO_MAX_SEGMENTS) {
+        if ((ret = socket_io_flush(io)) < 0) {
+            return ret;
+        }
+    }
+    *dest = io->staging + io->stagingUsed;
+    struct iovec *last = io->numSegments ? &io->segments[io->numSegments - 1] : NULL;
+    if (last && (uint8_t *) last->iov_base + last->iov_len == *dest) {
+        last->iov_len += (size_t) size;
+        io->pendingBytes += size;
+    } else {
+        add_segment(io, *dest, size);
+    }
+    io->stagingUsed += size;
+    ADD_RELAXED(&io->stats->copiedBytes, (uint64_t) size);
+    return 0;
+}
+
+/**
+ * Read up to size bytes, waiting at most timeoutMs for the first of them; 0 doesn't wait.
+ * Returns the number read, 0 if nothing arrived in time, or a negative AVERROR (AVERROR_EOF once
+ * the peer has closed the connection, AVERROR_EXIT if interrupted).
+ */
+int socket_io_read(SocketIo *io, uint8_t *buf, int size, int timeoutMs) {
+    int ret = wait_socket(io->fd, POLLIN, &io->interruptCallback, timeoutMs);
+    if (ret <= 0) {
+        return ret;
+    }
+    ssize_t length = recv(io->fd, buf, (size_t) size, MSG_DONTWAIT);
+    if (length < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : AVERROR(errno);
+    }
+    return length ? (int) length : AVERROR_EOF;
+}
+
+/**
+ * The AVIOContext's write callback. The payload of the current packet is referenced where it
+ * is; anything else is copied.
+ */
+static int write_packet(void *opaque, uint8_t *buf, int size) {
+    SocketIo *io = opaque;
+    AVBufferRef *current = io->currentBuf;
+    bool isPayload = current && buf >= current->data
+                     && buf + size <= current->data + current->size;
+    int ret = socket_io_write(io, buf, size, isPayload ? current : NULL);
+    return ret < 0 ? ret : size;
+}
+
+/**
+ * Connect to url and set up the AVIOContext. Delays are in ms, sizes in KB; 0 takes the
+ * defaults. interruptCallback may be NULL; when it fires, whatever is blocked returns
+ * AVERROR_EXIT. Returns 0 or a negative AVERROR.
+ */
+int socket_io_open(SocketIo **io, const char *url, int mode, int coalesceMs, int coalesceKb,
+                   int sendBufferKb, SocketIoStats *stats,
+                   const AVIOInterruptCB *interruptCallback) {
+    char proto[16], host[256], path[16];
+    int port = -1;
+    av_url_split(proto, sizeof(proto), NULL, 0, host, sizeof(host), &port, path, sizeof(path),
+                 url);
+    if (strcmp(proto, "tcp") != 0 || !host[0] || port <= 0) {
+        return AVERROR(EINVAL);
+    }
+    return socket_io_connect(io, host, port, mode, coalesceMs, coalesceKb, sendBufferKb, stats,
+                             interruptCallback);
+}
+
+/**
+ * Like socket_io_open(), for a host and port rather than a tcp:// URL.
+ */
+int socket_io_connect(SocketIo **io, const char *host, int port, int mode, int coalesceMs,
+                      int coalesceKb, int sendBufferKb, SocketIoStats *stats,
+                      const AVIOInterruptCB *interruptCallback) {
+    SocketIo *s = av_mallocz(sizeof(SocketIo));
+    uint8_t *buffer = av_malloc(SOCKET_IO_AVIO_BUFFER_SIZE);
+    if (!s || !buffer) {
+        av_free(s);
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    s->mode = mode;
+    s->coalesceNs = (int64_t) (coalesceMs > 0 ? coalesceMs : DEFAULT_SOCKET_IO_COALESCE_MS)
+                    * 1000000;
+    s->coalesceBytes = (coalesceKb > 0 ? coalesceKb : DEFAULT_SOCKET_IO_COALESCE_KB) * 1024;
+    s->stats = stats;
+    if (interruptCallback) {
+        s->interruptCallback = *interruptCallback;
+    }
+    s->fd = connect_socket(host, port, &s->interruptCallback);
+    if (s->fd < 0) {
+        int ret = s->fd;
+        av_free(s);
+        av_free(buffer);
+        return ret;
+    }
+
+    int value = 1;
+    if (mode == SOCKET_IO_LOW_LATENCY) {
+        setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+    } else {
+        value = (sendBufferKb > 0 ? sendBufferKb : DEFAULT_SOCKET_IO_SEND_BUFFER_KB) * 1024;
+        setsockopt(s->fd, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value));
+    }
+    socklen_t length = sizeof(value);
+    if (getsockopt(s->fd, SOL_SOCKET, SO_SNDBUF, &value, &length) == 0) {
+        __atomic_store_n(&stats->sendBufferBytes, (uint32_t) value, __ATOMIC_RELAXED);
+    }
+
+    s->avio = avio_alloc_context(buffer, SOCKET_IO_AVIO_BUFFER_SIZE, 1, s, NULL, write_packet,
+                                 NULL);
+    if (!s->avio) {
+        close(s->fd);
+        av_free(s);
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    //  Large writes (payloads) skip the AVIO buffer and reach write_packet() where they are.
+    s->avio->direct = 1;
+    s->avio->seekable = 0;
+    *io = s;
+    return 0;
+}
+
+/**
+ * Tell the socket which buffer the next packet's payload lives in, so it can be sent from there
+ * instead of copied. buf may be NULL.
+ */
+void socket_io_begin_packet(SocketIo *io, AVBufferRef *buf) {
+    io->currentBuf = buf;
+}
+
+/**
+ * Finish a packet, whether it went through io->avio or socket_io_write(), and send what's
+ * pending if the mode says it's time. Returns 0 or a negative AVERROR.
+ */
+int socket_io_end_packet(SocketIo *io) {
+    //  Moves the muxer's small writes out of the AVIO buffer and into a segment.
+    avio_flush(io->avio);
+    io->currentBuf = NULL;
+    if (io->avio->error < 0) {
+        return io->avio->error;
+    }
+    return io->mode == SOCKET_IO_LOW_LATENCY || io->pendingBytes >= io->coalesceBytes
+           ? socket_io_flush(io) : socket_io_poll(io);
+}
+
+/**
+ * Send whatever has been held back longer than the coalescing delay. Call it when there's
+ * nothing to write, so a quiet stream isn't left sitting in the buffer.
+ */
+int socket_io_poll(SocketIo *io) {
+    if (io->numSegments && clock_now_ns() - io->firstPendingNs >= io->coalesceNs) {
+        return socket_io_flush(io);
+    }
+    return 0;
+}
+
+/**
+ * Send everything pending, waiting for room in the socket as long as the interrupt callback
+ * allows. Returns 0 or a negative AVERROR; what wasn't sent is dropped either way.
+ */
+int socket_io_flush(SocketIo *io) {
+    struct iovec *segment = io->segments;
+    int count = io->numSegments;
+    int ret = 0;
+    while (count > 0) {
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = segment;
+        message.msg_iovlen = (size_t) count;
+        //  sendmsg() rather than writev() so a closed peer is an EPIPE, not a SIGPIPE.
+        ssize_t sent = sendmsg(io->fd, &message, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                //  The peer isn't taking data fast enough; this is where a dead uplink blocks.
+                if ((ret = wait_socket(io->fd, POLLOUT, &io->interruptCallback, -1)) < 0) {
+                    break;
+                }
+                ret = 0;
+                continue;
+            }
+            ret = AVERROR(errno);
+            break;
+        }
+        ADD_RELAXED(&io->stats->writevCalls, 1);
+        ADD_RELAXED(&io->stats->bytesSent, (uint64_t) sent);
+        //  A short send leaves the rest of the current segment and everything after it.
+        while (count > 0 && (size_t) sent >= segment->iov_len) {
+            sent -= segment->iov_len;
+            segment++;
+            count--;
+        }
+        if (count > 0) {
+            segment->iov_base = (uint8_t *) segment->iov_base + sent;
+            segment->iov_len -= (size_t) sent;
+        }
+    }
+    for (int i = 0; i < io->numPinned; i++) {
+        av_buffer_unref(&io->pinned[i]);
+    }
+    io->numPinned = 0;
+    io->numSegments = 0;
+    io->pendingBytes = 0;
+    io->stagingUsed = 0;
+
+    int queued;
+    if (ret == 0 && ioctl(io->fd, SIOCOUTQ, &queued) == 0) {
+        __atomic_store_n(&io->stats->sendQueueBytes, (uint32_t) queued, __ATOMIC_RELAXED);
+        if ((uint32_t) queued > io->stats->maxSendQueueBytes) {
+            __atomic_store_n(&io->stats->maxSendQueueBytes, (uint32_t) queued, __ATOMIC_RELAXED);
+        }
+    }
+    return ret;
+}
+
+/**
+ * Flush, close the socket and free the context. The muxer must be done with io->avio.
+ */
+void socket_io_close(SocketIo **io) {
+    SocketIo *s = *io;
+    if (!s) {
+        return;
+    }
+    avio_flush(s->avio);
+    socket_io_flush(s);
+    av_freep(&s->avio->buffer);
+    av_freep(&s->avio);
+    close(s->fd);
+    av_freep(io);
+}
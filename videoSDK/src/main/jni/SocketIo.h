@@ -0,0 +1,148 @@
+#ifndef SOCKET_IO_H
+#define SOCKET_IO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include "libavformat/avio.h"
+#include "libavutil/buffer.h"
+
+//  How a destination's bytes get to its socket. 0 leaves the URL to FFmpeg's own protocols.
+#define SOCKET_IO_OFF 0
+//  Send every packet as soon as it's muxed, with Nagle off.
+#define SOCKET_IO_LOW_LATENCY 1
+//  Hold packets back until coalesceMs or coalesceKb is reached, with a big send buffer.
+#define SOCKET_IO_THROUGHPUT 2
+
+#define DEFAULT_SOCKET_IO_COALESCE_MS 20
+#define DEFAULT_SOCKET_IO_COALESCE_KB 64
+//  SO_SNDBUF asked for in throughput mode; 0 leaves the kernel default.
+#define DEFAULT_SOCKET_IO_SEND_BUFFER_KB 512
+//  The muxer's small writes (tag headers, sizes) collect here before becoming one segment.
+#define SOCKET_IO_AVIO_BUFFER_SIZE 4096
+//  Copied bytes waiting to be sent. Payloads aren't copied, so this only holds the small stuff.
+#define SOCKET_IO_STAGING_SIZE (16 * 1024)
+//  Segments and pinned payload buffers per writev().
+#define SOCKET_IO_MAX_SEGMENTS 64
+//  How often a blocked connect, send or read checks the interrupt callback.
+#define SOCKET_IO_WAIT_SLICE_MS 100
+
+/**
+ * Counters for one destination's socket. They outlive the socket itself, so they carry on
+ * across reconnects. Written by the sender thread only, read from anywhere.
+ */
+typedef struct socket_io_stats_t {
+    uint64_t bytesSent;
+    uint64_t writevCalls;
+    //  Payload bytes sent straight out of the packet buffers, and small bytes that were copied.
+    uint64_t referencedBytes;
+    uint64_t copiedBytes;
+    //  Unsent plus unacknowledged bytes in the kernel, sampled after each flush.
+    uint32_t sendQueueBytes;
+    uint32_t maxSendQueueBytes;
+    //  SO_SNDBUF as the kernel reports it (Linux doubles what was asked for).
+    uint32_t sendBufferBytes;
+} SocketIoStats;
+
+/**
+ * A TCP connection behind an AVIOContext for the muxer to write into. Writes are gathered into
+ * iovecs: payloads are referenced where they sit in the packet buffer, everything else is copied
+ * into a small staging area, and the lot goes out in a single writev(). Calls block until done
+ * or until the interrupt callback says to give up, like FFmpeg's own protocols.
+ * Owned by one sender thread.
+ */
+typedef struct socket_io_t {
+    int fd;
+    int mode;
+    AVIOInterruptCB interruptCallback;
+    int64_t coalesceNs;
+    int coalesceBytes;
+    AVIOContext *avio;
+
+    struct iovec segments[SOCKET_IO_MAX_SEGMENTS];
+    int numSegments;
+    int pendingBytes;
+    int64_t firstPendingNs;
+    uint8_t staging[SOCKET_IO_STAGING_SIZE];
+    int stagingUsed;
+
+    //  The payload of the packet being muxed, and the buffers pending segments point into.
+    AVBufferRef *currentBuf;
+    AVBufferRef *pinned[SOCKET_IO_MAX_SEGMENTS];
+    int numPinned;
+
+    SocketIoStats *stats;
+} SocketIo;
+
+/**
+ * Return whether url is one we can open ourselves (tcp://host:port).
+ */
+bool socket_io_supports_url(const char *url);
+
+/**
+ * Connect to url and set up the AVIOContext. Delays are in ms, sizes in KB; 0 takes the
+ * defaults. interruptCallback may be NULL; when it fires, whatever is blocked returns
+ * AVERROR_EXIT. Returns 0 or a negative AVERROR.
+ */
+int socket_io_open(SocketIo **io, const char *url, int mode, int coalesceMs, int coalesceKb,
+                   int sendBufferKb, SocketIoStats *stats,
+                   const AVIOInterruptCB *interruptCallback);
+
+/**
+ * Like socket_io_open(), for a host and port rather than a tcp:// URL.
+ */
+int socket_io_connect(SocketIo **io, const char *host, int port, int mode, int coalesceMs,
+                      int coalesceKb, int sendBufferKb, SocketIoStats *stats,
+                      const AVIOInterruptCB *interruptCallback);
+
+/**
+ * Queue size bytes at data to be sent. When buf is given, data must lie inside it and is sent
+ * from there, with a reference held on buf until it's gone; otherwise it's copied. Returns 0 or
+ * a negative AVERROR.
+ */
+int socket_io_write(SocketIo *io, const uint8_t *data, int size, AVBufferRef *buf);
+
+/**
+ * Make room for size bytes in the staging area, queued to be sent in order with everything
+ * else, and point *dest at them so the caller can build a header in place. size must be no more
+ * than SOCKET_IO_STAGING_SIZE. Returns 0 or a negative AVERROR.
+ */
+int socket_io_reserve(SocketIo *io, int size, uint8_t **dest);
+
+/**
+ * Read up to size bytes, waiting at most timeoutMs for the first of them; 0 doesn't wait.
+ * Returns the number read, 0 if nothing arrived in time, or a negative AVERROR (AVERROR_EOF once
+ * the peer has closed the connection, AVERROR_EXIT if interrupted).
+ */
+int socket_io_read(SocketIo *io, uint8_t *buf, int size, int timeoutMs);
+
+/**
+ * Tell the socket which buffer the next packet's payload lives in, so it can be sent from there
+ * instead of copied. buf may be NULL.
+ */
+void socket_io_begin_packet(SocketIo *io, AVBufferRef *buf);
+
+/**
+ * Finish a packet, whether it went through io->avio or socket_io_write(), and send what's
+ * pending if the mode says it's time. Returns 0 or a negative AVERROR.
+ */
+int socket_io_end_packet(SocketIo *io);
+
+/**
+ * Send whatever has been held back longer than the coalescing delay. Call it when there's
+ * nothing to write, so a quiet stream isn't left sitting in the buffer.
+ */
+int socket_io_poll(SocketIo *io);
+
+/**
+ * Send everything pending, waiting for room in the socket as long as the interrupt callback
+ * allows. Returns 0 or a negative AVERROR; what wasn't sent is dropped either way.
+ */
+int socket_io_flush(SocketIo *io);
+
+/**
+ * Flush, close the socket and free the context. The muxer must be done with io->avio.
+ */
+void socket_io_close(SocketIo **io);
+
+#endif /* SOCKET_IO_H */
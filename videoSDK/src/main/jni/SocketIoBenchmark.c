@@ -0,0 +1,273 @@
+/**
+ * Check and benchmark for SocketIo against a local TCP sink. Not part of the library; build it
+ * on Linux against a host FFmpeg 3.x with something like
+ *
+ *     gcc --std=c99 -D_GNU_SOURCE -O2 -I. SocketIoBenchmark.c SocketIo.c Watchdog.c Stats.c \
+ *         -o socket_io_benchmark -lavformat -lavutil -lpthread
+ *
+ * and run it with no arguments. Writes the same FLV-shaped tags through both modes, checks the
+ * sink received them byte for byte, and reports syscalls, copying and kernel queue occupancy.
+ * Then writes to a sink that stops reading, and checks the watchdog gets the writer out within
+ * its deadline.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "libavformat/avio.h"
+#include "libavutil/buffer.h"
+#include "Clock.h"
+#include "SocketIo.h"
+#include "Watchdog.h"
+
+//  About 30 s of 30 fps video at 2 Mbps with its AAC, interleaved.
+#define NUM_VIDEO_PACKETS 900
+#define VIDEO_PACKET_SIZE 8192
+#define AUDIO_PACKETS_PER_VIDEO 2
+#define AUDIO_PACKET_SIZE 256
+#define FLV_TAG_HEADER_SIZE 11
+//  The packet deadline for the stalled sink, and how late giving up may be.
+#define STALL_TIMEOUT_MS 500
+#define STALL_SLACK_MS (2 * SOCKET_IO_WAIT_SLICE_MS)
+
+typedef struct sink_t {
+    int listenFd;
+    uint64_t bytes;
+    uint32_t checksum;
+    //  For the stalled sink: it stops reading until this is set.
+    int isReleased;
+} Sink;
+
+static uint32_t checksum_update(uint32_t checksum, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        checksum = (checksum ^ data[i]) * 16777619u;
+    }
+    return checksum;
+}
+
+/**
+ * Accept one connection and read it to the end, the way a server would.
+ */
+static void *run_sink(void *arg) {
+    Sink *sink = arg;
+    uint8_t buf[65536];
+    int fd = accept(sink->listenFd, NULL, NULL);
+    if (fd < 0) {
+        return NULL;
+    }
+    ssize_t length;
+    while ((length = read(fd, buf, sizeof(buf))) > 0) {
+        sink->bytes += (uint64_t) length;
+        sink->checksum = checksum_update(sink->checksum, buf, (size_t) length);
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Write one FLV tag the way the muxer does: header and trailer through the AVIO buffer, the
+ * payload with a single avio_write().
+ */
+static void write_tag(AVIOContext *avio, int type, const uint8_t *payload, int size, int ms) {
+    avio_w8(avio, type);
+    avio_wb24(avio, size);
+    avio_wb24(avio, ms & 0xffffff);
+    avio_w8(avio, (ms >> 24) & 0x7f);
+    avio_wb24(avio, 0);
+    avio_write(avio, payload, size);
+    avio_wb32(avio, size + FLV_TAG_HEADER_SIZE);
+}
+
+/**
+ * Start listening on an ephemeral loopback port and return the tcp:// URL for it in url.
+ */
+static int open_sink(Sink *sink, char *url, int urlSize) {
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sink->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sink->listenFd < 0
+        || bind(sink->listenFd, (struct sockaddr *) &address, addressLength) < 0
+        || listen(sink->listenFd, 1) < 0
+        || getsockname(sink->listenFd, (struct sockaddr *) &address, &addressLength) < 0) {
+        fprintf(stderr, "Couldn't start the sink.\n");
+        return -1;
+    }
+    sink->checksum = 2166136261u;
+    snprintf(url, (size_t) urlSize, "tcp://127.0.0.1:%d", ntohs(address.sin_port));
+    return 0;
+}
+
+static int run_mode(const char *name, int mode, AVBufferRef *video, AVBufferRef *audio,
+                    uint32_t expectedChecksum, uint64_t expectedBytes) {
+    Sink sink = {0};
+    char url[64];
+    if (open_sink(&sink, url, sizeof(url)) < 0) {
+        return 1;
+    }
+    pthread_t sinkThread;
+    pthread_create(&sinkThread, NULL, run_sink, &sink);
+
+    SocketIoStats stats = {0};
+    SocketIo *io = NULL;
+    int ret = socket_io_open(&io, url, mode, 0, 0, 0, &stats, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Couldn't connect to %s: %d\n", url, ret);
+        return 1;
+    }
+    int64_t startNs = clock_now_ns();
+    int numPackets = 0;
+    for (int i = 0; i < NUM_VIDEO_PACKETS && ret >= 0; i++) {
+        socket_io_begin_packet(io, video);
+        write_tag(io->avio, 9, video->data, video->size, i * 33);
+        ret = socket_io_end_packet(io);
+        numPackets++;
+        for (int j = 0; j < AUDIO_PACKETS_PER_VIDEO && ret >= 0; j++) {
+            socket_io_begin_packet(io, audio);
+            write_tag(io->avio, 8, audio->data, audio->size, i * 33 + j * 16);
+            ret = socket_io_end_packet(io);
+            numPackets++;
+        }
+    }
+    int64_t elapsedNs = clock_now_ns() - startNs;
+    socket_io_close(&io);
+    pthread_join(sinkThread, NULL);
+    close(sink.listenFd);
+
+    printf("%-12s %6.1f ms  %5.2f syscalls/packet  %llu copied / %llu referenced bytes  "
+           "max send queue %u of %u\n", name, elapsedNs / 1e6,
+           (double) stats.writevCalls / numPackets, (unsigned long long) stats.copiedBytes,
+           (unsigned long long) stats.referencedBytes, stats.maxSendQueueBytes,
+           stats.sendBufferBytes);
+    if (ret < 0 || sink.bytes != expectedBytes || sink.checksum != expectedChecksum) {
+        fprintf(stderr, "%s: the sink got %llu bytes, expected %llu, or they differ.\n", name,
+                (unsigned long long) sink.bytes, (unsigned long long) expectedBytes);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Accept one connection and then sit on it without reading, like a server behind a dead link.
+ */
+static void *run_stalled_sink(void *arg) {
+    Sink *sink = arg;
+    int fd = accept(sink->listenFd, NULL, NULL);
+    if (fd < 0) {
+        return NULL;
+    }
+    while (!__atomic_load_n(&sink->isReleased, __ATOMIC_ACQUIRE)) {
+        usleep(10000);
+    }
+    close(fd);
+    return NULL;
+}
+
+static int watchdog_interrupted(void *opaque) {
+    return watchdog_check(opaque, clock_now_ns());
+}
+
+/**
+ * Write to a sink that has stopped reading until the socket fills up, and check the packet
+ * deadline gets the writer out with AVERROR(ETIMEDOUT) in time, and that closing doesn't hang.
+ */
+static int run_stall(AVBufferRef *video) {
+    Sink sink = {0};
+    char url[64];
+    if (open_sink(&sink, url, sizeof(url)) < 0) {
+        return 1;
+    }
+    pthread_t sinkThread;
+    pthread_create(&sinkThread, NULL, run_stalled_sink, &sink);
+
+    Watchdog watchdog;
+    watchdog_init(&watchdog, STALL_TIMEOUT_MS, STALL_TIMEOUT_MS, STALL_TIMEOUT_MS);
+    AVIOInterruptCB interruptCallback = {watchdog_interrupted, &watchdog};
+    SocketIoStats stats = {0};
+    SocketIo *io = NULL;
+    watchdog_arm(&watchdog, WATCHDOG_CONNECT, clock_now_ns());
+    int ret = watchdog_disarm(&watchdog, socket_io_open(&io, url, SOCKET_IO_LOW_LATENCY, 0, 0, 0,
+                                                        &stats, &interruptCallback));
+    if (ret < 0) {
+        fprintf(stderr, "Couldn't connect to %s: %d\n", url, ret);
+        return 1;
+    }
+    int64_t armedNs = 0;
+    int numPackets = 0;
+    while (ret >= 0) {
+        armedNs = clock_now_ns();
+        watchdog_arm(&watchdog, WATCHDOG_PACKET, armedNs);
+        socket_io_begin_packet(io, video);
+        write_tag(io->avio, 9, video->data, video->size, numPackets * 33);
+        ret = watchdog_disarm(&watchdog, socket_io_end_packet(io));
+        if (ret >= 0) {
+            watchdog_on_progress(&watchdog, clock_now_ns());
+            numPackets++;
+        }
+    }
+    int64_t stalledNs = clock_now_ns() - armedNs;
+    int64_t closeStartNs = clock_now_ns();
+    watchdog_arm(&watchdog, WATCHDOG_CLOSE, closeStartNs);
+    socket_io_close(&io);
+    watchdog_disarm(&watchdog, 0);
+    int64_t closeNs = clock_now_ns() - closeStartNs;
+    __atomic_store_n(&sink.isReleased, 1, __ATOMIC_RELEASE);
+    pthread_join(sinkThread, NULL);
+    close(sink.listenFd);
+
+    printf("stalled sink gave up after %d packets (%llu bytes) in %.1f ms, closed in %.1f ms\n",
+           numPackets, (unsigned long long) stats.bytesSent, stalledNs / 1e6, closeNs / 1e6);
+    int64_t limitNs = (int64_t) (STALL_TIMEOUT_MS + STALL_SLACK_MS) * 1000000;
+    if (ret != AVERROR(ETIMEDOUT) || stalledNs > limitNs || closeNs > limitNs
+        || watchdog.stalls[WATCHDOG_PACKET] != 1 || !watchdog.isStalled) {
+        fprintf(stderr, "stalled sink: got %d, expected a timeout within %d ms.\n", ret,
+                STALL_TIMEOUT_MS + STALL_SLACK_MS);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    AVBufferRef *video = av_buffer_alloc(VIDEO_PACKET_SIZE);
+    AVBufferRef *audio = av_buffer_alloc(AUDIO_PACKET_SIZE);
+    if (!video || !audio) {
+        return 1;
+    }
+    for (int i = 0; i < VIDEO_PACKET_SIZE; i++) {
+        video->data[i] = (uint8_t) (i * 7);
+    }
+    for (int i = 0; i < AUDIO_PACKET_SIZE; i++) {
+        audio->data[i] = (uint8_t) (i * 13);
+    }
+
+    //  Work out what the sink should see by writing the same tags into a memory buffer.
+    uint8_t *expected;
+    AVIOContext *memory;
+    if (avio_open_dyn_buf(&memory) < 0) {
+        return 1;
+    }
+    for (int i = 0; i < NUM_VIDEO_PACKETS; i++) {
+        write_tag(memory, 9, video->data, video->size, i * 33);
+        for (int j = 0; j < AUDIO_PACKETS_PER_VIDEO; j++) {
+            write_tag(memory, 8, audio->data, audio->size, i * 33 + j * 16);
+        }
+    }
+    int expectedBytes = avio_close_dyn_buf(memory, &expected);
+    uint32_t expectedChecksum = checksum_update(2166136261u, expected, (size_t) expectedBytes);
+    av_free(expected);
+
+    int failed = run_mode("low latency", SOCKET_IO_LOW_LATENCY, video, audio, expectedChecksum,
+                          (uint64_t) expectedBytes);
+    failed |= run_mode("throughput", SOCKET_IO_THROUGHPUT, video, audio, expectedChecksum,
+                       (uint64_t) expectedBytes);
+    failed |= run_stall(video);
+    av_buffer_unref(&video);
+    av_buffer_unref(&audio);
+    return failed;
+}
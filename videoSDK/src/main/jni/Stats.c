@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include "Stats.h"
+
+#define LOAD_RELAXED(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+
+/**
+ * Add one sample, in nanoseconds.
+ */
+void histogram_record(LatencyHistogram *histogram, int64_t ns) {
+    uint64_t sampleNs = ns > 0 ? (uint64_t) ns : 0;
+    uint64_t us = sampleNs / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= STATS_NUM_BUCKETS) {
+        bucket = STATS_NUM_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->totalNs, sampleNs, __ATOMIC_RELAXED);
+    uint64_t maxNs = LOAD_RELAXED(&histogram->maxNs);
+    while (sampleNs > maxNs
+           && !__atomic_compare_exchange_n(&histogram->maxNs, &maxNs, sampleNs, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Return the upper bound, in us, of the bucket holding the given percentile (0-100) of samples.
+ */
+int64_t histogram_percentile_us(const LatencyHistogram *histogram, int percentile) {
+    uint64_t count = 0;
+    uint64_t buckets[STATS_NUM_BUCKETS];
+    for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+        buckets[i] = LOAD_RELAXED(&histogram->buckets[i]);
+        count += buckets[i];
+    }
+    if (!count) {
+        return 0;
+    }
+    uint64_t wanted = (count * (uint64_t) percentile + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_NUM_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= wanted && seen > 0) {
+            return (int64_t) 1 << i;
+        }
+    }
+    //  The last bucket has no upper bound; the largest sample is the best we have.
+    return (int64_t) (LOAD_RELAXED(&histogram->maxNs) / 1000);
+}
+
+/**
+ * Count a written packet of the given stream.
+ */
+void stats_count_packet(DestinationStats *stats, int stream, int bytes) {
+    __atomic_store_n(&stats->packets[stream], stats->packets[stream] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->bytes[stream], stats->bytes[stream] + (uint64_t) bytes,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * Append printf-style text at buf + length without overrunning size. Returns the new length,
+ * which stays at size - 1 once the buffer is full.
+ */
+int stats_append(char *buf, int size, int length, const char *format, ...) {
+    if (length >= size - 1) {
+        return length;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buf + length, (size_t) (size - length), format, args);
+    va_end(args);
+    if (written < 0) {
+        return length;
+    }
+    return length + written < size ? length + written : size - 1;
+}
+
+/**
+ * Append a histogram as a JSON object: count, avg/p50/p99/max in us, and the raw buckets.
+ */
+int stats_append_histogram(char *buf, int size, int length, const LatencyHistogram *histogram) {
+    uint64_t count = LOAD_RELAXED(&histogram->count);
+    uint64_t totalNs = LOAD_RELAXED(&histogram->totalNs);
+    length = stats_append(buf, size, length,
+                          "{\"count\":%llu,\"avgUs\":%llu,\"p50Us\":%lld,\"p99Us\":%lld,"
+                          "\"maxUs\":%llu,\"buckets\":[",
+                          (unsigned long long) count,
+                          (unsigned long long) (count ? totalNs / count / 1000 : 0),
+                          (long long) histogram_percentile_us(histogram, 50),
+                          (long long) histogram_percentile_us(histogram, 99),
+                          (unsigned long long) (LOAD_RELAXED(&histogram->maxNs) / 1000));
+    for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+        length = stats_append(buf, size, length, i ? ",%llu" : "%llu",
+                              (unsigned long long) LOAD_RELAXED(&histogram->buckets[i]));
+    }
+    return stats_append(buf, size, length, "]}");
+}
+
+/**
+ * Append what a sender measured as JSON members: packets and bytes per stream, then the queue,
+ * headerWrite, packetWrite and endToEnd histograms.
+ */
+int stats_append_destination(char *buf, int size, int length, const DestinationStats *stats) {
+    for (int stream = 0; stream < STATS_NUM_STREAMS; stream++) {
+        length = stats_append(buf, size, length, "\"%s\":{\"packets\":%llu,\"bytes\":%llu},",
+                              stream == STATS_STREAM_VIDEO ? "video" : "audio",
+                              (unsigned long long) LOAD_RELAXED(&stats->packets[stream]),
+                              (unsigned long long) LOAD_RELAXED(&stats->bytes[stream]));
+    }
+    length = stats_append(buf, size, length, "\"queue\":");
+    length = stats_append_histogram(buf, size, length, &stats->queue);
+    length = stats_append(buf, size, length, ",\"headerWrite\":");
+    length = stats_append_histogram(buf, size, length, &stats->headerWrite);
+    length = stats_append(buf, size, length, ",\"packetWrite\":");
+    length = stats_append_histogram(buf, size, length, &stats->packetWrite);
+    length = stats_append(buf, size, length, ",\"endToEnd\":");
+    return stats_append_histogram(buf, size, length, &stats->endToEnd);
+}
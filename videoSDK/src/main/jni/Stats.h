@@ -0,0 +1,77 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//  Bucket 0 holds samples under 1 us, bucket i holds [2^(i-1), 2^i) us and the last one holds
+//  everything from about 4 s up.
+#define STATS_NUM_BUCKETS 24
+//  Indexes of the per-stream counters.
+#define STATS_STREAM_AUDIO 0
+#define STATS_STREAM_VIDEO 1
+#define STATS_NUM_STREAMS 2
+
+/**
+ * Fixed-bucket latency histogram with power-of-two buckets. Recording is a handful of relaxed
+ * atomic adds, so any number of threads can record into it without a lock while another reads
+ * it; a reader may see a sample in count before it shows up in its bucket.
+ */
+typedef struct latency_histogram_t {
+    uint64_t buckets[STATS_NUM_BUCKETS];
+    uint64_t count;
+    uint64_t totalNs;
+    uint64_t maxNs;
+} LatencyHistogram;
+
+/**
+ * What one destination's sender thread measures. Written by that thread, read from anywhere.
+ */
+typedef struct destination_stats_t {
+    //  Time a packet waits in the ring before its write starts.
+    LatencyHistogram queue;
+    //  Writing the header. With our own RTMP publisher this takes in connecting and publishing
+    //  too, unless that was pre-dialed.
+    LatencyHistogram headerWrite;
+    //  av_write_frame() on its own.
+    LatencyHistogram packetWrite;
+    //  From the JNI call that handed the packet over to its write returning.
+    LatencyHistogram endToEnd;
+    uint64_t packets[STATS_NUM_STREAMS];
+    uint64_t bytes[STATS_NUM_STREAMS];
+} DestinationStats;
+
+/**
+ * Add one sample, in nanoseconds.
+ */
+void histogram_record(LatencyHistogram *histogram, int64_t ns);
+
+/**
+ * Return the upper bound, in us, of the bucket holding the given percentile (0-100) of samples.
+ */
+int64_t histogram_percentile_us(const LatencyHistogram *histogram, int percentile);
+
+/**
+ * Count a written packet of the given stream.
+ */
+void stats_count_packet(DestinationStats *stats, int stream, int bytes);
+
+/**
+ * Append printf-style text at buf + length without overrunning size. Returns the new length,
+ * which stays at size - 1 once the buffer is full.
+ */
+int stats_append(char *buf, int size, int length, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+/**
+ * Append a histogram as a JSON object: count, avg/p50/p99/max in us, and the raw buckets.
+ */
+int stats_append_histogram(char *buf, int size, int length, const LatencyHistogram *histogram);
+
+/**
+ * Append what a sender measured as JSON members: packets and bytes per stream, then the queue,
+ * headerWrite, packetWrite and endToEnd histograms.
+ */
+int stats_append_destination(char *buf, int size, int length, const DestinationStats *stats);
+
+#endif /* STATS_H */
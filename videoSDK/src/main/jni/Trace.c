@@ -0,0 +1,157 @@
+//  For syscall() under --std=c99.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+#include "Clock.h"
+#include "Trace.h"
+
+static const char *const EVENT_NAMES[TRACE_NUM_EVENTS] = {
+    "submit",
+    "queueFull",
+    "policyDrop",
+    "headerWrite",
+    "packetWrite",
+    "reconnect",
+    "keyFrameRequest",
+    "stall",
+    "probe",
+    "muxRead",
+    "muxWait",
+    "muxWrite",
+    "muxSkip",
+    "decode",
+    "scale",
+    "reencode",
+};
+
+/**
+ * One thread's records. Only the owning thread writes; head counts every record ever written,
+ * so the live ones are the last TRACE_RING_SIZE before it.
+ */
+typedef struct trace_ring_t {
+    TraceRecord records[TRACE_RING_SIZE];
+    uint32_t head;
+    int isInUse;
+} TraceRing;
+
+static TraceRing *rings[TRACE_MAX_THREADS];
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+//  Set to (TraceRing *) -1 when a thread found no free ring, so it doesn't keep looking.
+static __thread TraceRing *threadRing;
+static __thread int32_t threadId;
+
+/**
+ * Thread exit: give the ring back so a later thread can reuse it.
+ */
+static void release_ring(void *ring) {
+    __atomic_store_n(&((TraceRing *) ring)->isInUse, 0, __ATOMIC_RELEASE);
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&ringKey, release_ring);
+}
+
+/**
+ * Find the calling thread a ring on its first record. This is the only part that locks or
+ * allocates. A fresh ring is preferred, so finished threads' records last as long as they can.
+ */
+static TraceRing *claim_ring(void) {
+    TraceRing *ring = (TraceRing *) -1;
+    pthread_once(&ringKeyOnce, create_ring_key);
+    pthread_mutex_lock(&ringsLock);
+    for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+        if (!rings[i]) {
+            TraceRing *fresh = calloc(1, sizeof(TraceRing));
+            if (fresh) {
+                fresh->isInUse = 1;
+                __atomic_store_n(&rings[i], fresh, __ATOMIC_RELEASE);
+                ring = fresh;
+            }
+            break;
+        }
+    }
+    for (int i = 0; ring == (TraceRing *) -1 && i < TRACE_MAX_THREADS && rings[i]; i++) {
+        if (!__atomic_load_n(&rings[i]->isInUse, __ATOMIC_ACQUIRE)) {
+            ring = rings[i];
+            ring->isInUse = 1;
+        }
+    }
+    pthread_mutex_unlock(&ringsLock);
+    if (ring != (TraceRing *) -1) {
+        pthread_setspecific(ringKey, ring);
+    }
+    threadId = (int32_t) syscall(__NR_gettid);
+    return ring;
+}
+
+/**
+ * Append a record to the calling thread's ring. Use the TRACE_* macros rather than calling this,
+ * so trace points disappear from builds without tracing.
+ */
+void trace_record(TraceEvent event, char phase, int stream, int64_t pts, int size) {
+    TraceRing *ring = threadRing;
+    if (!ring) {
+        ring = threadRing = claim_ring();
+    }
+    if (ring == (TraceRing *) -1) {
+        return;
+    }
+    uint32_t head = ring->head;
+    TraceRecord *record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->timeNs = clock_now_ns();
+    record->pts = pts;
+    record->size = size;
+    record->tid = threadId;
+    record->event = (uint16_t) event;
+    record->phase = (uint8_t) phase;
+    record->stream = (uint8_t) stream;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write every thread's records to path as Chrome trace JSON, which Perfetto and
+ * chrome://tracing load. Records written while exporting may come out garbled. Returns 0 or a
+ * negative AVERROR.
+ */
+int trace_export_chrome_json(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return AVERROR(errno);
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool isFirst = true;
+    int pid = (int) getpid();
+    for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+        TraceRing *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (!ring) {
+            continue;
+        }
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (uint32_t n = first; n != head; n++) {
+            const TraceRecord *record = &ring->records[n & (TRACE_RING_SIZE - 1)];
+            if (record->event >= TRACE_NUM_EVENTS) {
+                continue;
+            }
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,",
+                    isFirst ? "\n" : ",\n", EVENT_NAMES[record->event], record->phase,
+                    record->timeNs / 1000.0, pid, record->tid);
+            if (record->phase == 'i') {
+                fprintf(file, "\"s\":\"t\",");
+            }
+            fprintf(file, "\"args\":{\"stream\":%d,\"pts\":%lld,\"size\":%d}}",
+                    record->stream == TRACE_STREAM_NONE ? -1 : record->stream,
+                    (long long) record->pts, record->size);
+            isFirst = false;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0 ? 0 : AVERROR(EIO);
+}
@@ -0,0 +1,88 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//  Trace points compile to nothing unless the library is built with -DTRACE_ENABLED=1
+//  (FFMPEG_WRAPPER_TRACE=1 in Android.mk).
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0
+#endif
+
+//  Records kept per thread; older ones are overwritten. Must be a power of 2.
+#define TRACE_RING_SIZE 8192
+//  Threads that can trace at once. Rings of finished threads are reused, records and all.
+#define TRACE_MAX_THREADS 16
+
+#define TRACE_STREAM_AUDIO 0
+#define TRACE_STREAM_VIDEO 1
+#define TRACE_STREAM_NONE 0xff
+
+/**
+ * What a trace record marks. Names for the export are in Trace.c.
+ */
+typedef enum trace_event_t {
+    //  Live streaming.
+    TRACE_SUBMIT,
+    TRACE_QUEUE_FULL,
+    TRACE_POLICY_DROP,
+    TRACE_HEADER_WRITE,
+    TRACE_PACKET_WRITE,
+    TRACE_RECONNECT,
+    TRACE_KEY_FRAME_REQUEST,
+    TRACE_STALL,
+    //  Stitching.
+    TRACE_PROBE,
+    TRACE_MUX_READ,
+    TRACE_MUX_WAIT,
+    TRACE_MUX_WRITE,
+    TRACE_MUX_SKIP,
+    TRACE_DECODE,
+    TRACE_SCALE,
+    TRACE_REENCODE,
+    TRACE_NUM_EVENTS
+} TraceEvent;
+
+/**
+ * One fixed-size binary trace record.
+ */
+typedef struct trace_record_t {
+    int64_t timeNs;
+    int64_t pts;
+    int32_t size;
+    int32_t tid;
+    uint16_t event;
+    //  Chrome trace phase: 'B'egin, 'E'nd or 'i'nstant.
+    uint8_t phase;
+    uint8_t stream;
+} TraceRecord;
+
+#if TRACE_ENABLED
+#define TRACE_BEGIN(event, stream, pts, size) trace_record(event, 'B', stream, pts, size)
+#define TRACE_END(event, stream, pts, size) trace_record(event, 'E', stream, pts, size)
+#define TRACE_INSTANT(event, stream, pts, size) trace_record(event, 'i', stream, pts, size)
+#else
+//  Still type-checked, and keeps the arguments "used", but no code is generated.
+#define TRACE_BEGIN(event, stream, pts, size) \
+    do { if (0) trace_record(event, 'B', stream, pts, size); } while (0)
+#define TRACE_END(event, stream, pts, size) \
+    do { if (0) trace_record(event, 'E', stream, pts, size); } while (0)
+#define TRACE_INSTANT(event, stream, pts, size) \
+    do { if (0) trace_record(event, 'i', stream, pts, size); } while (0)
+#endif
+
+/**
+ * Append a record to the calling thread's ring. Use the TRACE_* macros rather than calling this,
+ * so trace points disappear from builds without tracing.
+ */
+void trace_record(TraceEvent event, char phase, int stream, int64_t pts, int size);
+
+/**
+ * Write every thread's records to path as Chrome trace JSON, which Perfetto and
+ * chrome://tracing load. Records written while exporting may come out garbled. Returns 0 or a
+ * negative AVERROR.
+ */
+int trace_export_chrome_json(const char *path);
+
+#endif /* TRACE_H */
@@ -0,0 +1,565 @@
+#include <string.h>
+#include "libavutil/imgutils.h"
+#include "Clock.h"
+#include "Trace.h"
+#include "BufferPool.h"
+#include "Transcoder.h"
+
+//  What an item in a queue carries. Clip markers travel the whole pipeline, in order with the
+//  frames, so every stage sees where one clip ends.
+#define ITEM_CLIP_START 0
+#define ITEM_PACKET 1
+#define ITEM_FRAME 2
+#define ITEM_CLIP_END 3
+#define ITEM_END 4
+
+typedef struct transcode_item_t {
+    int type;
+    //  A TranscodeClip for ITEM_CLIP_START, the AVPacket or AVFrame, or NULL for the markers.
+    void *data;
+} TranscodeItem;
+
+/**
+ * One clip's decoder and where it starts, handed from the writer to the decode thread.
+ */
+typedef struct transcode_clip_t {
+    AVCodecContext *decoder;
+    bool isOpen;
+    AVRational timeBase;
+    int64_t skipMs;
+} TranscodeClip;
+
+static void free_clip(TranscodeClip **clip) {
+    if (*clip) {
+        avcodec_free_context(&(*clip)->decoder);
+        av_freep(clip);
+    }
+}
+
+static void free_item(TranscodeItem *item) {
+    if (item->type == ITEM_PACKET) {
+        recycler_put_packet(item->data);
+    } else if (item->type == ITEM_FRAME) {
+        recycler_put_frame(item->data);
+    } else if (item->type == ITEM_CLIP_START) {
+        TranscodeClip *clip = item->data;
+        free_clip(&clip);
+    }
+    item->data = NULL;
+}
+
+static int queue_init(TranscodeQueue *queue, int capacity) {
+    memset(queue, 0, sizeof(*queue));
+    if (!(queue->items = av_malloc_array((size_t) capacity, sizeof(TranscodeItem)))) {
+        return AVERROR(ENOMEM);
+    }
+    queue->capacity = capacity;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+    return 0;
+}
+
+/**
+ * Free whatever is still queued, and the queue.
+ */
+static void queue_uninit(TranscodeQueue *queue) {
+    if (!queue->items) {
+        return;
+    }
+    for (; queue->count; queue->count--) {
+        free_item(&queue->items[queue->head]);
+        queue->head = (queue->head + 1) % queue->capacity;
+    }
+    av_freep(&queue->items);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_cond_destroy(&queue->notFull);
+}
+
+/**
+ * Wake everyone waiting on the queue, and make it refuse anything from now on.
+ */
+static void queue_abort(TranscodeQueue *queue) {
+    if (!queue->items) {
+        return;
+    }
+    pthread_mutex_lock(&queue->lock);
+    queue->isAborted = true;
+    pthread_cond_broadcast(&queue->notEmpty);
+    pthread_cond_broadcast(&queue->notFull);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Append item, waiting for room. Returns 0, or AVERROR_EXIT if the queue was aborted, in which
+ * case the caller still owns the item.
+ */
+static int queue_push(TranscodeQueue *queue, const TranscodeItem *item) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity && !queue->isAborted) {
+        int64_t startNs = clock_now_ns();
+        while (queue->count == queue->capacity && !queue->isAborted) {
+            pthread_cond_wait(&queue->notFull, &queue->lock);
+        }
+        queue->waitNs += clock_now_ns() - startNs;
+    }
+    int ret = AVERROR_EXIT;
+    if (!queue->isAborted) {
+        queue->items[(queue->head + queue->count) % queue->capacity] = *item;
+        queue->count++;
+        pthread_cond_signal(&queue->notEmpty);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+/**
+ * Take the oldest item, waiting for one if wait is set. Returns 0, AVERROR(EAGAIN) if there's
+ * none and wait isn't set, or AVERROR_EXIT once the queue is aborted and empty.
+ */
+static int queue_pop(TranscodeQueue *queue, TranscodeItem *item, bool wait) {
+    pthread_mutex_lock(&queue->lock);
+    while (wait && !queue->count && !queue->isAborted) {
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+    }
+    int ret = queue->count ? 0 : queue->isAborted ? AVERROR_EXIT : AVERROR(EAGAIN);
+    if (!ret) {
+        *item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->notFull);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+/**
+ * Open a clip's decoder with as much threading as it supports.
+ */
+static int open_decoder(TranscodeClip *clip) {
+    AVCodec *codec = avcodec_find_decoder(clip->decoder->codec_id);
+    if (!codec) {
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+    //  Frames go on to other threads, so they have to own their data.
+    clip->decoder->refcounted_frames = 1;
+    clip->decoder->thread_count = 0;
+    clip->decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    int ret = avcodec_open2(clip->decoder, codec, NULL);
+    clip->isOpen = ret >= 0;
+    return ret;
+}
+
+/**
+ * Give a decoded frame its place on the encoder's timeline and pass it on, unless it falls in
+ * the part of the clip being left out.
+ */
+static void deliver_frame(Transcoder *transcoder, TranscodeClip *clip, AVFrame *frame) {
+    AVRational encoderTimeBase = transcoder->timeBase;
+    int64_t timestamp = av_frame_get_best_effort_timestamp(frame);
+    if (timestamp != AV_NOPTS_VALUE
+        && av_rescale_q(timestamp, clip->timeBase, (AVRational) {1, 1000}) < clip->skipMs) {
+        __atomic_store_n(&transcoder->framesSkipped, transcoder->framesSkipped + 1,
+                         __ATOMIC_RELAXED);
+        recycler_put_frame(frame);
+        return;
+    }
+    int64_t duration = frame->pkt_duration > 0
+                       ? av_rescale_q(frame->pkt_duration, clip->timeBase, encoderTimeBase) : 0;
+    if (duration <= 0) {
+        duration = FFMAX(av_rescale_q(1, (AVRational) {1, TRANSCODER_DEFAULT_FPS},
+                                      encoderTimeBase), 1);
+    }
+    frame->pts = transcoder->nextPts;
+    frame->pkt_duration = duration;
+    //  The encoder picks its own frame types; the source's would only get in the way.
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+    transcoder->nextPts += duration;
+    __atomic_store_n(&transcoder->framesDecoded, transcoder->framesDecoded + 1, __ATOMIC_RELAXED);
+    TranscodeItem item = {ITEM_FRAME, frame};
+    if (queue_push(&transcoder->frames, &item) < 0) {
+        recycler_put_frame(frame);
+    }
+}
+
+/**
+ * Decode one packet, or drain the decoder when packet is empty.
+ */
+static void decode_packet(Transcoder *transcoder, TranscodeClip *clip, AVPacket *packet) {
+    int gotFrame;
+    do {
+        AVFrame *frame = recycler_get_frame();
+        if (!frame) {
+            return;
+        }
+        gotFrame = 0;
+        TRACE_BEGIN(TRACE_DECODE, TRACE_STREAM_VIDEO, packet->pts, packet->size);
+        int ret = avcodec_decode_video2(clip->decoder, frame, &gotFrame, packet);
+        TRACE_END(TRACE_DECODE, TRACE_STREAM_VIDEO, packet->pts, packet->size);
+        if (ret < 0) {
+            __atomic_store_n(&transcoder->decodeErrors, transcoder->decodeErrors + 1,
+                             __ATOMIC_RELAXED);
+            gotFrame = 0;
+        }
+        if (gotFrame) {
+            deliver_frame(transcoder, clip, frame);
+        } else {
+            recycler_put_frame(frame);
+        }
+    } while (!packet->data && gotFrame);
+}
+
+/**
+ * Decode thread: packets in, frames out, one decoder per clip.
+ */
+static void *decode_loop(void *arg) {
+    Transcoder *transcoder = arg;
+    TranscodeClip *clip = NULL;
+    TranscodeItem item;
+    while (queue_pop(&transcoder->packets, &item, true) == 0) {
+        if (item.type == ITEM_CLIP_START) {
+            free_clip(&clip);
+            clip = item.data;
+            if (open_decoder(clip) < 0) {
+                //  Its packets are dropped; the clip just goes missing from the video.
+                __atomic_store_n(&transcoder->decodeErrors, transcoder->decodeErrors + 1,
+                                 __ATOMIC_RELAXED);
+            }
+            continue;
+        }
+        if (item.type == ITEM_PACKET) {
+            if (clip && clip->isOpen) {
+                decode_packet(transcoder, clip, item.data);
+            }
+            free_item(&item);
+            continue;
+        }
+        //  The end of a clip: whatever the decoder still holds belongs to it.
+        if (clip && clip->isOpen) {
+            AVPacket flush;
+            av_init_packet(&flush);
+            flush.data = NULL;
+            flush.size = 0;
+            decode_packet(transcoder, clip, &flush);
+        }
+        free_clip(&clip);
+        if (queue_push(&transcoder->frames, &item) < 0 || item.type == ITEM_END) {
+            break;
+        }
+    }
+    free_clip(&clip);
+    return NULL;
+}
+
+/**
+ * Convert frame to the encoder's size and pixel format if it isn't in them already. Returns
+ * the frame to encode, or NULL if it couldn't be converted.
+ */
+static AVFrame *scale_frame(Transcoder *transcoder, AVFrame *frame) {
+    if (frame->width == transcoder->width && frame->height == transcoder->height
+        && frame->format == transcoder->pixFmt) {
+        return frame;
+    }
+    transcoder->scaler = sws_getCachedContext(transcoder->scaler, frame->width, frame->height,
+                                              frame->format, transcoder->width,
+                                              transcoder->height, transcoder->pixFmt,
+                                              SWS_BILINEAR, NULL, NULL, NULL);
+    AVFrame *scaled = transcoder->scaler ? recycler_get_frame() : NULL;
+    if (scaled) {
+        scaled->buf[0] = av_buffer_pool_get(transcoder->framePool);
+    }
+    if (!scaled || !scaled->buf[0]) {
+        recycler_put_frame(scaled);
+        recycler_put_frame(frame);
+        return NULL;
+    }
+    TRACE_BEGIN(TRACE_SCALE, TRACE_STREAM_VIDEO, frame->pts, 0);
+    av_image_fill_arrays(scaled->data, scaled->linesize, scaled->buf[0]->data,
+                         transcoder->pixFmt, transcoder->width, transcoder->height, 32);
+    scaled->format = transcoder->pixFmt;
+    scaled->width = transcoder->width;
+    scaled->height = transcoder->height;
+    sws_scale(transcoder->scaler, (const uint8_t * const *) frame->data, frame->linesize, 0,
+              frame->height, scaled->data, scaled->linesize);
+    scaled->pts = frame->pts;
+    scaled->pkt_duration = frame->pkt_duration;
+    TRACE_END(TRACE_SCALE, TRACE_STREAM_VIDEO, frame->pts, 0);
+    recycler_put_frame(frame);
+    __atomic_store_n(&transcoder->framesScaled, transcoder->framesScaled + 1, __ATOMIC_RELAXED);
+    return scaled;
+}
+
+/**
+ * Scale thread: decoded frames in, frames the encoder takes out.
+ */
+static void *scale_loop(void *arg) {
+    Transcoder *transcoder = arg;
+    TranscodeItem item;
+    while (queue_pop(&transcoder->frames, &item, true) == 0) {
+        if (item.type == ITEM_FRAME && !(item.data = scale_frame(transcoder, item.data))) {
+            continue;
+        }
+        if (queue_push(&transcoder->scaledFrames, &item) < 0) {
+            free_item(&item);
+            break;
+        }
+        if (item.type == ITEM_END) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Encode one frame, or drain the encoder when frame is NULL, and queue what comes out for the
+ * writer.
+ */
+static void encode_frame(Transcoder *transcoder, AVFrame *frame) {
+    if (frame) {
+        //  Oldest first; the ring only wraps if the encoder holds on to that many frames.
+        int tail = (transcoder->durationHead + transcoder->numDurations)
+                   % TRANSCODER_OUTPUT_QUEUE_SIZE;
+        transcoder->durations[tail] = frame->pkt_duration;
+        if (transcoder->numDurations < TRANSCODER_OUTPUT_QUEUE_SIZE) {
+            transcoder->numDurations++;
+        } else {
+            transcoder->durationHead = (transcoder->durationHead + 1)
+                                       % TRANSCODER_OUTPUT_QUEUE_SIZE;
+        }
+    }
+    int gotPacket;
+    do {
+        AVPacket *packet = recycler_get_packet();
+        if (!packet) {
+            return;
+        }
+        gotPacket = 0;
+        TRACE_BEGIN(TRACE_REENCODE, TRACE_STREAM_VIDEO, frame ? frame->pts : 0, 0);
+        int ret = avcodec_encode_video2(transcoder->encoder, packet, frame, &gotPacket);
+        TRACE_END(TRACE_REENCODE, TRACE_STREAM_VIDEO, frame ? frame->pts : 0, packet->size);
+        if (ret < 0 || !gotPacket) {
+            recycler_put_packet(packet);
+            return;
+        }
+        if (transcoder->numDurations) {
+            packet->duration = transcoder->durations[transcoder->durationHead];
+            transcoder->durationHead = (transcoder->durationHead + 1)
+                                       % TRANSCODER_OUTPUT_QUEUE_SIZE;
+            transcoder->numDurations--;
+        }
+        __atomic_store_n(&transcoder->packetsEncoded, transcoder->packetsEncoded + 1,
+                         __ATOMIC_RELAXED);
+        TranscodeItem item = {ITEM_PACKET, packet};
+        if (queue_push(&transcoder->output, &item) < 0) {
+            recycler_put_packet(packet);
+            return;
+        }
+    } while (!frame);
+}
+
+/**
+ * Replace the drained encoder with a fresh one set up the same way. Returns 0 or a negative
+ * AVERROR, in which case the drained one is kept.
+ */
+static int reopen_encoder(Transcoder *transcoder) {
+    const AVCodec *codec = transcoder->encoder->codec;
+    AVCodecContext *encoder = avcodec_alloc_context3(codec);
+    int ret = encoder ? avcodec_copy_context(encoder, transcoder->encoder) : AVERROR(ENOMEM);
+    if (ret >= 0) {
+        //  Opening makes the global headers again, from the same settings.
+        av_freep(&encoder->extradata);
+        encoder->extradata_size = 0;
+        ret = avcodec_open2(encoder, codec, NULL);
+    }
+    if (ret < 0) {
+        avcodec_free_context(&encoder);
+        return ret;
+    }
+    avcodec_free_context(&transcoder->encoder);
+    transcoder->encoder = encoder;
+    transcoder->isEncoderDrained = false;
+    return 0;
+}
+
+/**
+ * Encode thread: frames in, packets for the writer out.
+ */
+static void *encode_loop(void *arg) {
+    Transcoder *transcoder = arg;
+    TranscodeItem item;
+    while (queue_pop(&transcoder->scaledFrames, &item, true) == 0) {
+        if (item.type == ITEM_FRAME) {
+            if (!transcoder->isEncoderDrained || reopen_encoder(transcoder) == 0) {
+                encode_frame(transcoder, item.data);
+            } else {
+                __atomic_store_n(&transcoder->encodeErrors, transcoder->encodeErrors + 1,
+                                 __ATOMIC_RELAXED);
+            }
+            free_item(&item);
+            continue;
+        }
+        //  Nothing of a clip may be left in the encoder when the writer moves on to the next.
+        if (!transcoder->isEncoderDrained) {
+            encode_frame(transcoder, NULL);
+            transcoder->isEncoderDrained = true;
+            transcoder->durationHead = 0;
+            transcoder->numDurations = 0;
+        }
+        if (queue_push(&transcoder->output, &item) < 0 || item.type == ITEM_END) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start the pipeline, feeding the given opened encoder, which the transcoder now owns.
+ * Returns 0 or a negative AVERROR.
+ */
+int transcoder_start(Transcoder *transcoder, AVCodecContext *encoder) {
+    memset(transcoder, 0, sizeof(*transcoder));
+    transcoder->encoder = encoder;
+    transcoder->timeBase = encoder->time_base;
+    transcoder->width = encoder->width;
+    transcoder->height = encoder->height;
+    transcoder->pixFmt = encoder->pix_fmt;
+    int ret;
+    if ((ret = queue_init(&transcoder->packets, TRANSCODER_PACKET_QUEUE_SIZE)) < 0
+        || (ret = queue_init(&transcoder->frames, TRANSCODER_FRAME_QUEUE_SIZE)) < 0
+        || (ret = queue_init(&transcoder->scaledFrames, TRANSCODER_FRAME_QUEUE_SIZE)) < 0
+        || (ret = queue_init(&transcoder->output, TRANSCODER_OUTPUT_QUEUE_SIZE)) < 0) {
+        transcoder_stop(transcoder);
+        return ret;
+    }
+    //  Room for every frame that can be between the scaler and the encoder, and then some.
+    transcoder->framePoolSize = av_image_get_buffer_size(encoder->pix_fmt, encoder->width,
+                                                         encoder->height, 32);
+    if (transcoder->framePoolSize <= 0
+        || !(transcoder->framePool = av_buffer_pool_init(transcoder->framePoolSize,
+                                                         av_buffer_alloc))) {
+        transcoder_stop(transcoder);
+        return transcoder->framePoolSize < 0 ? transcoder->framePoolSize : AVERROR(ENOMEM);
+    }
+    void *(*loops[3])(void *) = {decode_loop, scale_loop, encode_loop};
+    for (int i = 0; i < 3; i++) {
+        if (pthread_create(&transcoder->threads[i], NULL, loops[i], transcoder) != 0) {
+            transcoder_stop(transcoder);
+            return AVERROR(EAGAIN);
+        }
+        transcoder->numThreads++;
+    }
+    return 0;
+}
+
+/**
+ * Writer side: start a clip whose video is stream, leaving out the frames in its first skipMs.
+ * Returns 0 or a negative AVERROR.
+ */
+int transcoder_begin_clip(Transcoder *transcoder, AVStream *stream, int64_t skipMs) {
+    TranscodeClip *clip = av_mallocz(sizeof(TranscodeClip));
+    if (!clip || !(clip->decoder = avcodec_alloc_context3(NULL))
+        || avcodec_copy_context(clip->decoder, stream->codec) < 0) {
+        free_clip(&clip);
+        return AVERROR(ENOMEM);
+    }
+    clip->timeBase = stream->time_base;
+    clip->skipMs = skipMs;
+    TranscodeItem item = {ITEM_CLIP_START, clip};
+    int ret = queue_push(&transcoder->packets, &item);
+    if (ret < 0) {
+        free_clip(&clip);
+    }
+    return ret;
+}
+
+/**
+ * Writer side: queue a demuxed packet of the current clip, taking over its reference. Waits
+ * while the decoder is behind. Returns 0 or a negative AVERROR.
+ */
+int transcoder_send_packet(Transcoder *transcoder, AVPacket *packet) {
+    AVPacket *queued = recycler_get_packet();
+    if (!queued) {
+        av_packet_unref(packet);
+        return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(queued, packet);
+    TranscodeItem item = {ITEM_PACKET, queued};
+    int ret = queue_push(&transcoder->packets, &item);
+    if (ret < 0) {
+        recycler_put_packet(queued);
+    }
+    return ret;
+}
+
+/**
+ * Writer side: end the current clip. Its decoder and the encoder are flushed, and once the last
+ * of its packets has been received transcoder_receive_packet() returns TRANSCODER_CLIP_DONE.
+ * Returns 0 or a negative AVERROR.
+ */
+int transcoder_end_clip(Transcoder *transcoder) {
+    TranscodeItem item = {ITEM_CLIP_END, NULL};
+    return queue_push(&transcoder->packets, &item);
+}
+
+/**
+ * Writer side: move the next encoded packet, in the encoder's time_base, into packet.
+ * Returns 0, TRANSCODER_CLIP_DONE at the end of a clip, AVERROR(EAGAIN) if there's none yet and
+ * wait is false, or AVERROR_EOF once the pipeline has stopped.
+ */
+int transcoder_receive_packet(Transcoder *transcoder, AVPacket *packet, bool wait) {
+    TranscodeItem item;
+    int ret = queue_pop(&transcoder->output, &item, wait);
+    if (ret < 0) {
+        return ret == AVERROR_EXIT ? AVERROR_EOF : ret;
+    }
+    if (item.type == ITEM_PACKET) {
+        av_packet_move_ref(packet, item.data);
+        free_item(&item);
+        return 0;
+    }
+    if (item.type == ITEM_CLIP_END) {
+        return TRANSCODER_CLIP_DONE;
+    }
+    //  Nothing comes after the end, so don't let anyone wait for it.
+    queue_abort(&transcoder->output);
+    return AVERROR_EOF;
+}
+
+/**
+ * Stop the pipeline and free it, along with the encoder. Anything still in it is dropped.
+ */
+void transcoder_stop(Transcoder *transcoder) {
+    if (transcoder->numThreads == 3) {
+        //  Let the end marker run through, so every stage finishes what it has first.
+        TranscodeItem item = {ITEM_END, NULL};
+        AVPacket packet;
+        av_init_packet(&packet);
+        queue_push(&transcoder->packets, &item);
+        int ret;
+        while ((ret = transcoder_receive_packet(transcoder, &packet, true)) != AVERROR_EOF) {
+            if (ret == 0) {
+                av_packet_unref(&packet);
+                __atomic_store_n(&transcoder->packetsDropped, transcoder->packetsDropped + 1,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+    }
+    queue_abort(&transcoder->packets);
+    queue_abort(&transcoder->frames);
+    queue_abort(&transcoder->scaledFrames);
+    queue_abort(&transcoder->output);
+    for (int i = 0; i < transcoder->numThreads; i++) {
+        pthread_join(transcoder->threads[i], NULL);
+    }
+    transcoder->numThreads = 0;
+    queue_uninit(&transcoder->packets);
+    queue_uninit(&transcoder->frames);
+    queue_uninit(&transcoder->scaledFrames);
+    queue_uninit(&transcoder->output);
+    avcodec_free_context(&transcoder->encoder);
+    sws_freeContext(transcoder->scaler);
+    transcoder->scaler = NULL;
+    av_buffer_pool_uninit(&transcoder->framePool);
+}
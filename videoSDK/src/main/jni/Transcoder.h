@@ -0,0 +1,125 @@
+#ifndef TRANSCODER_H
+#define TRANSCODER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+#include "libswscale/swscale.h"
+
+//  Demuxed packets waiting to be decoded, and frames between the stages after that. Small, since
+//  a decoded frame is megabytes; the codecs' own threads keep the cores busy in between.
+#define TRANSCODER_PACKET_QUEUE_SIZE 16
+#define TRANSCODER_FRAME_QUEUE_SIZE 4
+//  Encoded packets waiting for the writer. Never fills: it only ever holds what's in flight in
+//  the stages before it, plus clip markers.
+#define TRANSCODER_OUTPUT_QUEUE_SIZE 64
+//  Frame duration assumed when a decoder doesn't give one, in frames per second.
+#define TRANSCODER_DEFAULT_FPS 30
+
+//  transcoder_receive_packet(): every packet of the clip that was ended has been handed over.
+#define TRANSCODER_CLIP_DONE 1
+
+/**
+ * Bounded blocking queue of work items between two pipeline stages.
+ */
+typedef struct transcode_queue_t {
+    struct transcode_item_t *items;
+    int capacity;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    bool isAborted;
+    //  Time producers spent waiting for room, i.e. behind the stage this queue feeds.
+    int64_t waitNs;
+} TranscodeQueue;
+
+/**
+ * Re-encodes the video of a series of clips into one stream: a decode thread (the decoder
+ * running frame and slice threads of its own), a scale thread converting to the encoder's size
+ * and pixel format, and an encode thread (slice threaded), joined by bounded queues. Each clip
+ * gets its own decoder, and both it and the encoder are drained at the end of the clip, so a
+ * clip's video starts on a keyframe and is all written before the next clip's. That lets copied
+ * clips go between re-encoded ones. Frame data comes from pools, so steady state doesn't
+ * allocate.
+ */
+typedef struct transcoder_t {
+    //  Only the encode thread uses it once started; it reopens it for each clip.
+    AVCodecContext *encoder;
+    //  The encoder's time_base, size and pixel format, which every stage reads.
+    AVRational timeBase;
+    int width;
+    int height;
+    enum AVPixelFormat pixFmt;
+    TranscodeQueue packets;
+    TranscodeQueue frames;
+    TranscodeQueue scaledFrames;
+    TranscodeQueue output;
+    pthread_t threads[3];
+    int numThreads;
+
+    //  Decode thread: the next frame's pts, in the encoder's time_base, running across clips.
+    int64_t nextPts;
+    //  Scale thread.
+    struct SwsContext *scaler;
+    AVBufferPool *framePool;
+    int framePoolSize;
+    //  Encode thread: durations of the frames given to the encoder, oldest first. Without
+    //  B-frames packets come out in the same order.
+    int64_t durations[TRANSCODER_OUTPUT_QUEUE_SIZE];
+    int durationHead;
+    int numDurations;
+    //  Whether the encoder has been flushed and needs reopening before the next frame.
+    bool isEncoderDrained;
+
+    //  Counters, written by one stage each.
+    uint64_t framesDecoded;
+    uint64_t framesSkipped;
+    uint64_t framesScaled;
+    uint64_t packetsEncoded;
+    uint64_t decodeErrors;
+    uint64_t encodeErrors;
+    uint64_t packetsDropped;
+} Transcoder;
+
+/**
+ * Start the pipeline, feeding the given opened encoder, which the transcoder now owns.
+ * Returns 0 or a negative AVERROR.
+ */
+int transcoder_start(Transcoder *transcoder, AVCodecContext *encoder);
+
+/**
+ * Writer side: start a clip whose video is stream, leaving out the frames in its first skipMs.
+ * Returns 0 or a negative AVERROR.
+ */
+int transcoder_begin_clip(Transcoder *transcoder, AVStream *stream, int64_t skipMs);
+
+/**
+ * Writer side: queue a demuxed packet of the current clip, taking over its reference. Waits
+ * while the decoder is behind. Returns 0 or a negative AVERROR.
+ */
+int transcoder_send_packet(Transcoder *transcoder, AVPacket *packet);
+
+/**
+ * Writer side: end the current clip. Its decoder and the encoder are flushed, and once the last
+ * of its packets has been received transcoder_receive_packet() returns TRANSCODER_CLIP_DONE.
+ * Returns 0 or a negative AVERROR.
+ */
+int transcoder_end_clip(Transcoder *transcoder);
+
+/**
+ * Writer side: move the next encoded packet, in the encoder's time_base, into packet.
+ * Returns 0, TRANSCODER_CLIP_DONE at the end of a clip, AVERROR(EAGAIN) if there's none yet and
+ * wait is false, or AVERROR_EOF once the pipeline has stopped.
+ */
+int transcoder_receive_packet(Transcoder *transcoder, AVPacket *packet, bool wait);
+
+/**
+ * Stop the pipeline and free it, along with the encoder. Anything still in it is dropped.
+ */
+void transcoder_stop(Transcoder *transcoder);
+
+#endif /* TRANSCODER_H */
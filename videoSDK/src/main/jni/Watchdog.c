@@ -0,0 +1,75 @@
+#include <errno.h>
+#include <string.h>
+#include "libavutil/error.h"
+#include "Watchdog.h"
+
+/**
+ * Set the deadlines, in ms, and clear the counters.
+ */
+void watchdog_init(Watchdog *watchdog, int connectTimeoutMs, int headerTimeoutMs,
+                   int packetTimeoutMs) {
+    memset(watchdog, 0, sizeof(*watchdog));
+    watchdog->operation = WATCHDOG_NONE;
+    watchdog->timeoutNs[WATCHDOG_CONNECT] = (int64_t) connectTimeoutMs * 1000000;
+    watchdog->timeoutNs[WATCHDOG_HEADER] = (int64_t) headerTimeoutMs * 1000000;
+    watchdog->timeoutNs[WATCHDOG_PACKET] = (int64_t) packetTimeoutMs * 1000000;
+    watchdog->timeoutNs[WATCHDOG_CLOSE] = watchdog->timeoutNs[WATCHDOG_PACKET];
+}
+
+/**
+ * Start the deadline for an operation that's about to block.
+ */
+void watchdog_arm(Watchdog *watchdog, int operation, int64_t nowNs) {
+    int64_t timeoutNs = watchdog->timeoutNs[operation];
+    watchdog->operation = operation;
+    watchdog->operationStartNs = nowNs;
+    watchdog->deadlineNs = timeoutNs > 0 ? nowNs + timeoutNs : 0;
+    watchdog->hasExpired = false;
+}
+
+/**
+ * Return whether the armed operation is past its deadline. The first time it is, the stall is
+ * counted. Meant to be called from an AVIOInterruptCB.
+ */
+bool watchdog_check(Watchdog *watchdog, int64_t nowNs) {
+    if (watchdog->hasExpired) {
+        return true;
+    }
+    if (!watchdog->deadlineNs || nowNs < watchdog->deadlineNs) {
+        return false;
+    }
+    watchdog->hasExpired = true;
+    __atomic_store_n(&watchdog->stalls[watchdog->operation],
+                     watchdog->stalls[watchdog->operation] + 1, __ATOMIC_RELAXED);
+    //  A stall that's still going keeps its original start.
+    if (!watchdog->isStalled) {
+        watchdog->stallStartNs = watchdog->operationStartNs;
+        __atomic_store_n(&watchdog->isStalled, 1, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+/**
+ * Stop the deadline once the operation returns with ret. Returns ret, or AVERROR(ETIMEDOUT)
+ * when it was the deadline that ended the operation, so callers can tell it from a stop.
+ */
+int watchdog_disarm(Watchdog *watchdog, int ret) {
+    bool hasExpired = watchdog->hasExpired;
+    watchdog->operation = WATCHDOG_NONE;
+    watchdog->deadlineNs = 0;
+    watchdog->hasExpired = false;
+    return ret < 0 && hasExpired ? AVERROR(ETIMEDOUT) : ret;
+}
+
+/**
+ * Note that a packet went out, which ends the current stall, if any, and records how long it
+ * lasted. Returns whether a stall ended.
+ */
+bool watchdog_on_progress(Watchdog *watchdog, int64_t nowNs) {
+    if (!watchdog->isStalled) {
+        return false;
+    }
+    histogram_record(&watchdog->stallDuration, nowNs - watchdog->stallStartNs);
+    __atomic_store_n(&watchdog->isStalled, 0, __ATOMIC_RELAXED);
+    return true;
+}
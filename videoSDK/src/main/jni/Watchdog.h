@@ -0,0 +1,71 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "Stats.h"
+
+//  Default deadlines per blocking operation. 0 lets that operation block as long as it likes.
+#define DEFAULT_CONNECT_TIMEOUT_MS 10000
+#define DEFAULT_HEADER_TIMEOUT_MS 10000
+#define DEFAULT_PACKET_TIMEOUT_MS 3000
+
+//  What a deadline is guarding. Closing gets the packet timeout.
+#define WATCHDOG_NONE (-1)
+#define WATCHDOG_CONNECT 0
+#define WATCHDOG_HEADER 1
+#define WATCHDOG_PACKET 2
+#define WATCHDOG_CLOSE 3
+#define WATCHDOG_NUM_OPERATIONS 4
+
+/**
+ * Deadlines for one destination's blocking network operations, checked from its AVIO interrupt
+ * callback, and the stalls they catch. A stall lasts from the start of the operation that
+ * missed its deadline until a packet goes out again. Owned by whichever thread is doing the
+ * destination's I/O (the pre-dial thread, then the sender thread); the counters are read from
+ * anywhere.
+ */
+typedef struct watchdog_t {
+    int64_t timeoutNs[WATCHDOG_NUM_OPERATIONS];
+    //  The armed operation, WATCHDOG_NONE between operations, and its deadline (0 for none).
+    int operation;
+    int64_t operationStartNs;
+    int64_t deadlineNs;
+    bool hasExpired;
+    int64_t stallStartNs;
+
+    int isStalled;
+    uint64_t stalls[WATCHDOG_NUM_OPERATIONS];
+    LatencyHistogram stallDuration;
+} Watchdog;
+
+/**
+ * Set the deadlines, in ms, and clear the counters.
+ */
+void watchdog_init(Watchdog *watchdog, int connectTimeoutMs, int headerTimeoutMs,
+                   int packetTimeoutMs);
+
+/**
+ * Start the deadline for an operation that's about to block.
+ */
+void watchdog_arm(Watchdog *watchdog, int operation, int64_t nowNs);
+
+/**
+ * Return whether the armed operation is past its deadline. The first time it is, the stall is
+ * counted. Meant to be called from an AVIOInterruptCB.
+ */
+bool watchdog_check(Watchdog *watchdog, int64_t nowNs);
+
+/**
+ * Stop the deadline once the operation returns with ret. Returns ret, or AVERROR(ETIMEDOUT)
+ * when it was the deadline that ended the operation, so callers can tell it from a stop.
+ */
+int watchdog_disarm(Watchdog *watchdog, int ret);
+
+/**
+ * Note that a packet went out, which ends the current stall, if any, and records how long it
+ * lasted. Returns whether a stall ended.
+ */
+bool watchdog_on_progress(Watchdog *watchdog, int64_t nowNs);
+
+#endif /* WATCHDOG_H */